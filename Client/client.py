@@ -22,8 +22,18 @@ class RedBoxClient:
     CMD_SET_PROBES  = 9
     CMD_CREATE_HNSW_DB = 10
     CMD_SET_HNSW_EF = 11
+    CMD_CREATE_IVFPQ_DB = 14
 
-    def __init__(self, host: str = '127.0.0.1', port: int = 8080, db_name: str = 'default', dim: int = 128, capacity: int=100_000, timeout: float = 30.0):
+    # Similarity metric, sent in the top byte of the handshake META field.
+    # Only takes effect when the database is first created.
+    METRICS = {'l2': 0, 'ip': 1, 'cosine': 2}
+
+    # Vector storage, sent in bits 16-23 of the same field. 'sq8' keeps a
+    # uint8 copy of every vector for scanning, 'binary' a 1-bit-per-dimension
+    # code (IVF only), both plus the float32 original.
+    STORAGE = {'f32': 0, 'sq8': 1, 'binary': 2}
+
+    def __init__(self, host: str = '127.0.0.1', port: int = 8080, db_name: str = 'default', dim: int = 128, capacity: int=100_000, timeout: float = 30.0, metric: str = 'l2', storage: str = 'f32'):
         self.host    = host
         self.port    = port
         self.dim     = dim
@@ -34,7 +44,7 @@ class RedBoxClient:
 
         try:
             self._connect()
-            self._handshake(db_name, dim, capacity)
+            self._handshake(db_name, dim, capacity, metric, storage)
         except Exception:
             self.close()
             raise
@@ -51,9 +61,17 @@ class RedBoxClient:
         except socket.timeout:
             raise ConnectionError(f"Timed out connecting to RedBoxDb at {self.host}:{self.port} after {self.timeout}s.")
 
-    def _handshake(self, name: str, dim: int, capacity: int):
+    @classmethod
+    def _handshake_meta(cls, name_len: int, metric: str, storage: str = 'f32') -> int:
+        if metric not in cls.METRICS:
+            raise ValueError(f"Unknown metric {metric!r}; expected one of {sorted(cls.METRICS)}")
+        if storage not in cls.STORAGE:
+            raise ValueError(f"Unknown storage {storage!r}; expected one of {sorted(cls.STORAGE)}")
+        return name_len | (cls.STORAGE[storage] << 16) | (cls.METRICS[metric] << 24)
+
+    def _handshake(self, name: str, dim: int, capacity: int, metric: str = 'l2', storage: str = 'f32'):
         name_bytes = name.encode('utf-8')
-        header  = struct.pack('<BI', self.CMD_SELECT_DB, len(name_bytes))
+        header  = struct.pack('<BI', self.CMD_SELECT_DB, self._handshake_meta(len(name_bytes), metric, storage))
         payload = name_bytes + struct.pack('<II', dim, capacity)
         self.sock.sendall(header + payload)
         ack = self.sock.recv(1)
@@ -157,7 +175,7 @@ class RedBoxClient:
                     db_name: str = 'default', dim: int = 128,
                     capacity: int = 100_000,
                     hnsw_M: int = 16, hnsw_ef_construction: int = 200,
-                    timeout: float = 30.0):
+                    timeout: float = 30.0, metric: str = 'l2', storage: str = 'f32'):
         """Create a new client connected to an HNSW database."""
         client = cls.__new__(cls)
         client.host = host
@@ -170,15 +188,15 @@ class RedBoxClient:
 
         try:
             client._connect()
-            client._handshake_hnsw(db_name, dim, capacity, hnsw_M, hnsw_ef_construction)
+            client._handshake_hnsw(db_name, dim, capacity, hnsw_M, hnsw_ef_construction, metric, storage)
         except Exception:
             client.close()
             raise
         return client
 
-    def _handshake_hnsw(self, name: str, dim: int, capacity: int, hnsw_M: int, hnsw_ef_construction: int):
+    def _handshake_hnsw(self, name: str, dim: int, capacity: int, hnsw_M: int, hnsw_ef_construction: int, metric: str = 'l2', storage: str = 'f32'):
         name_bytes = name.encode('utf-8')
-        header  = struct.pack('<BI', self.CMD_CREATE_HNSW_DB, len(name_bytes))
+        header  = struct.pack('<BI', self.CMD_CREATE_HNSW_DB, self._handshake_meta(len(name_bytes), metric, storage))
         payload = name_bytes + struct.pack('<I', dim) + struct.pack('<I', capacity)
         payload += struct.pack('<B', hnsw_M) + struct.pack('<H', hnsw_ef_construction)
         self.sock.sendall(header + payload)
@@ -186,6 +204,42 @@ class RedBoxClient:
         if not ack:
             raise RuntimeError("Server rejected HNSW handshake or disconnected.")
 
+    @classmethod
+    def create_ivf_pq(cls, host: str = '127.0.0.1', port: int = 8080,
+                      db_name: str = 'default', dim: int = 128,
+                      capacity: int = 100_000, pq_m: int = 0,
+                      timeout: float = 30.0, metric: str = 'l2'):
+        """Create a new client connected to an IVF-PQ database.
+
+        pq_m is the number of 4-bit sub-quantizers and must divide dim;
+        0 lets the server pick one.
+        """
+        client = cls.__new__(cls)
+        client.host = host
+        client.port = port
+        client.dim = dim
+        client.db_name = db_name
+        client.capacity = capacity
+        client.timeout = timeout
+        client.sock = None
+
+        try:
+            client._connect()
+            client._handshake_ivf_pq(db_name, dim, capacity, pq_m, metric)
+        except Exception:
+            client.close()
+            raise
+        return client
+
+    def _handshake_ivf_pq(self, name: str, dim: int, capacity: int, pq_m: int, metric: str = 'l2'):
+        name_bytes = name.encode('utf-8')
+        header  = struct.pack('<BI', self.CMD_CREATE_IVFPQ_DB, self._handshake_meta(len(name_bytes), metric))
+        payload = name_bytes + struct.pack('<II', dim, capacity) + struct.pack('<B', pq_m)
+        self.sock.sendall(header + payload)
+        ack = self.sock.recv(1)
+        if ack != b'1':
+            raise RuntimeError("Server rejected IVF-PQ handshake or disconnected.")
+
     # ------------------------------------------------------------------
 
     def close(self):
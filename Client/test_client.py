@@ -47,5 +47,27 @@ class TestRecvExact(unittest.TestCase):
             client._recv_exact(6)
 
 
+class TestHandshakeMeta(unittest.TestCase):
+    def test_default_metric_is_plain_name_length(self):
+        self.assertEqual(RedBoxClient._handshake_meta(7, "l2"), 7)
+
+    def test_metric_goes_in_top_byte(self):
+        self.assertEqual(RedBoxClient._handshake_meta(7, "ip"), 7 | (1 << 24))
+        self.assertEqual(RedBoxClient._handshake_meta(7, "cosine"), 7 | (2 << 24))
+
+    def test_unknown_metric_raises(self):
+        with self.assertRaises(ValueError):
+            RedBoxClient._handshake_meta(7, "manhattan")
+
+    def test_storage_goes_in_third_byte(self):
+        self.assertEqual(RedBoxClient._handshake_meta(7, "l2", "sq8"), 7 | (1 << 16))
+        self.assertEqual(RedBoxClient._handshake_meta(7, "cosine", "sq8"), 7 | (1 << 16) | (2 << 24))
+        self.assertEqual(RedBoxClient._handshake_meta(7, "l2", "binary"), 7 | (2 << 16))
+
+    def test_unknown_storage_raises(self):
+        with self.assertRaises(ValueError):
+            RedBoxClient._handshake_meta(7, "l2", "fp16")
+
+
 if __name__ == "__main__":
     unittest.main()
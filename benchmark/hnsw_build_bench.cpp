@@ -0,0 +1,104 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <iomanip>
+#include <string>
+#include <set>
+#include <filesystem>
+#include <algorithm>
+#include "redboxdb/engine.hpp"
+
+// HNSW build time against thread count.
+//
+//   HnswBuildBench [n] [dim] [M] [ef_construction]     (default 50000 128 16 200)
+//
+// "insert()" feeds the rows one at a time, the way ingest did before
+// insert_bulk; the other rows build the same data with insert_bulk on 1, 2,
+// 4, ... threads, linking incrementally and with the NN-Descent level 0.
+// recall@10 is measured at ef_search 64 against brute force.
+
+using Clock = std::chrono::high_resolution_clock;
+using Secs  = std::chrono::duration<double>;
+
+int main(int argc, char** argv) {
+    size_t   n    = argc > 1 ? std::stoul(argv[1]) : 50'000;
+    size_t   dim  = argc > 2 ? std::stoul(argv[2]) : 128;
+    uint8_t  M    = argc > 3 ? (uint8_t)std::stoul(argv[3]) : 16;
+    uint16_t efc  = argc > 4 ? (uint16_t)std::stoul(argv[4]) : 200;
+    const size_t Q = 200, K = 10;
+    const std::string file = "hnsw_build_bench.db";
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dis(-1.0f, 1.0f);
+    std::vector<float> data(n * dim), queries(Q * dim);
+    for (auto& x : data) x = dis(rng);
+    for (auto& x : queries) x = dis(rng);
+    std::vector<uint64_t> ids(n);
+    for (size_t i = 0; i < n; ++i) ids[i] = i + 1;
+
+    Distance::DistanceFn l2 = Distance::kernels().l2;
+    std::vector<std::set<int>> truth(Q);
+    for (size_t q = 0; q < Q; ++q) {
+        std::vector<std::pair<float, int>> d(n);
+        for (size_t i = 0; i < n; ++i) d[i] = { l2(&queries[q * dim], &data[i * dim], dim), (int)i + 1 };
+        std::partial_sort(d.begin(), d.begin() + K, d.end());
+        for (size_t r = 0; r < K; ++r) truth[q].insert(d[r].second);
+    }
+
+    auto recall = [&](CoreEngine::RedBoxVector& db) {
+        db.set_hnsw_ef_search(64);
+        size_t hits = 0;
+        for (size_t q = 0; q < Q; ++q) {
+            std::vector<float> query(queries.begin() + q * dim, queries.begin() + (q + 1) * dim);
+            for (int id : db.search_N(query, (int)K)) hits += truth[q].count(id);
+        }
+        return (double)hits / (double)(Q * K);
+    };
+
+    auto fresh = [&] {
+        std::filesystem::remove(file);
+        return std::make_unique<CoreEngine::RedBoxVector>(file, dim, (int)n, M, efc);
+    };
+
+    std::cout << "n=" << n << " dim=" << dim << " M=" << (int)M << " ef_construction=" << efc
+              << " | hardware threads: " << std::thread::hardware_concurrency() << "\n\n";
+    std::cout << std::left << std::setw(14) << "build" << std::setw(9) << "threads" << std::right
+              << std::setw(10) << "secs" << std::setw(12) << "inserts/s" << std::setw(11) << "recall@10" << "\n";
+    std::cout << std::fixed;
+
+    auto report = [&](const char* name, size_t threads, double secs, CoreEngine::RedBoxVector& db) {
+        std::cout << std::left << std::setw(14) << name << std::setw(9) << threads << std::right
+                  << std::setprecision(2) << std::setw(10) << secs
+                  << std::setprecision(0) << std::setw(12) << (double)n / secs
+                  << std::setprecision(4) << std::setw(11) << recall(db) << "\n";
+    };
+
+    {
+        auto db = fresh();
+        std::vector<float> row(dim);
+        auto t0 = Clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            std::copy(data.begin() + i * dim, data.begin() + (i + 1) * dim, row.begin());
+            db->insert(ids[i], row);
+        }
+        report("insert()", 1, Secs(Clock::now() - t0).count(), *db);
+    }
+
+    using Build = CoreEngine::RedBoxVector::BulkBuild;
+    size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (Build build : { Build::Incremental, Build::NnDescent }) {
+        for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+            auto db = fresh();
+            auto t0 = Clock::now();
+            db->insert_bulk(ids.data(), data.data(), n, threads, build);
+            report(build == Build::NnDescent ? "nn-descent" : "insert_bulk", threads,
+                   Secs(Clock::now() - t0).count(), *db);
+        }
+    }
+
+    std::filesystem::remove(file);
+    std::filesystem::remove(file + ".del");
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iomanip>
+#include <string>
+#include <set>
+#include <filesystem>
+#include <algorithm>
+#include "redboxdb/engine.hpp"
+
+// HNSW search speed before and after reorganize() renumbers the slots
+// breadth-first over the graph.
+//
+//   HnswReorderBench [n] [dim] [M] [ef_search]     (default 200000 128 16 64)
+//
+// The rows are built with insert_bulk, so slot order is insertion order.
+// Queries run on one thread; recall@10 is against brute force and should
+// not move, since the graph itself is unchanged.
+
+using Clock = std::chrono::high_resolution_clock;
+using Secs  = std::chrono::duration<double>;
+
+int main(int argc, char** argv) {
+    size_t   n    = argc > 1 ? std::stoul(argv[1]) : 200'000;
+    size_t   dim  = argc > 2 ? std::stoul(argv[2]) : 128;
+    uint8_t  M    = argc > 3 ? (uint8_t)std::stoul(argv[3]) : 16;
+    uint16_t ef   = argc > 4 ? (uint16_t)std::stoul(argv[4]) : 64;
+    const size_t Q = 2000, K = 10, TRUTH = 200;
+    const std::string file = "hnsw_reorder_bench.db";
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dis(-1.0f, 1.0f);
+    std::vector<float> data(n * dim), queries(Q * dim);
+    for (auto& x : data) x = dis(rng);
+    for (auto& x : queries) x = dis(rng);
+    std::vector<uint64_t> ids(n);
+    for (size_t i = 0; i < n; ++i) ids[i] = i + 1;
+
+    Distance::DistanceFn l2 = Distance::kernels().l2;
+    std::vector<std::set<int>> truth(TRUTH);
+    for (size_t q = 0; q < TRUTH; ++q) {
+        std::vector<std::pair<float, int>> d(n);
+        for (size_t i = 0; i < n; ++i) d[i] = { l2(&queries[q * dim], &data[i * dim], dim), (int)i + 1 };
+        std::partial_sort(d.begin(), d.begin() + K, d.end());
+        for (size_t r = 0; r < K; ++r) truth[q].insert(d[r].second);
+    }
+
+    std::filesystem::remove(file);
+    std::filesystem::remove(file + ".del");
+    CoreEngine::RedBoxVector db(file, dim, (int)n, M, (uint16_t)100);
+    auto t0 = Clock::now();
+    db.insert_bulk(ids.data(), data.data(), n);
+    std::cout << "built " << n << " x " << dim << " (M=" << (int)M << ") in "
+              << std::fixed << std::setprecision(1) << Secs(Clock::now() - t0).count() << " s\n";
+    db.set_hnsw_ef_search(ef);
+
+    auto run = [&](const char* label) {
+        std::vector<float> query(dim);
+        size_t hits = 0;
+        for (size_t q = 0; q < TRUTH; ++q) {
+            query.assign(queries.begin() + q * dim, queries.begin() + (q + 1) * dim);
+            for (int id : db.search_N(query, (int)K)) hits += truth[q].count(id);
+        }
+        auto start = Clock::now();
+        for (size_t q = 0; q < Q; ++q) {
+            query.assign(queries.begin() + q * dim, queries.begin() + (q + 1) * dim);
+            db.search_N(query, (int)K);
+        }
+        double secs = Secs(Clock::now() - start).count();
+        std::cout << std::left << std::setw(14) << label
+                  << std::right << std::setw(10) << std::setprecision(0) << (double)Q / secs << " qps"
+                  << std::setw(10) << std::setprecision(3) << (double)hits / (double)(TRUTH * K) << " recall@10\n";
+    };
+
+    run("insertion");
+    t0 = Clock::now();
+    db.reorganize();
+    std::cout << "reordered in " << std::setprecision(2) << Secs(Clock::now() - t0).count() << " s\n";
+    run("bfs");
+
+    std::filesystem::remove(file);
+    std::filesystem::remove(file + ".del");
+    return 0;
+}
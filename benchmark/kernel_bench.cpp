@@ -0,0 +1,143 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <iomanip>
+#include <string>
+#include <algorithm>
+#include "redboxdb/distance.hpp"
+
+// Generic vs dimension-specialised distance kernels, ns per call, then the
+// early-abandoning l2 against the full one, then row-major against
+// transposed-tile scans (ns per vector).
+// Each row scans a small pool of vectors (stays in L1/L2) so we time the
+// arithmetic, not memory bandwidth.
+
+using Clock = std::chrono::high_resolution_clock;
+using Ns    = std::chrono::duration<double, std::nano>;
+
+const int N_VECS  = 64;
+const int N_ITERS = 200'000;
+
+std::mt19937 rng(42);
+std::uniform_real_distribution<float> dis(-1.0f, 1.0f);
+
+volatile float sink;
+
+double time_kernel(Distance::DistanceFn fn, const std::vector<float>& query,
+                   const std::vector<float>& pool, size_t dim) {
+    float acc = 0.0f;
+    // warm up
+    for (int i = 0; i < N_VECS; ++i) acc += fn(query.data(), pool.data() + (size_t)i * dim, dim);
+
+    auto t0 = Clock::now();
+    for (int i = 0; i < N_ITERS; ++i)
+        acc += fn(query.data(), pool.data() + (size_t)(i % N_VECS) * dim, dim);
+    auto t1 = Clock::now();
+    sink = acc;
+    return Ns(t1 - t0).count() / N_ITERS;
+}
+
+int main() {
+    using CoreEngine::Metric;
+    auto top = Platform::detect_simd_level();
+    std::cout << "Detected SIMD: " << Platform::simd_level_name(top) << "\n\n";
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << std::left << std::setw(8) << "level" << std::setw(6) << "dim"
+              << std::setw(8) << "metric" << std::right
+              << std::setw(12) << "generic ns" << std::setw(12) << "fixed ns"
+              << std::setw(10) << "speedup" << "\n";
+
+    for (auto level : {Platform::SimdLevel::AVX2, Platform::SimdLevel::AVX512}) {
+        if (level > top) continue;
+        auto table = Distance::kernels_for(level);
+
+        for (size_t dim : {128, 384, 768, 1024, 1536}) {
+            std::vector<float> query(dim), pool((size_t)N_VECS * dim);
+            for (auto& x : query) x = dis(rng);
+            for (auto& x : pool)  x = dis(rng);
+
+            for (auto metric : {Metric::L2, Metric::InnerProduct}) {
+                double generic = time_kernel(table.for_metric(metric), query, pool, dim);
+                double fixed   = time_kernel(table.for_metric(metric, dim), query, pool, dim);
+                std::cout << std::left << std::setw(8) << table.name << std::setw(6) << dim
+                          << std::setw(8) << (metric == Metric::L2 ? "l2" : "ip") << std::right
+                          << std::setw(12) << generic << std::setw(12) << fixed
+                          << std::setw(9) << generic / fixed << "x\n";
+            }
+        }
+    }
+
+    // Early-abandoning l2 with the bound at the pool's 10th-smallest distance,
+    // roughly where a top-10 heap sits once it is full.
+    std::cout << "\n" << std::left << std::setw(8) << "level" << std::setw(6) << "dim" << std::right
+              << std::setw(12) << "full ns" << std::setw(12) << "bounded ns"
+              << std::setw(10) << "speedup" << "\n";
+    for (auto level : {Platform::SimdLevel::Scalar, Platform::SimdLevel::AVX2,
+                       Platform::SimdLevel::AVX512}) {
+        if (level > top) continue;
+        auto table = Distance::kernels_for(level);
+        for (size_t dim : {384, 1536}) {
+            std::vector<float> query(dim), pool((size_t)N_VECS * dim);
+            for (auto& x : query) x = dis(rng);
+            for (auto& x : pool)  x = dis(rng);
+
+            std::vector<float> dists;
+            for (int i = 0; i < N_VECS; ++i)
+                dists.push_back(table.l2(query.data(), pool.data() + (size_t)i * dim, dim));
+            std::nth_element(dists.begin(), dists.begin() + 9, dists.end());
+            const float bound = dists[9];
+
+            Distance::BoundedFn bounded = table.l2_bounded;
+            float acc = 0.0f;
+            auto t0 = Clock::now();
+            for (int i = 0; i < N_ITERS; ++i)
+                acc += bounded(query.data(), pool.data() + (size_t)(i % N_VECS) * dim, dim, bound);
+            auto t1 = Clock::now();
+            sink = acc;
+
+            double full = time_kernel(table.l2, query, pool, dim);
+            double cut  = Ns(t1 - t0).count() / N_ITERS;
+            std::cout << std::left << std::setw(8) << table.name << std::setw(6) << dim << std::right
+                      << std::setw(12) << full << std::setw(12) << cut
+                      << std::setw(9) << full / cut << "x\n";
+        }
+    }
+
+    // Same pool scanned row by row and as dimension-major tiles.
+    std::cout << "\n" << std::left << std::setw(8) << "level" << std::setw(6) << "dim" << std::right
+              << std::setw(12) << "row ns" << std::setw(12) << "tile ns"
+              << std::setw(10) << "speedup" << "\n";
+    for (auto level : {Platform::SimdLevel::Scalar, Platform::SimdLevel::AVX2,
+                       Platform::SimdLevel::AVX512}) {
+        if (level > top) continue;
+        auto table = Distance::kernels_for(level);
+        size_t W = table.tile_rows;
+        for (size_t dim : {32, 64, 128, 256, 768}) {
+            std::vector<float> query(dim), pool((size_t)N_VECS * dim), tiles;
+            for (auto& x : query) x = dis(rng);
+            for (auto& x : pool)  x = dis(rng);
+            for (size_t i = 0; i < (size_t)N_VECS; ++i)
+                Distance::tile_pack(tiles, W, i, pool.data() + i * dim, dim);
+
+            size_t n_tiles = N_VECS / W;
+            float out[Distance::MAX_TILE_ROWS];
+            float acc = 0.0f;
+            auto t0 = Clock::now();
+            for (int i = 0; i < N_ITERS / (int)W; ++i) {
+                table.l2_tile(query.data(), tiles.data() + (i % n_tiles) * W * dim, dim, out);
+                acc += out[0];
+            }
+            auto t1 = Clock::now();
+            sink = acc;
+
+            double row  = time_kernel(table.l2, query, pool, dim);
+            double tile = Ns(t1 - t0).count() / ((N_ITERS / (int)W) * W);
+            std::cout << std::left << std::setw(8) << table.name << std::setw(6) << dim << std::right
+                      << std::setw(12) << row << std::setw(12) << tile
+                      << std::setw(9) << row / tile << "x\n";
+        }
+    }
+    return 0;
+}
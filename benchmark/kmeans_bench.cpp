@@ -0,0 +1,77 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <iomanip>
+#include <string>
+#include <memory>
+#include "redboxdb/cluster_manager.hpp"
+
+// IVF training time against thread count.
+//
+//   KMeansBench [n] [dim] [k]     (default 20000 128 1000)
+//
+// "serial init" is the old path (k-means++ on every vector, one assignment
+// pass, one thread); the other rows run ClusterManager::kmeans_train with
+// the engine's default sampling and Lloyd passes, for both seedings.
+
+using Clock = std::chrono::high_resolution_clock;
+using Secs  = std::chrono::duration<double>;
+
+int main(int argc, char** argv) {
+    size_t   n   = argc > 1 ? std::stoul(argv[1]) : 20'000;
+    size_t   dim = argc > 2 ? std::stoul(argv[2]) : 128;
+    uint16_t k   = argc > 3 ? (uint16_t)std::stoul(argv[3]) : 1000;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dis(-1.0f, 1.0f);
+    std::vector<float> data(n * dim);
+    for (auto& x : data) x = dis(rng);
+
+    std::vector<float>    centroids((size_t)k * dim);
+    std::vector<uint64_t> counts(k);
+    std::vector<uint16_t> assign(n);
+    Distance::DistanceFn l2 = Distance::kernels().l2;
+
+    auto inertia = [&] {
+        double sum = 0.0;
+        for (size_t i = 0; i < n; ++i)
+            sum += l2(data.data() + i * dim, centroids.data() + (size_t)assign[i] * dim, dim);
+        return sum / (double)n;
+    };
+
+    std::cout << "n=" << n << " dim=" << dim << " k=" << k
+              << " | hardware threads: " << std::thread::hardware_concurrency() << "\n\n";
+    std::cout << std::left << std::setw(16) << "seeding" << std::setw(9) << "threads" << std::right
+              << std::setw(10) << "secs" << std::setw(12) << "inertia" << "\n";
+    std::cout << std::fixed;
+
+    auto t0 = Clock::now();
+    ClusterManager::kmeans_plus_plus_init(centroids.data(), counts.data(), assign.data(),
+                                          data.data(), k, n, dim, l2);
+    double base = Secs(Clock::now() - t0).count();
+    std::cout << std::left << std::setw(16) << "serial init" << std::setw(9) << 1 << std::right
+              << std::setprecision(3) << std::setw(10) << base
+              << std::setprecision(4) << std::setw(12) << inertia() << "\n";
+
+    size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int rounds : {0, 3}) {
+        for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+            std::unique_ptr<Parallel::ThreadPool> pool;
+            if (threads > 1) pool = std::make_unique<Parallel::ThreadPool>(threads - 1);
+            ClusterManager::TrainParams params;
+            params.seed_rounds = rounds;
+
+            t0 = Clock::now();
+            ClusterManager::kmeans_train(centroids.data(), counts.data(), assign.data(),
+                                         data.data(), k, n, dim, l2, params, pool.get());
+            double secs = Secs(Clock::now() - t0).count();
+            std::cout << std::left << std::setw(16) << (rounds ? "k-means||" : "k-means++")
+                      << std::setw(9) << threads << std::right
+                      << std::setprecision(3) << std::setw(10) << secs
+                      << std::setprecision(4) << std::setw(12) << inertia() << "\n";
+        }
+    }
+    return 0;
+}
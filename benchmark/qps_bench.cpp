@@ -158,6 +158,50 @@ int main(int argc, char* argv[]) {
 
         run_single("IVF QPS", db);
 
+        // One thread, top-10: per-query search_N vs one search_batch call.
+        {
+            const int BATCH = 1024;
+            std::vector<float> flat;
+            flat.reserve((size_t)BATCH * DIMENSIONS);
+            for (int i = 0; i < BATCH; ++i) flat.insert(flat.end(), queries[i].begin(), queries[i].end());
+
+            auto t0 = Clock::now();
+            for (int i = 0; i < BATCH; ++i) (void)db->search_N(queries[i], 10);
+            auto t1 = Clock::now();
+            auto res = db->search_batch(flat.data(), BATCH, 10);
+            auto t2 = Clock::now();
+
+            double single_s = std::chrono::duration<double>(t1 - t0).count();
+            double batch_s  = std::chrono::duration<double>(t2 - t1).count();
+            std::cout << std::fixed << std::setprecision(0)
+                      << "  search_N x" << BATCH << "  : " << BATCH / single_s << " QPS\n"
+                      << "  search_batch(" << BATCH << "): " << BATCH / batch_s << " QPS ("
+                      << std::setprecision(2) << single_s / batch_s << "x)\n";
+        }
+
+        // One thread, top-10: fixed num_probes vs adaptive probing (up to
+        // 4x as many candidates, ratio cut at 1.2x the nearest centroid).
+        {
+            const int Q = 1024;
+            auto time_q = [&] {
+                auto t0 = Clock::now();
+                for (int i = 0; i < Q; ++i) (void)db->search_N(queries[i], 10);
+                return Q / std::chrono::duration<double>(Clock::now() - t0).count();
+            };
+            double fixed_qps = time_q();
+            ClusterManager::ProbeParams pp;
+            pp.adaptive   = true;
+            pp.max_probes = (uint8_t)std::min(255, 4 * (int)db->get_header()->num_probes);
+            pp.ratio      = 1.2f;
+            db->set_probe_params(pp);
+            double adaptive_qps = time_q();
+            db->set_probe_params({});
+            std::cout << std::fixed << std::setprecision(0)
+                      << "  fixed probes    : " << fixed_qps << " QPS\n"
+                      << "  adaptive probes : " << adaptive_qps << " QPS ("
+                      << std::setprecision(2) << db->get_mean_probes() << " clusters/query)\n";
+        }
+
         delete db;
         cleanup(db_file);
     }
@@ -176,6 +220,20 @@ int main(int argc, char* argv[]) {
 
         run_single("HNSW QPS (ef_s=" + std::to_string(HNSW_EF_S) + ")", db);
 
+        // One thread, top-10 and top-100 at the default beam (ef_search x 4)
+        // and with ef_search as the beam itself.
+        for (int top : {10, 100}) {
+            for (uint8_t factor : {4, 1}) {
+                db->set_hnsw_ef_factor(factor);
+                const int Q = 1000;
+                auto t0 = Clock::now();
+                for (int i = 0; i < Q; ++i) (void)db->search_N(queries[i], top);
+                double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+                std::cout << std::fixed << std::setprecision(0) << "  search_N top-" << top
+                          << " ef x" << (int)factor << " : " << Q / secs << " QPS\n";
+            }
+        }
+
         delete db;
         cleanup(db_file);
     }
@@ -4,8 +4,26 @@
 namespace CoreEngine {
 
     enum class IndexType : uint8_t {
-        IVF  = 0,
-        HNSW = 1
+        IVF    = 0,
+        HNSW   = 1,
+        IVF_PQ = 2     // IVF with 4-bit product-quantised residuals
+    };
+
+    // Similarity metric, fixed at creation. Stored in the byte that used to
+    // be _pad0, so files written before it existed read back as L2.
+    enum class Metric : uint8_t {
+        L2           = 0,   // squared euclidean
+        InnerProduct = 1,   // 1 - <a,b>
+        Cosine       = 2    // vectors normalised on insert, then inner product
+    };
+
+    // How vectors are held for scanning. float_block is always kept (exact
+    // rerank, training, graph build); SQ8 adds a uint8 code block next to it,
+    // BINARY a 1-bit-per-dimension sign code (IVF / flat scans only).
+    enum class StorageMode : uint8_t {
+        F32    = 0,
+        SQ8    = 1,
+        BINARY = 2
     };
 
     struct SpecificMetadata {
@@ -26,13 +44,30 @@ namespace CoreEngine {
         uint16_t hnsw_ef_construction;
         uint16_t hnsw_ef_search;
         uint8_t  hnsw_max_level;
-        uint8_t  _pad0;
+        uint8_t  metric;           // Metric (formerly _pad0)
         uint32_t hnsw_entry_point;
         uint32_t hnsw_graph_version;
-        // --- Padding (bytes 64-127) ---
-        uint8_t  _padding[64];
+        // --- Quantization fields (bytes 64-65) ---
+        uint8_t  storage_mode;     // StorageMode; 0 in files that predate it
+        uint8_t  codes_trained;    // 1 once SQ8 ranges / BQ means are set and codes valid
+        // --- IVF-PQ fields (bytes 66-67) ---
+        uint8_t  pq_m;             // sub-quantizers per vector
+        uint8_t  pq_trained;       // 1 once the codebook is trained and codes valid
+        // --- IVF rebalancing fields (bytes 68-70) ---
+        uint16_t cluster_capacity; // centroid slots allocated; 0 = num_clusters (older files)
+        uint8_t  auto_clusters;    // 1 = num_clusters follows ~sqrt(vector_count)
+        uint8_t  _pad1;
+        // --- HNSW upper-level lists (bytes 72-75) ---
+        uint32_t hnsw_upper_used;  // lists handed out of the upper edge region
+        // --- Padding (bytes 76-127) ---
+        uint8_t  _padding[52];
 
-        static constexpr uint8_t CURRENT_VERSION = 4;
+        // 5: HNSW edges split into a dense level-0 block and upper lists
+        // allocated per node; edge words hold slot + 1, so an unwritten
+        // (zero) word means no edge. IVF layouts are unchanged since 4, so
+        // those files open as they are.
+        static constexpr uint8_t CURRENT_VERSION  = 5;
+        static constexpr uint8_t MIN_IVF_VERSION  = 4;
         static constexpr uint32_t UINT32_MAX_SENTINEL = 0xFFFFFFFF;
     };
 
@@ -0,0 +1,83 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <bit>
+#include "redboxdb/distance.hpp"
+
+// Binary quantization: one bit per component.
+//
+// Bit d of a vector's code is set when v[d] > mean[d], the per-dimension
+// mean trained once from a sample (centering first keeps the bits balanced
+// on data that is not zero-mean). Codes are packed into 64-bit words and
+// compared by Hamming distance, 32x fewer bytes per candidate than float32.
+//
+// Hamming distance only ranks; scans oversample a shortlist and rerank it
+// against float_block.
+namespace Bq {
+
+    inline size_t words(size_t dim) { return (dim + 63) / 64; }
+
+    inline void train(const float* data, size_t n, size_t dim, float* mean) {
+        std::vector<double> sum(dim, 0.0);
+        for (size_t i = 0; i < n; ++i)
+            for (size_t d = 0; d < dim; ++d) sum[d] += data[i * dim + d];
+        for (size_t d = 0; d < dim; ++d)
+            mean[d] = n ? static_cast<float>(sum[d] / (double)n) : 0.0f;
+    }
+
+    // Bits past dim in the last word stay 0 for every code, so they never
+    // contribute to a distance.
+    inline void encode(const float* v, const float* mean, size_t dim, uint64_t* out) {
+        size_t nw = words(dim);
+        for (size_t w = 0; w < nw; ++w) out[w] = 0;
+        for (size_t d = 0; d < dim; ++d)
+            if (v[d] > mean[d]) out[d >> 6] |= (uint64_t)1 << (d & 63);
+    }
+
+    using HammingFn = uint32_t (*)(const uint64_t* a, const uint64_t* b, size_t nwords);
+
+    inline uint32_t hamming_scalar(const uint64_t* a, const uint64_t* b, size_t nwords) {
+        uint32_t sum = 0;
+        for (size_t w = 0; w < nwords; ++w) sum += (uint32_t)std::popcount(a[w] ^ b[w]);
+        return sum;
+    }
+
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+    // Nibble-table popcount (vpshufb) summed per 64-bit lane with vpsadbw:
+    // AVX2 has no vector popcount instruction.
+    REDBOXDB_TARGET_AVX2
+    inline uint32_t hamming_avx2(const uint64_t* a, const uint64_t* b, size_t nwords) {
+        const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                               0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low4 = _mm256_set1_epi8(0x0F);
+        __m256i acc = _mm256_setzero_si256();
+        size_t w = 0;
+        for (; w + 4 <= nwords; w += 4) {
+            __m256i x  = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + w)),
+                                          _mm256_loadu_si256((const __m256i*)(b + w)));
+            __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(x, low4));
+            __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low4));
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+        }
+        alignas(32) uint64_t lanes[4];
+        _mm256_store_si256((__m256i*)lanes, acc);
+        uint32_t sum = (uint32_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+        for (; w < nwords; ++w) sum += (uint32_t)std::popcount(a[w] ^ b[w]);
+        return sum;
+    }
+#endif
+
+    inline HammingFn hamming_for(Platform::SimdLevel level) {
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+        if (level >= Platform::SimdLevel::AVX2) return &hamming_avx2;
+#else
+        (void)level;
+#endif
+        return &hamming_scalar;
+    }
+
+    inline HammingFn hamming() {
+        static const HammingFn fn = hamming_for(Platform::detect_simd_level());
+        return fn;
+    }
+}
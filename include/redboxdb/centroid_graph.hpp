@@ -0,0 +1,104 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <random>
+#include <algorithm>
+#include "redboxdb/distance.hpp"
+#include "redboxdb/hnsw_manager.hpp"
+#include "redboxdb/SpecificMetadata.hpp"
+
+// HNSW graph over the IVF centroid block: the coarse quantizer for large K.
+//
+// Ranking every centroid costs K x dim per insert and per query, which
+// dominates once K reaches the thousands. The graph finds the nearest
+// centroid (insert assignment) or the nearest n (probe selection) in
+// O(log K) hops instead, approximately.
+//
+// Nodes are centroid ids and vectors are read straight from the centroid
+// block, so the running-mean updates inserts make move the nodes without a
+// rebuild; the edges just go slightly stale until the next build (k-means
+// init, rebalancing). The graph is in memory only and uses the same
+// HnswManager code as the HNSW index, with its own header standing in for
+// the file's.
+namespace CentroidGraph {
+
+    class Graph {
+    public:
+        static constexpr uint8_t  M               = 16;
+        static constexpr uint16_t EF_CONSTRUCTION = 100;
+
+        bool     empty() const { return size == 0; }
+        uint16_t nodes() const { return size; }
+        void     clear()       { size = 0; level0.clear(); upper_index.clear(); upper.clear(); levels.clear(); }
+
+        void build(float* centroids, uint16_t k, size_t dim, Distance::DistanceFn dist_fn,
+                   Distance::Rows4Fn rows4) {
+            header = CoreEngine::SpecificMetadata{};
+            header.max_capacity         = k;
+            header.hnsw_M               = M;
+            header.hnsw_ef_construction = EF_CONSTRUCTION;
+            header.hnsw_entry_point     = HnswManager::EMPTY;
+            level0.assign((size_t)k * HnswManager::level0_words(M), 0);
+            upper_index.assign(k, 0);
+            upper.assign(HnswManager::upper_lists(k, M) * M, 0);
+            upper_used = 0;
+            levels.assign(k, 0);
+
+            std::mt19937 rng(42);
+            HnswManager::SearchContext ctx;
+            std::vector<HnswManager::SearchResult> nb_cands;
+            for (uint16_t c = 0; c < k; ++c)
+                HnswManager::hnsw_insert(c, centroids + (size_t)c * dim, &header, centroids,
+                                         edges(), levels.data(), dim, dist_fn, nullptr, rng,
+                                         ctx, nb_cands, rows4);
+            size = k;
+        }
+
+        // Approximate nearest centroid; ef is the level-0 beam width.
+        uint16_t nearest(const float* q, const float* centroids, size_t dim,
+                         Distance::DistanceFn dist_fn, int ef) const {
+            return (uint16_t)HnswManager::hnsw_search_1(q, &header, centroids, edges(), dim,
+                                                        dist_fn, nullptr, scratch().graph.visited, ef);
+        }
+
+        // Approximate n nearest centroids, closest first, into out.
+        void nearest_n(const float* q, int n, const float* centroids, size_t dim,
+                       Distance::DistanceFn dist_fn, int ef, std::vector<uint16_t>& out) const {
+            Scratch& s = scratch();
+            s.found.resize(std::max(n, 0));
+            size_t found = HnswManager::hnsw_search_by(HnswManager::FloatSlotDist{ q, centroids, dim, dist_fn },
+                                                       ef, &header, edges(), nullptr, s.graph, s.found);
+            out.clear();
+            for (size_t i = 0; i < found; ++i) out.push_back((uint16_t)s.found[i].second);
+        }
+
+    private:
+        // Search buffers, per thread: readers share the graph under the
+        // engine's shared lock. Separate from the engine's own per-thread
+        // context, which may be mid-query when a probe list is picked.
+        struct Scratch {
+            HnswManager::SearchContext              graph;
+            std::vector<std::pair<float, uint32_t>> found;
+        };
+        static Scratch& scratch() {
+            thread_local Scratch s;
+            return s;
+        }
+
+        // Searches only read through it; build() is the one writer.
+        HnswManager::EdgeStore edges() const {
+            auto* self = const_cast<Graph*>(this);
+            return { self->level0.data(), self->upper_index.data(), self->upper.data(),
+                     &self->upper_used, upper.size() / M };
+        }
+
+        CoreEngine::SpecificMetadata header{};
+        std::vector<uint32_t>        level0;
+        std::vector<uint32_t>        upper_index;
+        std::vector<uint32_t>        upper;
+        uint32_t                     upper_used = 0;
+        std::vector<uint8_t>         levels;
+        uint16_t                     size = 0;
+    };
+
+} // namespace CentroidGraph
@@ -5,7 +5,9 @@
 #include <limits>
 #include <random>
 #include <algorithm>
+#include <numeric>
 #include "redboxdb/distance.hpp"
+#include "redboxdb/thread_pool.hpp"
 
 namespace ClusterManager {
 
@@ -16,13 +18,13 @@ namespace ClusterManager {
         const float* centroid_block,  // K x dim, row-major
         uint16_t     k,
         size_t       dim,
-        bool         use_avx2)
+        Distance::DistanceFn dist_fn)
     {
         float    best_dist = std::numeric_limits<float>::max();
         uint16_t best_c    = 0;
         for (uint16_t c = 0; c < k; ++c) {
             const float* centroid = centroid_block + (size_t)c * dim;
-            float dist = Distance::l2(vec, centroid, dim, use_avx2);
+            float dist = dist_fn(vec, centroid, dim);
             if (dist < best_dist) { best_dist = dist; best_c = c; }
         }
         return best_c;
@@ -44,91 +46,372 @@ namespace ClusterManager {
             centroid[d] += (vec[d] - centroid[d]) / (float)new_count;
     }
 
-    // K-Means++ initialization.
-    // Called once when vector_count reaches the init threshold.
-    // Picks k spread-out centroids from the first n vectors in float_block,
-    // then assigns every one of those n slots to its nearest centroid,
-    // writing into cluster_block and setting cluster_count_block to the
-    // true per-cluster counts so online updates afterwards are correct.
-    inline void kmeans_plus_plus_init(
+    // Inverse of update_centroid: takes vec back out of centroid c's mean
+    // (an update moving it to another cluster). The last member leaves the
+    // centroid where it is.
+    inline void remove_from_centroid(
+        float*       centroid_block,
+        uint64_t*    cluster_count_block,
+        uint16_t     c,
+        const float* vec,
+        size_t       dim)
+    {
+        uint64_t& count = cluster_count_block[c];
+        if (count == 0) return;
+        float* centroid = centroid_block + (size_t)c * dim;
+        if (--count == 0) return;
+        for (size_t d = 0; d < dim; ++d)
+            centroid[d] += (centroid[d] - vec[d]) / (float)count;
+    }
+
+    // Cluster count for n vectors when K follows the data: ~sqrt(n), the
+    // point where probing a cluster and ranking the centroids cost about
+    // the same.
+    inline uint16_t auto_k(size_t n, uint16_t max_k) {
+        size_t k = (size_t)std::llround(std::sqrt((double)n));
+        return (uint16_t)std::clamp<size_t>(k, 1, std::max<uint16_t>(max_k, 1));
+    }
+
+    // Centroid slots to allocate for a database of `capacity` vectors with
+    // K = auto_k: sqrt(capacity), doubled to leave room for splits of
+    // oversized clusters.
+    inline uint16_t auto_capacity(size_t capacity) {
+        size_t k = 2 * (size_t)std::ceil(std::sqrt((double)std::max<size_t>(capacity, 1)));
+        return (uint16_t)std::clamp<size_t>(k, 16, std::numeric_limits<uint16_t>::max());
+    }
+
+    struct TrainParams {
+        size_t sample_per_cluster = 256;  // seed / refine on <= k x this points; 0 = all n
+        int    lloyd_iters        = 2;    // Lloyd passes over the sample after seeding
+        int    seed_rounds        = 0;    // k-means|| rounds; 0 = sequential k-means++ seeding
+    };
+
+    // Cluster-size and centroid-drift limits for online rebalancing.
+    struct RebalanceParams {
+        bool     automatic   = false;   // run passes from the write path
+        double   split_ratio = 4.0;     // split clusters above this x the mean size
+        double   merge_ratio = 0.125;   // merge clusters below this x the mean size
+        double   drift_ratio = 0.25;    // reassign when a centroid moved this x its cluster's spread
+        uint64_t interval    = 100000;  // writes between passes when nothing else triggers; 0 = never
+    };
+
+    // Adaptive probing: clusters are visited nearest centroid first and the
+    // scan stops once no remaining cluster can beat the current k-th best
+    // (see probe_lower_bound), or, with ratio > 0, once the next centroid
+    // is more than ratio x as far as the nearest one (L2 / cosine).
+    struct ProbeParams {
+        bool    adaptive   = false;
+        uint8_t min_probes = 1;      // always scanned
+        uint8_t max_probes = 32;     // candidate clusters considered
+        float   ratio      = 0.0f;   // 0 = bound only
+    };
+
+    // Smallest distance any member of a cluster can have to the query,
+    // given the query-centroid distance and the cluster radius (largest
+    // member-centroid Euclidean distance). L2 distances are squared:
+    // |q - x| >= |q - c| - r. Inner-product distances are 1 - <q, x>, and
+    // <q, x> <= <q, c> + |q| r by Cauchy-Schwarz.
+    inline float probe_lower_bound(float centroid_dist, float radius, float query_norm, bool is_l2) {
+        if (is_l2) {
+            float gap = std::sqrt(std::max(centroid_dist, 0.0f)) - radius;
+            return gap > 0.0f ? gap * gap : 0.0f;
+        }
+        return centroid_dist - query_norm * radius;
+    }
+
+    namespace detail {
+        static constexpr size_t MIN_GRAIN = 1024;   // points per parallel task
+
+        // Row j of a point set: rows[j] into data, or j itself when rows is null.
+        inline const float* row(const float* data, const uint32_t* rows, size_t j, size_t dim) {
+            return data + (size_t)(rows ? rows[j] : j) * dim;
+        }
+
+        // Uniform [0, 1) keyed on (round, point), so k-means|| draws the
+        // same sample whichever thread scores the point.
+        inline double unit_hash(uint64_t round, uint64_t i) {
+            uint64_t x = (round << 40) ^ i ^ 0x9E3779B97F4A7C15ull;
+            x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+            x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+            x ^= x >> 31;
+            return (double)(x >> 11) * 0x1.0p-53;
+        }
+
+        // min_dists[j] = min(min_dists[j], d(point j, centers[c])) for every
+        // center. Inner-product distance (1 - <a,b>) can go negative for
+        // unnormalised data; a sampling weight can't, hence the clamp at 0.
+        inline void update_min_dists(Parallel::ThreadPool* pool, const float* data,
+                                     const uint32_t* rows, size_t m, size_t dim,
+                                     const float* centers, size_t n_centers,
+                                     std::vector<float>& min_dists, Distance::DistanceFn dist_fn) {
+            size_t tasks = Parallel::split_count(pool, m, MIN_GRAIN);
+            Parallel::parallel_for(pool, m, tasks, [&](size_t begin, size_t end, size_t) {
+                for (size_t j = begin; j < end; ++j) {
+                    const float* vec = row(data, rows, j, dim);
+                    for (size_t c = 0; c < n_centers; ++c) {
+                        float d = std::max(0.0f, dist_fn(vec, centers + c * dim, dim));
+                        if (d < min_dists[j]) min_dists[j] = d;
+                    }
+                }
+            });
+        }
+
+        // Index drawn with probability weight[i] / sum(weight), sequentially
+        // so the draw doesn't depend on the thread count.
+        inline size_t sample_weighted(const std::vector<float>& weight, std::mt19937& rng) {
+            float total = 0.0f;
+            for (float w : weight) total += w;
+            std::uniform_real_distribution<float> dist_sample(0.0f, total);
+            float sample     = dist_sample(rng);
+            float cumulative = 0.0f;
+            for (size_t i = 0; i < weight.size(); ++i) {
+                cumulative += weight[i];
+                if (cumulative >= sample) return i;
+            }
+            return 0;
+        }
+
+        // Sequential k-means++: centroids [have, k) drawn by D^2 weighting
+        // over the m points; min_dists holds distances to centroids [0, have).
+        inline void seed_sequential(Parallel::ThreadPool* pool, float* centroid_block, uint16_t have,
+                                    uint16_t k, const float* data, const uint32_t* rows, size_t m,
+                                    size_t dim, std::vector<float>& min_dists, std::mt19937& rng,
+                                    Distance::DistanceFn dist_fn) {
+            for (uint16_t chosen = have; chosen < k; ++chosen) {
+                update_min_dists(pool, data, rows, m, dim,
+                                 centroid_block + (size_t)(chosen - 1) * dim, 1, min_dists, dist_fn);
+                const float* next = row(data, rows, sample_weighted(min_dists, rng), dim);
+                std::copy(next, next + dim, centroid_block + (size_t)chosen * dim);
+            }
+        }
+
+        // k-means|| (Bahmani et al.): each round keeps every point with
+        // probability ~ k * D^2 / phi, all in one parallel pass, so a few
+        // rounds gather O(k * rounds) candidates. The candidates, weighted by
+        // how many points they are nearest to, are then reduced to k with
+        // weighted k-means++.
+        inline void seed_parallel(Parallel::ThreadPool* pool, float* centroid_block, uint16_t k,
+                                  const float* data, const uint32_t* rows, size_t m, size_t dim,
+                                  int rounds, std::vector<float>& min_dists, std::mt19937& rng,
+                                  Distance::DistanceFn dist_fn) {
+            std::vector<uint32_t> cand = { (uint32_t)std::uniform_int_distribution<size_t>(0, m - 1)(rng) };
+            std::vector<float> cand_vecs(row(data, rows, cand[0], dim), row(data, rows, cand[0], dim) + dim);
+            update_min_dists(pool, data, rows, m, dim, cand_vecs.data(), 1, min_dists, dist_fn);
+
+            size_t tasks = Parallel::split_count(pool, m, MIN_GRAIN);
+            std::vector<std::vector<uint32_t>> picked(tasks);
+            for (int r = 0; r < rounds; ++r) {
+                double phi = 0.0;
+                for (float d : min_dists) phi += d;
+                if (phi <= 0.0) break;
+                Parallel::parallel_for(pool, m, tasks, [&](size_t begin, size_t end, size_t t) {
+                    picked[t].clear();
+                    for (size_t j = begin; j < end; ++j)
+                        if (unit_hash((uint64_t)r, j) < (double)k * min_dists[j] / phi)
+                            picked[t].push_back((uint32_t)j);
+                });
+                size_t first_new = cand.size();
+                for (const auto& p : picked) cand.insert(cand.end(), p.begin(), p.end());
+                for (size_t c = first_new; c < cand.size(); ++c) {
+                    const float* v = row(data, rows, cand[c], dim);
+                    cand_vecs.insert(cand_vecs.end(), v, v + dim);
+                }
+                update_min_dists(pool, data, rows, m, dim, cand_vecs.data() + first_new * dim,
+                                 cand.size() - first_new, min_dists, dist_fn);
+            }
+
+            if (cand.size() <= k) {
+                // Too few candidates (tiny or duplicate-heavy data): take them
+                // all and draw the rest sequentially.
+                std::copy(cand_vecs.begin(), cand_vecs.end(), centroid_block);
+                seed_sequential(pool, centroid_block, (uint16_t)std::max<size_t>(cand.size(), 1), k,
+                                data, rows, m, dim, min_dists, rng, dist_fn);
+                return;
+            }
+
+            // Weight = number of points nearest each candidate.
+            std::vector<std::vector<uint32_t>> counts(tasks, std::vector<uint32_t>(cand.size(), 0));
+            Parallel::parallel_for(pool, m, tasks, [&](size_t begin, size_t end, size_t t) {
+                for (size_t j = begin; j < end; ++j) {
+                    const float* vec = row(data, rows, j, dim);
+                    float best = std::numeric_limits<float>::max();
+                    size_t best_c = 0;
+                    for (size_t c = 0; c < cand.size(); ++c) {
+                        float d = dist_fn(vec, cand_vecs.data() + c * dim, dim);
+                        if (d < best) { best = d; best_c = c; }
+                    }
+                    counts[t][best_c]++;
+                }
+            });
+            std::vector<float> weight(cand.size(), 0.0f);
+            for (const auto& tc : counts)
+                for (size_t c = 0; c < cand.size(); ++c) weight[c] += (float)tc[c];
+
+            // Weighted k-means++ over the candidates.
+            std::vector<float> cand_min(cand.size(), std::numeric_limits<float>::max());
+            std::vector<float> score(cand.size());
+            size_t first = sample_weighted(weight, rng);
+            std::copy(cand_vecs.data() + first * dim, cand_vecs.data() + (first + 1) * dim, centroid_block);
+            for (uint16_t chosen = 1; chosen < k; ++chosen) {
+                update_min_dists(pool, cand_vecs.data(), nullptr, cand.size(), dim,
+                                 centroid_block + (size_t)(chosen - 1) * dim, 1, cand_min, dist_fn);
+                for (size_t c = 0; c < cand.size(); ++c) score[c] = weight[c] * cand_min[c];
+                size_t next = sample_weighted(score, rng);
+                std::copy(cand_vecs.data() + next * dim, cand_vecs.data() + (next + 1) * dim,
+                          centroid_block + (size_t)chosen * dim);
+            }
+        }
+
+        // Assigns each of the m points to its nearest centroid (in parallel)
+        // and moves every non-empty centroid to the mean of its points.
+        // Means are summed per cluster in point order, in double, so they
+        // don't depend on the thread count. counts may be null.
+        inline void assign_and_average(Parallel::ThreadPool* pool, float* centroid_block, uint16_t k,
+                                       const float* data, const uint32_t* rows, size_t m, size_t dim,
+                                       uint16_t* assign, uint64_t* counts, Distance::DistanceFn dist_fn) {
+            size_t tasks = Parallel::split_count(pool, m, MIN_GRAIN);
+            Parallel::parallel_for(pool, m, tasks, [&](size_t begin, size_t end, size_t) {
+                for (size_t j = begin; j < end; ++j)
+                    assign[j] = find_nearest_centroid(row(data, rows, j, dim), centroid_block, k, dim, dist_fn);
+            });
+
+            // Bucket point indices by cluster (counting sort keeps point order).
+            std::vector<size_t> start(k + 1, 0);
+            for (size_t j = 0; j < m; ++j) start[assign[j] + 1]++;
+            for (uint16_t c = 0; c < k; ++c) start[c + 1] += start[c];
+            std::vector<uint32_t> members(m);
+            std::vector<size_t> fill(start.begin(), start.end() - 1);
+            for (size_t j = 0; j < m; ++j) members[fill[assign[j]]++] = (uint32_t)j;
+            if (counts)
+                for (uint16_t c = 0; c < k; ++c) counts[c] = start[c + 1] - start[c];
+
+            size_t ctasks = Parallel::split_count(pool, k, 1);
+            Parallel::parallel_for(pool, k, ctasks, [&](size_t begin, size_t end, size_t) {
+                std::vector<double> sum(dim);
+                for (size_t c = begin; c < end; ++c) {
+                    if (start[c + 1] == start[c]) continue;
+                    std::fill(sum.begin(), sum.end(), 0.0);
+                    for (size_t p = start[c]; p < start[c + 1]; ++p) {
+                        const float* vec = row(data, rows, members[p], dim);
+                        for (size_t d = 0; d < dim; ++d) sum[d] += (double)vec[d];
+                    }
+                    float* centroid = centroid_block + c * dim;
+                    double inv = 1.0 / (double)(start[c + 1] - start[c]);
+                    for (size_t d = 0; d < dim; ++d) centroid[d] = (float)(sum[d] * inv);
+                }
+            });
+        }
+    } // namespace detail
+
+    // IVF training, run once when vector_count reaches the init threshold.
+    //
+    // Seeds k centroids from a random sample of the first n vectors in
+    // float_block (k-means++, or k-means|| when params.seed_rounds > 0),
+    // refines them with params.lloyd_iters Lloyd passes over the sample,
+    // then assigns all n slots, writing cluster_block and setting
+    // cluster_count_block / the centroids to the true per-cluster counts and
+    // means so online updates afterwards are correct.
+    //
+    // Distance passes, assignment and means run on pool (serially when it
+    // is null); every random draw is sequential or keyed on the point, so
+    // the result is the same for any thread count.
+    inline void kmeans_train(
         float*        centroid_block,
         uint64_t*     cluster_count_block,
         uint16_t*     cluster_block,
         const float*  float_block,
         uint16_t      k,
-        size_t        n,           // number of vectors to init from (>= k)
+        size_t        n,           // number of vectors to train on (>= k)
         size_t        dim,
-        bool          use_avx2)
+        Distance::DistanceFn dist_fn,
+        const TrainParams&   params,
+        Parallel::ThreadPool* pool = nullptr)
     {
         std::mt19937 rng(42);
 
-        // Reset counts: we will recount from scratch during assignment
-        for (uint16_t c = 0; c < k; ++c) cluster_count_block[c] = 0;
-
-        // Step 1: pick first centroid randomly from the n vectors
-        std::uniform_int_distribution<size_t> uniform(0, n - 1);
-        size_t first = uniform(rng);
-        const float* first_vec = float_block + first * dim;
-        float* c0 = centroid_block;
-        for (size_t d = 0; d < dim; ++d) c0[d] = first_vec[d];
-
-        // Step 2: pick remaining k-1 centroids with D^2 weighting
-        std::vector<float> min_dists(n, std::numeric_limits<float>::max());
-
-        for (uint16_t chosen = 1; chosen < k; ++chosen) {
-            // Update min distances from each point to nearest chosen centroid
-            const float* last_centroid = centroid_block + (size_t)(chosen - 1) * dim;
-            for (size_t i = 0; i < n; ++i) {
-                const float* vec = float_block + i * dim;
-                float d = Distance::l2(vec, last_centroid, dim, use_avx2);
-                if (d < min_dists[i]) min_dists[i] = d;
-            }
+        // Sample without replacement (partial Fisher-Yates), kept in slot
+        // order for locality. rows = null means all n.
+        std::vector<uint32_t> sample;
+        size_t m = n;
+        if (params.sample_per_cluster && (size_t)k * params.sample_per_cluster < n) {
+            m = (size_t)k * params.sample_per_cluster;
+            std::vector<uint32_t> perm(n);
+            std::iota(perm.begin(), perm.end(), 0u);
+            for (size_t i = 0; i < m; ++i)
+                std::swap(perm[i], perm[std::uniform_int_distribution<size_t>(i, n - 1)(rng)]);
+            sample.assign(perm.begin(), perm.begin() + m);
+            std::sort(sample.begin(), sample.end());
+        }
+        const uint32_t* rows = sample.empty() ? nullptr : sample.data();
 
-            // Sample next centroid proportional to D^2
-            float total = 0.0f;
-            for (float d : min_dists) total += d;
+        std::vector<float> min_dists(m, std::numeric_limits<float>::max());
+        if (params.seed_rounds > 0) {
+            detail::seed_parallel(pool, centroid_block, k, float_block, rows, m, dim,
+                                  params.seed_rounds, min_dists, rng, dist_fn);
+        } else {
+            const float* first = detail::row(float_block, rows,
+                                             std::uniform_int_distribution<size_t>(0, m - 1)(rng), dim);
+            std::copy(first, first + dim, centroid_block);
+            detail::seed_sequential(pool, centroid_block, 1, k, float_block, rows, m, dim,
+                                    min_dists, rng, dist_fn);
+        }
 
-            std::uniform_real_distribution<float> dist_sample(0.0f, total);
-            float  sample     = dist_sample(rng);
-            float  cumulative = 0.0f;
-            size_t next_idx   = 0;
-            for (size_t i = 0; i < n; ++i) {
-                cumulative += min_dists[i];
-                if (cumulative >= sample) { next_idx = i; break; }
-            }
+        std::vector<uint16_t> assign(m);
+        for (int it = 0; it < params.lloyd_iters; ++it)
+            detail::assign_and_average(pool, centroid_block, k, float_block, rows, m, dim,
+                                       assign.data(), nullptr, dist_fn);
 
-            const float* next_vec     = float_block + next_idx * dim;
-            float*       next_centroid = centroid_block + (size_t)chosen * dim;
-            for (size_t d = 0; d < dim; ++d) next_centroid[d] = next_vec[d];
-        }
+        detail::assign_and_average(pool, centroid_block, k, float_block, nullptr, n, dim,
+                                   cluster_block, cluster_count_block, dist_fn);
+    }
 
-        // Step 3: assign all n vectors to their nearest centroid.
-        // Compute true per-cluster means and counts so post-init online
-        // updates use the correct denominator and don't destroy centroids.
-        //
-        // We do two passes:
-        //   Pass 1 — assign cluster_block, accumulate sums + counts
-        //   Pass 2 — divide sums by counts to get true cluster means
-
-        std::vector<std::vector<double>> sums(k, std::vector<double>(dim, 0.0));
-
-        for (size_t i = 0; i < n; ++i) {
-            const float* vec = float_block + i * dim;
-            uint16_t c = find_nearest_centroid(vec, centroid_block, k, dim, use_avx2);
-            cluster_block[i] = c;
-            cluster_count_block[c]++;
-            for (size_t d = 0; d < dim; ++d)
-                sums[c][d] += (double)vec[d];
-        }
+    // 2-means over the m rows of one cluster, for splitting it. Seeds are
+    // the row farthest from `center` and the row farthest from that one;
+    // iters Lloyd passes follow. Writes the two centroids (2 x dim) and a
+    // side (0 / 1) per row.
+    inline void split_in_two(
+        const float*     float_block,
+        const uint32_t*  rows,
+        size_t           m,
+        size_t           dim,
+        const float*     center,
+        float*           out_centroids,
+        uint16_t*        side,
+        Distance::DistanceFn dist_fn,
+        int              iters = 4)
+    {
+        auto farthest = [&](const float* from) {
+            size_t best = 0;
+            float  best_d = std::numeric_limits<float>::lowest();
+            for (size_t j = 0; j < m; ++j) {
+                float d = dist_fn(from, detail::row(float_block, rows, j, dim), dim);
+                if (d > best_d) { best_d = d; best = j; }
+            }
+            return detail::row(float_block, rows, best, dim);
+        };
+        const float* a = farthest(center);
+        const float* b = farthest(a);
+        std::copy(a, a + dim, out_centroids);
+        std::copy(b, b + dim, out_centroids + dim);
+        for (int it = 0; it < std::max(iters, 1); ++it)
+            detail::assign_and_average(nullptr, out_centroids, 2, float_block, rows, m, dim,
+                                       side, nullptr, dist_fn);
+    }
 
-        // Recompute centroids as true means of assigned vectors
-        for (uint16_t c = 0; c < k; ++c) {
-            if (cluster_count_block[c] == 0) continue;
-            float* centroid = centroid_block + (size_t)c * dim;
-            double inv = 1.0 / (double)cluster_count_block[c];
-            for (size_t d = 0; d < dim; ++d)
-                centroid[d] = (float)(sums[c][d] * inv);
-        }
+    // Sequential k-means++ seeding on all n vectors followed by one
+    // assignment pass: kmeans_train without sampling or Lloyd refinement.
+    inline void kmeans_plus_plus_init(
+        float*        centroid_block,
+        uint64_t*     cluster_count_block,
+        uint16_t*     cluster_block,
+        const float*  float_block,
+        uint16_t      k,
+        size_t        n,           // number of vectors to init from (>= k)
+        size_t        dim,
+        Distance::DistanceFn dist_fn)
+    {
+        kmeans_train(centroid_block, cluster_count_block, cluster_block, float_block,
+                     k, n, dim, dist_fn, TrainParams{ 0, 0, 0 });
     }
 
 } // namespace ClusterManager
@@ -1,8 +1,10 @@
 #pragma once
+#include <cstdint>
 
 // One might ask, but Bibidh why AVX2? why not AVX-512?
 // I might answer
 // I am poor and my ryzen 5 5500U doesn't support AVX-512, but it does in fact support AVX2.
+// (The Xeon fleet does though, so detect_simd_level() below can pick it up.)
 
 #if defined(__x86_64__) || defined(_M_X64)
     #ifdef _MSC_VER
@@ -13,26 +15,95 @@
 #endif
 
 namespace Platform {
-    inline bool has_avx2() {
+
+    // Widest SIMD path that is safe to run on this machine.
+    // Ordered: a higher level implies every lower one is usable.
+    enum class SimdLevel : uint8_t {
+        Scalar = 0,
+        AVX2   = 1,   // AVX2 + FMA, YMM state enabled by the OS
+        AVX512 = 2    // AVX-512F on top of AVX2, ZMM state enabled by the OS
+    };
+
+    inline const char* simd_level_name(SimdLevel level) {
+        switch (level) {
+            case SimdLevel::AVX512: return "avx512";
+            case SimdLevel::AVX2:   return "avx2";
+            default:                return "scalar";
+        }
+    }
+
 #if defined(__x86_64__) || defined(_M_X64)
-#ifdef _MSC_VER
-        int info[4] = { 0, 0, 0, 0 };
-        __cpuid(info, 0);           // First ask: what's the max input level?
-        if (info[0] < 7) return false; // If CPU doesn't support level 7, no AVX2
+    namespace detail {
+        struct CpuidRegs { unsigned int eax, ebx, ecx, edx; };
 
-        __cpuidex(info, 7, 0);      // Now ask level 7 — extended features
-        return (info[1] & (1 << 5)) != 0; // Bit 5 of EBX = AVX2
+        inline bool cpuid(unsigned int leaf, unsigned int subleaf, CpuidRegs& r) {
+#ifdef _MSC_VER
+            int info[4] = { 0, 0, 0, 0 };
+            __cpuid(info, 0);
+            if ((unsigned int)info[0] < leaf) return false;
+            __cpuidex(info, (int)leaf, (int)subleaf);
+            r = { (unsigned int)info[0], (unsigned int)info[1],
+                  (unsigned int)info[2], (unsigned int)info[3] };
+            return true;
 #else
-        unsigned int eax, ebx, ecx, edx;
-        if (__get_cpuid(0, &eax, &ebx, &ecx, &edx) == 0) return false;
-        if (eax < 7) return false;
+            if ((unsigned int)__get_cpuid_max(0, nullptr) < leaf) return false;
+            __cpuid_count(leaf, subleaf, r.eax, r.ebx, r.ecx, r.edx);
+            return true;
+#endif
+        }
 
-        __cpuid_count(7, 0, eax, ebx, ecx, edx);
-        return (ebx & (1 << 5)) != 0; // Bit 5 of EBX = AVX2
+        // XCR0: which register files the OS saves/restores on context switch.
+        // Only valid when CPUID.1:ECX.OSXSAVE (bit 27) is set.
+        inline uint64_t read_xcr0() {
+#ifdef _MSC_VER
+            return _xgetbv(0);
+#else
+            // Raw opcode instead of _xgetbv() so we don't need -mxsave.
+            unsigned int lo, hi;
+            __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+            return ((uint64_t)hi << 32) | lo;
+#endif
+        }
+    }
 #endif
+
+    // Probes CPUID + XCR0 once per call. Callers that sit on a hot path
+    // should go through Distance::kernels(), which caches the result.
+    inline SimdLevel detect_simd_level() {
+#if defined(__x86_64__) || defined(_M_X64)
+        detail::CpuidRegs l1{}, l7{};
+        if (!detail::cpuid(1, 0, l1)) return SimdLevel::Scalar;
+
+        bool osxsave = (l1.ecx & (1u << 27)) != 0;
+        bool fma     = (l1.ecx & (1u << 12)) != 0;
+        bool avx     = (l1.ecx & (1u << 28)) != 0;
+        if (!osxsave || !avx || !fma) return SimdLevel::Scalar;
+
+        uint64_t xcr0 = detail::read_xcr0();
+        bool ymm_os = (xcr0 & 0x6) == 0x6;      // XMM | YMM
+        bool zmm_os = (xcr0 & 0xE6) == 0xE6;    // XMM | YMM | opmask | ZMM_Hi256 | Hi16_ZMM
+        if (!ymm_os) return SimdLevel::Scalar;
+
+        if (!detail::cpuid(7, 0, l7)) return SimdLevel::Scalar;
+        bool avx2    = (l7.ebx & (1u << 5))  != 0;  // Bit 5 of EBX = AVX2
+        bool avx512f = (l7.ebx & (1u << 16)) != 0;  // Bit 16 of EBX = AVX-512F
+        if (!avx2) return SimdLevel::Scalar;
+
+        if (avx512f && zmm_os) return SimdLevel::AVX512;
+        return SimdLevel::AVX2;
 #else
-        // No x86 AVX2 support on this architecture (e.g. ARM/NEON).
-        return false;
+        // No x86 SIMD on this architecture (e.g. ARM/NEON).
+        return SimdLevel::Scalar;
 #endif
     }
+
+    // True when the AVX2+FMA kernel is safe to run: the CPU advertises
+    // both and the OS has enabled YMM state.
+    inline bool has_avx2() {
+        return detect_simd_level() >= SimdLevel::AVX2;
+    }
+
+    inline bool has_avx512f() {
+        return detect_simd_level() >= SimdLevel::AVX512;
+    }
 }
@@ -1,5 +1,11 @@
 ﻿#pragma once
 #include <cstddef>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include "redboxdb/cpu_features.hpp"
+#include "redboxdb/SpecificMetadata.hpp"
 
 #if defined(__x86_64__) || defined(_M_X64)
     #define REDBOXDB_HAS_AVX2_INTRINSICS 1
@@ -8,8 +14,33 @@
     #define REDBOXDB_HAS_AVX2_INTRINSICS 0
 #endif
 
+// Per-function ISA targets. The kernels below are selected at runtime, so
+// they must compile to the right instructions even in translation units
+// built without -mavx2 / -mavx512f. MSVC lets intrinsics through without
+// any flag, so the attributes are GCC/Clang only.
+#if REDBOXDB_HAS_AVX2_INTRINSICS && (defined(__GNUC__) || defined(__clang__))
+    #define REDBOXDB_TARGET_AVX2   __attribute__((target("avx2,fma")))
+    #define REDBOXDB_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#else
+    #define REDBOXDB_TARGET_AVX2
+    #define REDBOXDB_TARGET_AVX512
+#endif
+
+// Ask for full unrolling of loops with a compile-time trip count.
+#if defined(__clang__)
+    #define REDBOXDB_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+    #define REDBOXDB_UNROLL _Pragma("GCC unroll 64")
+#else
+    #define REDBOXDB_UNROLL
+#endif
+
 namespace Distance {
 
+    // Every distance kernel has this shape; the engine and index managers
+    // hold one of these and call it directly, no per-call ISA branch.
+    using DistanceFn = float (*)(const float*, const float*, size_t);
+
     // FALLBACK : when AVX2 is not available
     inline float l2_scalar(const float* a, const float* b, size_t dim) {
         float sum = 0.0f;
@@ -20,8 +51,40 @@ namespace Distance {
         return sum;
     }
 
+    inline float dot_scalar(const float* a, const float* b, size_t dim) {
+        float sum = 0.0f;
+        for (size_t d = 0; d < dim; ++d) sum += a[d] * b[d];
+        return sum;
+    }
+
+    // Inner-product "distance": 1 - <a,b>, so smaller is still better and
+    // every search / heap / pruning comparison works unchanged. For unit
+    // vectors this is exactly cosine distance.
+    inline float ip_scalar(const float* a, const float* b, size_t dim) {
+        return 1.0f - dot_scalar(a, b, dim);
+    }
+
 #if REDBOXDB_HAS_AVX2_INTRINSICS
+    REDBOXDB_TARGET_AVX2
+    inline float hsum_avx2(__m256 v) {
+        __m128 acc = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        acc = _mm_hadd_ps(acc, acc);
+        acc = _mm_hadd_ps(acc, acc);
+        return _mm_cvtss_f32(acc);
+    }
+
+    // Horizontal sum through a 64-byte spill. _mm512_reduce_add_ps and the
+    // 512->256 casts go through _mm256_undefined_pd(), which trips
+    // -Werror=uninitialized on GCC 12; the spill costs the same.
+    REDBOXDB_TARGET_AVX512
+    inline float hsum_avx512(__m512 v) {
+        alignas(64) float lanes[16];
+        _mm512_store_ps(lanes, v);
+        return hsum_avx2(_mm256_add_ps(_mm256_load_ps(lanes), _mm256_load_ps(lanes + 8)));
+    }
+
     // l2 with avx2
+    REDBOXDB_TARGET_AVX2
     inline float l2_avx2(const float* a, const float* b, size_t dim) {
         __m256 sum = _mm256_setzero_ps();   // 8-lane accumulator, starts at 0
         size_t d = 0;
@@ -71,9 +134,628 @@ namespace Distance {
 
         return result;
     }
+
+    // l2 with avx-512: 16 lanes per op, and the tail is a masked load
+    // instead of a scalar loop, so there is no per-element cleanup.
+    REDBOXDB_TARGET_AVX512
+    inline float l2_avx512(const float* a, const float* b, size_t dim) {
+        __m512 sum = _mm512_setzero_ps();
+        size_t d = 0;
+
+        for (; d + 16 <= dim; d += 16) {
+            __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(a + d), _mm512_loadu_ps(b + d));
+            sum = _mm512_fmadd_ps(diff, diff, sum);
+        }
+
+        if (d < dim) {
+            __mmask16 m = (__mmask16)((1u << (dim - d)) - 1u);
+            __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + d),
+                                        _mm512_maskz_loadu_ps(m, b + d));
+            sum = _mm512_fmadd_ps(diff, diff, sum);
+        }
+
+        return hsum_avx512(sum);
+    }
+
+    // dot product with avx2: two accumulators to hide FMA latency
+    REDBOXDB_TARGET_AVX2
+    inline float dot_avx2(const float* a, const float* b, size_t dim) {
+        __m256 s0 = _mm256_setzero_ps();
+        __m256 s1 = _mm256_setzero_ps();
+        size_t d = 0;
+        for (; d + 16 <= dim; d += 16) {
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + d),     _mm256_loadu_ps(b + d),     s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + d + 8), _mm256_loadu_ps(b + d + 8), s1);
+        }
+        for (; d + 8 <= dim; d += 8)
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + d), _mm256_loadu_ps(b + d), s0);
+
+        float result = hsum_avx2(_mm256_add_ps(s0, s1));
+        for (; d < dim; ++d) result += a[d] * b[d];
+        return result;
+    }
+
+    REDBOXDB_TARGET_AVX2
+    inline float ip_avx2(const float* a, const float* b, size_t dim) {
+        return 1.0f - dot_avx2(a, b, dim);
+    }
+
+    REDBOXDB_TARGET_AVX512
+    inline float dot_avx512(const float* a, const float* b, size_t dim) {
+        __m512 sum = _mm512_setzero_ps();
+        size_t d = 0;
+        for (; d + 16 <= dim; d += 16)
+            sum = _mm512_fmadd_ps(_mm512_loadu_ps(a + d), _mm512_loadu_ps(b + d), sum);
+        if (d < dim) {
+            __mmask16 m = (__mmask16)((1u << (dim - d)) - 1u);
+            sum = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + d),
+                                  _mm512_maskz_loadu_ps(m, b + d), sum);
+        }
+        return hsum_avx512(sum);
+    }
+
+    REDBOXDB_TARGET_AVX512
+    inline float ip_avx512(const float* a, const float* b, size_t dim) {
+        return 1.0f - dot_avx512(a, b, dim);
+    }
+
+    // -----------------------------------------------------------------------
+    // Dimension-specialised kernels. DIM is a template parameter, so the loop
+    // trip count is a constant: the compiler unrolls it completely, there is
+    // no tail, and four independent accumulators keep the FMA ports busy
+    // instead of serialising on one register. The runtime dim argument is
+    // ignored; it is only there so these fit DistanceFn.
+    // -----------------------------------------------------------------------
+    template <size_t DIM>
+    REDBOXDB_TARGET_AVX2
+    inline float l2_avx2_fixed(const float* a, const float* b, size_t) {
+        static_assert(DIM % 32 == 0, "AVX2 fixed kernels step 4 x 8 floats");
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+        REDBOXDB_UNROLL
+        for (size_t d = 0; d < DIM; d += 32) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + d),      _mm256_loadu_ps(b + d));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + d + 8),  _mm256_loadu_ps(b + d + 8));
+            __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(a + d + 16), _mm256_loadu_ps(b + d + 16));
+            __m256 d3 = _mm256_sub_ps(_mm256_loadu_ps(a + d + 24), _mm256_loadu_ps(b + d + 24));
+            s0 = _mm256_fmadd_ps(d0, d0, s0);
+            s1 = _mm256_fmadd_ps(d1, d1, s1);
+            s2 = _mm256_fmadd_ps(d2, d2, s2);
+            s3 = _mm256_fmadd_ps(d3, d3, s3);
+        }
+        return hsum_avx2(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+    }
+
+    template <size_t DIM>
+    REDBOXDB_TARGET_AVX2
+    inline float ip_avx2_fixed(const float* a, const float* b, size_t) {
+        static_assert(DIM % 32 == 0, "AVX2 fixed kernels step 4 x 8 floats");
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+        REDBOXDB_UNROLL
+        for (size_t d = 0; d < DIM; d += 32) {
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + d),      _mm256_loadu_ps(b + d),      s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + d + 8),  _mm256_loadu_ps(b + d + 8),  s1);
+            s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + d + 16), _mm256_loadu_ps(b + d + 16), s2);
+            s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + d + 24), _mm256_loadu_ps(b + d + 24), s3);
+        }
+        return 1.0f - hsum_avx2(_mm256_add_ps(_mm256_add_ps(s0, s1), _mm256_add_ps(s2, s3)));
+    }
+
+    template <size_t DIM>
+    REDBOXDB_TARGET_AVX512
+    inline float l2_avx512_fixed(const float* a, const float* b, size_t) {
+        static_assert(DIM % 64 == 0, "AVX-512 fixed kernels step 4 x 16 floats");
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+        __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+        REDBOXDB_UNROLL
+        for (size_t d = 0; d < DIM; d += 64) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + d),      _mm512_loadu_ps(b + d));
+            __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + d + 16), _mm512_loadu_ps(b + d + 16));
+            __m512 d2 = _mm512_sub_ps(_mm512_loadu_ps(a + d + 32), _mm512_loadu_ps(b + d + 32));
+            __m512 d3 = _mm512_sub_ps(_mm512_loadu_ps(a + d + 48), _mm512_loadu_ps(b + d + 48));
+            s0 = _mm512_fmadd_ps(d0, d0, s0);
+            s1 = _mm512_fmadd_ps(d1, d1, s1);
+            s2 = _mm512_fmadd_ps(d2, d2, s2);
+            s3 = _mm512_fmadd_ps(d3, d3, s3);
+        }
+        return hsum_avx512(_mm512_add_ps(_mm512_add_ps(s0, s1), _mm512_add_ps(s2, s3)));
+    }
+
+    template <size_t DIM>
+    REDBOXDB_TARGET_AVX512
+    inline float ip_avx512_fixed(const float* a, const float* b, size_t) {
+        static_assert(DIM % 64 == 0, "AVX-512 fixed kernels step 4 x 16 floats");
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+        __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+        REDBOXDB_UNROLL
+        for (size_t d = 0; d < DIM; d += 64) {
+            s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + d),      _mm512_loadu_ps(b + d),      s0);
+            s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + d + 16), _mm512_loadu_ps(b + d + 16), s1);
+            s2 = _mm512_fmadd_ps(_mm512_loadu_ps(a + d + 32), _mm512_loadu_ps(b + d + 32), s2);
+            s3 = _mm512_fmadd_ps(_mm512_loadu_ps(a + d + 48), _mm512_loadu_ps(b + d + 48), s3);
+        }
+        return 1.0f - hsum_avx512(_mm512_add_ps(_mm512_add_ps(s0, s1), _mm512_add_ps(s2, s3)));
+    }
+
+    template <size_t DIM>
+    inline DistanceFn fixed_kernel(Platform::SimdLevel level, CoreEngine::Metric metric) {
+        bool ip = (metric != CoreEngine::Metric::L2);
+        if (level >= Platform::SimdLevel::AVX512)
+            return ip ? &ip_avx512_fixed<DIM> : &l2_avx512_fixed<DIM>;
+        if (level >= Platform::SimdLevel::AVX2)
+            return ip ? &ip_avx2_fixed<DIM> : &l2_avx2_fixed<DIM>;
+        return nullptr;
+    }
+#endif
+
+    // Specialised kernel for the embedding sizes we actually deploy, or
+    // nullptr if dim isn't one of them (or there's no SIMD to specialise).
+    inline DistanceFn fixed_kernel_for(Platform::SimdLevel level, CoreEngine::Metric metric, size_t dim) {
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+        switch (dim) {
+            case 128:  return fixed_kernel<128>(level, metric);
+            case 384:  return fixed_kernel<384>(level, metric);
+            case 768:  return fixed_kernel<768>(level, metric);
+            case 1024: return fixed_kernel<1024>(level, metric);
+            case 1536: return fixed_kernel<1536>(level, metric);
+            default:   break;
+        }
+#else
+        (void)level; (void)metric; (void)dim;
+#endif
+        return nullptr;
+    }
+
+    // -----------------------------------------------------------------------
+    // Early-abandoning L2 for top-N scans.
+    //
+    // Squared L2 only grows as dimensions are added, so once the partial sum
+    // passes the current k-th best distance the candidate cannot make the
+    // heap. These kernels check the partial sum every ABANDON_STRIDE floats
+    // and return it (>= bound) as soon as it reaches bound; otherwise they
+    // return the full distance. Inner product partial sums are not monotone,
+    // so there is no IP variant.
+    // -----------------------------------------------------------------------
+    using BoundedFn = float (*)(const float*, const float*, size_t, float bound);
+
+    static constexpr size_t ABANDON_STRIDE = 64;
+
+    inline float l2_bounded_scalar(const float* a, const float* b, size_t dim, float bound) {
+        float sum = 0.0f;
+        size_t d = 0;
+        while (d < dim) {
+            size_t end = std::min(dim, d + ABANDON_STRIDE);
+            for (; d < end; ++d) {
+                float diff = a[d] - b[d];
+                sum += diff * diff;
+            }
+            if (sum >= bound) return sum;
+        }
+        return sum;
+    }
+
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+    REDBOXDB_TARGET_AVX2
+    inline float l2_bounded_avx2(const float* a, const float* b, size_t dim, float bound) {
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        size_t d = 0;
+        for (; d + ABANDON_STRIDE <= dim; ) {
+            for (size_t end = d + ABANDON_STRIDE; d < end; d += 16) {
+                __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + d),     _mm256_loadu_ps(b + d));
+                __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + d + 8), _mm256_loadu_ps(b + d + 8));
+                s0 = _mm256_fmadd_ps(d0, d0, s0);
+                s1 = _mm256_fmadd_ps(d1, d1, s1);
+            }
+            float partial = hsum_avx2(_mm256_add_ps(s0, s1));
+            if (partial >= bound) return partial;
+        }
+        for (; d + 8 <= dim; d += 8) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + d), _mm256_loadu_ps(b + d));
+            s0 = _mm256_fmadd_ps(d0, d0, s0);
+        }
+        float sum = hsum_avx2(_mm256_add_ps(s0, s1));
+        for (; d < dim; ++d) {
+            float diff = a[d] - b[d];
+            sum += diff * diff;
+        }
+        return sum;
+    }
+
+    REDBOXDB_TARGET_AVX512
+    inline float l2_bounded_avx512(const float* a, const float* b, size_t dim, float bound) {
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+        size_t d = 0;
+        for (; d + ABANDON_STRIDE <= dim; d += ABANDON_STRIDE) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + d),      _mm512_loadu_ps(b + d));
+            __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + d + 16), _mm512_loadu_ps(b + d + 16));
+            __m512 d2 = _mm512_sub_ps(_mm512_loadu_ps(a + d + 32), _mm512_loadu_ps(b + d + 32));
+            __m512 d3 = _mm512_sub_ps(_mm512_loadu_ps(a + d + 48), _mm512_loadu_ps(b + d + 48));
+            s0 = _mm512_fmadd_ps(d0, d0, s0);
+            s1 = _mm512_fmadd_ps(d1, d1, s1);
+            s0 = _mm512_fmadd_ps(d2, d2, s0);
+            s1 = _mm512_fmadd_ps(d3, d3, s1);
+            float partial = hsum_avx512(_mm512_add_ps(s0, s1));
+            if (partial >= bound) return partial;
+        }
+        for (; d + 16 <= dim; d += 16) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + d), _mm512_loadu_ps(b + d));
+            s0 = _mm512_fmadd_ps(d0, d0, s0);
+        }
+        if (d < dim) {
+            __mmask16 m = (__mmask16)((1u << (dim - d)) - 1);
+            __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + d), _mm512_maskz_loadu_ps(m, b + d));
+            s0 = _mm512_fmadd_ps(d0, d0, s0);
+        }
+        return hsum_avx512(_mm512_add_ps(s0, s1));
+    }
 #endif
 
-    // Call this everywhere — it picks the right path at runtime
+    // -----------------------------------------------------------------------
+    // Register-blocked kernels: one query against 4 rows per pass.
+    //
+    // Scans call the single-row kernel once per candidate, reloading the
+    // query chunk for every row. These load each query chunk once and
+    // stream it against 4 rows with 4 accumulators. Rows are pointers, so
+    // they need not be contiguous (IVF cluster members, graph neighbours).
+    //
+    // bound works as for l2_bounded, per block: once all 4 partial sums
+    // reach it the kernel stops, and an out[i] >= bound may be a partial
+    // sum. Pass FLT_MAX for exact distances. The IP / dot kernels ignore it.
+    // -----------------------------------------------------------------------
+    static constexpr int ROW_BLOCK = 4;
+
+    using Rows4Fn = void (*)(const float* q, const float* const* rows, size_t dim,
+                             float bound, float* out);
+
+    inline void l2_x4_scalar(const float* q, const float* const* rows, size_t dim,
+                             float bound, float* out) {
+        for (int r = 0; r < ROW_BLOCK; ++r) out[r] = 0.0f;
+        size_t d = 0;
+        while (d < dim) {
+            size_t end = std::min(dim, d + ABANDON_STRIDE);
+            for (int r = 0; r < ROW_BLOCK; ++r) {
+                float s = out[r];
+                for (size_t i = d; i < end; ++i) {
+                    float diff = q[i] - rows[r][i];
+                    s += diff * diff;
+                }
+                out[r] = s;
+            }
+            d = end;
+            if (out[0] >= bound && out[1] >= bound && out[2] >= bound && out[3] >= bound) return;
+        }
+    }
+
+    // Raw <q, row> for 4 rows; the GEMM tile behind search_batch.
+    inline void dot_x4_scalar(const float* q, const float* const* rows, size_t dim,
+                              float, float* out) {
+        for (int r = 0; r < ROW_BLOCK; ++r) out[r] = dot_scalar(q, rows[r], dim);
+    }
+
+    inline void ip_x4_scalar(const float* q, const float* const* rows, size_t dim,
+                             float bound, float* out) {
+        dot_x4_scalar(q, rows, dim, bound, out);
+        for (int r = 0; r < ROW_BLOCK; ++r) out[r] = 1.0f - out[r];
+    }
+
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+    REDBOXDB_TARGET_AVX2
+    inline void l2_x4_avx2(const float* q, const float* const* rows, size_t dim,
+                           float bound, float* out) {
+        const float *r0 = rows[0], *r1 = rows[1], *r2 = rows[2], *r3 = rows[3];
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+        const bool may_abandon = bound < std::numeric_limits<float>::max();
+        size_t d = 0;
+        for (size_t next_check = ABANDON_STRIDE; d + 8 <= dim; d += 8) {
+            __m256 vq = _mm256_loadu_ps(q + d);
+            __m256 d0 = _mm256_sub_ps(vq, _mm256_loadu_ps(r0 + d));
+            __m256 d1 = _mm256_sub_ps(vq, _mm256_loadu_ps(r1 + d));
+            __m256 d2 = _mm256_sub_ps(vq, _mm256_loadu_ps(r2 + d));
+            __m256 d3 = _mm256_sub_ps(vq, _mm256_loadu_ps(r3 + d));
+            s0 = _mm256_fmadd_ps(d0, d0, s0);
+            s1 = _mm256_fmadd_ps(d1, d1, s1);
+            s2 = _mm256_fmadd_ps(d2, d2, s2);
+            s3 = _mm256_fmadd_ps(d3, d3, s3);
+            if (may_abandon && d + 8 == next_check) {
+                next_check += ABANDON_STRIDE;
+                out[0] = hsum_avx2(s0); out[1] = hsum_avx2(s1);
+                out[2] = hsum_avx2(s2); out[3] = hsum_avx2(s3);
+                if (out[0] >= bound && out[1] >= bound && out[2] >= bound && out[3] >= bound) return;
+            }
+        }
+        out[0] = hsum_avx2(s0); out[1] = hsum_avx2(s1);
+        out[2] = hsum_avx2(s2); out[3] = hsum_avx2(s3);
+        for (; d < dim; ++d) {
+            for (int r = 0; r < ROW_BLOCK; ++r) {
+                float diff = q[d] - rows[r][d];
+                out[r] += diff * diff;
+            }
+        }
+    }
+
+    REDBOXDB_TARGET_AVX2
+    inline void dot_x4_avx2(const float* q, const float* const* rows, size_t dim,
+                            float, float* out) {
+        const float *r0 = rows[0], *r1 = rows[1], *r2 = rows[2], *r3 = rows[3];
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+        size_t d = 0;
+        for (; d + 8 <= dim; d += 8) {
+            __m256 vq = _mm256_loadu_ps(q + d);
+            s0 = _mm256_fmadd_ps(vq, _mm256_loadu_ps(r0 + d), s0);
+            s1 = _mm256_fmadd_ps(vq, _mm256_loadu_ps(r1 + d), s1);
+            s2 = _mm256_fmadd_ps(vq, _mm256_loadu_ps(r2 + d), s2);
+            s3 = _mm256_fmadd_ps(vq, _mm256_loadu_ps(r3 + d), s3);
+        }
+        float dot[ROW_BLOCK] = { hsum_avx2(s0), hsum_avx2(s1), hsum_avx2(s2), hsum_avx2(s3) };
+        for (; d < dim; ++d)
+            for (int r = 0; r < ROW_BLOCK; ++r) dot[r] += q[d] * rows[r][d];
+        for (int r = 0; r < ROW_BLOCK; ++r) out[r] = dot[r];
+    }
+
+    REDBOXDB_TARGET_AVX2
+    inline void ip_x4_avx2(const float* q, const float* const* rows, size_t dim,
+                           float bound, float* out) {
+        dot_x4_avx2(q, rows, dim, bound, out);
+        for (int r = 0; r < ROW_BLOCK; ++r) out[r] = 1.0f - out[r];
+    }
+
+    REDBOXDB_TARGET_AVX512
+    inline void l2_x4_avx512(const float* q, const float* const* rows, size_t dim,
+                             float bound, float* out) {
+        const float *r0 = rows[0], *r1 = rows[1], *r2 = rows[2], *r3 = rows[3];
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+        __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+        const bool may_abandon = bound < std::numeric_limits<float>::max();
+        size_t d = 0;
+        for (size_t next_check = ABANDON_STRIDE; d + 16 <= dim; d += 16) {
+            __m512 vq = _mm512_loadu_ps(q + d);
+            __m512 d0 = _mm512_sub_ps(vq, _mm512_loadu_ps(r0 + d));
+            __m512 d1 = _mm512_sub_ps(vq, _mm512_loadu_ps(r1 + d));
+            __m512 d2 = _mm512_sub_ps(vq, _mm512_loadu_ps(r2 + d));
+            __m512 d3 = _mm512_sub_ps(vq, _mm512_loadu_ps(r3 + d));
+            s0 = _mm512_fmadd_ps(d0, d0, s0);
+            s1 = _mm512_fmadd_ps(d1, d1, s1);
+            s2 = _mm512_fmadd_ps(d2, d2, s2);
+            s3 = _mm512_fmadd_ps(d3, d3, s3);
+            if (may_abandon && d + 16 == next_check) {
+                next_check += ABANDON_STRIDE;
+                out[0] = hsum_avx512(s0); out[1] = hsum_avx512(s1);
+                out[2] = hsum_avx512(s2); out[3] = hsum_avx512(s3);
+                if (out[0] >= bound && out[1] >= bound && out[2] >= bound && out[3] >= bound) return;
+            }
+        }
+        if (d < dim) {
+            __mmask16 m = (__mmask16)((1u << (dim - d)) - 1);
+            __m512 vq = _mm512_maskz_loadu_ps(m, q + d);
+            __m512 d0 = _mm512_sub_ps(vq, _mm512_maskz_loadu_ps(m, r0 + d));
+            __m512 d1 = _mm512_sub_ps(vq, _mm512_maskz_loadu_ps(m, r1 + d));
+            __m512 d2 = _mm512_sub_ps(vq, _mm512_maskz_loadu_ps(m, r2 + d));
+            __m512 d3 = _mm512_sub_ps(vq, _mm512_maskz_loadu_ps(m, r3 + d));
+            s0 = _mm512_fmadd_ps(d0, d0, s0);
+            s1 = _mm512_fmadd_ps(d1, d1, s1);
+            s2 = _mm512_fmadd_ps(d2, d2, s2);
+            s3 = _mm512_fmadd_ps(d3, d3, s3);
+        }
+        out[0] = hsum_avx512(s0); out[1] = hsum_avx512(s1);
+        out[2] = hsum_avx512(s2); out[3] = hsum_avx512(s3);
+    }
+
+    REDBOXDB_TARGET_AVX512
+    inline void dot_x4_avx512(const float* q, const float* const* rows, size_t dim,
+                              float, float* out) {
+        const float *r0 = rows[0], *r1 = rows[1], *r2 = rows[2], *r3 = rows[3];
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+        __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+        size_t d = 0;
+        for (; d + 16 <= dim; d += 16) {
+            __m512 vq = _mm512_loadu_ps(q + d);
+            s0 = _mm512_fmadd_ps(vq, _mm512_loadu_ps(r0 + d), s0);
+            s1 = _mm512_fmadd_ps(vq, _mm512_loadu_ps(r1 + d), s1);
+            s2 = _mm512_fmadd_ps(vq, _mm512_loadu_ps(r2 + d), s2);
+            s3 = _mm512_fmadd_ps(vq, _mm512_loadu_ps(r3 + d), s3);
+        }
+        if (d < dim) {
+            __mmask16 m = (__mmask16)((1u << (dim - d)) - 1);
+            __m512 vq = _mm512_maskz_loadu_ps(m, q + d);
+            s0 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(m, r0 + d), s0);
+            s1 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(m, r1 + d), s1);
+            s2 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(m, r2 + d), s2);
+            s3 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(m, r3 + d), s3);
+        }
+        out[0] = hsum_avx512(s0); out[1] = hsum_avx512(s1);
+        out[2] = hsum_avx512(s2); out[3] = hsum_avx512(s3);
+    }
+
+    REDBOXDB_TARGET_AVX512
+    inline void ip_x4_avx512(const float* q, const float* const* rows, size_t dim,
+                             float bound, float* out) {
+        dot_x4_avx512(q, rows, dim, bound, out);
+        for (int r = 0; r < ROW_BLOCK; ++r) out[r] = 1.0f - out[r];
+    }
+#endif
+
+    // -----------------------------------------------------------------------
+    // Transposed tiles: W rows stored dimension-major, tile[d * W + r].
+    //
+    // One SIMD lane per row: each dimension is one broadcast of q[d] and one
+    // contiguous load of W values, so a tile yields W distances in registers
+    // with no horizontal reduction. W is the register width (8 for scalar /
+    // AVX2, 16 for AVX-512); pack with tile_pack. Pays off most at low to
+    // mid dimensions, where the row kernels' per-call reduction dominates.
+    // -----------------------------------------------------------------------
+    static constexpr size_t MAX_TILE_ROWS = 16;
+
+    using TileFn = void (*)(const float* q, const float* tile, size_t dim, float* out);
+
+    // Writes v into row `pos` of a tile array, growing it by a zeroed tile
+    // when pos starts a new one.
+    inline void tile_pack(std::vector<float>& tiles, size_t width, size_t pos,
+                          const float* v, size_t dim) {
+        size_t tb = width * dim;
+        size_t t  = pos / width, r = pos % width;
+        if (tiles.size() < (t + 1) * tb) tiles.resize((t + 1) * tb, 0.0f);
+        float* tile = tiles.data() + t * tb;
+        for (size_t d = 0; d < dim; ++d) tile[d * width + r] = v[d];
+    }
+
+    inline void l2_tile8_scalar(const float* q, const float* tile, size_t dim, float* out) {
+        float s[8] = {};
+        for (size_t d = 0; d < dim; ++d)
+            for (int r = 0; r < 8; ++r) {
+                float diff = q[d] - tile[d * 8 + r];
+                s[r] += diff * diff;
+            }
+        for (int r = 0; r < 8; ++r) out[r] = s[r];
+    }
+
+    inline void ip_tile8_scalar(const float* q, const float* tile, size_t dim, float* out) {
+        float s[8] = {};
+        for (size_t d = 0; d < dim; ++d)
+            for (int r = 0; r < 8; ++r) s[r] += q[d] * tile[d * 8 + r];
+        for (int r = 0; r < 8; ++r) out[r] = 1.0f - s[r];
+    }
+
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+    // Two accumulators over alternating dimensions hide the FMA latency.
+    REDBOXDB_TARGET_AVX2
+    inline void l2_tile8_avx2(const float* q, const float* tile, size_t dim, float* out) {
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        size_t d = 0;
+        for (; d + 2 <= dim; d += 2) {
+            __m256 d0 = _mm256_sub_ps(_mm256_set1_ps(q[d]),     _mm256_loadu_ps(tile + d * 8));
+            __m256 d1 = _mm256_sub_ps(_mm256_set1_ps(q[d + 1]), _mm256_loadu_ps(tile + d * 8 + 8));
+            s0 = _mm256_fmadd_ps(d0, d0, s0);
+            s1 = _mm256_fmadd_ps(d1, d1, s1);
+        }
+        if (d < dim) {
+            __m256 d0 = _mm256_sub_ps(_mm256_set1_ps(q[d]), _mm256_loadu_ps(tile + d * 8));
+            s0 = _mm256_fmadd_ps(d0, d0, s0);
+        }
+        _mm256_storeu_ps(out, _mm256_add_ps(s0, s1));
+    }
+
+    REDBOXDB_TARGET_AVX2
+    inline void ip_tile8_avx2(const float* q, const float* tile, size_t dim, float* out) {
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        size_t d = 0;
+        for (; d + 2 <= dim; d += 2) {
+            s0 = _mm256_fmadd_ps(_mm256_set1_ps(q[d]),     _mm256_loadu_ps(tile + d * 8),     s0);
+            s1 = _mm256_fmadd_ps(_mm256_set1_ps(q[d + 1]), _mm256_loadu_ps(tile + d * 8 + 8), s1);
+        }
+        if (d < dim) s0 = _mm256_fmadd_ps(_mm256_set1_ps(q[d]), _mm256_loadu_ps(tile + d * 8), s0);
+        _mm256_storeu_ps(out, _mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(s0, s1)));
+    }
+
+    REDBOXDB_TARGET_AVX512
+    inline void l2_tile16_avx512(const float* q, const float* tile, size_t dim, float* out) {
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+        size_t d = 0;
+        for (; d + 2 <= dim; d += 2) {
+            __m512 d0 = _mm512_sub_ps(_mm512_set1_ps(q[d]),     _mm512_loadu_ps(tile + d * 16));
+            __m512 d1 = _mm512_sub_ps(_mm512_set1_ps(q[d + 1]), _mm512_loadu_ps(tile + d * 16 + 16));
+            s0 = _mm512_fmadd_ps(d0, d0, s0);
+            s1 = _mm512_fmadd_ps(d1, d1, s1);
+        }
+        if (d < dim) {
+            __m512 d0 = _mm512_sub_ps(_mm512_set1_ps(q[d]), _mm512_loadu_ps(tile + d * 16));
+            s0 = _mm512_fmadd_ps(d0, d0, s0);
+        }
+        _mm512_storeu_ps(out, _mm512_add_ps(s0, s1));
+    }
+
+    REDBOXDB_TARGET_AVX512
+    inline void ip_tile16_avx512(const float* q, const float* tile, size_t dim, float* out) {
+        __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+        size_t d = 0;
+        for (; d + 2 <= dim; d += 2) {
+            s0 = _mm512_fmadd_ps(_mm512_set1_ps(q[d]),     _mm512_loadu_ps(tile + d * 16),      s0);
+            s1 = _mm512_fmadd_ps(_mm512_set1_ps(q[d + 1]), _mm512_loadu_ps(tile + d * 16 + 16), s1);
+        }
+        if (d < dim) s0 = _mm512_fmadd_ps(_mm512_set1_ps(q[d]), _mm512_loadu_ps(tile + d * 16), s0);
+        _mm512_storeu_ps(out, _mm512_sub_ps(_mm512_set1_ps(1.0f), _mm512_add_ps(s0, s1)));
+    }
+#endif
+
+    // Kernel registry: one table per SIMD level, picked once per process.
+    struct KernelTable {
+        Platform::SimdLevel level;
+        const char*         name;
+        DistanceFn          l2;    // squared euclidean
+        DistanceFn          ip;    // 1 - <a,b>
+        DistanceFn          dot;   // raw <a,b>, for norms; not a distance
+        BoundedFn           l2_bounded;  // early-abandoning l2
+        Rows4Fn             l2_x4;       // 1 query x 4 rows
+        Rows4Fn             ip_x4;
+        Rows4Fn             dot_x4;      // raw <q,row>, bound ignored
+        size_t              tile_rows;   // W of the transposed tile kernels
+        TileFn              l2_tile;
+        TileFn              ip_tile;
+
+        // Distance used for search/build under a given metric. Cosine data
+        // is normalised on the way in, so it runs on the inner-product kernel.
+        DistanceFn for_metric(CoreEngine::Metric metric) const {
+            return (metric == CoreEngine::Metric::L2) ? l2 : ip;
+        }
+
+        // Same, but prefers a kernel specialised on dim when one exists.
+        DistanceFn for_metric(CoreEngine::Metric metric, size_t dim) const {
+            DistanceFn fixed = fixed_kernel_for(level, metric, dim);
+            return fixed ? fixed : for_metric(metric);
+        }
+
+        // Early-abandoning kernel for a metric, or nullptr when abandoning
+        // can't help: non-L2 metrics, or dim too short to check more than once.
+        BoundedFn bounded_for_metric(CoreEngine::Metric metric, size_t dim) const {
+            if (metric != CoreEngine::Metric::L2 || dim < 2 * ABANDON_STRIDE) return nullptr;
+            return l2_bounded;
+        }
+
+        Rows4Fn rows4_for_metric(CoreEngine::Metric metric) const {
+            return (metric == CoreEngine::Metric::L2) ? l2_x4 : ip_x4;
+        }
+
+        TileFn tile_for_metric(CoreEngine::Metric metric) const {
+            return (metric == CoreEngine::Metric::L2) ? l2_tile : ip_tile;
+        }
+    };
+
+    inline KernelTable kernels_for(Platform::SimdLevel level) {
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+        if (level >= Platform::SimdLevel::AVX512)
+            return { Platform::SimdLevel::AVX512, "avx512", &l2_avx512, &ip_avx512, &dot_avx512,
+                     &l2_bounded_avx512, &l2_x4_avx512, &ip_x4_avx512, &dot_x4_avx512,
+                     16, &l2_tile16_avx512, &ip_tile16_avx512 };
+        if (level >= Platform::SimdLevel::AVX2)
+            return { Platform::SimdLevel::AVX2, "avx2", &l2_avx2, &ip_avx2, &dot_avx2,
+                     &l2_bounded_avx2, &l2_x4_avx2, &ip_x4_avx2, &dot_x4_avx2,
+                     8, &l2_tile8_avx2, &ip_tile8_avx2 };
+#else
+        (void)level;
+#endif
+        return { Platform::SimdLevel::Scalar, "scalar", &l2_scalar, &ip_scalar, &dot_scalar,
+                 &l2_bounded_scalar, &l2_x4_scalar, &ip_x4_scalar, &dot_x4_scalar,
+                 8, &l2_tile8_scalar, &ip_tile8_scalar };
+    }
+
+    // Probes the CPU on first use (thread-safe static init) and returns the
+    // widest table this machine supports.
+    inline const KernelTable& kernels() {
+        static const KernelTable table = kernels_for(Platform::detect_simd_level());
+        return table;
+    }
+
+    // Scales v to unit length in place. Zero vectors are left as-is.
+    inline void normalize(float* v, size_t dim) {
+        float norm_sq = kernels().dot(v, v, dim);
+        if (norm_sq <= 0.0f) return;
+        float inv = 1.0f / std::sqrt(norm_sq);
+        for (size_t d = 0; d < dim; ++d) v[d] *= inv;
+    }
+
+    // Legacy entry point kept for callers outside the hot paths.
     inline float l2(const float* a, const float* b, size_t dim, bool use_avx2) {
 #if REDBOXDB_HAS_AVX2_INTRINSICS
         if (use_avx2) return l2_avx2(a, b, dim);
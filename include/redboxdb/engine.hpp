@@ -5,10 +5,21 @@
 #include <thread>
 #include <algorithm>
 #include <shared_mutex>
+#include <queue>
+#include <span>
 #include <random>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <atomic>
 #include "redboxdb/storage_manager.hpp"
 #include "redboxdb/SpecificMetadata.hpp"
 #include "redboxdb/hnsw_manager.hpp"
+#include "redboxdb/distance.hpp"
+#include "redboxdb/thread_pool.hpp"
+#include "redboxdb/cluster_manager.hpp"
+#include "redboxdb/centroid_graph.hpp"
+#include "redboxdb/nn_descent.hpp"
 
 namespace CoreEngine {
 
@@ -17,9 +28,17 @@ namespace CoreEngine {
         static constexpr int     default_capacity      = 1000;
         static constexpr size_t  TOMBSTONE_COMPACT_SLACK = 64;
         static constexpr int     PARALLEL_THRESHOLD    = 50000;
-        static constexpr uint16_t  DEFAULT_CLUSTERS      = 1000;
-        static constexpr uint8_t DEFAULT_PROBES        = 10;
         static constexpr uint64_t KMEANS_INIT_THRESHOLD = 10000;
+        static constexpr uint64_t SQ8_TRAIN_THRESHOLD   = 1000;   // HNSW; IVF trains with k-means
+        static constexpr int      SQ8_RERANK_FACTOR     = 4;      // exact rerank depth = N x this
+        static constexpr int      PQ_RERANK_FACTOR      = 8;      // 4-bit PQ is coarser than SQ8
+        static constexpr uint64_t BQ_TRAIN_THRESHOLD    = 1000;   // means need no clustering
+        static constexpr uint16_t BQ_RERANK_FACTOR      = 16;     // default bq_oversample
+        static constexpr size_t   BATCH_TILE_BYTES      = 64 * 1024;  // rows kept hot per batch tile
+        static constexpr size_t   REORG_TAIL_DIVISOR    = 4;      // re-group when tail > grouped / 4
+        static constexpr uint64_t REBALANCE_MIN_WRITES  = 1000;   // between imbalance-triggered passes
+        static constexpr uint16_t CENTROID_GRAPH_MIN_K  = 256;    // below this brute force is faster
+        static constexpr uint8_t  HNSW_EF_FACTOR        = 4;      // default top-N beam = max(ef_search, N) x this
 
         size_t dimension;
         std::unique_ptr<StorageManager::Manager> _manager;
@@ -37,41 +56,335 @@ namespace CoreEngine {
         // IVF in-memory index
         std::vector<std::vector<int>> cluster_index;
 
+        // ||x||^2 per slot (IVF only), so search_batch can expand L2 as
+        // ||q||^2 - 2 q.x + ||x||^2. Rebuilt on open.
+        std::vector<float> row_norms;
+        void set_row_norm(size_t slot);
+
+        // Cluster-contiguous layout: slots [0, organised_count) hold each
+        // cluster's vectors as one run (deleted slots parked after them);
+        // later inserts append past it until the tail is worth re-grouping.
+        size_t organised_count = 0;
+        bool needs_reorganize() const;
+        void schedule_reorganize();
+        void reorganize_locked();
+        void hnsw_reorder_locked();
+
         // HNSW RNG
         std::mt19937 hnsw_rng;
+        // The file's edge blocks, as the graph code addresses them.
+        HnswManager::EdgeStore hnsw_edges() const;
 
         // HNSW insert buffers (reused across inserts to avoid per-insert allocation)
-        std::vector<uint8_t> hnsw_insert_visited_buf;
-        uint32_t hnsw_insert_visit_gen = 0;
+        HnswManager::SearchContext hnsw_insert_ctx;
+
+        // Concurrent HNSW linking: insert() and insert_bulk() record slots
+        // under the write lock, then link them under the read lock
+        // (hnsw_link_pending, insert_bulk's link pass).
+        HnswManager::GraphLocks      hnsw_locks;
+        std::unordered_set<uint32_t> hnsw_unlinked;       // guarded by hnsw_unlinked_mtx
+        std::mutex                   hnsw_unlinked_mtx;
+        void hnsw_link_pending(uint32_t slot);
+        NnDescent::Params            nn_descent_params;
+
+        // Level-0 beam for an HNSW top-N search (see set_hnsw_ef_factor).
+        uint8_t hnsw_ef_factor = HNSW_EF_FACTOR;
+        int     hnsw_topn_ef(int n) const;
         std::vector<HnswManager::SearchResult> hnsw_insert_nb_cands;
 
-        bool   use_avx2;
+        // Distance kernel picked once from Distance::kernels() at construction
+        // (specialised on dimension when one exists); every hot loop calls
+        // through this pointer.
+        Distance::DistanceFn dist_fn;
+        // Early-abandoning variant for the IVF / flat float scans; nullptr
+        // when the metric or dimension can't use it (see bounded_for_metric).
+        Distance::BoundedFn  bounded_fn = nullptr;
+        // 1 query x 4 rows (Distance::Rows4Fn) for the same scans and the
+        // HNSW neighbour heuristic.
+        Distance::Rows4Fn    rows4_fn   = nullptr;
+        Metric metric;
         size_t num_threads;
 
+        // Intra-query parallelism: float scans over PARALLEL_THRESHOLD+
+        // candidates are split across num_threads (pool workers + caller),
+        // each with its own top-N heap, then merged. Pool started on first use.
+        //
+        // TopN keeps the N nearest (dist, slot) seen so far, farthest on top,
+        // as a Heap4 over storage the caller lends it, so queries can run it
+        // on per-thread buffers.
+        class TopN {
+        public:
+            using Entry = std::pair<float, int>;
+            explicit TopN(std::vector<Entry>& storage) : h(&storage) { h->clear(); }
+            size_t       size()  const { return h->size(); }
+            bool         empty() const { return h->empty(); }
+            const Entry& top()   const { return h->front(); }
+            void offer(Entry e, int n) {
+                if ((int)h->size() < n)       HnswManager::Heap4::push(*h, e, Farther{});
+                else if (e.first < top().first) HnswManager::Heap4::replace_top(*h, e, Farther{});
+            }
+            // Ascending; the heap order is gone afterwards.
+            std::vector<Entry>& sorted() { std::sort(h->begin(), h->end()); return *h; }
+        private:
+            struct Farther { bool operator()(const Entry& a, const Entry& b) const { return a > b; } };
+            std::vector<Entry>* h;
+        };
+        mutable std::shared_ptr<Parallel::ThreadPool> pool;
+        mutable std::mutex pool_mutex;
+        // The shared pool, or nullptr when num_threads is 1. Also used by
+        // k-means training, which holds its own reference.
+        std::shared_ptr<Parallel::ThreadPool> worker_pool() const;
+        bool parallel_scan_worthwhile(size_t candidates) const;
+        void scan_float_range(const std::vector<int>& candidates, size_t begin, size_t end,
+                              const float* query, int N, TopN& pq) const;
+        void parallel_scan(const std::vector<int>& candidates, const float* query, int N, TopN& pq) const;
+
+        // Cosine DBs store unit vectors; returns vec untouched for the other
+        // metrics, otherwise a normalised copy in scratch.
+        const std::vector<float>& apply_metric(const std::vector<float>& vec,
+                                               std::vector<float>& scratch) const;
+
+        // IVF-PQ: fast-scan blocks per cluster, parallel to cluster_index
+        // (pq_blocks[c] position p <-> cluster_index[c][p]). Rebuilt on open.
+        std::vector<std::vector<uint8_t>> pq_blocks;
+        bool pq_ready() const;
+        void pq_train(size_t n);
+        void pq_train_codebook(const float* data, const uint16_t* assign, const float* centroids,
+                               size_t n, float* codebook) const;
+        void pq_encode_all(size_t n);
+        void pq_encode_slot(int slot, uint16_t c);
+        void pq_append(uint16_t c);
+        void pq_rebuild_blocks();
+        const std::vector<std::pair<float, int>>& pq_search(const float* query, int N) const;
+
+        // Dimension-major float tiles for the IVF / flat scans, opt-in via
+        // set_tiled_scan. tile_blocks[c] mirrors cluster_index[c] (row p <->
+        // cluster_index[c][p]); before k-means tile_blocks[0] holds every
+        // slot in slot order. In memory only.
+        bool tiled_scan = false;
+        std::vector<std::vector<float>> tile_blocks;
+        bool tiles_ready() const;
+        void tile_rebuild();
+        void tile_store(int slot);
+        const std::vector<std::pair<float, int>>& tile_search(const float* query, int N) const;
+        void tile_scan_cluster(const float* query, uint16_t g, int N, TopN& pq) const;
+
+        ClusterManager::TrainParams     kmeans_params;
+        ClusterManager::RebalanceParams rebalance_params;
+
+        // IVF initialisation at KMEANS_INIT_THRESHOLD. train_clusters runs
+        // k-means (and the PQ codebook) on the first n vectors of data
+        // without touching engine state; install_clusters swaps the result
+        // in under the write lock. With background_training the training
+        // runs in maintenance_thread on a copy while inserts and flat scans
+        // go on, and install also assigns what arrived or changed meanwhile.
+        // Rebalancing and insert-triggered re-grouping use the same thread.
+        struct TrainedClusters {
+            size_t                n = 0;
+            std::vector<float>    centroids;
+            std::vector<uint64_t> counts;
+            std::vector<uint16_t> assign;
+            std::vector<float>    pq_codebook;   // IVF-PQ only
+        };
+        bool        background_training = false;
+        bool        maintenance_running = false;   // guarded by rw_mutex
+        std::thread maintenance_thread;
+        std::mutex  maintenance_mutex;             // guards the std::thread object
+        TrainedClusters train_clusters(const float* data, size_t n,
+                                       const ClusterManager::TrainParams& params) const;
+        void launch_maintenance(std::function<void()> job);
+        void start_background_kmeans(size_t n);
+        void install_clusters(const TrainedClusters& t, const float* data);
+
+        // Online rebalancing (see rebalance()). Writes into clusters are
+        // counted; an oversized cluster, an auto-K target that has pulled
+        // ahead, or rebalance_params.interval writes start a pass.
+        uint64_t writes_since_rebalance = 0;
+        void   note_cluster_write(uint16_t c);
+        size_t rebalance_locked();
+        // Drops slot from cluster c's list, moving the last member into its
+        // position (and its PQ / tile row with it).
+        void   detach_from_cluster(int slot, uint16_t c);
+
+        void open_ivf(bool auto_clusters);
+
+        // Coarse quantizer: the nearest centroid (insert assignment) and the
+        // nearest `probes` (search), brute force over the K centroids or
+        // through centroid_graph when set_centroid_graph is on and K is at
+        // least CENTROID_GRAPH_MIN_K. probes is clamped to K.
+        bool     use_centroid_graph = false;
+        int      centroid_ef        = 64;
+        CentroidGraph::Graph centroid_graph;
+        bool     centroid_graph_ready() const;
+        void     centroid_graph_rebuild();
+        uint16_t nearest_centroid(const float* v) const;
+        void     select_probes(const float* query, int probes, std::vector<uint16_t>& out) const;
+
+        // Adaptive probing over float IVF data (set_probe_params).
+        // cluster_radius[c] bounds the Euclidean distance from centroid c to
+        // any of its members: recomputed at k-means init and re-grouping,
+        // and on writes grown by however far the running mean moved.
+        ClusterManager::ProbeParams probe_params;
+        std::vector<float> cluster_radius;
+        std::vector<float> centroid_before;   // centroid_add / centroid_remove scratch
+        mutable std::atomic<uint64_t> adaptive_queries{ 0 };
+        mutable std::atomic<uint64_t> adaptive_probes{ 0 };
+        void radius_rebuild();
+        void radius_cover(uint16_t c, const float* v);
+        // Running-mean add / remove of v in centroid c (cosine centroids
+        // re-normalised), keeping cluster_radius[c] a bound.
+        void centroid_add(uint16_t c, const float* v);
+        void centroid_remove(uint16_t c, const float* v);
+        bool adaptive_ready() const;
+        void adaptive_search(const float* query, int N, TopN& pq) const;
+        // Both search_N overloads, under the read lock on a metric-applied query.
+        size_t search_N_locked(const float* query, std::span<int> out);
+
+        // Compressed scans (SQ8, PQ) shortlist N * <factor> candidates and,
+        // when rerank_exact is set, rerank them against float_block. They
+        // return ascending (dist, slot), at most N, in the calling thread's
+        // query scratch (as does tile_search): valid until its next query.
+        bool rerank_exact = true;
+        bool sq8_ready() const;
+        const std::vector<std::pair<float, int>>& sq8_scan(const std::vector<int>& candidates,
+                                                           const float* query, int N) const;
+        const std::vector<std::pair<float, int>>& hnsw_sq8_search(const float* query, int N) const;
+        // Binary codes: Hamming shortlist of N * bq_oversample.
+        uint16_t bq_oversample = BQ_RERANK_FACTOR;
+        bool bq_ready() const;
+        const std::vector<std::pair<float, int>>& bq_scan(const std::vector<int>& candidates,
+                                                          const float* query, int N) const;
+        void finish_shortlist(std::vector<std::pair<float, int>>& cands, const float* query, int N) const;
+
         mutable std::shared_mutex rw_mutex;
 
     public:
+        static constexpr uint16_t DEFAULT_CLUSTERS = 1000;
+        static constexpr uint8_t  DEFAULT_PROBES   = 10;
+        // Pass as k to size K from the data: ~sqrt(N) clusters at k-means
+        // init, grown by rebalancing splits as the database fills.
+        static constexpr uint16_t AUTO_CLUSTERS    = 0;
+
         // IVF constructor
         RedBoxVector(std::string file_name, size_t dim,
                      int     capacity   = default_capacity,
                      uint16_t k         = DEFAULT_CLUSTERS,
-                     uint8_t num_probes = DEFAULT_PROBES);
+                     uint8_t num_probes = DEFAULT_PROBES,
+                     Metric  metric     = Metric::L2,
+                     StorageMode storage = StorageMode::F32);
+
+        struct IvfPqParams {
+            uint16_t k          = DEFAULT_CLUSTERS;
+            uint8_t  num_probes = DEFAULT_PROBES;
+            uint8_t  pq_m       = 0;      // sub-quantizers; 0 = PqManager::default_m(dim)
+        };
+
+        // IVF-PQ constructor
+        RedBoxVector(std::string file_name, size_t dim, int capacity,
+                     const IvfPqParams& pq, Metric metric = Metric::L2);
 
         // HNSW constructor
         RedBoxVector(std::string file_name, size_t dim,
                      int capacity,
                      uint8_t hnsw_M,
-                     uint16_t hnsw_ef_construction);
+                     uint16_t hnsw_ef_construction,
+                     Metric metric = Metric::L2,
+                     StorageMode storage = StorageMode::F32);
+
+        // Waits for background IVF training, if any.
+        ~RedBoxVector();
 
         void     insert(uint64_t id, const std::vector<float>& vec);
         uint64_t insert_auto(const std::vector<float>& vec);
+        // How insert_bulk links an HNSW graph. Incremental runs the usual
+        // per-node beam searches in parallel. NnDescent builds level 0 from
+        // an NN-Descent k-NN graph (see nn_descent.hpp); much faster for a
+        // one-shot import of a static corpus, and used only when the
+        // database is empty (otherwise Incremental).
+        enum class BulkBuild : uint8_t { Incremental, NnDescent };
+
+        // n rows (row-major, n x dim) and their ids in one call. HNSW copies
+        // the rows into the file as one block and draws every level upfront
+        // under the write lock, then links the graph on `threads` threads
+        // (0 = hardware concurrency) under the read lock and per-node locks,
+        // so searches go on meanwhile; an NnDescent build keeps the write
+        // lock throughout. Other index types, and ids that were deleted, go
+        // through insert() row by row.
+        void     insert_bulk(const uint64_t* ids, const float* vecs, size_t n, size_t threads = 0,
+                             BulkBuild build = BulkBuild::Incremental);
         int      search(const std::vector<float>& query);
         std::vector<int> search_N(const std::vector<float>& query, int N);
+        // search_N with N = out.size(), writing the ids nearest first into
+        // out; returns how many were written. Allocates nothing once the
+        // calling thread has run a query of this size.
+        size_t           search_N(const std::vector<float>& query, std::span<int> out);
+        // nq queries, row-major (nq x dim); element i approximates search_N
+        // for query i. Float IVF / flat scans visit each probed cluster once
+        // per batch with the fixed probe count, ignoring adaptive probing,
+        // tiled and parallel scan, and score L2 as ||q||^2 - 2 q.x + ||x||^2,
+        // whose rounding can reorder near-ties. Other index and storage modes
+        // run search_N per query.
+        std::vector<std::vector<int>> search_batch(const float* queries, size_t nq, int k);
         bool     remove(uint64_t id);
         uint32_t get_dim() const;
         bool     update(uint64_t id, const std::vector<float>& vec);
         void     set_num_probes(uint8_t p);
         void     set_hnsw_ef_search(uint16_t ef);
+        // HNSW search_N beam width = max(ef_search, N) x factor. Default
+        // HNSW_EF_FACTOR; 1 makes ef_search the beam itself. Not persisted.
+        void     set_hnsw_ef_factor(uint8_t factor);
+        void     set_rerank(bool on);
+        void     set_bq_oversample(uint16_t factor);
+        // Keeps a transposed (dimension-major) copy of float IVF data in
+        // tiles of Distance::kernels().tile_rows and scans it one SIMD lane
+        // per vector. Doubles the float data's memory; fastest at low to
+        // mid dimensions.
+        void     set_tiled_scan(bool on);
+        // Threads one large scan may use (caller included); 0 restores the
+        // default, std::thread::hardware_concurrency().
+        void     set_search_threads(size_t n);
+        // Sampling, seeding and Lloyd iterations for the k-means run at
+        // KMEANS_INIT_THRESHOLD; takes effect if the IVF isn't trained yet.
+        void     set_kmeans_params(const ClusterManager::TrainParams& params);
+        // List length, sampling and passes for insert_bulk's NnDescent build.
+        void     set_nn_descent_params(const NnDescent::Params& params);
+        // Runs IVF k-means off the insert path: the insert that reaches
+        // KMEANS_INIT_THRESHOLD starts it and returns; search stays flat
+        // until the clusters are installed. Automatic rebalancing passes
+        // also run on that thread. Off by default.
+        void     set_background_training(bool on);
+        // Blocks until background training or rebalancing (if any) is done.
+        void     wait_for_training();
+        // One IVF maintenance pass: centroids are reset to the exact mean of
+        // their live members (members of those that drifted far are
+        // reassigned), clusters above split_ratio x the mean size (or all
+        // the way to the auto-K target) are split by 2-means, clusters below
+        // merge_ratio x the mean are merged into their neighbours, and the
+        // file is re-grouped. IVF-PQ centroids are not re-centred. Returns
+        // the number of clusters changed.
+        size_t   rebalance();
+        // Finds centroids through a small HNSW graph over the centroid block
+        // instead of comparing against all K, for inserts and probe
+        // selection (ef = level-0 beam width). Approximate; only used once
+        // K reaches CENTROID_GRAPH_MIN_K. Rebuilt at k-means init and
+        // rebalancing.
+        void     set_centroid_graph(bool on, uint16_t ef = 64);
+        void     set_rebalance_params(const ClusterManager::RebalanceParams& params);
+        // Adaptive probing for float IVF searches (search, search_N): each
+        // query scans clusters nearest centroid first and stops when the
+        // cluster radii prove the rest can't improve its top N, or at the
+        // ratio cut-off. num_probes is not used while it is on; compressed
+        // storage, IVF-PQ and search_batch keep the fixed count.
+        void     set_probe_params(const ClusterManager::ProbeParams& params);
+        // Mean clusters scanned per adaptive query since open.
+        double   get_mean_probes() const;
+        // Physically groups each IVF cluster's slots into one contiguous
+        // range so a probe streams memory. Also runs at k-means init and
+        // whenever appended slots exceed a quarter of the grouped range.
+        // On an HNSW database it renumbers the slots breadth-first over the
+        // graph instead, so neighbours share pages; that only runs when
+        // called, and holds the write lock throughout.
+        void     reorganize();
         void     warm_pages();
 
         uint64_t get_count() const { return _manager->get_count(); }
@@ -90,6 +403,8 @@ namespace CoreEngine {
         void loadFromDisk(const std::string& filename);
 
         IndexType get_index_type() const { return _manager->get_index_type(); }
+        Metric    get_metric()     const { return metric; }
+        StorageMode get_storage_mode() const { return _manager->get_storage_mode(); }
     };
 
 }
\ No newline at end of file
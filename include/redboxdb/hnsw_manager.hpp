@@ -5,7 +5,11 @@
 #include <limits>
 #include <random>
 #include <algorithm>
-#include <queue>
+#include <span>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 #include "redboxdb/distance.hpp"
 #include "redboxdb/SpecificMetadata.hpp"
@@ -34,35 +38,116 @@ namespace HnswManager {
         return (level == 0) ? M * 2 : M;
     }
 
-    inline int edges_per_node(int M) {
-        return M * 2 + MAX_LEVEL * M;
+    // Edge lists. Level 0 is dense, 2M words per slot. Only about one node
+    // in M reaches level 1, so the upper levels live in a separate region
+    // handed out as nodes get their level: upper_index[slot] is one past the
+    // first of slot's lists for levels 1..level, M words each, consecutive,
+    // or 0 for a level-0 node. Lists are never moved or freed once handed
+    // out. Every word of all three blocks is 0 until written (see
+    // load_edge), so a new file needs no initialisation.
+    struct EdgeStore {
+        uint32_t* level0;        // capacity x 2M
+        uint32_t* upper_index;   // capacity
+        uint32_t* upper;         // upper_capacity x M
+        uint32_t* upper_used;    // lists handed out so far
+        size_t    upper_capacity;
+    };
+
+    inline size_t level0_words(int M) {
+        return (size_t)M * 2;
     }
 
-    inline uint32_t* node_edges(uint32_t* edge_base, int slot, int M) {
-        return edge_base + (size_t)slot * edges_per_node(M);
+    // Upper lists reserved for a graph of capacity nodes: a node has
+    // 1/(M-1) of them on average, so twice that plus one full tower.
+    inline size_t upper_lists(size_t capacity, int M) {
+        return capacity * 2 / (size_t)std::max(M - 1, 1) + MAX_LEVEL;
     }
 
-    inline const uint32_t* node_edges(const uint32_t* edge_base, int slot, int M) {
-        return edge_base + (size_t)slot * edges_per_node(M);
+    inline uint32_t* level_edges(const EdgeStore& g, uint32_t slot, int level, int M) {
+        if (level == 0) return g.level0 + (size_t)slot * level0_words(M);
+        return g.upper + ((size_t)g.upper_index[slot] - 1 + level - 1) * M;
     }
 
-    inline uint32_t* level_edges(uint32_t* node_ed, int level, int M) {
-        if (level == 0) return node_ed;
-        return node_ed + M * 2 + (level - 1) * M;
+    // Records slot's level after reserving its upper lists; returns the
+    // level granted, lower than asked only once the upper region is full.
+    // For a slot that has no lists yet, with a single writer.
+    inline int set_level(const EdgeStore& g, uint8_t* level_block, uint32_t slot, int level) {
+        if (level > 0) {
+            size_t used = *g.upper_used;
+            level = (int)std::min<size_t>((size_t)level, g.upper_capacity - used);
+            if (level > 0) {
+                g.upper_index[slot] = (uint32_t)used + 1;
+                *g.upper_used = (uint32_t)(used + level);
+            }
+        }
+        level_block[slot] = (uint8_t)level;
+        return level;
     }
 
-    inline const uint32_t* level_edges(const uint32_t* node_ed, int level, int M) {
-        if (level == 0) return node_ed;
-        return node_ed + M * 2 + (level - 1) * M;
+    // Edge words are read while other threads may be linking nodes (see
+    // GraphLocks), so every access is a relaxed atomic: a reader sees each
+    // word whole, either the old neighbour or the new one. A walk tolerates
+    // a list that is mid-rewrite; it only needs valid slots or EMPTY.
+    //
+    // A word holds slot + 1, so EMPTY is stored as 0: the zero-filled pages
+    // of a freshly truncated file read as lists with no edges, and only the
+    // pages nodes are linked into are ever written.
+    inline uint32_t load_edge(const uint32_t* e) {
+        return std::atomic_ref<uint32_t>(*const_cast<uint32_t*>(e)).load(std::memory_order_relaxed) - 1;
+    }
+
+    inline void store_edge(uint32_t* e, uint32_t v) {
+        std::atomic_ref<uint32_t>(*e).store(v + 1, std::memory_order_relaxed);
     }
 
     inline int level_edge_count(const uint32_t* lev_ed, int m_max_val) {
         int count = 0;
         for (int i = 0; i < m_max_val; ++i)
-            if (lev_ed[i] != EMPTY) ++count;
+            if (load_edge(lev_ed + i) != EMPTY) ++count;
         return count;
     }
 
+    // Locks for linking several nodes into one graph at once. Nodes hash
+    // onto a fixed set of spinlock stripes guarding their edge lists; a
+    // linker holds one stripe at a time (its own lists, or one neighbour's
+    // while appending / pruning), so stripes never nest and cannot deadlock.
+    // entry guards the header's entry point and max level.
+    class GraphLocks {
+    public:
+        void lock(uint32_t slot) {
+            std::atomic_flag& f = stripes[slot & (STRIPES - 1)];
+            while (f.test_and_set(std::memory_order_acquire)) {
+                while (f.test(std::memory_order_relaxed)) std::this_thread::yield();
+            }
+        }
+        void unlock(uint32_t slot) {
+            stripes[slot & (STRIPES - 1)].clear(std::memory_order_release);
+        }
+
+        std::mutex entry;
+
+    private:
+        static constexpr size_t STRIPES = 4096;
+        std::atomic_flag stripes[STRIPES];
+    };
+
+    // Holds slot's stripe for a scope; a no-op without locks (single writer).
+    class NodeLock {
+    public:
+        NodeLock(GraphLocks* locks, uint32_t slot) : locks(locks), slot(slot) {
+            if (locks) locks->lock(slot);
+        }
+        ~NodeLock() {
+            if (locks) locks->unlock(slot);
+        }
+        NodeLock(const NodeLock&) = delete;
+        NodeLock& operator=(const NodeLock&) = delete;
+
+    private:
+        GraphLocks* locks;
+        uint32_t    slot;
+    };
+
     struct SearchResult {
         float dist;
         uint32_t slot;
@@ -70,94 +155,204 @@ namespace HnswManager {
         bool operator>(const SearchResult& o) const { return dist > o.dist; }
     };
 
+    // Visited marks for one graph walk at a time. Tags are 16-bit epochs:
+    // starting a walk bumps the epoch instead of clearing, and the array is
+    // zeroed only when the epoch wraps (every 65535 walks) or the capacity
+    // grows. Never shrinks, so one set can serve databases of any size.
+    class VisitedSet {
+    public:
+        void next(size_t capacity) {
+            if (tags.size() < capacity) {
+                tags.assign(capacity, 0);
+                epoch = 0;
+            }
+            if (++epoch == 0) {
+                std::fill(tags.begin(), tags.end(), (uint16_t)0);
+                epoch = 1;
+            }
+        }
+        bool test(uint32_t slot) const { return tags[slot] == epoch; }
+        void set(uint32_t slot)        { tags[slot] = epoch; }
+        // Marks slot; true if it was already marked in this walk.
+        bool test_and_set(uint32_t slot) {
+            if (tags[slot] == epoch) return true;
+            tags[slot] = epoch;
+            return false;
+        }
+
+    private:
+        std::vector<uint16_t> tags;
+        uint16_t              epoch = 0;
+    };
+
+    // 4-ary heap over a flat vector: half the depth of a binary heap, and a
+    // node's four children are adjacent (32 bytes of SearchResult). before(a,
+    // b) is true when a belongs nearer the top.
+    namespace Heap4 {
+        template <typename T, typename Before>
+        inline void push(std::vector<T>& h, T v, Before before) {
+            size_t i = h.size();
+            h.push_back(v);
+            while (i > 0) {
+                size_t parent = (i - 1) / 4;
+                if (!before(v, h[parent])) break;
+                h[i] = h[parent];
+                i = parent;
+            }
+            h[i] = v;
+        }
+
+        // Replaces the top with v and sifts it down.
+        template <typename T, typename Before>
+        inline void replace_top(std::vector<T>& h, T v, Before before) {
+            size_t n = h.size(), i = 0;
+            for (;;) {
+                size_t first = 4 * i + 1;
+                if (first >= n) break;
+                size_t best = first, end = std::min(first + 4, n);
+                for (size_t c = first + 1; c < end; ++c)
+                    if (before(h[c], h[best])) best = c;
+                if (!before(h[best], v)) break;
+                h[i] = h[best];
+                i = best;
+            }
+            h[i] = v;
+        }
+
+        template <typename T, typename Before>
+        inline void pop(std::vector<T>& h, Before before) {
+            T last = h.back();
+            h.pop_back();
+            if (!h.empty()) replace_top(h, last, before);
+        }
+    }
+
+    // Buffers one graph walk reuses: the visited set and the candidate /
+    // result heap storage. Kept per thread for searches (and per writer for
+    // inserts), so a warm query allocates nothing.
+    struct SearchContext {
+        VisitedSet                visited;
+        std::vector<SearchResult> candidates;   // Heap4, nearest on top
+        std::vector<SearchResult> results;      // Heap4, farthest on top; then ascending
+    };
+
+    // Distance from the current query to a stored slot, over the raw float
+    // block. search_layer_by / hnsw_search_by take any type with this shape,
+    // so other encodings of the same slots (e.g. SQ8 codes) can be walked
+    // with the same graph code.
+    struct FloatSlotDist {
+        const float*         query;
+        const float*         float_block;
+        size_t               dim;
+        Distance::DistanceFn dist_fn;
+
+        float operator()(uint32_t slot) const {
+            return dist_fn(query, float_block + (size_t)slot * dim, dim);
+        }
+        void prefetch(uint32_t slot) const {
+            HNSW_PREFETCH(float_block + (size_t)slot * dim);
+        }
+    };
+
     // Standard HNSW beam search at a single level.
-    // Returns the ef closest non-deleted slots.
-    // Uses a generation counter for O(1) visited reset.
-    inline std::vector<SearchResult> search_layer(
-        const float* query,
+    // Leaves the ef closest non-deleted slots in ctx.results, ascending.
+    template <typename SlotDist>
+    inline void search_layer_by(
+        const SlotDist& dist,
         uint32_t entry_slot,
         int ef,
         int level,
-        const float* float_block,
-        const uint32_t* edge_base,
-        size_t dim,
+        const EdgeStore& edges,
         int M,
-        bool use_avx2,
         const uint8_t* deleted_flags,
-        std::vector<uint8_t>& visited_buf,
-        uint32_t& visit_gen,
+        SearchContext& ctx,
         int capacity)
     {
-        using MinPQ = std::priority_queue<SearchResult, std::vector<SearchResult>, std::greater<SearchResult>>;
-        MinPQ candidates_pq;
-        std::priority_queue<SearchResult> results_pq;
-
-        ++visit_gen;
-        if (visit_gen >= 255 || (int)visited_buf.size() != capacity) {
-            visited_buf.assign(capacity, 0);
-            visit_gen = 1;
-        }
+        auto& candidates = ctx.candidates;
+        auto& results    = ctx.results;
+        candidates.clear();
+        results.clear();
+        const auto nearer  = [](const SearchResult& a, const SearchResult& b) { return a.dist < b.dist; };
+        const auto farther = [](const SearchResult& a, const SearchResult& b) { return a.dist > b.dist; };
 
-        float entry_dist = Distance::l2(query, float_block + (size_t)entry_slot * dim, dim, use_avx2);
-        candidates_pq.push({entry_dist, entry_slot});
+        ctx.visited.next((size_t)capacity);
+
+        float entry_dist = dist(entry_slot);
+        Heap4::push(candidates, {entry_dist, entry_slot}, nearer);
         if (!(deleted_flags && deleted_flags[entry_slot])) {
-            results_pq.push({entry_dist, entry_slot});
+            Heap4::push(results, {entry_dist, entry_slot}, farther);
         }
-        visited_buf[entry_slot] = visit_gen;
+        ctx.visited.set(entry_slot);
 
-        while (!candidates_pq.empty()) {
-            SearchResult f = candidates_pq.top();
-            candidates_pq.pop();
+        while (!candidates.empty()) {
+            SearchResult f = candidates.front();
+            Heap4::pop(candidates, nearer);
 
             // If f is worse than the current ef-th best, all remaining are too
-            if ((int)results_pq.size() >= ef && f.dist > results_pq.top().dist) {
+            if ((int)results.size() >= ef && f.dist > results.front().dist) {
                 break;
             }
+            // The next node to expand is already known: fetch its edge list
+            // while this one's neighbours are scored.
+            if (!candidates.empty()) {
+                HNSW_PREFETCH(level_edges(edges, candidates.front().slot, level, M));
+            }
 
             // Expand neighbors of f at this level
-            const uint32_t* neighb = level_edges(node_edges(edge_base, f.slot, M), level, M);
+            const uint32_t* neighb = level_edges(edges, f.slot, level, M);
             int mm = m_max(level, M);
 
             // Prefetch first few neighbor vectors to hide DRAM latency
             for (int pi = 0; pi < mm && pi < 4; ++pi) {
-                if (neighb[pi] != EMPTY) {
-                    HNSW_PREFETCH(float_block + (size_t)neighb[pi] * dim);
+                uint32_t ahead = load_edge(neighb + pi);
+                if (ahead != EMPTY) {
+                    dist.prefetch(ahead);
                 }
             }
 
             for (int i = 0; i < mm; ++i) {
-                uint32_t nb = neighb[i];
+                uint32_t nb = load_edge(neighb + i);
                 if (nb == EMPTY) continue;
                 if (deleted_flags && deleted_flags[nb]) continue;
-                if (visited_buf[nb] == visit_gen) continue;
-                visited_buf[nb] = visit_gen;
+                if (ctx.visited.test_and_set(nb)) continue;
 
                 // Prefetch next neighbor's vector while computing current
-                if (i + 4 < mm && neighb[i + 4] != EMPTY) {
-                    HNSW_PREFETCH(float_block + (size_t)neighb[i + 4] * dim);
+                if (i + 4 < mm) {
+                    uint32_t ahead = load_edge(neighb + i + 4);
+                    if (ahead != EMPTY) dist.prefetch(ahead);
                 }
 
-                float nb_dist = Distance::l2(query, float_block + (size_t)nb * dim, dim, use_avx2);
+                float nb_dist = dist(nb);
 
-                if ((int)results_pq.size() < ef || nb_dist < results_pq.top().dist) {
-                    candidates_pq.push({nb_dist, nb});
-                    results_pq.push({nb_dist, nb});
-                    if ((int)results_pq.size() > ef) {
-                        results_pq.pop();
-                    }
+                if ((int)results.size() < ef) {
+                    Heap4::push(candidates, {nb_dist, nb}, nearer);
+                    Heap4::push(results, {nb_dist, nb}, farther);
+                } else if (nb_dist < results.front().dist) {
+                    Heap4::push(candidates, {nb_dist, nb}, nearer);
+                    Heap4::replace_top(results, {nb_dist, nb}, farther);
                 }
             }
         }
 
-        // Extract results sorted ascending
-        std::vector<SearchResult> results;
-        results.reserve(results_pq.size());
-        while (!results_pq.empty()) {
-            results.push_back(results_pq.top());
-            results_pq.pop();
-        }
-        std::reverse(results.begin(), results.end());
-        return results;
+        std::sort(results.begin(), results.end(), nearer);
+    }
+
+    inline void search_layer(
+        const float* query,
+        uint32_t entry_slot,
+        int ef,
+        int level,
+        const float* float_block,
+        const EdgeStore& edges,
+        size_t dim,
+        int M,
+        Distance::DistanceFn dist_fn,
+        const uint8_t* deleted_flags,
+        SearchContext& ctx,
+        int capacity)
+    {
+        search_layer_by(FloatSlotDist{query, float_block, dim, dist_fn},
+                        entry_slot, ef, level, edges, M, deleted_flags, ctx, capacity);
     }
 
     // Ultra-optimized single-NN search_layer: flat sorted arrays, zero heap allocation,
@@ -168,13 +363,12 @@ namespace HnswManager {
         int ef,
         int level,
         const float* float_block,
-        const uint32_t* edge_base,
+        const EdgeStore& edges,
         size_t dim,
         int M,
-        bool use_avx2,
+        Distance::DistanceFn dist_fn,
         const uint8_t* deleted_flags,
-        std::vector<uint8_t>& visited_buf,
-        uint32_t& visit_gen,
+        VisitedSet& visited,
         int capacity)
     {
         struct FlatEntry { float dist; uint32_t slot; };
@@ -190,20 +384,16 @@ namespace HnswManager {
         uint32_t best_slot = EMPTY;
         float best_dist = std::numeric_limits<float>::max();
 
-        ++visit_gen;
-        if (visit_gen >= 255 || (int)visited_buf.size() != capacity) {
-            visited_buf.assign(capacity, 0);
-            visit_gen = 1;
-        }
+        visited.next((size_t)capacity);
 
-        float entry_dist = Distance::l2(query, float_block + (size_t)entry_slot * dim, dim, use_avx2);
+        float entry_dist = dist_fn(query, float_block + (size_t)entry_slot * dim, dim);
         cand[n_cand++] = {entry_dist, entry_slot};
         if (!(deleted_flags && deleted_flags[entry_slot])) {
             res[n_res++] = {entry_dist, entry_slot};
             best_slot = entry_slot;
             best_dist = entry_dist;
         }
-        visited_buf[entry_slot] = visit_gen;
+        visited.set(entry_slot);
 
         int mm = m_max(level, M);
 
@@ -220,11 +410,12 @@ namespace HnswManager {
                 break;
             }
 
-            const uint32_t* neighb = level_edges(node_edges(edge_base, f.slot, M), level, M);
+            const uint32_t* neighb = level_edges(edges, f.slot, level, M);
 
             for (int pi = 0; pi < mm && pi < 4; ++pi) {
-                if (neighb[pi] != EMPTY) {
-                    HNSW_PREFETCH(float_block + (size_t)neighb[pi] * dim);
+                uint32_t ahead = load_edge(neighb + pi);
+                if (ahead != EMPTY) {
+                    HNSW_PREFETCH(float_block + (size_t)ahead * dim);
                 }
             }
             if (n_cand > 0) {
@@ -233,21 +424,21 @@ namespace HnswManager {
                     if (cand[i].dist < cand[next_idx].dist)
                         next_idx = i;
                 }
-                HNSW_PREFETCH(node_edges(edge_base, cand[next_idx].slot, M));
+                HNSW_PREFETCH(level_edges(edges, cand[next_idx].slot, level, M));
             }
 
             for (int i = 0; i < mm; ++i) {
-                uint32_t nb = neighb[i];
+                uint32_t nb = load_edge(neighb + i);
                 if (nb == EMPTY) continue;
                 if (deleted_flags && deleted_flags[nb]) continue;
-                if (visited_buf[nb] == visit_gen) continue;
-                visited_buf[nb] = visit_gen;
+                if (visited.test_and_set(nb)) continue;
 
-                if (i + 4 < mm && neighb[i + 4] != EMPTY) {
-                    HNSW_PREFETCH(float_block + (size_t)neighb[i + 4] * dim);
+                if (i + 4 < mm) {
+                    uint32_t ahead = load_edge(neighb + i + 4);
+                    if (ahead != EMPTY) HNSW_PREFETCH(float_block + (size_t)ahead * dim);
                 }
 
-                float nb_dist = Distance::l2(query, float_block + (size_t)nb * dim, dim, use_avx2);
+                float nb_dist = dist_fn(query, float_block + (size_t)nb * dim, dim);
 
                 if (n_res < ef || nb_dist < res[n_res - 1].dist) {
                     if (n_cand < MAX_CAND) {
@@ -282,13 +473,16 @@ namespace HnswManager {
     }
 
     // Select M neighbors from candidates using the pruning heuristic
-    // (keep neighbors whose edge is shorter than the connection to any already selected)
+    // (keep neighbors whose edge is shorter than the connection to any already selected).
+    // With rows4, the candidate is checked against 4 selected neighbours per
+    // pass, abandoning once all four are past cand.dist.
     inline std::vector<uint32_t> select_neighbors_heuristic(
         const std::vector<SearchResult>& candidates,
         int M,
         const float* float_block,
         size_t dim,
-        bool use_avx2)
+        Distance::DistanceFn dist_fn,
+        Distance::Rows4Fn rows4 = nullptr)
     {
         std::vector<SearchResult> sorted = candidates;
         std::sort(sorted.begin(), sorted.end(),
@@ -301,16 +495,23 @@ namespace HnswManager {
             if ((int)selected.size() >= M) break;
 
             bool good = true;
-            for (uint32_t s : selected) {
-                float d = Distance::l2(
-                    float_block + (size_t)cand.slot * dim,
-                    float_block + (size_t)s * dim,
-                    dim, use_avx2);
-                if (d < cand.dist) {
-                    good = false;
-                    break;
+            const float* cand_vec = float_block + (size_t)cand.slot * dim;
+            size_t i = 0;
+            if (rows4) {
+                const float* rows[Distance::ROW_BLOCK];
+                float d[Distance::ROW_BLOCK];
+                for (; good && i + Distance::ROW_BLOCK <= selected.size(); i += Distance::ROW_BLOCK) {
+                    for (int r = 0; r < Distance::ROW_BLOCK; ++r)
+                        rows[r] = float_block + (size_t)selected[i + r] * dim;
+                    rows4(cand_vec, rows, dim, cand.dist, d);
+                    for (int r = 0; r < Distance::ROW_BLOCK; ++r)
+                        if (d[r] < cand.dist) good = false;
                 }
             }
+            for (; good && i < selected.size(); ++i) {
+                float d = dist_fn(cand_vec, float_block + (size_t)selected[i] * dim, dim);
+                if (d < cand.dist) good = false;
+            }
             if (good) {
                 selected.push_back(cand.slot);
             }
@@ -368,89 +569,147 @@ namespace HnswManager {
     }
 
     inline void set_neighbors(
-        uint32_t* edge_base,
+        const EdgeStore& edges,
         int slot,
         int level,
         int M,
         const std::vector<uint32_t>& neighbors)
     {
-        uint32_t* lev = level_edges(node_edges(edge_base, slot, M), level, M);
+        uint32_t* lev = level_edges(edges, slot, level, M);
         int mm = m_max(level, M);
         for (int i = 0; i < mm; ++i) {
-            lev[i] = (i < (int)neighbors.size()) ? neighbors[i] : EMPTY;
+            store_edge(lev + i, (i < (int)neighbors.size()) ? neighbors[i] : EMPTY);
         }
     }
 
     inline void append_neighbor(
-        uint32_t* edge_base,
+        const EdgeStore& edges,
         int slot,
         int level,
         int M,
         uint32_t neighbor)
     {
-        uint32_t* lev = level_edges(node_edges(edge_base, slot, M), level, M);
+        uint32_t* lev = level_edges(edges, slot, level, M);
         int mm = m_max(level, M);
         for (int i = 0; i < mm; ++i) {
-            if (lev[i] == EMPTY) {
-                lev[i] = neighbor;
+            if (load_edge(lev + i) == EMPTY) {
+                store_edge(lev + i, neighbor);
                 return;
             }
         }
     }
 
-    inline bool hnsw_insert(
+    // Adds the edge nb -> slot at level l: appended while nb has room,
+    // otherwise nb's list is re-chosen by the heuristic from its current
+    // neighbours plus slot. No-op if the edge exists. Caller holds nb's lock
+    // when there are several writers.
+    inline void add_reverse_edge(
+        const EdgeStore& edges,
+        uint32_t nb,
+        uint32_t slot,
+        int l,
+        int M,
+        const float* float_block,
+        size_t dim,
+        Distance::DistanceFn dist_fn,
+        std::vector<SearchResult>& nb_cands,
+        Distance::Rows4Fn rows4 = nullptr)
+    {
+        int mm = m_max(l, M);
+        const uint32_t* nb_lev = level_edges(edges, nb, l, M);
+        int nb_count = 0;
+        for (int i = 0; i < mm; ++i) {
+            uint32_t e = load_edge(nb_lev + i);
+            if (e == slot) return;
+            if (e != EMPTY) ++nb_count;
+        }
+
+        if (nb_count < mm) {
+            append_neighbor(edges, nb, l, M, slot);
+        } else {
+            nb_cands.clear();
+            nb_cands.push_back({dist_fn(
+                float_block + (size_t)nb * dim,
+                float_block + (size_t)slot * dim, dim), slot});
+            for (int i = 0; i < mm; ++i) {
+                uint32_t e = load_edge(nb_lev + i);
+                if (e != EMPTY) {
+                    nb_cands.push_back({dist_fn(
+                        float_block + (size_t)nb * dim,
+                        float_block + (size_t)e * dim, dim), e});
+                }
+            }
+            // Diversity heuristic at all levels for well-connected graph
+            std::vector<uint32_t> pruned;
+            pruned = select_neighbors_heuristic(nb_cands, mm, float_block, dim, dist_fn, rows4);
+            set_neighbors(edges, nb, l, M, pruned);
+        }
+    }
+
+    // Links slot, whose level is already drawn, into the graph around vec.
+    // With locks, several threads may link different slots at once and
+    // searches may walk the graph meanwhile: each edge list is written under
+    // its node's stripe, and the entry point / max level are read and raised
+    // under locks->entry. Without locks the caller is the only writer.
+    // Levels below min_level are left alone (bulk builds that lay level 0
+    // down separately).
+    inline void hnsw_link(
         uint32_t slot,
         const float* vec,
+        int level,
         CoreEngine::SpecificMetadata* header,
-        float* float_block,
-        uint32_t* edge_base,
-        uint8_t* level_block,
+        const float* float_block,
+        const EdgeStore& edges,
         size_t dim,
-        bool use_avx2,
+        Distance::DistanceFn dist_fn,
         const uint8_t* deleted_flags,
-        std::mt19937& rng,
-        std::vector<uint8_t>& visited_buf,
-        uint32_t& visit_gen,
-        std::vector<SearchResult>& nb_cands)
+        SearchContext& ctx,
+        std::vector<SearchResult>& nb_cands,
+        Distance::Rows4Fn rows4 = nullptr,
+        GraphLocks* locks = nullptr,
+        int min_level = 0)
     {
         int M = header->hnsw_M;
         int ef_construction = header->hnsw_ef_construction;
 
-        // First node becomes entry point
-        if (header->is_initialized == 0) {
-            level_block[slot] = 0;
-            header->hnsw_entry_point = slot;
-            header->hnsw_max_level = 0;
-            header->is_initialized = 1;
-            return true;
+        uint32_t entry;
+        int cur_max_level;
+        {
+            std::unique_lock<std::mutex> guard;
+            if (locks) guard = std::unique_lock<std::mutex>(locks->entry);
+
+            // First node becomes entry point
+            if (header->is_initialized == 0) {
+                header->hnsw_entry_point = slot;
+                header->hnsw_max_level = (uint8_t)level;
+                header->is_initialized = 1;
+                return;
+            }
+            entry = (uint32_t)header->hnsw_entry_point;
+            cur_max_level = header->hnsw_max_level;
         }
 
-        int level = std::min(compute_level(M, rng), MAX_LEVEL);
-        level_block[slot] = (uint8_t)level;
-
-        uint32_t entry = (uint32_t)header->hnsw_entry_point;
-        int cur_max_level = header->hnsw_max_level;
-
         // Phase 1: greedy descent from top level to level+1
         uint32_t curr = entry;
         for (int l = cur_max_level; l > level; --l) {
-            float curr_dist = Distance::l2(vec, float_block + (size_t)curr * dim, dim, use_avx2);
+            float curr_dist = dist_fn(vec, float_block + (size_t)curr * dim, dim);
             bool improved = true;
             while (improved) {
                 improved = false;
-                const uint32_t* neighb = level_edges(node_edges(edge_base, curr, M), l, M);
+                const uint32_t* neighb = level_edges(edges, curr, l, M);
                 int mm = m_max(l, M);
                 uint32_t best_nb = EMPTY;
                 float best_dist = curr_dist;
                 for (int i = 0; i < mm; ++i) {
-                    uint32_t nb = neighb[i];
+                    uint32_t nb = load_edge(neighb + i);
                     if (nb == EMPTY) continue;
                     if (deleted_flags && deleted_flags[nb]) continue;
                     // Prefetch next neighbor's vector
-                    if (i + 1 < mm && neighb[i + 1] != EMPTY) {
-                        HNSW_PREFETCH(float_block + (size_t)neighb[i + 1] * dim);
+                    if (i + 1 < mm) {
+                        uint32_t ahead = load_edge(neighb + i + 1);
+                        if (ahead != EMPTY) HNSW_PREFETCH(float_block + (size_t)ahead * dim);
                     }
-                    float nb_dist = Distance::l2(vec, float_block + (size_t)nb * dim, dim, use_avx2);
+                    float nb_dist = dist_fn(vec, float_block + (size_t)nb * dim, dim);
                     if (nb_dist < best_dist) {
                         best_nb = nb;
                         best_dist = nb_dist;
@@ -467,46 +726,44 @@ namespace HnswManager {
         // Phase 2: for each level from min(level, cur_max_level) down to 0
         int lower_bound = std::min(level, cur_max_level);
 
-        for (int l = lower_bound; l >= 0; --l) {
+        for (int l = lower_bound; l >= min_level; --l) {
             int ef = ef_construction;
-            auto results = search_layer(vec, curr, ef, l, float_block, edge_base, dim, M, use_avx2, deleted_flags, visited_buf, visit_gen, (int)header->max_capacity);
+            search_layer(vec, curr, ef, l, float_block, edges, dim, M, dist_fn, deleted_flags, ctx, (int)header->max_capacity);
+            const auto& results = ctx.results;
 
             // Diversity heuristic at all levels for well-connected graph
             std::vector<uint32_t> selected;
-            selected = select_neighbors_heuristic(results, m_max(l, M), float_block, dim, use_avx2);
-
-            // Set outgoing edges from new node
-            set_neighbors(edge_base, slot, l, M, selected);
+            selected = select_neighbors_heuristic(results, m_max(l, M), float_block, dim, dist_fn, rows4);
+
+            // Set outgoing edges from new node. A linker running alongside
+            // may have picked this slot already and written its reverse edge
+            // here; prune with those nodes included rather than overwrite.
+            {
+                NodeLock own(locks, slot);
+                if (locks) {
+                    const uint32_t* own_lev = level_edges(edges, slot, l, M);
+                    int mm = m_max(l, M);
+                    nb_cands.assign(results.begin(), results.end());
+                    for (int i = 0; i < mm; ++i) {
+                        uint32_t e = load_edge(own_lev + i);
+                        if (e == EMPTY) continue;
+                        if (std::any_of(results.begin(), results.end(),
+                                        [e](const SearchResult& r) { return r.slot == e; })) continue;
+                        nb_cands.push_back({dist_fn(vec, float_block + (size_t)e * dim, dim), e});
+                    }
+                    if (nb_cands.size() > results.size())
+                        selected = select_neighbors_heuristic(nb_cands, mm, float_block, dim, dist_fn, rows4);
+                }
+                set_neighbors(edges, slot, l, M, selected);
+            }
 
             // Add bidirectional connections
-            int mm = m_max(l, M);
             for (uint32_t nb : selected) {
                 // Prefetch next neighbor's edge data
-                HNSW_PREFETCH(node_edges(edge_base, nb, M));
+                HNSW_PREFETCH(level_edges(edges, nb, l, M));
 
-                int nb_count = level_edge_count(
-                    level_edges(node_edges(edge_base, nb, M), l, M), mm);
-
-                if (nb_count < mm) {
-                    append_neighbor(edge_base, nb, l, M, slot);
-                } else {
-                    nb_cands.clear();
-                    nb_cands.push_back({Distance::l2(
-                        float_block + (size_t)nb * dim,
-                        float_block + (size_t)slot * dim, dim, use_avx2), slot});
-                    const uint32_t* nb_lev = level_edges(node_edges(edge_base, nb, M), l, M);
-                    for (int i = 0; i < mm; ++i) {
-                        if (nb_lev[i] != EMPTY) {
-                            nb_cands.push_back({Distance::l2(
-                                float_block + (size_t)nb * dim,
-                                float_block + (size_t)nb_lev[i] * dim, dim, use_avx2), nb_lev[i]});
-                        }
-                    }
-                    // Diversity heuristic at all levels for well-connected graph
-                    std::vector<uint32_t> pruned;
-                    pruned = select_neighbors_heuristic(nb_cands, mm, float_block, dim, use_avx2);
-                    set_neighbors(edge_base, nb, l, M, pruned);
-                }
+                NodeLock nb_lock(locks, nb);
+                add_reverse_edge(edges, nb, slot, l, M, float_block, dim, dist_fn, nb_cands, rows4);
             }
 
             // Continue descent from best neighbor at this level
@@ -515,49 +772,142 @@ namespace HnswManager {
 
         // If new node is above current max level, update entry point
         if (level > cur_max_level) {
-            header->hnsw_entry_point = slot;
-            header->hnsw_max_level = (uint8_t)level;
+            std::unique_lock<std::mutex> guard;
+            if (locks) guard = std::unique_lock<std::mutex>(locks->entry);
+            // Another linker may have raised it since the read above.
+            if (level > header->hnsw_max_level) {
+                header->hnsw_entry_point = slot;
+                header->hnsw_max_level = (uint8_t)level;
+            }
         }
+    }
 
+    // Draws a new slot's level and links it in; the first node becomes the
+    // entry point at level 0.
+    inline bool hnsw_insert(
+        uint32_t slot,
+        const float* vec,
+        CoreEngine::SpecificMetadata* header,
+        float* float_block,
+        const EdgeStore& edges,
+        uint8_t* level_block,
+        size_t dim,
+        Distance::DistanceFn dist_fn,
+        const uint8_t* deleted_flags,
+        std::mt19937& rng,
+        SearchContext& ctx,
+        std::vector<SearchResult>& nb_cands,
+        Distance::Rows4Fn rows4 = nullptr)
+    {
+        int level = header->is_initialized
+            ? std::min(compute_level(header->hnsw_M, rng), MAX_LEVEL) : 0;
+        level = set_level(edges, level_block, slot, level);
+        hnsw_link(slot, vec, level, header, float_block, edges, dim, dist_fn,
+                  deleted_flags, ctx, nb_cands, rows4);
         return true;
     }
 
-    inline void hnsw_search(
-        const float* query,
-        int N,
+    // Slot order for memory locality: breadth-first over level 0 from the
+    // entry point, so a node's neighbours get numbers (and float / edge
+    // rows) near its own and a walk touches fewer pages. Live nodes the
+    // walk misses start walks of their own; deleted slots go last, like
+    // the IVF reorganisation parks them. Returns new_to_old over [0, n).
+    inline std::vector<uint32_t> bfs_order(
+        const EdgeStore& edges,
         const CoreEngine::SpecificMetadata* header,
-        const float* float_block,
-        const uint32_t* edge_base,
-        size_t dim,
-        bool use_avx2,
+        size_t n,
+        const uint8_t* deleted_flags)
+    {
+        int M = header->hnsw_M;
+        int mm = m_max(0, M);
+        std::vector<uint32_t> order;
+        order.reserve(n);
+        std::vector<uint8_t> seen(n, 0);
+        auto dead = [&](uint32_t s) { return deleted_flags && deleted_flags[s]; };
+
+        auto walk = [&](uint32_t root) {
+            size_t head = order.size();
+            seen[root] = 1;
+            order.push_back(root);
+            while (head < order.size()) {
+                const uint32_t* lev = level_edges(edges, order[head++], 0, M);
+                for (int i = 0; i < mm; ++i) {
+                    uint32_t nb = load_edge(lev + i);
+                    if (nb == EMPTY || nb >= n || seen[nb] || dead(nb)) continue;
+                    seen[nb] = 1;
+                    order.push_back(nb);
+                }
+            }
+        };
+
+        uint32_t entry = header->hnsw_entry_point;
+        if (header->is_initialized && entry < n && !dead(entry)) walk(entry);
+        for (uint32_t s = 0; s < n; ++s)
+            if (!seen[s] && !dead(s)) walk(s);
+        for (uint32_t s = 0; s < n; ++s)
+            if (dead(s)) order.push_back(s);
+        return order;
+    }
+
+    // Rewrites every edge of the first n slots' lists, and the entry point,
+    // through old_to_new once the per-slot blocks have been permuted.
+    // Upper lists stay where they are; only their contents change.
+    inline void remap_edges(
+        const EdgeStore& edges,
+        CoreEngine::SpecificMetadata* header,
+        size_t n,
+        const std::vector<uint32_t>& old_to_new)
+    {
+        auto remap = [&](uint32_t* words, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                uint32_t v = load_edge(words + i);
+                if (v != EMPTY) store_edge(words + i, old_to_new[v]);
+            }
+        };
+        int M = header->hnsw_M;
+        remap(edges.level0, n * level0_words(M));
+        remap(edges.upper, (size_t)*edges.upper_used * M);
+        if (header->hnsw_entry_point < n)
+            header->hnsw_entry_point = old_to_new[header->hnsw_entry_point];
+    }
+
+    // Top-N search: the out.size() nearest non-deleted slots, ascending,
+    // written straight into out; returns how many were found. The level-0
+    // beam is max(ef, out.size()).
+    template <typename SlotDist>
+    inline size_t hnsw_search_by(
+        const SlotDist& dist,
+        int ef,
+        const CoreEngine::SpecificMetadata* header,
+        const EdgeStore& edges,
         const uint8_t* deleted_flags,
-        std::vector<std::pair<float, uint32_t>>& results_out,
-        std::vector<uint8_t>& visited_buf,
-        uint32_t& visit_gen)
+        SearchContext& ctx,
+        std::span<std::pair<float, uint32_t>> out)
     {
+        if (out.empty()) return 0;
         int M = header->hnsw_M;
-        int ef_search = header->hnsw_ef_search;
         uint32_t entry = (uint32_t)header->hnsw_entry_point;
         int cur_max_level = header->hnsw_max_level;
 
         uint32_t curr = entry;
         for (int l = cur_max_level; l >= 1; --l) {
-            float curr_dist = Distance::l2(query, float_block + (size_t)curr * dim, dim, use_avx2);
+            float curr_dist = dist(curr);
             bool improved = true;
             while (improved) {
                 improved = false;
-                const uint32_t* neighb = level_edges(node_edges(edge_base, curr, M), l, M);
+                const uint32_t* neighb = level_edges(edges, curr, l, M);
                 int mm = m_max(l, M);
                 uint32_t best_nb = EMPTY;
                 float best_dist = curr_dist;
                 for (int i = 0; i < mm; ++i) {
-                    uint32_t nb = neighb[i];
+                    uint32_t nb = load_edge(neighb + i);
                     if (nb == EMPTY) continue;
                     if (deleted_flags && deleted_flags[nb]) continue;
-                    if (i + 4 < mm && neighb[i + 4] != EMPTY) {
-                        HNSW_PREFETCH(float_block + (size_t)neighb[i + 4] * dim);
+                    if (i + 4 < mm) {
+                        uint32_t ahead = load_edge(neighb + i + 4);
+                        if (ahead != EMPTY) dist.prefetch(ahead);
                     }
-                    float nb_dist = Distance::l2(query, float_block + (size_t)nb * dim, dim, use_avx2);
+                    float nb_dist = dist(nb);
                     if (nb_dist < best_dist) {
                         best_nb = nb;
                         best_dist = nb_dist;
@@ -571,26 +921,39 @@ namespace HnswManager {
             }
         }
 
-        int ef = std::max(ef_search, N) * 4;
-        auto results = search_layer(query, curr, ef, 0, float_block, edge_base, dim, M, use_avx2, deleted_flags, visited_buf, visit_gen, (int)header->max_capacity);
+        ef = std::max(ef, (int)out.size());
+        search_layer_by(dist, curr, ef, 0, edges, M, deleted_flags, ctx, (int)header->max_capacity);
 
-        results_out.clear();
-        results_out.reserve(results.size());
-        for (const auto& r : results) {
-            results_out.push_back({r.dist, r.slot});
-        }
+        size_t n = std::min(out.size(), ctx.results.size());
+        for (size_t i = 0; i < n; ++i) out[i] = { ctx.results[i].dist, ctx.results[i].slot };
+        return n;
+    }
+
+    inline size_t hnsw_search(
+        const float* query,
+        int ef,
+        const CoreEngine::SpecificMetadata* header,
+        const float* float_block,
+        const EdgeStore& edges,
+        size_t dim,
+        Distance::DistanceFn dist_fn,
+        const uint8_t* deleted_flags,
+        SearchContext& ctx,
+        std::span<std::pair<float, uint32_t>> out)
+    {
+        return hnsw_search_by(FloatSlotDist{query, float_block, dim, dist_fn}, ef, header,
+                              edges, deleted_flags, ctx, out);
     }
 
     inline uint32_t hnsw_search_1(
         const float* query,
         const CoreEngine::SpecificMetadata* header,
         const float* float_block,
-        const uint32_t* edge_base,
+        const EdgeStore& edges,
         size_t dim,
-        bool use_avx2,
+        Distance::DistanceFn dist_fn,
         const uint8_t* deleted_flags,
-        std::vector<uint8_t>& visited_buf,
-        uint32_t& visit_gen,
+        VisitedSet& visited,
         int ef_override = 0)
     {
         int M = header->hnsw_M;
@@ -600,30 +963,32 @@ namespace HnswManager {
 
         uint32_t curr = entry;
         for (int l = cur_max_level; l >= 1; --l) {
-            float curr_dist = Distance::l2(query, float_block + (size_t)curr * dim, dim, use_avx2);
+            float curr_dist = dist_fn(query, float_block + (size_t)curr * dim, dim);
             bool improved = true;
             while (improved) {
                 improved = false;
-                const uint32_t* neighb = level_edges(node_edges(edge_base, curr, M), l, M);
+                const uint32_t* neighb = level_edges(edges, curr, l, M);
                 int mm = m_max(l, M);
                 uint32_t best_nb = EMPTY;
                 float best_dist = curr_dist;
 
                 // Batch prefetch first 4 neighbors
             for (int pi = 0; pi < mm && pi < 4; ++pi) {
-                if (neighb[pi] != EMPTY) {
-                    HNSW_PREFETCH(float_block + (size_t)neighb[pi] * dim);
+                uint32_t ahead = load_edge(neighb + pi);
+                if (ahead != EMPTY) {
+                    HNSW_PREFETCH(float_block + (size_t)ahead * dim);
                 }
             }
 
                 for (int i = 0; i < mm; ++i) {
-                    uint32_t nb = neighb[i];
+                    uint32_t nb = load_edge(neighb + i);
                     if (nb == EMPTY) continue;
                     if (deleted_flags && deleted_flags[nb]) continue;
-                    if (i + 4 < mm && neighb[i + 4] != EMPTY) {
-                        HNSW_PREFETCH(float_block + (size_t)neighb[i + 4] * dim);
+                    if (i + 4 < mm) {
+                        uint32_t ahead = load_edge(neighb + i + 4);
+                        if (ahead != EMPTY) HNSW_PREFETCH(float_block + (size_t)ahead * dim);
                     }
-                    float nb_dist = Distance::l2(query, float_block + (size_t)nb * dim, dim, use_avx2);
+                    float nb_dist = dist_fn(query, float_block + (size_t)nb * dim, dim);
                     if (nb_dist < best_dist) {
                         best_nb = nb;
                         best_dist = nb_dist;
@@ -637,7 +1002,7 @@ namespace HnswManager {
             }
         }
 
-        auto best = search_layer_1(query, curr, std::max(ef_search, 1), 0, float_block, edge_base, dim, M, use_avx2, deleted_flags, visited_buf, visit_gen, (int)header->max_capacity);
+        auto best = search_layer_1(query, curr, std::max(ef_search, 1), 0, float_block, edges, dim, M, dist_fn, deleted_flags, visited, (int)header->max_capacity);
 
         return best.first;
     }
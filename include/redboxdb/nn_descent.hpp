@@ -0,0 +1,266 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include "redboxdb/distance.hpp"
+#include "redboxdb/hnsw_manager.hpp"
+#include "redboxdb/thread_pool.hpp"
+#include "redboxdb/SpecificMetadata.hpp"
+
+// NN-Descent: an approximate k-nearest-neighbour graph built by local joins,
+// and an HNSW bootstrap on top of it for one-shot bulk loads.
+//
+// Every node starts with k random neighbours. Each pass compares the
+// neighbours of a node with one another ("a neighbour of my neighbour is
+// probably my neighbour"), in both directions of every edge, and keeps the
+// closer pairs. Only pairs involving an entry that is new since the last
+// pass are compared, and at most rho x k new entries per node take part, so
+// a pass costs about n x (rho k)^2 distances. The lists settle after a
+// handful of passes.
+//
+// build_hnsw turns the lists into level 0 (each list merged with the
+// entries pointing at it, then pruned by the neighbour heuristic) and links
+// the few nodes above level 0 with hnsw_link stopping at level 1. Level 0
+// therefore costs no ef_construction beam searches at all.
+namespace NnDescent {
+
+    struct Params {
+        int      k          = 0;        // list length; 0 = m_max(0) in build_hnsw
+        int      iterations = 10;
+        float    rho        = 0.5f;     // share of a node's new entries joined per pass
+        float    delta      = 0.01f;    // stop once a pass changes < delta x n x k entries
+        uint32_t seed       = 42;
+    };
+
+    struct Neighbor {
+        float    dist;
+        uint32_t id;
+        bool     fresh;                  // not yet joined
+    };
+
+    // Approximate k nearest neighbours of each of the n rows of data. List i
+    // is lists[i * k, i * k + k), ascending, padded with EMPTY ids when n is
+    // k or less. Passes run on pool (inline when null).
+    inline std::vector<Neighbor> build_knn(
+        const float* data,
+        size_t n,
+        size_t dim,
+        Distance::DistanceFn dist_fn,
+        int k,
+        const Params& params,
+        Parallel::ThreadPool* pool)
+    {
+        const Neighbor none{ std::numeric_limits<float>::max(), HnswManager::EMPTY, false };
+        std::vector<Neighbor> lists(n * (size_t)k, none);
+        std::vector<int>      sizes(n, 0);
+        if (n < 2 || k < 1) return lists;
+
+        HnswManager::GraphLocks locks;
+        auto row = [&](uint32_t i) { return data + (size_t)i * dim; };
+
+        // Caller holds v's lock (or is v's only writer).
+        auto update = [&](uint32_t v, uint32_t u, float d) -> bool {
+            Neighbor* l = &lists[(size_t)v * k];
+            int& s = sizes[v];
+            if (s == k && d >= l[k - 1].dist) return false;
+            for (int i = 0; i < s; ++i)
+                if (l[i].id == u) return false;
+            int pos = (s < k) ? s++ : k - 1;
+            for (; pos > 0 && l[pos - 1].dist > d; --pos) l[pos] = l[pos - 1];
+            l[pos] = { d, u, true };
+            return true;
+        };
+
+        size_t tasks = Parallel::split_count(pool, n, 256);
+
+        Parallel::parallel_for(pool, n, tasks, [&](size_t begin, size_t end, size_t t) {
+            std::mt19937 rng(params.seed + (uint32_t)t);
+            std::uniform_int_distribution<uint32_t> pick(0, (uint32_t)n - 1);
+            for (size_t v = begin; v < end; ++v) {
+                if (n - 1 <= (size_t)k) {
+                    for (uint32_t u = 0; u < n; ++u)
+                        if (u != v) update((uint32_t)v, u, dist_fn(row((uint32_t)v), row(u), dim));
+                    continue;
+                }
+                while (sizes[v] < k) {
+                    uint32_t u = pick(rng);
+                    if (u != v) update((uint32_t)v, u, dist_fn(row((uint32_t)v), row(u), dim));
+                }
+            }
+        });
+
+        int sample = std::max(1, (int)(params.rho * (float)k));
+        std::vector<std::vector<uint32_t>> fresh(n), old(n), rfresh(n), rold(n);
+
+        for (int it = 0; it < params.iterations; ++it) {
+            // Sample each node's new entries; they count as old from now on.
+            Parallel::parallel_for(pool, n, tasks, [&](size_t begin, size_t end, size_t t) {
+                std::mt19937 rng(params.seed + (uint32_t)(it + 1) * 7919u + (uint32_t)t);
+                std::vector<int> picked;
+                for (size_t v = begin; v < end; ++v) {
+                    Neighbor* l = &lists[v * k];
+                    fresh[v].clear();
+                    old[v].clear();
+                    picked.clear();
+                    for (int i = 0; i < sizes[v]; ++i) {
+                        if (l[i].fresh) picked.push_back(i);
+                        else            old[v].push_back(l[i].id);
+                    }
+                    std::shuffle(picked.begin(), picked.end(), rng);
+                    if ((int)picked.size() > sample) picked.resize(sample);
+                    for (int i : picked) {
+                        fresh[v].push_back(l[i].id);
+                        l[i].fresh = false;
+                    }
+                }
+            });
+
+            for (size_t v = 0; v < n; ++v) {
+                rfresh[v].clear();
+                rold[v].clear();
+            }
+            for (size_t v = 0; v < n; ++v) {
+                for (uint32_t u : fresh[v]) rfresh[u].push_back((uint32_t)v);
+                for (uint32_t u : old[v])   rold[u].push_back((uint32_t)v);
+            }
+
+            // Reverse edges join too, sampled to the same budget.
+            Parallel::parallel_for(pool, n, tasks, [&](size_t begin, size_t end, size_t t) {
+                std::mt19937 rng(params.seed + (uint32_t)(it + 1) * 104729u + (uint32_t)t);
+                for (size_t v = begin; v < end; ++v) {
+                    for (auto* pair : { &rfresh, &rold }) {
+                        auto& r = (*pair)[v];
+                        std::shuffle(r.begin(), r.end(), rng);
+                        if ((int)r.size() > sample) r.resize(sample);
+                    }
+                    fresh[v].insert(fresh[v].end(), rfresh[v].begin(), rfresh[v].end());
+                    old[v].insert(old[v].end(), rold[v].begin(), rold[v].end());
+                }
+            });
+
+            // Local join: new x new and new x old around every node.
+            std::atomic<size_t> changed{ 0 };
+            Parallel::parallel_for(pool, n, tasks, [&](size_t begin, size_t end, size_t) {
+                size_t c = 0;
+                auto join = [&](uint32_t a, uint32_t b) {
+                    if (a == b) return;
+                    float d = dist_fn(row(a), row(b), dim);
+                    {
+                        HnswManager::NodeLock g(&locks, a);
+                        c += update(a, b, d);
+                    }
+                    HnswManager::NodeLock g(&locks, b);
+                    c += update(b, a, d);
+                };
+                for (size_t v = begin; v < end; ++v) {
+                    const auto& f = fresh[v];
+                    for (size_t i = 0; i < f.size(); ++i) {
+                        for (size_t j = i + 1; j < f.size(); ++j) join(f[i], f[j]);
+                        for (uint32_t o : old[v]) join(f[i], o);
+                    }
+                }
+                changed.fetch_add(c, std::memory_order_relaxed);
+            });
+
+            if ((double)changed.load() < (double)params.delta * (double)n * (double)k) break;
+        }
+        return lists;
+    }
+
+    // Builds the HNSW graph over slots [0, n) of float_block into an empty
+    // header and edge blocks. Levels must already be set (set_level).
+    inline void build_hnsw(
+        CoreEngine::SpecificMetadata* header,
+        const float* float_block,
+        const HnswManager::EdgeStore& edges,
+        const uint8_t* level_block,
+        size_t n,
+        size_t dim,
+        Distance::DistanceFn dist_fn,
+        Distance::Rows4Fn rows4,
+        const Params& params,
+        Parallel::ThreadPool* pool)
+    {
+        if (n == 0) return;
+        int M   = header->hnsw_M;
+        int mm0 = HnswManager::m_max(0, M);
+        int k   = params.k > 0 ? params.k : mm0;
+        std::vector<Neighbor> lists = build_knn(float_block, n, dim, dist_fn, k, params, pool);
+
+        size_t tasks = Parallel::split_count(pool, n, 256);
+
+        // A k-NN graph is one-directional, so each node's candidates are its
+        // own list plus the nodes whose lists hold it (the k nearest of
+        // those). One heuristic pass over the union picks its level-0
+        // edges: diverse, and reachable from the neighbours it points at.
+        std::vector<std::vector<HnswManager::SearchResult>> reverse(n);
+        for (size_t u = 0; u < n; ++u) {
+            for (int i = 0; i < k; ++i) {
+                const Neighbor& nb = lists[u * k + i];
+                if (nb.id != HnswManager::EMPTY) reverse[nb.id].push_back({ nb.dist, (uint32_t)u });
+            }
+        }
+
+        Parallel::parallel_for(pool, n, tasks, [&](size_t begin, size_t end, size_t) {
+            std::vector<HnswManager::SearchResult> cands;
+            for (size_t v = begin; v < end; ++v) {
+                auto& rev = reverse[v];
+                if ((int)rev.size() > k) {
+                    std::nth_element(rev.begin(), rev.begin() + k, rev.end());
+                    rev.resize(k);
+                }
+                cands.assign(rev.begin(), rev.end());
+                for (int i = 0; i < k; ++i) {
+                    const Neighbor& nb = lists[v * k + i];
+                    if (nb.id == HnswManager::EMPTY) break;
+                    bool dup = false;
+                    for (const auto& r : rev) dup |= (r.slot == nb.id);
+                    if (!dup) cands.push_back({ nb.dist, nb.id });
+                }
+                auto selected = HnswManager::select_neighbors_heuristic(cands, mm0, float_block, dim, dist_fn, rows4);
+                HnswManager::set_neighbors(edges, (int)v, 0, M, selected);
+                std::vector<HnswManager::SearchResult>().swap(rev);
+            }
+        });
+        lists = {};
+
+        // Upper layers hold about n / M nodes: link them the usual way,
+        // highest level first so the entry point is in place from the start.
+        std::vector<uint32_t> upper;
+        for (size_t v = 0; v < n; ++v)
+            if (level_block[v] > 0) upper.push_back((uint32_t)v);
+        std::stable_sort(upper.begin(), upper.end(),
+            [&](uint32_t a, uint32_t b) { return level_block[a] > level_block[b]; });
+
+        if (upper.empty()) {
+            header->hnsw_entry_point = 0;
+            header->hnsw_max_level   = 0;
+            header->is_initialized   = 1;
+            return;
+        }
+
+        HnswManager::GraphLocks                locks;
+        HnswManager::SearchContext             ctx;
+        std::vector<HnswManager::SearchResult> nb_cands;
+        HnswManager::hnsw_link(upper[0], float_block + (size_t)upper[0] * dim, level_block[upper[0]], header,
+                               float_block, edges, dim, dist_fn, nullptr, ctx, nb_cands, rows4, &locks, 1);
+
+        std::atomic<size_t> next{ 1 };
+        auto link = [&](size_t) {
+            HnswManager::SearchContext             lctx;
+            std::vector<HnswManager::SearchResult> lcands;
+            for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < upper.size(); ) {
+                uint32_t s = upper[i];
+                HnswManager::hnsw_link(s, float_block + (size_t)s * dim, level_block[s], header, float_block,
+                                       edges, dim, dist_fn, nullptr, lctx, lcands, rows4, &locks, 1);
+            }
+        };
+        size_t workers = pool ? pool->size() + 1 : 1;
+        if (pool) pool->run(workers, link);
+        else      link(0);
+    }
+
+} // namespace NnDescent
@@ -0,0 +1,243 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <algorithm>
+#include "redboxdb/distance.hpp"
+
+// Product quantisation of IVF residuals, 4 bits per sub-quantizer.
+//
+// A vector's residual (vec - its cluster centroid) is split into m
+// sub-vectors of dsub = dim / m floats; each is replaced by the index of the
+// nearest of 16 codewords trained for that sub-space. A vector costs
+// ceil(m / 2) bytes.
+//
+// Search builds one 16-entry distance table per sub-quantizer and sums
+// table lookups. The tables are quantised to uint8 so that a whole table
+// fits in one SSE register, and 32 codes are looked up with one vpshufb
+// (fast-scan). For that the codes of a cluster are repacked in memory into
+// blocks of 32 vectors:
+//
+//   block = m x 16 bytes; for sub-quantizer j, byte i holds
+//           code_j(vector i) in the low nibble, code_j(vector i + 16) in the high
+namespace PqManager {
+
+    static constexpr int KSUB        = 16;   // codewords per sub-quantizer (4 bits)
+    static constexpr int BLOCK       = 32;   // vectors per fast-scan block
+    static constexpr int TRAIN_ITERS = 15;
+
+    inline size_t code_bytes(size_t m)               { return (m + 1) / 2; }
+    inline size_t block_bytes(size_t m)              { return m * 16; }
+
+    // Largest m <= dim / 4 that divides dim (>= 1): 8 bytes of float per code
+    // byte, the usual operating point.
+    inline uint8_t default_m(size_t dim) {
+        size_t m = std::min<size_t>(std::max<size_t>(dim / 4, 1), 255);
+        while (m > 1 && dim % m != 0) --m;
+        return static_cast<uint8_t>(m);
+    }
+
+    inline uint8_t get_code(const uint8_t* code, size_t j) {
+        return (j & 1) ? (code[j >> 1] >> 4) : (code[j >> 1] & 0x0F);
+    }
+
+    // -----------------------------------------------------------------------
+    // Training / encoding
+    // -----------------------------------------------------------------------
+
+    // Per sub-space Lloyd k-means (16 centroids) over n residuals.
+    // codebook: m x KSUB x dsub, sub-space major.
+    inline void train(const float* residuals, size_t n, size_t dim, size_t m, float* codebook) {
+        size_t dsub = dim / m;
+        std::mt19937 rng(42);
+        std::vector<float>    sums(KSUB * dsub);
+        std::vector<uint32_t> counts(KSUB);
+        std::vector<uint8_t>  assign(n);
+
+        for (size_t j = 0; j < m; ++j) {
+            float* cb = codebook + j * KSUB * dsub;
+
+            // Init from distinct-ish sample points
+            std::uniform_int_distribution<size_t> pick(0, n ? n - 1 : 0);
+            for (int k = 0; k < KSUB; ++k) {
+                size_t i = n ? pick(rng) : 0;
+                for (size_t d = 0; d < dsub; ++d)
+                    cb[k * dsub + d] = n ? residuals[i * dim + j * dsub + d] : 0.0f;
+            }
+            if (n == 0) continue;
+
+            for (int iter = 0; iter < TRAIN_ITERS; ++iter) {
+                std::fill(sums.begin(), sums.end(), 0.0f);
+                std::fill(counts.begin(), counts.end(), 0u);
+                for (size_t i = 0; i < n; ++i) {
+                    const float* sub = residuals + i * dim + j * dsub;
+                    float best = std::numeric_limits<float>::max();
+                    int   best_k = 0;
+                    for (int k = 0; k < KSUB; ++k) {
+                        float dd = Distance::l2_scalar(sub, cb + k * dsub, dsub);
+                        if (dd < best) { best = dd; best_k = k; }
+                    }
+                    assign[i] = (uint8_t)best_k;
+                    counts[best_k]++;
+                    for (size_t d = 0; d < dsub; ++d) sums[best_k * dsub + d] += sub[d];
+                }
+                for (int k = 0; k < KSUB; ++k) {
+                    if (counts[k] == 0) {
+                        // Empty codeword: re-seed from a random point
+                        size_t i = pick(rng);
+                        for (size_t d = 0; d < dsub; ++d)
+                            cb[k * dsub + d] = residuals[i * dim + j * dsub + d];
+                        continue;
+                    }
+                    for (size_t d = 0; d < dsub; ++d)
+                        cb[k * dsub + d] = sums[k * dsub + d] / (float)counts[k];
+                }
+            }
+        }
+    }
+
+    inline void encode(const float* residual, const float* codebook, size_t dim, size_t m, uint8_t* code) {
+        size_t dsub = dim / m;
+        std::fill(code, code + code_bytes(m), (uint8_t)0);
+        for (size_t j = 0; j < m; ++j) {
+            const float* sub = residual + j * dsub;
+            const float* cb  = codebook + j * KSUB * dsub;
+            float best = std::numeric_limits<float>::max();
+            int   best_k = 0;
+            for (int k = 0; k < KSUB; ++k) {
+                float dd = Distance::l2_scalar(sub, cb + k * dsub, dsub);
+                if (dd < best) { best = dd; best_k = k; }
+            }
+            code[j >> 1] |= (j & 1) ? (uint8_t)(best_k << 4) : (uint8_t)best_k;
+        }
+    }
+
+    // Writes one vector's code into position pos of a cluster's block array,
+    // growing it by a zeroed block when pos starts a new one.
+    inline void pack(std::vector<uint8_t>& blocks, size_t pos, const uint8_t* code, size_t m) {
+        size_t bb = block_bytes(m);
+        size_t b  = pos / BLOCK, lane = pos % BLOCK;
+        if (blocks.size() < (b + 1) * bb) blocks.resize((b + 1) * bb, 0);
+        uint8_t* blk = blocks.data() + b * bb;
+        for (size_t j = 0; j < m; ++j) {
+            uint8_t c = get_code(code, j);
+            uint8_t& byte = blk[j * 16 + (lane & 15)];
+            if (lane < 16) byte = (uint8_t)((byte & 0xF0) | c);
+            else           byte = (uint8_t)((byte & 0x0F) | (c << 4));
+        }
+    }
+
+    // -----------------------------------------------------------------------
+    // Query tables
+    // -----------------------------------------------------------------------
+
+    // Quantised lookup tables for one (query, cluster) pair.
+    //   approx distance = bias + scale * sum_j lut[j][code_j]
+    struct Lut {
+        std::vector<float>   f;        // m x 16 float table (scratch)
+        std::vector<uint8_t> q;        // m x 16 uint8 table
+        std::vector<float>   r;        // query residual (scratch)
+        float bias  = 0.0f;
+        float scale = 1.0f;
+
+        // L2:  |q - (c + r)|^2 = sum_j |(q - c)_j - cw_j|^2
+        // IP:  1 - <q, c + r>  = (1 - <q, c>) + sum_j -<q_j, cw_j>
+        void build(const float* query, const float* centroid, const float* codebook,
+                   size_t dim, size_t m, bool is_l2) {
+            size_t dsub = dim / m;
+            f.resize(m * KSUB);
+            q.resize(m * KSUB);
+            r.resize(dim);
+            float base = 0.0f;
+            if (is_l2) {
+                for (size_t d = 0; d < dim; ++d) r[d] = query[d] - centroid[d];
+            } else {
+                base = 1.0f - Distance::dot_scalar(query, centroid, dim);
+            }
+            for (size_t j = 0; j < m; ++j) {
+                const float* cb = codebook + j * KSUB * dsub;
+                for (int k = 0; k < KSUB; ++k) {
+                    f[j * KSUB + k] = is_l2
+                        ? Distance::l2_scalar(r.data() + j * dsub, cb + k * dsub, dsub)
+                        : -Distance::dot_scalar(query + j * dsub, cb + k * dsub, dsub);
+                }
+            }
+
+            // One scale for every table so the uint8 sums stay comparable;
+            // each table keeps its own offset, folded into bias.
+            float max_range = 0.0f;
+            bias = base;
+            for (size_t j = 0; j < m; ++j) {
+                auto first = f.begin() + j * KSUB;
+                auto [lo, hi] = std::minmax_element(first, first + KSUB);
+                max_range = std::max(max_range, *hi - *lo);
+                bias += *lo;
+            }
+            scale = (max_range > 0.0f) ? max_range / 255.0f : 1.0f;
+            for (size_t j = 0; j < m; ++j) {
+                float lo = *std::min_element(f.begin() + j * KSUB, f.begin() + (j + 1) * KSUB);
+                for (int k = 0; k < KSUB; ++k) {
+                    float v = std::nearbyint((f[j * KSUB + k] - lo) / scale);
+                    q[j * KSUB + k] = (uint8_t)std::clamp(v, 0.0f, 255.0f);
+                }
+            }
+        }
+    };
+
+    // -----------------------------------------------------------------------
+    // Fast-scan kernels: 32 uint16 table sums for one block.
+    // m * 255 < 65536 for every m we allow, so the 16-bit sums never wrap.
+    // -----------------------------------------------------------------------
+    using ScanFn = void (*)(const uint8_t* block, const uint8_t* lut, size_t m, uint16_t* out);
+
+    inline void scan_block_scalar(const uint8_t* block, const uint8_t* lut, size_t m, uint16_t* out) {
+        for (int i = 0; i < BLOCK; ++i) out[i] = 0;
+        for (size_t j = 0; j < m; ++j) {
+            const uint8_t* b = block + j * 16;
+            const uint8_t* t = lut + j * 16;
+            for (int i = 0; i < 16; ++i) {
+                out[i]      = (uint16_t)(out[i]      + t[b[i] & 0x0F]);
+                out[i + 16] = (uint16_t)(out[i + 16] + t[b[i] >> 4]);
+            }
+        }
+    }
+
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+    REDBOXDB_TARGET_AVX2
+    inline void scan_block_avx2(const uint8_t* block, const uint8_t* lut, size_t m, uint16_t* out) {
+        const __m128i low4 = _mm_set1_epi8(0x0F);
+        __m256i acc_lo = _mm256_setzero_si256();   // vectors 0..15
+        __m256i acc_hi = _mm256_setzero_si256();   // vectors 16..31
+        for (size_t j = 0; j < m; ++j) {
+            __m128i packed = _mm_loadu_si128((const __m128i*)(block + j * 16));
+            __m128i lo = _mm_and_si128(packed, low4);
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), low4);
+            __m256i idx   = _mm256_set_m128i(hi, lo);
+            __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(lut + j * 16)));
+            // One vpshufb: 32 table lookups
+            __m256i d = _mm256_shuffle_epi8(table, idx);
+            acc_lo = _mm256_add_epi16(acc_lo, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(d)));
+            acc_hi = _mm256_add_epi16(acc_hi, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(d, 1)));
+        }
+        _mm256_storeu_si256((__m256i*)out,        acc_lo);
+        _mm256_storeu_si256((__m256i*)(out + 16), acc_hi);
+    }
+#endif
+
+    inline ScanFn scan_for(Platform::SimdLevel level) {
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+        if (level >= Platform::SimdLevel::AVX2) return &scan_block_avx2;
+#else
+        (void)level;
+#endif
+        return &scan_block_scalar;
+    }
+
+    inline ScanFn scan_block() {
+        static const ScanFn fn = scan_for(Platform::detect_simd_level());
+        return fn;
+    }
+
+} // namespace PqManager
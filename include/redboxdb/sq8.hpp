@@ -0,0 +1,179 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include "redboxdb/distance.hpp"
+
+// Scalar quantization to 8 bits per component (SQ8).
+//
+// Each dimension d gets its own range [vmin[d], vmin[d] + 255 * scale[d]],
+// trained once from a sample, and a vector is stored as one uint8 code per
+// component. Scans read dim bytes per candidate instead of dim * 4.
+//
+// Distances are asymmetric: the query stays in float and is folded into the
+// code space once per search (Query::prepare), so the per-candidate kernel is
+// widen-u8 -> float and one or two FMAs, with no decode pass.
+namespace Sq8 {
+
+    // Per-dimension min and step. A constant dimension gets scale 1 so every
+    // vector encodes to code 0 there and contributes nothing to distances.
+    inline void train(const float* data, size_t n, size_t dim, float* vmin, float* scale) {
+        std::vector<float> vmax(dim);
+        for (size_t d = 0; d < dim; ++d) {
+            vmin[d] = std::numeric_limits<float>::max();
+            vmax[d] = std::numeric_limits<float>::lowest();
+        }
+        for (size_t i = 0; i < n; ++i) {
+            const float* v = data + i * dim;
+            for (size_t d = 0; d < dim; ++d) {
+                vmin[d] = std::min(vmin[d], v[d]);
+                vmax[d] = std::max(vmax[d], v[d]);
+            }
+        }
+        for (size_t d = 0; d < dim; ++d) {
+            if (n == 0) vmin[d] = 0.0f;
+            float range = (n == 0) ? 0.0f : vmax[d] - vmin[d];
+            scale[d] = (range > 0.0f) ? range / 255.0f : 1.0f;
+        }
+    }
+
+    // Values outside the trained range clamp to 0 / 255.
+    inline void encode(const float* v, const float* vmin, const float* scale,
+                       size_t dim, uint8_t* out) {
+        for (size_t d = 0; d < dim; ++d) {
+            float c = std::nearbyint((v[d] - vmin[d]) / scale[d]);
+            out[d] = static_cast<uint8_t>(std::clamp(c, 0.0f, 255.0f));
+        }
+    }
+
+    inline void decode(const uint8_t* code, const float* vmin, const float* scale,
+                       size_t dim, float* out) {
+        for (size_t d = 0; d < dim; ++d) out[d] = vmin[d] + scale[d] * code[d];
+    }
+
+    // sum_d w[d] * (q[d] - c[d])^2, with q already in code units.
+    using L2Fn  = float (*)(const float* q, const float* w, const uint8_t* code, size_t dim);
+    // sum_d q[d] * c[d]
+    using DotFn = float (*)(const float* q, const uint8_t* code, size_t dim);
+
+    inline float l2_scalar(const float* q, const float* w, const uint8_t* code, size_t dim) {
+        float sum = 0.0f;
+        for (size_t d = 0; d < dim; ++d) {
+            float diff = q[d] - (float)code[d];
+            sum += w[d] * diff * diff;
+        }
+        return sum;
+    }
+
+    inline float dot_scalar(const float* q, const uint8_t* code, size_t dim) {
+        float sum = 0.0f;
+        for (size_t d = 0; d < dim; ++d) sum += q[d] * (float)code[d];
+        return sum;
+    }
+
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+    // 8 codes -> 8 floats: zero-extend u8 to i32, convert.
+    REDBOXDB_TARGET_AVX2
+    inline __m256 widen8(const uint8_t* code) {
+        __m128i bytes = _mm_loadl_epi64((const __m128i*)code);
+        return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+    }
+
+    REDBOXDB_TARGET_AVX2
+    inline float l2_avx2(const float* q, const float* w, const uint8_t* code, size_t dim) {
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        size_t d = 0;
+        for (; d + 16 <= dim; d += 16) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q + d),     widen8(code + d));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(q + d + 8), widen8(code + d + 8));
+            s0 = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(w + d),     d0), d0, s0);
+            s1 = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(w + d + 8), d1), d1, s1);
+        }
+        for (; d + 8 <= dim; d += 8) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q + d), widen8(code + d));
+            s0 = _mm256_fmadd_ps(_mm256_mul_ps(_mm256_loadu_ps(w + d), d0), d0, s0);
+        }
+        float sum = Distance::hsum_avx2(_mm256_add_ps(s0, s1));
+        for (; d < dim; ++d) {
+            float diff = q[d] - (float)code[d];
+            sum += w[d] * diff * diff;
+        }
+        return sum;
+    }
+
+    REDBOXDB_TARGET_AVX2
+    inline float dot_avx2(const float* q, const uint8_t* code, size_t dim) {
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        size_t d = 0;
+        for (; d + 16 <= dim; d += 16) {
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + d),     widen8(code + d),     s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + d + 8), widen8(code + d + 8), s1);
+        }
+        for (; d + 8 <= dim; d += 8)
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + d), widen8(code + d), s0);
+        float sum = Distance::hsum_avx2(_mm256_add_ps(s0, s1));
+        for (; d < dim; ++d) sum += q[d] * (float)code[d];
+        return sum;
+    }
+#endif
+
+    struct Kernels {
+        L2Fn  l2;
+        DotFn dot;
+    };
+
+    // AVX-512 machines run the AVX2 kernels: the loop is bound on the
+    // u8 -> f32 widen, not on vector width.
+    inline Kernels kernels_for(Platform::SimdLevel level) {
+#if REDBOXDB_HAS_AVX2_INTRINSICS
+        if (level >= Platform::SimdLevel::AVX2) return { &l2_avx2, &dot_avx2 };
+#else
+        (void)level;
+#endif
+        return { &l2_scalar, &dot_scalar };
+    }
+
+    inline const Kernels& kernels() {
+        static const Kernels table = kernels_for(Platform::detect_simd_level());
+        return table;
+    }
+
+    // A float query rewritten into code space for one search.
+    //   L2:  |q - x|^2    = sum_d scale^2 * ((q - vmin) / scale - c)^2
+    //   IP:  1 - <q, x>   = 1 - (sum_d q * vmin + sum_d (q * scale) * c)
+    struct Query {
+        std::vector<float> q;      // query in code units (L2) or q * scale (IP)
+        std::vector<float> w;      // scale^2, L2 only
+        float              bias = 0.0f;
+        size_t             dim  = 0;
+        bool               is_l2 = true;
+        Kernels            k = kernels();
+
+        void prepare(const float* query, const float* vmin, const float* scale,
+                     size_t d, CoreEngine::Metric metric) {
+            dim   = d;
+            is_l2 = (metric == CoreEngine::Metric::L2);
+            q.resize(dim);
+            bias = 0.0f;
+            if (is_l2) {
+                w.resize(dim);
+                for (size_t i = 0; i < dim; ++i) {
+                    q[i] = (query[i] - vmin[i]) / scale[i];
+                    w[i] = scale[i] * scale[i];
+                }
+            } else {
+                for (size_t i = 0; i < dim; ++i) {
+                    q[i]  = query[i] * scale[i];
+                    bias += query[i] * vmin[i];
+                }
+            }
+        }
+
+        float distance(const uint8_t* code) const {
+            if (is_l2) return k.l2(q.data(), w.data(), code, dim);
+            return 1.0f - (bias + k.dot(q.data(), code, dim));
+        }
+    };
+}
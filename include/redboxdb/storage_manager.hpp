@@ -31,7 +31,7 @@ namespace StorageManager {
 
         CoreEngine::SpecificMetadata* header;
 
-        // IVF layout:
+        // IVF layout (K = cluster capacity; the first num_clusters are live):
         //   [ Header (128 bytes)                        ]
         //   [ centroid_block:      K x dim x 4 bytes    ]
         //   [ cluster_count_block: K x 8 bytes          ]
@@ -46,23 +46,58 @@ namespace StorageManager {
 
         // HNSW layout (appended after float_block):
         //   [ level_block: capacity x 1 byte            ]
-        //   [ edge_block:  capacity x edges_per_node x 4 bytes ]
+        //   [ edge_block:  capacity x 2M x 4 bytes      ]  <- level 0
+        //   [ upper_index: capacity x 4 bytes           ]
+        //   [ upper_block: upper_lists(capacity, M) x M x 4 bytes ]
         uint8_t*  hnsw_level_block;
         uint32_t* hnsw_edge_block;
+        uint32_t* hnsw_upper_index;
+        uint32_t* hnsw_upper_block;
+
+        // SQ8 block (StorageMode::SQ8 only, appended after everything above):
+        //   [ sq8_min:    dim x 4 bytes                 ]
+        //   [ sq8_scale:  dim x 4 bytes                 ]
+        //   [ code_block: capacity x dim x 1 byte       ]
+        // BQ block (StorageMode::BINARY only, same place as the SQ8 block):
+        //   [ bq_mean:     dim x 4 bytes                ]
+        //   [ bq_block:    capacity x ceil(dim/64) x 8  ]
+        // IVF-PQ block (IndexType::IVF_PQ only, after float_block):
+        //   [ pq_codebook: 16 x dim x 4 bytes           ]  <- m x 16 codewords of dim/m
+        //   [ pq_code_block: capacity x ceil(m/2) bytes ]  <- 4-bit codes, slot order
+        float*    pq_codebook;
+        uint8_t*  pq_code_block;
+
+        float*    sq8_min;
+        float*    sq8_scale;
+        uint8_t*  code_block;
+
+        float*    bq_mean;
+        uint64_t* bq_block;
 
     public:
         Manager(const std::string& db_file, uint64_t dimensions, int initial_capacity,
                 uint16_t num_clusters = 100, uint8_t num_probes = 1,
                 CoreEngine::IndexType index_type = CoreEngine::IndexType::IVF,
-                uint8_t hnsw_M = 16, uint16_t hnsw_ef_construction = 200);
+                uint8_t hnsw_M = 16, uint16_t hnsw_ef_construction = 200,
+                CoreEngine::Metric metric = CoreEngine::Metric::L2,
+                CoreEngine::StorageMode storage = CoreEngine::StorageMode::F32,
+                uint8_t pq_m = 0);
         ~Manager();
 
         void             add_vector(uint64_t id, const std::vector<float>& vec, uint16_t cluster = 0);
+        // Appends n rows (row-major, n x dimensions) with one copy into the
+        // float block; cluster 0 for IVF layouts. Throws if they don't fit.
+        void             add_vectors(const uint64_t* ids, const float* vecs, size_t n);
         const float*     get_float_ptr(int index) const;
         float*           get_float_ptr_mut(int index);
         uint64_t         get_id(int index) const;
         uint16_t         get_cluster(int index) const;
         void             set_cluster(int index, uint16_t c);
+        // Reorders every per-slot block (ids, clusters, floats, codes, HNSW
+        // levels, level-0 lists and upper indices) so new slot i holds what
+        // was in slot new_to_old[i]. In place, one slot of scratch per
+        // block. Edge contents still name old slots; the caller remaps them.
+        void             permute_slots(const std::vector<uint32_t>& new_to_old);
         uint64_t         get_count() const;
         uint64_t         next_id();
 
@@ -74,18 +109,54 @@ namespace StorageManager {
         bool    is_cluster_initialized() const  { return header->is_initialized != 0; }
         void    set_cluster_initialized()       { header->is_initialized = 1; }
         uint16_t get_num_clusters() const        { return header->num_clusters; }
+        void    set_num_clusters(uint16_t k)    { header->num_clusters = k; }
+        uint16_t get_cluster_capacity() const {
+            return header->cluster_capacity ? header->cluster_capacity : header->num_clusters;
+        }
+        bool    is_auto_clusters() const        { return header->auto_clusters != 0; }
+        void    set_auto_clusters()             { header->auto_clusters = 1; }
         uint8_t get_num_probes()   const        { return header->num_probes; }
         void    set_num_probes(uint8_t p)       { header->num_probes = p; }
 
         // HNSW accessors
         uint8_t*  get_hnsw_level_block()       { return hnsw_level_block; }
         uint32_t* get_hnsw_edge_block()        { return hnsw_edge_block; }
+        uint32_t* get_hnsw_upper_index()       { return hnsw_upper_index; }
+        uint32_t* get_hnsw_upper_block()       { return hnsw_upper_block; }
+        uint32_t* get_hnsw_upper_used()        { return &header->hnsw_upper_used; }
         CoreEngine::IndexType get_index_type() const {
             return static_cast<CoreEngine::IndexType>(header->index_type);
         }
         void set_hnsw_ef_search(uint16_t ef)  { header->hnsw_ef_search = ef; }
         uint16_t get_hnsw_ef_search() const    { return header->hnsw_ef_search; }
 
+        CoreEngine::Metric get_metric() const {
+            return static_cast<CoreEngine::Metric>(header->metric);
+        }
+
+        // SQ8 / BQ accessors
+        CoreEngine::StorageMode get_storage_mode() const {
+            return static_cast<CoreEngine::StorageMode>(header->storage_mode);
+        }
+        bool           is_codes_trained() const { return header->codes_trained != 0; }
+        const float*   get_sq8_min()    const { return sq8_min; }
+        const float*   get_sq8_scale()  const { return sq8_scale; }
+        const uint8_t* get_code_block() const { return code_block; }
+        const float*    get_bq_mean()   const { return bq_mean; }
+        const uint64_t* get_bq_block()  const { return bq_block; }
+        void           train_codes(uint64_t n);
+        void           encode_slot(int index);
+
+        // IVF-PQ accessors
+        bool     has_clusters()   const { return get_index_type() != CoreEngine::IndexType::HNSW; }
+        uint8_t  get_pq_m()       const { return header->pq_m; }
+        bool     is_pq_trained()  const { return header->pq_trained != 0; }
+        void     set_pq_trained()       { header->pq_trained = 1; }
+        float*   get_pq_codebook()      { return pq_codebook; }
+        const float* get_pq_codebook() const { return pq_codebook; }
+        uint8_t* get_pq_code_mut(int index);
+        const uint8_t* get_pq_code(int index) const;
+
         CoreEngine::SpecificMetadata* get_header() { return header; }
     };
 }
@@ -0,0 +1,139 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+
+// Fixed set of worker threads for splitting one query's scan into tasks.
+//
+// run() hands out task indices from a shared counter and blocks until all of
+// them are done. The calling thread works on tasks too, so a pool of n - 1
+// workers keeps n cores busy. The pool runs one job at a time: a run() that
+// finds it busy (another query mid-scan) executes its tasks inline instead of
+// queueing, so concurrent queries degrade to today's per-query threading.
+//
+// Waits are timed (wait_for in a loop): the untimed condition_variable::wait
+// is a GLIBCXX_3.4.30 symbol with GCC 12+, and the library also has to load
+// against older libstdc++ runtimes. The timed path is inline.
+namespace Parallel {
+
+    class ThreadPool {
+        static constexpr std::chrono::milliseconds WAIT_SLICE{ 100 };
+
+    public:
+        explicit ThreadPool(size_t workers) {
+            threads.reserve(workers);
+            for (size_t i = 0; i < workers; ++i)
+                threads.emplace_back([this] { worker_loop(); });
+        }
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lk(m);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& t : threads) t.join();
+        }
+
+        ThreadPool(const ThreadPool&)            = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        size_t size() const { return threads.size(); }
+
+        // Calls fn(i) for every i in [0, n_tasks), in no particular order.
+        void run(size_t n_tasks, const std::function<void(size_t)>& fn) {
+            std::unique_lock<std::mutex> busy(job_mutex, std::try_to_lock);
+            if (!busy.owns_lock() || threads.empty() || n_tasks < 2) {
+                for (size_t i = 0; i < n_tasks; ++i) fn(i);
+                return;
+            }
+            {
+                // A worker that woke late for the previous job may still be
+                // draining it; wait before resetting what it reads.
+                std::unique_lock<std::mutex> lk(m);
+                wait(idle, lk, [this] { return active == 0; });
+                task  = &fn;
+                total = n_tasks;
+                next.store(0, std::memory_order_relaxed);
+                ++generation;
+            }
+            wake.notify_all();
+            drain();
+
+            // Every index is handed out; tasks still running belong to
+            // workers counted in active.
+            std::unique_lock<std::mutex> lk(m);
+            wait(idle, lk, [this] { return active == 0; });
+        }
+
+    private:
+        template <typename Pred>
+        static void wait(std::condition_variable& cv, std::unique_lock<std::mutex>& lk, Pred pred) {
+            while (!cv.wait_for(lk, WAIT_SLICE, pred)) {}
+        }
+
+        void drain() {
+            for (;;) {
+                size_t i = next.fetch_add(1, std::memory_order_relaxed);
+                if (i >= total) return;
+                (*task)(i);
+            }
+        }
+
+        void worker_loop() {
+            uint64_t seen = 0;
+            std::unique_lock<std::mutex> lk(m);
+            for (;;) {
+                wait(wake, lk, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                ++active;
+                lk.unlock();
+                drain();
+                lk.lock();
+                if (--active == 0) idle.notify_all();
+            }
+        }
+
+        std::vector<std::thread> threads;
+        std::mutex               job_mutex;   // held by the run() in progress
+
+        std::mutex              m;
+        std::condition_variable wake;
+        std::condition_variable idle;
+        uint64_t generation = 0;
+        size_t   active     = 0;
+        bool     stopping   = false;
+
+        const std::function<void(size_t)>* task = nullptr;
+        size_t                             total = 0;
+        std::atomic<size_t>                next{ 0 };
+    };
+
+    // Number of contiguous ranges to cut n items into: one per thread
+    // (pool workers + caller), but none smaller than min_grain items.
+    inline size_t split_count(const ThreadPool* pool, size_t n, size_t min_grain) {
+        size_t threads = pool ? pool->size() + 1 : 1;
+        return std::max<size_t>(1, std::min(threads, n / std::max<size_t>(min_grain, 1)));
+    }
+
+    // fn(begin, end, task) over `tasks` near-equal ranges of [0, n); runs
+    // inline when pool is null.
+    inline void parallel_for(ThreadPool* pool, size_t n, size_t tasks,
+                             const std::function<void(size_t, size_t, size_t)>& fn) {
+        size_t chunk = (n + tasks - 1) / std::max<size_t>(tasks, 1);
+        auto body = [&](size_t t) {
+            size_t begin = std::min(n, t * chunk);
+            fn(begin, std::min(n, begin + chunk), t);
+        };
+        if (pool) pool->run(tasks, body);
+        else      for (size_t t = 0; t < tasks; ++t) body(t);
+    }
+
+} // namespace Parallel
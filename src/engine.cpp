@@ -7,29 +7,95 @@
 #include <fstream>
 #include <queue>
 #include <algorithm>
+#include <numeric>
 #include "redboxdb/cpu_features.hpp"
 #include "redboxdb/distance.hpp"
 #include "redboxdb/cluster_manager.hpp"
 #include "redboxdb/hnsw_manager.hpp"
+#include "redboxdb/nn_descent.hpp"
+#include "redboxdb/sq8.hpp"
+#include "redboxdb/bq.hpp"
+#include "redboxdb/pq_manager.hpp"
 #include "redboxdb/logger.hpp"
 #include <cstring>
 
 
 namespace CoreEngine {
 
-    RedBoxVector::RedBoxVector(std::string file_name, size_t dim, int capacity, uint16_t k, uint8_t num_probes) : dimension(dim), file_name(file_name), tombstone_file(file_name + ".del")
+    namespace {
+        // Per-thread query scratch, reused across queries and databases so
+        // a warm query allocates nothing beyond its returned ids: the graph
+        // walk buffers, the IVF candidate and probe lists, the top-N heap
+        // and the compressed-code query. Each field has one user on the
+        // call path; pool tasks never call query_context(), parallel_scan
+        // lends each one an entry of partials.
+        struct QueryContext {
+            HnswManager::SearchContext               graph;
+            std::vector<std::pair<float, uint32_t>>  hits;
+            std::vector<float>                       normalized;
+            std::vector<int>                         slots;
+            std::vector<uint16_t>                    probes;
+            std::vector<std::pair<float, uint16_t>>  centroid_dists;   // select_probes
+            std::vector<float>                       probe_dists;      // adaptive_search
+            std::vector<float>                       probe_bounds;
+            std::vector<float>                       probe_rest;
+            PqManager::Lut                           lut;
+            Sq8::Query                               sq8;
+            std::vector<uint64_t>                    bq_code;
+            std::vector<std::pair<float, int>>       top;              // TopN storage, shortlists
+            std::vector<std::vector<std::pair<float, int>>> partials;  // parallel_scan
+            std::vector<HnswManager::SearchResult>   nb_cands;         // hnsw_link_pending
+        };
+
+        QueryContext& query_context() {
+            thread_local QueryContext ctx;
+            return ctx;
+        }
+    }
+
+    RedBoxVector::RedBoxVector(std::string file_name, size_t dim, int capacity, uint16_t k, uint8_t num_probes, Metric metric, StorageMode storage) : dimension(dim), file_name(file_name), tombstone_file(file_name + ".del")
     {
-        _manager = std::make_unique<StorageManager::Manager>(file_name, dim, capacity, k, num_probes);
-        load_tombstones();
+        bool auto_k = (k == AUTO_CLUSTERS);
+        _manager = std::make_unique<StorageManager::Manager>(
+            file_name, dim, capacity, auto_k ? ClusterManager::auto_capacity(capacity) : k, num_probes,
+            IndexType::IVF, 16, 200, metric, storage);
+        open_ivf(auto_k);
+    }
+
+    RedBoxVector::RedBoxVector(std::string file_name, size_t dim, int capacity,
+                               const IvfPqParams& pq, Metric metric)
+        : dimension(dim), file_name(file_name), tombstone_file(file_name + ".del")
+    {
+        bool auto_k = (pq.k == AUTO_CLUSTERS);
+        _manager = std::make_unique<StorageManager::Manager>(
+            file_name, dim, capacity, auto_k ? ClusterManager::auto_capacity(capacity) : pq.k,
+            pq.num_probes, IndexType::IVF_PQ, 16, 200, metric, StorageMode::F32, pq.pq_m);
+        open_ivf(auto_k);
+    }
 
-        use_avx2    = Platform::has_avx2();
+    // Shared tail of the IVF / IVF-PQ constructors: rebuilds the in-memory
+    // state (tombstones, id map, cluster lists, PQ blocks) from the file.
+    // auto_clusters marks a new file as AUTO_CLUSTERS; an existing one keeps
+    // what it was created with.
+    void RedBoxVector::open_ivf(bool auto_clusters) {
+        load_tombstones();
+        if (auto_clusters && _manager->get_count() == 0 && !_manager->is_cluster_initialized())
+            _manager->set_auto_clusters();
+        uint16_t k = _manager->get_num_clusters();
+
+        // An existing file keeps the metric it was created with.
+        this->metric = _manager->get_metric();
+        dist_fn      = Distance::kernels().for_metric(this->metric, dimension);
+        bounded_fn   = Distance::kernels().bounded_for_metric(this->metric, dimension);
+        rows4_fn     = Distance::kernels().rows4_for_metric(this->metric);
         num_threads = std::max(1u, std::thread::hardware_concurrency());
 
         int existing = static_cast<int>(_manager->get_count());
         deleted_flags.resize(existing, 0);
-        cluster_index.resize(k);
+        cluster_index.resize(_manager->get_cluster_capacity());
 
         for (int i = 0; i < existing; ++i) {
+            set_row_norm(i);
             uint64_t id = _manager->get_id(i);
             if (deleted_ids.count(id)) {
                 deleted_flags[i] = 1;
@@ -42,29 +108,53 @@ namespace CoreEngine {
             }
         }
 
+        // Grouped prefix: up to the first live slot whose cluster goes back
+        // down. Anything after it is tail from inserts since the last re-group.
+        // Before k-means has run nothing is grouped.
+        organised_count = 0;
+        if (_manager->is_cluster_initialized()) {
+            organised_count = existing;
+            int last = -1;
+            for (int i = 0; i < existing; ++i) {
+                if (deleted_flags[i]) continue;
+                int c = _manager->get_cluster(i);
+                if (c < last) { organised_count = i; break; }
+                last = c;
+            }
+        }
+
         if (_manager->is_cluster_initialized()) {
             size_t max_cluster = 0;
             for (auto& v : cluster_index) max_cluster = std::max(max_cluster, v.size());
             Log::info("Max cluster size: " + std::to_string(max_cluster));
         }
+        if (pq_ready()) pq_rebuild_blocks();
+        radius_rebuild();
 
-        Log::info("AVX2: " + std::string(use_avx2 ? "enabled" : "disabled")
+        Log::info("SIMD: " + std::string(Distance::kernels().name)
                   + " | Threads: " + std::to_string(num_threads)
+                  + " | Metric: " + std::to_string(static_cast<int>(metric))
+                  + " | Storage: " + std::to_string(static_cast<int>(_manager->get_storage_mode()))
+                  + " | PQ m: " + std::to_string(static_cast<int>(_manager->get_pq_m()))
                   + " | Clusters: " + std::to_string(static_cast<int>(_manager->get_num_clusters()))
+                  + (_manager->is_auto_clusters() ? " (auto)" : "")
                   + " | Probes: "   + std::to_string(static_cast<int>(_manager->get_num_probes())));
     }
 
     RedBoxVector::RedBoxVector(std::string file_name, size_t dim, int capacity,
-                               uint8_t hnsw_M, uint16_t hnsw_ef_construction)
+                               uint8_t hnsw_M, uint16_t hnsw_ef_construction, Metric metric,
+                               StorageMode storage)
         : dimension(dim), file_name(file_name), tombstone_file(file_name + ".del"),
           hnsw_rng(std::random_device{}())
     {
         _manager = std::make_unique<StorageManager::Manager>(
             file_name, dim, capacity, 100, 1,
-            IndexType::HNSW, hnsw_M, hnsw_ef_construction);
+            IndexType::HNSW, hnsw_M, hnsw_ef_construction, metric, storage);
         load_tombstones();
 
-        use_avx2    = Platform::has_avx2();
+        this->metric = _manager->get_metric();
+        dist_fn      = Distance::kernels().for_metric(this->metric, dimension);
+        rows4_fn     = Distance::kernels().rows4_for_metric(this->metric);
         num_threads = std::max(1u, std::thread::hardware_concurrency());
 
         int existing = static_cast<int>(_manager->get_count());
@@ -79,7 +169,9 @@ namespace CoreEngine {
             }
         }
 
-        Log::info("HNSW initialized | AVX2: " + std::string(use_avx2 ? "enabled" : "disabled")
+        Log::info("HNSW initialized | SIMD: " + std::string(Distance::kernels().name)
+                  + " | Metric: " + std::to_string(static_cast<int>(metric))
+                  + " | Storage: " + std::to_string(static_cast<int>(_manager->get_storage_mode()))
                   + " | M=" + std::to_string((int)hnsw_M)
                   + " | ef_construction=" + std::to_string((int)hnsw_ef_construction)
                   + " | ef_search=" + std::to_string((int)_manager->get_hnsw_ef_search())
@@ -87,10 +179,27 @@ namespace CoreEngine {
     }
 
     // -----------------------------------------------------------------------
-    void RedBoxVector::insert(uint64_t id, const std::vector<float>& vec) {
+    const std::vector<float>& RedBoxVector::apply_metric(const std::vector<float>& vec,
+                                                         std::vector<float>& scratch) const {
+        if (metric != Metric::Cosine) return vec;
+        scratch = vec;
+        Distance::normalize(scratch.data(), scratch.size());
+        return scratch;
+    }
+
+    // -----------------------------------------------------------------------
+    void RedBoxVector::insert(uint64_t id, const std::vector<float>& raw_vec) {
+        std::vector<float> normalized;
+        const std::vector<float>& vec = apply_metric(raw_vec, normalized);
+
         std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        // HNSW slot left for hnsw_link_pending once the write lock is dropped.
+        uint32_t unlinked = HnswManager::EMPTY;
 
         bool is_hnsw = (_manager->get_index_type() == IndexType::HNSW);
+        // IVF-PQ codes are residuals against a centroid, so its centroids
+        // stay where k-means put them instead of drifting with inserts.
+        bool frozen_centroids = (_manager->get_index_type() == IndexType::IVF_PQ);
 
         // Re-insert after delete
         if (deleted_ids.count(id)) {
@@ -108,34 +217,45 @@ namespace CoreEngine {
             if (old_slot != -1) {
                 float* dst = _manager->get_float_ptr_mut(old_slot);
                 std::memcpy(dst, vec.data(), dimension * sizeof(float));
+                _manager->encode_slot(old_slot);
 
                 if (!is_hnsw) {
-                    uint16_t k = _manager->get_num_clusters();
+                    set_row_norm(old_slot);
                     uint16_t c = 0;
                     if (_manager->is_cluster_initialized()) {
-                        c = ClusterManager::find_nearest_centroid(
-                            vec.data(), _manager->get_centroid_block(),
-                            k, dimension, use_avx2);
-                        ClusterManager::update_centroid(
-                            _manager->get_centroid_block(),
-                            _manager->get_cluster_count_block(),
-                            c, vec.data(), dimension);
+                        c = nearest_centroid(vec.data());
+                        if (!frozen_centroids) centroid_add(c, vec.data());
+                        else                   radius_cover(c, vec.data());
                         cluster_index[c].push_back(old_slot);
                     }
                     _manager->set_cluster(old_slot, c);
+                    if (pq_ready()) {
+                        pq_encode_slot(old_slot, c);
+                        pq_append(c);
+                    }
+                    tile_store(old_slot);
                 }
-                // HNSW: re-insert into graph
+                // HNSW: re-insert into graph. A fresh insert of this slot
+                // may still be waiting for its link; this one supersedes it.
                 else {
-                    HnswManager::hnsw_insert(
+                    {
+                        std::lock_guard<std::mutex> g(hnsw_unlinked_mtx);
+                        hnsw_unlinked.erase(static_cast<uint32_t>(old_slot));
+                    }
+                    // The slot keeps its level: its upper lists are sized
+                    // for it and other nodes' lists may still point here.
+                    HnswManager::hnsw_link(
                         static_cast<uint32_t>(old_slot), vec.data(),
-                        _manager->get_header(), _manager->get_float_ptr_mut(0),
-                        _manager->get_hnsw_edge_block(), _manager->get_hnsw_level_block(),
-                        dimension, use_avx2, deleted_flags.data(), hnsw_rng,
-                        hnsw_insert_visited_buf, hnsw_insert_visit_gen, hnsw_insert_nb_cands);
+                        _manager->get_hnsw_level_block()[old_slot], _manager->get_header(),
+                        _manager->get_float_ptr(0), hnsw_edges(),
+                        dimension, dist_fn, deleted_flags.data(),
+                        hnsw_insert_ctx, hnsw_insert_nb_cands, rows4_fn);
                 }
 
                 deleted_flags[old_slot] = 0;
                 id_to_index[id] = old_slot;
+                if (!is_hnsw && _manager->is_cluster_initialized())
+                    note_cluster_write(_manager->get_cluster(old_slot));
                 return;
             }
         }
@@ -149,61 +269,116 @@ namespace CoreEngine {
             deleted_flags.push_back(0);
 
             if (!is_hnsw) {
-                uint16_t k = _manager->get_num_clusters();
                 uint16_t c = 0;
 
                 if (!_manager->is_cluster_initialized()) {
                     c = 0;
                     _manager->add_vector(id, vec, c);
+                    set_row_norm(slot);
+                    tile_store(static_cast<int>(slot));
+
+                    // Binary codes make the flat scan before k-means cheap too.
+                    if (_manager->get_storage_mode() == StorageMode::BINARY && !_manager->is_codes_trained()
+                        && (uint64_t)(slot + 1) >= BQ_TRAIN_THRESHOLD) {
+                        _manager->train_codes(slot + 1);
+                        Log::info("BQ trained on " + std::to_string(slot + 1) + " vectors");
+                    }
 
-                    if ((uint64_t)(slot + 1) >= KMEANS_INIT_THRESHOLD) {
-                        ClusterManager::kmeans_plus_plus_init(
-                            _manager->get_centroid_block(),
-                            _manager->get_cluster_count_block(),
-                            _manager->get_cluster_block(),
-                            _manager->get_float_ptr(0),
-                            k, slot+1, dimension, use_avx2);
-                        _manager->set_cluster_initialized();
-
-                        for (auto& v : cluster_index) v.clear();
-                        for (int i = 0; i <= (int)slot; ++i) {
-                            if (!deleted_flags[i]) {
-                                uint16_t ci = _manager->get_cluster(i);
-                                if (ci < k) cluster_index[ci].push_back(i);
-                            }
+                    if ((uint64_t)(slot + 1) >= KMEANS_INIT_THRESHOLD && !maintenance_running) {
+                        if (background_training) {
+                            start_background_kmeans(slot + 1);
+                        } else {
+                            const float* data = _manager->get_float_ptr(0);
+                            install_clusters(train_clusters(data, slot + 1, kmeans_params), data);
                         }
-
-                        Log::info("K-Means++ initialized with K=" + std::to_string((int)k));
                     }
                 } else {
-                    c = ClusterManager::find_nearest_centroid(
-                        vec.data(),
-                        _manager->get_centroid_block(),
-                        k, dimension, use_avx2);
+                    c = nearest_centroid(vec.data());
                     _manager->add_vector(id, vec, c);
-                    ClusterManager::update_centroid(
-                        _manager->get_centroid_block(),
-                        _manager->get_cluster_count_block(),
-                        c, vec.data(), dimension);
+                    set_row_norm(slot);
+                    if (!frozen_centroids) centroid_add(c, vec.data());
+                    else                   radius_cover(c, vec.data());
 
                     cluster_index[c].push_back(static_cast<int>(slot));
+                    if (pq_ready()) {
+                        pq_encode_slot(static_cast<int>(slot), c);
+                        pq_append(c);
+                    }
+                    tile_store(static_cast<int>(slot));
                 }
             } else {
-                // HNSW insert
+                // HNSW insert. Only the bookkeeping needs the write lock: a
+                // node that stays below the top level is linked afterwards
+                // under the read lock, alongside searches and other linkers.
+                // The first node and a new top level are linked here, so the
+                // entry point never moves under a reader.
                 _manager->add_vector(id, vec, 0);
-                HnswManager::hnsw_insert(
-                    static_cast<uint32_t>(slot), vec.data(),
-                    _manager->get_header(), _manager->get_float_ptr_mut(0),
-                    _manager->get_hnsw_edge_block(), _manager->get_hnsw_level_block(),
-                    dimension, use_avx2, deleted_flags.data(), hnsw_rng,
-                    hnsw_insert_visited_buf, hnsw_insert_visit_gen, hnsw_insert_nb_cands);
+                CoreEngine::SpecificMetadata* header = _manager->get_header();
+                int level = header->is_initialized
+                    ? std::min(HnswManager::compute_level(header->hnsw_M, hnsw_rng), HnswManager::MAX_LEVEL) : 0;
+                level = HnswManager::set_level(hnsw_edges(), _manager->get_hnsw_level_block(),
+                                               static_cast<uint32_t>(slot), level);
+                if (header->is_initialized == 0 || level > header->hnsw_max_level) {
+                    HnswManager::hnsw_link(
+                        static_cast<uint32_t>(slot), vec.data(), level, header,
+                        _manager->get_float_ptr(0), hnsw_edges(),
+                        dimension, dist_fn, deleted_flags.data(),
+                        hnsw_insert_ctx, hnsw_insert_nb_cands, rows4_fn);
+                } else {
+                    unlinked = static_cast<uint32_t>(slot);
+                    std::lock_guard<std::mutex> g(hnsw_unlinked_mtx);
+                    hnsw_unlinked.insert(unlinked);
+                }
+
+                // Graph build stays on floats; codes only serve search.
+                if (_manager->get_storage_mode() == StorageMode::SQ8 && !_manager->is_codes_trained()
+                    && (uint64_t)(slot + 1) >= SQ8_TRAIN_THRESHOLD) {
+                    _manager->train_codes(slot + 1);
+                    Log::info("SQ8 trained on " + std::to_string(slot + 1) + " vectors");
+                }
             }
 
             id_to_index[id] = slot;
+
+            if (!is_hnsw && _manager->is_cluster_initialized()) {
+                schedule_reorganize();
+                note_cluster_write(_manager->get_cluster(static_cast<int>(id_to_index[id])));
+            }
         }
         catch (const std::exception& e) {
             Log::error("Insert failed: " + std::string(e.what()));
         }
+
+        if (unlinked != HnswManager::EMPTY) {
+            lk.unlock();
+            hnsw_link_pending(unlinked);
+        }
+    }
+
+    HnswManager::EdgeStore RedBoxVector::hnsw_edges() const {
+        const CoreEngine::SpecificMetadata* header = _manager->get_header();
+        return { _manager->get_hnsw_edge_block(), _manager->get_hnsw_upper_index(),
+                 _manager->get_hnsw_upper_block(), _manager->get_hnsw_upper_used(),
+                 HnswManager::upper_lists(header->max_capacity, header->hnsw_M) };
+    }
+
+    // Links a slot insert() left unlinked. Runs under the read lock, so any
+    // number of these proceed together with searches; the graph's stripe
+    // locks order the edge writes. The slot cannot move meanwhile: reorganize()
+    // renumbers slots only under the write lock, and hnsw_reorder_locked
+    // drains hnsw_unlinked before it does, so a slot still listed keeps its
+    // number. A re-insert of the slot also removes it from hnsw_unlinked.
+    void RedBoxVector::hnsw_link_pending(uint32_t slot) {
+        std::shared_lock<std::shared_mutex> lk(rw_mutex);
+        {
+            std::lock_guard<std::mutex> g(hnsw_unlinked_mtx);
+            if (!hnsw_unlinked.erase(slot)) return;
+        }
+        QueryContext& ctx = query_context();
+        HnswManager::hnsw_link(
+            slot, _manager->get_float_ptr(slot), _manager->get_hnsw_level_block()[slot],
+            _manager->get_header(), _manager->get_float_ptr(0), hnsw_edges(),
+            dimension, dist_fn, deleted_flags.data(), ctx.graph, ctx.nb_cands, rows4_fn, &hnsw_locks);
     }
 
     uint64_t RedBoxVector::insert_auto(const std::vector<float>& vec) {
@@ -219,6 +394,134 @@ namespace CoreEngine {
         return new_id;
     }
 
+    void RedBoxVector::insert_bulk(const uint64_t* ids, const float* vecs, size_t n, size_t threads,
+                                   BulkBuild build) {
+        std::vector<size_t>   single;    // rows insert() takes instead
+        std::vector<uint32_t> pending;   // slots linked after the write lock is dropped
+        size_t workers = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        std::unique_ptr<Parallel::ThreadPool> build_pool;
+        {
+            std::unique_lock<std::shared_mutex> lk(rw_mutex);
+            if (_manager->get_index_type() != IndexType::HNSW) {
+                single.resize(n);
+                std::iota(single.begin(), single.end(), (size_t)0);
+            } else {
+                // A deleted id reuses its old slot, which insert() handles.
+                std::vector<uint64_t> fresh;
+                fresh.reserve(n);
+                for (size_t i = 0; i < n; ++i) {
+                    if (deleted_ids.count(ids[i])) single.push_back(i);
+                    else                           fresh.push_back(ids[i]);
+                }
+                size_t first = _manager->get_count();
+                size_t m     = std::min<size_t>(fresh.size(), _manager->get_header()->max_capacity - first);
+                fresh.resize(m);
+
+                // Rows go in as given unless some were set aside or need
+                // normalising.
+                const float*       rows = vecs;
+                std::vector<float> staged;
+                if (!single.empty() || metric == Metric::Cosine) {
+                    staged.resize(m * dimension);
+                    for (size_t i = 0, out = 0, skip = 0; out < m; ++i) {
+                        if (skip < single.size() && single[skip] == i) { ++skip; continue; }
+                        std::memcpy(&staged[out * dimension], vecs + i * dimension, dimension * sizeof(float));
+                        if (metric == Metric::Cosine) Distance::normalize(&staged[out * dimension], dimension);
+                        ++out;
+                    }
+                    rows = staged.data();
+                }
+
+                _manager->add_vectors(fresh.data(), rows, m);
+                deleted_flags.resize(first + m, 0);
+
+                CoreEngine::SpecificMetadata* header = _manager->get_header();
+                uint8_t*  levels = _manager->get_hnsw_level_block();
+                const HnswManager::EdgeStore edges = hnsw_edges();
+                const float* floats = _manager->get_float_ptr(0);
+                size_t end = first + m;
+                if (workers > 1 && m > 1)
+                    build_pool = std::make_unique<Parallel::ThreadPool>(workers - 1);
+
+                // NN-Descent needs the whole graph to itself: only into an
+                // empty database, and never for a single row. Searches wait
+                // for the whole build.
+                if (build == BulkBuild::NnDescent && header->is_initialized == 0 && first == 0 && m > 1) {
+                    for (size_t s = first; s < end; ++s)
+                        HnswManager::set_level(edges, levels, static_cast<uint32_t>(s),
+                                               std::min(HnswManager::compute_level(header->hnsw_M, hnsw_rng),
+                                                        HnswManager::MAX_LEVEL));
+                    NnDescent::build_hnsw(header, floats, edges, levels, m, dimension, dist_fn, rows4_fn,
+                                          nn_descent_params, build_pool.get());
+                } else {
+                    // As in insert(): the first node and any node that raises
+                    // the top level are linked here, so the entry point never
+                    // moves under a reader. The rest are listed in
+                    // hnsw_unlinked, so a reorganize() that gets the write
+                    // lock before the link pass links them before renumbering.
+                    pending.reserve(m);
+                    for (size_t s = first; s < end; ++s) {
+                        int level = header->is_initialized
+                            ? std::min(HnswManager::compute_level(header->hnsw_M, hnsw_rng), HnswManager::MAX_LEVEL)
+                            : 0;
+                        level = HnswManager::set_level(edges, levels, static_cast<uint32_t>(s), level);
+                        if (header->is_initialized == 0 || level > header->hnsw_max_level)
+                            HnswManager::hnsw_link(static_cast<uint32_t>(s), _manager->get_float_ptr(s), level,
+                                                   header, floats, edges, dimension, dist_fn, deleted_flags.data(),
+                                                   hnsw_insert_ctx, hnsw_insert_nb_cands, rows4_fn);
+                        else
+                            pending.push_back(static_cast<uint32_t>(s));
+                    }
+                    std::lock_guard<std::mutex> g(hnsw_unlinked_mtx);
+                    hnsw_unlinked.insert(pending.begin(), pending.end());
+                }
+
+                for (size_t i = 0; i < m; ++i) id_to_index[fresh[i]] = first + i;
+
+                if (_manager->get_storage_mode() == StorageMode::SQ8 && !_manager->is_codes_trained()
+                    && (uint64_t)end >= SQ8_TRAIN_THRESHOLD) {
+                    _manager->train_codes(end);
+                    Log::info("SQ8 trained on " + std::to_string(end) + " vectors");
+                }
+            }
+        }
+
+        // Link pass under the read lock, alongside searches and other
+        // linkers, as hnsw_link_pending does for one slot. Threads take
+        // slots in order from a shared counter, so the graph grows roughly
+        // as it would one insert at a time.
+        if (!pending.empty()) {
+            std::shared_lock<std::shared_mutex> lk(rw_mutex);
+            CoreEngine::SpecificMetadata* header = _manager->get_header();
+            const uint8_t* levels = _manager->get_hnsw_level_block();
+            const HnswManager::EdgeStore edges = hnsw_edges();
+            const float* floats = _manager->get_float_ptr(0);
+            std::atomic<size_t> next{ 0 };
+            auto link = [&](size_t) {
+                HnswManager::SearchContext             ctx;
+                std::vector<HnswManager::SearchResult> nb_cands;
+                for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < pending.size(); ) {
+                    uint32_t s = pending[i];
+                    {
+                        std::lock_guard<std::mutex> g(hnsw_unlinked_mtx);
+                        if (!hnsw_unlinked.erase(s)) continue;
+                    }
+                    HnswManager::hnsw_link(s, _manager->get_float_ptr(s), levels[s],
+                                           header, floats, edges, dimension, dist_fn, deleted_flags.data(),
+                                           ctx, nb_cands, rows4_fn, &hnsw_locks);
+                }
+            };
+            if (build_pool) build_pool->run(workers, link);
+            else            link(0);
+        }
+
+        std::vector<float> row(dimension);
+        for (size_t i : single) {
+            std::memcpy(row.data(), vecs + i * dimension, dimension * sizeof(float));
+            insert(ids[i], row);
+        }
+    }
+
     void RedBoxVector::saveToDisk([[maybe_unused]] const std::string& filename) {
         Log::info("Persistence handled by StorageManager (Auto-Save active).");
     }
@@ -229,83 +532,100 @@ namespace CoreEngine {
     }
 
     // -----------------------------------------------------------------------
-    int RedBoxVector::search(const std::vector<float>& query) {
+    int RedBoxVector::search(const std::vector<float>& raw_query) {
+        QueryContext& ctx = query_context();
+        const std::vector<float>& query = apply_metric(raw_query, ctx.normalized);
+
         std::shared_lock<std::shared_mutex> lk(rw_mutex);
         int count = static_cast<int>(_manager->get_count());
         if (count == 0) return -1;
 
         if (_manager->get_index_type() == IndexType::HNSW) {
-            std::vector<uint8_t> hnsw_visited_buf;
-            uint32_t hnsw_visit_gen = 0;
+            if (sq8_ready()) {
+                const auto& best = hnsw_sq8_search(query.data(), 1);
+                if (best.empty()) return -1;
+                return static_cast<int>(_manager->get_id(best[0].second));
+            }
             uint32_t best_slot = HnswManager::hnsw_search_1(
                 query.data(), _manager->get_header(),
-                _manager->get_float_ptr(0), _manager->get_hnsw_edge_block(),
-                dimension, use_avx2, deleted_flags.data(),
-                hnsw_visited_buf, hnsw_visit_gen, 8);
+                _manager->get_float_ptr(0), hnsw_edges(),
+                dimension, dist_fn, deleted_flags.data(), ctx.graph.visited, 8);
             if (best_slot == HnswManager::EMPTY) return -1;
             return static_cast<int>(_manager->get_id(best_slot));
         }
 
+        if (pq_ready()) {
+            const auto& best = pq_search(query.data(), 1);
+            if (best.empty()) return -1;
+            return static_cast<int>(_manager->get_id(best[0].second));
+        }
+        if (adaptive_ready()) {
+            TopN best(ctx.top);
+            adaptive_search(query.data(), 1, best);
+            if (best.empty()) return -1;
+            return static_cast<int>(_manager->get_id(best.top().second));
+        }
+        if (tiles_ready()) {
+            const auto& best = tile_search(query.data(), 1);
+            if (best.empty()) return -1;
+            return static_cast<int>(_manager->get_id(best[0].second));
+        }
+
         // IVF path
-        uint16_t k         = _manager->get_num_clusters();
         uint8_t num_probes = _manager->get_num_probes();
         bool initialized   = _manager->is_cluster_initialized();
         const float* float_block_snap = _manager->get_float_ptr(0);
-
-        // Thread-local buffers: no heap alloc per query
-        std::vector<std::pair<float, uint16_t>> centroid_dists;
-        std::vector<int> candidates;
+        std::vector<int>& candidates = ctx.slots;
+        candidates.clear();
 
         if (initialized) {
-            const float* centroid_block = _manager->get_centroid_block();
-
-            if (num_probes == 1) {
-                // Fast path: single linear scan for minimum, no sort needed
-                float    best_d = std::numeric_limits<float>::max();
-                uint16_t best_c = 0;
-                for (uint16_t c = 0; c < k; ++c) {
-                    float d = Distance::l2(query.data(), centroid_block + (size_t)c * dimension,
-                                           dimension, use_avx2);
-                    if (d < best_d) { best_d = d; best_c = c; }
-                }
-                for (int slot : cluster_index[best_c])
+            std::vector<uint16_t>& probes = ctx.probes;
+            select_probes(query.data(), num_probes, probes);
+            for (uint16_t c : probes)
+                for (int slot : cluster_index[c])
                     if (!deleted_flags[slot]) candidates.push_back(slot);
-            } else {
-                centroid_dists.resize(k);
-                for (uint16_t c = 0; c < k; ++c) {
-                    float d = Distance::l2(query.data(), centroid_block + (size_t)c * dimension,
-                                           dimension, use_avx2);
-                    centroid_dists[c] = { d, c };
-                }
-                std::partial_sort(centroid_dists.begin(),
-                                  centroid_dists.begin() + num_probes,
-                                  centroid_dists.end());
-
-                size_t reserve_size = 0;
-                for (int p = 0; p < num_probes; ++p)
-                    reserve_size += cluster_index[centroid_dists[p].second].size();
-                candidates.reserve(reserve_size);
-
-                for (int p = 0; p < num_probes; ++p) {
-                    uint16_t c = centroid_dists[p].second;
-                    for (int slot : cluster_index[c])
-                        if (!deleted_flags[slot]) candidates.push_back(slot);
-                }
-            }
         } else {
-            candidates.reserve(count);
             for (int i = 0; i < count; ++i)
                 if (!deleted_flags[i]) candidates.push_back(i);
         }
 
         if (candidates.empty()) return -1;
 
+        if (sq8_ready()) {
+            const auto& best = sq8_scan(candidates, query.data(), 1);
+            if (best.empty()) return -1;
+            return static_cast<int>(_manager->get_id(best[0].second));
+        }
+        if (bq_ready()) {
+            const auto& best = bq_scan(candidates, query.data(), 1);
+            if (best.empty()) return -1;
+            return static_cast<int>(_manager->get_id(best[0].second));
+        }
+
+        if (parallel_scan_worthwhile(candidates.size())) {
+            TopN best(ctx.top);
+            parallel_scan(candidates, query.data(), 1, best);
+            if (best.empty()) return -1;
+            return static_cast<int>(_manager->get_id(best.top().second));
+        }
+
         float min_dist  = std::numeric_limits<float>::max();
         int   best_slot = -1;
-        for (int slot : candidates) {
-            const float* vec_ptr = float_block_snap + (size_t)slot * dimension;
-            float dist = Distance::l2(vec_ptr, query.data(), dimension, use_avx2);
-            if (dist < min_dist) { min_dist = dist; best_slot = slot; }
+        size_t i = 0;
+        const float* rows[Distance::ROW_BLOCK];
+        float dists[Distance::ROW_BLOCK];
+        for (; i + Distance::ROW_BLOCK <= candidates.size(); i += Distance::ROW_BLOCK) {
+            for (int r = 0; r < Distance::ROW_BLOCK; ++r)
+                rows[r] = float_block_snap + (size_t)candidates[i + r] * dimension;
+            rows4_fn(query.data(), rows, dimension, min_dist, dists);
+            for (int r = 0; r < Distance::ROW_BLOCK; ++r)
+                if (dists[r] < min_dist) { min_dist = dists[r]; best_slot = candidates[i + r]; }
+        }
+        for (; i < candidates.size(); ++i) {
+            const float* vec_ptr = float_block_snap + (size_t)candidates[i] * dimension;
+            float dist = bounded_fn ? bounded_fn(vec_ptr, query.data(), dimension, min_dist)
+                                    : dist_fn(vec_ptr, query.data(), dimension);
+            if (dist < min_dist) { min_dist = dist; best_slot = candidates[i]; }
         }
 
         if (best_slot == -1) return -1;
@@ -313,102 +633,1196 @@ namespace CoreEngine {
     }
 
     // -----------------------------------------------------------------------
-    std::vector<int> RedBoxVector::search_N(const std::vector<float>& query, int N) {
+    std::vector<int> RedBoxVector::search_N(const std::vector<float>& raw_query, int N) {
+        QueryContext& ctx = query_context();
+        const std::vector<float>& query = apply_metric(raw_query, ctx.normalized);
+
         std::shared_lock<std::shared_mutex> lk(rw_mutex);
-        using PQ = std::priority_queue<std::pair<float, int>>;
+        std::vector<int> result(std::clamp<int64_t>(N, 0, (int64_t)_manager->get_count()));
+        result.resize(search_N_locked(query.data(), std::span<int>(result)));
+        return result;
+    }
 
+    size_t RedBoxVector::search_N(const std::vector<float>& raw_query, std::span<int> out) {
+        QueryContext& ctx = query_context();
+        const std::vector<float>& query = apply_metric(raw_query, ctx.normalized);
+
+        std::shared_lock<std::shared_mutex> lk(rw_mutex);
+        return search_N_locked(query.data(), out);
+    }
+
+    // N = out.size(). Every path leaves at most N ascending (dist, slot)
+    // in the thread's scratch; only the ids are copied out.
+    size_t RedBoxVector::search_N_locked(const float* query, std::span<int> out) {
+        QueryContext& ctx = query_context();
+        int N     = static_cast<int>(std::min<size_t>(out.size(), INT32_MAX));
         int count = static_cast<int>(_manager->get_count());
-        if (count == 0) return {};
+        if (count == 0 || N <= 0) return 0;
+
+        auto emit = [&](const std::vector<std::pair<float, int>>& ranked) {
+            size_t n = std::min(ranked.size(), out.size());
+            for (size_t i = 0; i < n; ++i)
+                out[i] = static_cast<int>(_manager->get_id(ranked[i].second));
+            return n;
+        };
+
+        if (_manager->get_index_type() == IndexType::HNSW && sq8_ready())
+            return emit(hnsw_sq8_search(query, N));
 
         if (_manager->get_index_type() == IndexType::HNSW) {
-            std::vector<uint8_t> hnsw_visited_buf;
-            uint32_t hnsw_visit_gen = 0;
-            std::vector<std::pair<float, uint32_t>> hnsw_results;
-            HnswManager::hnsw_search(
-                query.data(), N, _manager->get_header(),
-                _manager->get_float_ptr(0), _manager->get_hnsw_edge_block(),
-                dimension, use_avx2, deleted_flags.data(), hnsw_results,
-                hnsw_visited_buf, hnsw_visit_gen);
-
-            std::vector<int> result;
-            int limit = std::min(N, (int)hnsw_results.size());
-            result.reserve(limit);
-            for (int i = 0; i < limit; ++i) {
-                result.push_back(static_cast<int>(_manager->get_id(hnsw_results[i].second)));
-            }
-            return result;
+            ctx.hits.resize(N);
+            size_t found = HnswManager::hnsw_search(
+                query, hnsw_topn_ef(N), _manager->get_header(),
+                _manager->get_float_ptr(0), hnsw_edges(),
+                dimension, dist_fn, deleted_flags.data(), ctx.graph, ctx.hits);
+            for (size_t i = 0; i < found; ++i)
+                out[i] = static_cast<int>(_manager->get_id(ctx.hits[i].second));
+            return found;
+        }
+
+        if (pq_ready()) return emit(pq_search(query, N));
+        if (adaptive_ready()) {
+            TopN best(ctx.top);
+            adaptive_search(query, N, best);
+            return emit(best.sorted());
         }
+        if (tiles_ready()) return emit(tile_search(query, N));
 
         // IVF path
-        uint16_t k         = _manager->get_num_clusters();
         uint8_t num_probes = _manager->get_num_probes();
         bool initialized   = _manager->is_cluster_initialized();
-        const float* float_block_snap = _manager->get_float_ptr(0);
 
-        std::vector<std::pair<float, uint16_t>> centroid_dists;
-        std::vector<int> candidates;
+        std::vector<int>& candidates = ctx.slots;
+        candidates.clear();
 
         if (initialized) {
-            const float* centroid_block = _manager->get_centroid_block();
+            std::vector<uint16_t>& probes = ctx.probes;
+            select_probes(query, num_probes, probes);
+            for (uint16_t c : probes)
+                for (int slot : cluster_index[c])
+                    if (!deleted_flags[slot]) candidates.push_back(slot);
+        } else {
+            for (int i = 0; i < count; ++i)
+                if (!deleted_flags[i]) candidates.push_back(i);
+        }
 
-            if (num_probes == 1) {
-                float    best_d = std::numeric_limits<float>::max();
-                uint16_t best_c = 0;
-                for (uint16_t c = 0; c < k; ++c) {
-                    float d = Distance::l2(query.data(), centroid_block + (size_t)c * dimension,
-                                           dimension, use_avx2);
-                    if (d < best_d) { best_d = d; best_c = c; }
+        if (candidates.empty()) return 0;
+
+        if (sq8_ready()) return emit(sq8_scan(candidates, query, N));
+        if (bq_ready())  return emit(bq_scan(candidates, query, N));
+
+        TopN pq(ctx.top);
+        if (parallel_scan_worthwhile(candidates.size()))
+            parallel_scan(candidates, query, N, pq);
+        else
+            scan_float_range(candidates, 0, candidates.size(), query, N, pq);
+        return emit(pq.sorted());
+    }
+
+    // -----------------------------------------------------------------------
+    bool RedBoxVector::parallel_scan_worthwhile(size_t candidates) const {
+        return num_threads > 1 && candidates >= (size_t)PARALLEL_THRESHOLD;
+    }
+
+    std::shared_ptr<Parallel::ThreadPool> RedBoxVector::worker_pool() const {
+        if (num_threads <= 1) return nullptr;
+        std::lock_guard<std::mutex> g(pool_mutex);
+        if (!pool) pool = std::make_shared<Parallel::ThreadPool>(num_threads - 1);
+        return pool;
+    }
+
+    // Top-N over candidates[begin, end) into pq. Once the heap holds N, its
+    // top is the bound a candidate must beat; abandoned candidates come back
+    // >= it and are dropped.
+    void RedBoxVector::scan_float_range(const std::vector<int>& candidates, size_t begin, size_t end,
+                                        const float* query, int N, TopN& pq) const {
+        const float* float_block = _manager->get_float_ptr(0);
+        size_t i = begin;
+        const float* rows[Distance::ROW_BLOCK];
+        float dists[Distance::ROW_BLOCK];
+        for (; i + Distance::ROW_BLOCK <= end; i += Distance::ROW_BLOCK) {
+            for (int r = 0; r < Distance::ROW_BLOCK; ++r)
+                rows[r] = float_block + (size_t)candidates[i + r] * dimension;
+            float bound = ((int)pq.size() >= N) ? pq.top().first : std::numeric_limits<float>::max();
+            rows4_fn(query, rows, dimension, bound, dists);
+            for (int r = 0; r < Distance::ROW_BLOCK; ++r) pq.offer({ dists[r], candidates[i + r] }, N);
+        }
+        for (; i < end; ++i) {
+            const float* vec_ptr = float_block + (size_t)candidates[i] * dimension;
+            float dist;
+            if (bounded_fn && (int)pq.size() >= N)
+                dist = bounded_fn(vec_ptr, query, dimension, pq.top().first);
+            else
+                dist = dist_fn(vec_ptr, query, dimension);
+            pq.offer({ dist, candidates[i] }, N);
+        }
+    }
+
+    // One contiguous chunk of candidates per thread (a multiple of
+    // ROW_BLOCK), each into its own heap in the caller's partials; the heaps
+    // are merged into pq at the end.
+    void RedBoxVector::parallel_scan(const std::vector<int>& candidates,
+                                     const float* query, int N, TopN& pq) const {
+        std::shared_ptr<Parallel::ThreadPool> workers = worker_pool();
+
+        size_t n      = candidates.size();
+        size_t chunk  = (n + num_threads - 1) / num_threads;
+        chunk        += (Distance::ROW_BLOCK - chunk % Distance::ROW_BLOCK) % Distance::ROW_BLOCK;
+        size_t tasks  = (n + chunk - 1) / chunk;
+
+        std::vector<std::vector<TopN::Entry>>& partial = query_context().partials;
+        if (partial.size() < tasks) partial.resize(tasks);
+        workers->run(tasks, [&](size_t t) {
+            size_t begin = t * chunk;
+            TopN part(partial[t]);
+            scan_float_range(candidates, begin, std::min(n, begin + chunk), query, N, part);
+        });
+
+        for (size_t t = 0; t < tasks; ++t)
+            for (const auto& e : partial[t]) pq.offer(e, N);
+    }
+
+    // -----------------------------------------------------------------------
+    namespace {
+        // SQ8 counterpart of HnswManager::FloatSlotDist.
+        struct Sq8SlotDist {
+            const Sq8::Query* q;
+            const uint8_t*    code_block;
+            size_t            dim;
+
+            float operator()(uint32_t slot) const {
+                return q->distance(code_block + (size_t)slot * dim);
+            }
+            void prefetch(uint32_t slot) const {
+                HNSW_PREFETCH(code_block + (size_t)slot * dim);
+            }
+        };
+    }
+
+    bool RedBoxVector::sq8_ready() const {
+        return _manager->get_storage_mode() == StorageMode::SQ8 && _manager->is_codes_trained();
+    }
+
+    const std::vector<std::pair<float, int>>& RedBoxVector::sq8_scan(
+        const std::vector<int>& candidates, const float* query, int N) const
+    {
+        QueryContext& ctx = query_context();
+        TopN pq(ctx.top);
+        if (N <= 0) return ctx.top;
+        Sq8::Query& q = ctx.sq8;
+        q.prepare(query, _manager->get_sq8_min(), _manager->get_sq8_scale(), dimension, metric);
+        const uint8_t* codes = _manager->get_code_block();
+
+        int keep = rerank_exact ? N * SQ8_RERANK_FACTOR : N;
+        for (int slot : candidates)
+            pq.offer({ q.distance(codes + (size_t)slot * dimension), slot }, keep);
+
+        finish_shortlist(ctx.top, query, N);
+        return ctx.top;
+    }
+
+    const std::vector<std::pair<float, int>>& RedBoxVector::hnsw_sq8_search(const float* query, int N) const {
+        QueryContext& ctx = query_context();
+        std::vector<std::pair<float, int>>& out = ctx.top;
+        out.clear();
+        if (N <= 0) return out;
+        Sq8::Query& q = ctx.sq8;
+        q.prepare(query, _manager->get_sq8_min(), _manager->get_sq8_scale(), dimension, metric);
+
+        int keep = rerank_exact ? N * SQ8_RERANK_FACTOR : N;
+        ctx.hits.resize(keep);
+        size_t found = HnswManager::hnsw_search_by(
+            Sq8SlotDist{ &q, _manager->get_code_block(), dimension }, hnsw_topn_ef(keep),
+            _manager->get_header(), hnsw_edges(),
+            deleted_flags.data(), ctx.graph, ctx.hits);
+
+        out.resize(found);
+        for (size_t i = 0; i < found; ++i)
+            out[i] = { ctx.hits[i].first, static_cast<int>(ctx.hits[i].second) };
+        finish_shortlist(out, query, N);
+        return out;
+    }
+
+    // -----------------------------------------------------------------------
+    bool RedBoxVector::bq_ready() const {
+        return _manager->get_storage_mode() == StorageMode::BINARY && _manager->is_codes_trained();
+    }
+
+    // Hamming distances are at most dim, so they are exact as floats.
+    const std::vector<std::pair<float, int>>& RedBoxVector::bq_scan(
+        const std::vector<int>& candidates, const float* query, int N) const
+    {
+        QueryContext& ctx = query_context();
+        TopN pq(ctx.top);
+        if (N <= 0) return ctx.top;
+        size_t nw = Bq::words(dimension);
+        std::vector<uint64_t>& qcode = ctx.bq_code;
+        qcode.resize(nw);
+        Bq::encode(query, _manager->get_bq_mean(), dimension, qcode.data());
+        const uint64_t* codes = _manager->get_bq_block();
+        Bq::HammingFn hamming = Bq::hamming();
+
+        int keep = rerank_exact ? N * std::max<int>(bq_oversample, 1) : N;
+        for (int slot : candidates)
+            pq.offer({ (float)hamming(qcode.data(), codes + (size_t)slot * nw, nw), slot }, keep);
+
+        finish_shortlist(ctx.top, query, N);
+        return ctx.top;
+    }
+
+    // -----------------------------------------------------------------------
+    bool RedBoxVector::pq_ready() const {
+        return _manager->get_index_type() == IndexType::IVF_PQ && _manager->is_pq_trained();
+    }
+
+    // Trains the codebook on the residuals of the first n slots (already
+    // assigned by k-means), then encodes every slot and builds the blocks.
+    void RedBoxVector::pq_train(size_t n) {
+        pq_train_codebook(_manager->get_float_ptr(0), _manager->get_cluster_block(),
+                          _manager->get_centroid_block(), n, _manager->get_pq_codebook());
+        pq_encode_all(n);
+    }
+
+    // Codebook from the residuals of n vectors against their assigned
+    // centroids; touches no engine state, so it can run off the lock.
+    void RedBoxVector::pq_train_codebook(const float* data, const uint16_t* assign,
+                                         const float* centroids, size_t n, float* codebook) const {
+        std::vector<float> residuals(n * dimension);
+        for (size_t i = 0; i < n; ++i) {
+            const float* v = data + i * dimension;
+            const float* c = centroids + (size_t)assign[i] * dimension;
+            for (size_t d = 0; d < dimension; ++d)
+                residuals[i * dimension + d] = v[d] - c[d];
+        }
+        PqManager::train(residuals.data(), n, dimension, _manager->get_pq_m(), codebook);
+    }
+
+    void RedBoxVector::pq_encode_all(size_t n) {
+        _manager->set_pq_trained();
+        int count = static_cast<int>(_manager->get_count());
+        for (int i = 0; i < count; ++i)
+            pq_encode_slot(i, _manager->get_cluster(i));
+        pq_rebuild_blocks();
+        Log::info("PQ trained: m=" + std::to_string((int)_manager->get_pq_m())
+                  + " on " + std::to_string(n) + " residuals");
+    }
+
+    void RedBoxVector::pq_encode_slot(int slot, uint16_t c) {
+        const float* v        = _manager->get_float_ptr(slot);
+        const float* centroid = _manager->get_centroid_block() + (size_t)c * dimension;
+        std::vector<float> residual(dimension);
+        for (size_t d = 0; d < dimension; ++d) residual[d] = v[d] - centroid[d];
+        PqManager::encode(residual.data(), _manager->get_pq_codebook(), dimension,
+                          _manager->get_pq_m(), _manager->get_pq_code_mut(slot));
+    }
+
+    // Packs the last member of cluster c into its block array.
+    void RedBoxVector::pq_append(uint16_t c) {
+        const auto& members = cluster_index[c];
+        PqManager::pack(pq_blocks[c], members.size() - 1,
+                        _manager->get_pq_code(members.back()), _manager->get_pq_m());
+    }
+
+    void RedBoxVector::pq_rebuild_blocks() {
+        size_t m = _manager->get_pq_m();
+        pq_blocks.assign(cluster_index.size(), {});
+        for (size_t c = 0; c < cluster_index.size(); ++c) {
+            const auto& members = cluster_index[c];
+            for (size_t p = 0; p < members.size(); ++p)
+                PqManager::pack(pq_blocks[c], p, _manager->get_pq_code(members[p]), m);
+        }
+    }
+
+    const std::vector<std::pair<float, int>>& RedBoxVector::pq_search(const float* query, int N) const {
+        QueryContext& ctx = query_context();
+        TopN pq(ctx.top);
+        if (N <= 0) return ctx.top;
+        const float* centroid_block = _manager->get_centroid_block();
+        std::vector<uint16_t>& probes = ctx.probes;
+        select_probes(query, _manager->get_num_probes(), probes);
+
+        size_t m  = _manager->get_pq_m();
+        size_t bb = PqManager::block_bytes(m);
+        PqManager::ScanFn scan = PqManager::scan_block();
+        PqManager::Lut& lut = ctx.lut;
+        alignas(32) uint16_t sums[PqManager::BLOCK];
+
+        int keep = rerank_exact ? N * PQ_RERANK_FACTOR : N;
+        for (uint16_t c : probes) {
+            const auto& members = cluster_index[c];
+            if (members.empty()) continue;
+            lut.build(query, centroid_block + (size_t)c * dimension, _manager->get_pq_codebook(),
+                      dimension, m, metric == Metric::L2);
+
+            const uint8_t* blocks = pq_blocks[c].data();
+            for (size_t base = 0; base < members.size(); base += PqManager::BLOCK) {
+                scan(blocks + (base / PqManager::BLOCK) * bb, lut.q.data(), m, sums);
+                size_t lanes = std::min<size_t>(PqManager::BLOCK, members.size() - base);
+                for (size_t l = 0; l < lanes; ++l) {
+                    int slot = members[base + l];
+                    if (deleted_flags[slot]) continue;
+                    pq.offer({ lut.bias + lut.scale * (float)sums[l], slot }, keep);
                 }
-                for (int slot : cluster_index[best_c])
-                    if (!deleted_flags[slot]) candidates.push_back(slot);
+            }
+        }
+
+        finish_shortlist(ctx.top, query, N);
+        return ctx.top;
+    }
+
+    // -----------------------------------------------------------------------
+    RedBoxVector::TrainedClusters RedBoxVector::train_clusters(
+        const float* data, size_t n, const ClusterManager::TrainParams& params) const
+    {
+        uint16_t k = _manager->is_auto_clusters()
+                   ? ClusterManager::auto_k(n, _manager->get_cluster_capacity())
+                   : _manager->get_num_clusters();
+        TrainedClusters t;
+        t.n = n;
+        t.centroids.resize((size_t)k * dimension);
+        t.counts.resize(k);
+        t.assign.resize(n);
+        auto workers = worker_pool();
+        ClusterManager::kmeans_train(t.centroids.data(), t.counts.data(), t.assign.data(), data,
+                                     k, n, dimension, dist_fn, params, workers.get());
+        if (metric == Metric::Cosine) {
+            // Spherical k-means: keep centroids on the unit sphere
+            // so probe ranking by inner product isn't norm-biased.
+            for (uint16_t c = 0; c < k; ++c)
+                Distance::normalize(t.centroids.data() + (size_t)c * dimension, dimension);
+        }
+        // PQ codebooks come from the same sample k-means saw.
+        if (_manager->get_index_type() == IndexType::IVF_PQ && !_manager->is_pq_trained()) {
+            t.pq_codebook.resize((size_t)PqManager::KSUB * dimension);
+            pq_train_codebook(data, t.assign.data(), t.centroids.data(), n, t.pq_codebook.data());
+        }
+        return t;
+    }
+
+    // Called under the write lock with maintenance_running clear. job takes
+    // the write lock itself and clears maintenance_running under it. A
+    // previous job cleared it before releasing the lock, so joining that
+    // thread here never waits on us.
+    void RedBoxVector::launch_maintenance(std::function<void()> job) {
+        maintenance_running = true;
+        std::lock_guard<std::mutex> g(maintenance_mutex);
+        if (maintenance_thread.joinable()) maintenance_thread.join();
+        maintenance_thread = std::thread(std::move(job));
+    }
+
+    // The thread trains on a private copy, so the lock is only retaken to
+    // install.
+    void RedBoxVector::start_background_kmeans(size_t n) {
+        std::vector<float> snapshot(_manager->get_float_ptr(0),
+                                    _manager->get_float_ptr(0) + n * dimension);
+        ClusterManager::TrainParams params = kmeans_params;
+        launch_maintenance([this, n, params, snapshot = std::move(snapshot)] {
+            TrainedClusters t = train_clusters(snapshot.data(), n, params);
+            std::unique_lock<std::shared_mutex> lk(rw_mutex);
+            install_clusters(t, snapshot.data());
+            maintenance_running = false;
+        });
+        Log::info("K-Means training started in background on " + std::to_string(n) + " vectors");
+    }
+
+    // data is what t was trained on: the live float block, or the
+    // background snapshot, in which case slots rewritten since (update,
+    // reinsert) are reassigned along with slots appended since.
+    void RedBoxVector::install_clusters(const TrainedClusters& t, const float* data) {
+        uint16_t k  = static_cast<uint16_t>(t.counts.size());
+        _manager->set_num_clusters(k);
+        bool frozen = (_manager->get_index_type() == IndexType::IVF_PQ);
+        float* centroid_block = _manager->get_centroid_block();
+        std::copy(t.centroids.begin(), t.centroids.end(), centroid_block);
+        std::copy(t.counts.begin(), t.counts.end(), _manager->get_cluster_count_block());
+
+        // k-means counted every trained slot at its trained value. A slot
+        // deleted or rewritten since is taken back out of that cluster; a
+        // rewritten or appended live slot joins its nearest one. Frozen
+        // (IVF-PQ) centroids stay put, and only a rewrite moves a count.
+        uint64_t* counts = _manager->get_cluster_count_block();
+        auto leave = [&](uint16_t c, const float* v) {
+            if (frozen) {
+                if (counts[c] > 0) --counts[c];
+                return;
+            }
+            ClusterManager::remove_from_centroid(centroid_block, counts, c, v, dimension);
+            if (metric == Metric::Cosine)
+                Distance::normalize(centroid_block + (size_t)c * dimension, dimension);
+        };
+
+        int count = static_cast<int>(_manager->get_count());
+        bool snapshot = (data != _manager->get_float_ptr(0));
+        for (int i = 0; i < count; ++i) {
+            const float* v       = _manager->get_float_ptr(i);
+            const float* trained = data + (size_t)i * dimension;
+            bool was_trained     = (size_t)i < t.n;
+            if (was_trained && (!snapshot || std::memcmp(v, trained, dimension * sizeof(float)) == 0)) {
+                _manager->set_cluster(i, t.assign[i]);
+                if (deleted_flags[i]) leave(t.assign[i], trained);
+                continue;
+            }
+            if (was_trained) leave(t.assign[i], trained);
+            uint16_t c = ClusterManager::find_nearest_centroid(v, centroid_block, k, dimension, dist_fn);
+            _manager->set_cluster(i, c);
+            if (deleted_flags[i]) continue;
+            if (!frozen) {
+                ClusterManager::update_centroid(centroid_block, counts, c, v, dimension);
+                if (metric == Metric::Cosine)
+                    Distance::normalize(centroid_block + (size_t)c * dimension, dimension);
+            } else if (was_trained) {
+                ++counts[c];
+            }
+        }
+        _manager->set_cluster_initialized();
+
+        for (auto& v : cluster_index) v.clear();
+        for (int i = 0; i < count; ++i) {
+            if (!deleted_flags[i]) {
+                uint16_t ci = _manager->get_cluster(i);
+                if (ci < k) cluster_index[ci].push_back(i);
+            }
+        }
+
+        // SQ8 ranges come from the same sample k-means saw. The PQ blocks
+        // are packed from cluster_index, so it is filled first.
+        if (_manager->get_storage_mode() != StorageMode::F32 && !_manager->is_codes_trained())
+            _manager->train_codes(t.n);
+        if (!t.pq_codebook.empty()) {
+            std::copy(t.pq_codebook.begin(), t.pq_codebook.end(), _manager->get_pq_codebook());
+            pq_encode_all(t.n);
+        }
+
+        tile_rebuild();
+        radius_rebuild();
+        centroid_graph_rebuild();
+        Log::info("K-Means++ initialized with K=" + std::to_string((int)k)
+                  + " on " + std::to_string(t.n) + " vectors ("
+                  + std::to_string(count - (int)t.n) + " more assigned on install)");
+        // Every slot was in insertion order until now.
+        reorganize_locked();
+    }
+
+    // -----------------------------------------------------------------------
+    bool RedBoxVector::tiles_ready() const {
+        return tiled_scan && _manager->has_clusters() && !pq_ready() && !sq8_ready() && !bq_ready();
+    }
+
+    void RedBoxVector::tile_rebuild() {
+        tile_blocks.clear();
+        if (!tiles_ready()) return;
+        size_t width = Distance::kernels().tile_rows;
+        if (_manager->is_cluster_initialized()) {
+            tile_blocks.resize(cluster_index.size());
+            for (size_t c = 0; c < cluster_index.size(); ++c) {
+                const auto& members = cluster_index[c];
+                for (size_t p = 0; p < members.size(); ++p)
+                    Distance::tile_pack(tile_blocks[c], width, p,
+                                        _manager->get_float_ptr(members[p]), dimension);
+            }
+        } else {
+            tile_blocks.resize(1);
+            size_t count = _manager->get_count();
+            for (size_t slot = 0; slot < count; ++slot)
+                Distance::tile_pack(tile_blocks[0], width, slot,
+                                    _manager->get_float_ptr(static_cast<int>(slot)), dimension);
+        }
+    }
+
+    // (Re)writes slot's row wherever its cluster lists it; call after the
+    // slot is in cluster_index.
+    void RedBoxVector::tile_store(int slot) {
+        if (!tiles_ready()) return;
+        size_t width   = Distance::kernels().tile_rows;
+        const float* v = _manager->get_float_ptr(slot);
+        if (!_manager->is_cluster_initialized()) {
+            Distance::tile_pack(tile_blocks[0], width, (size_t)slot, v, dimension);
+            return;
+        }
+        uint16_t c = _manager->get_cluster(slot);
+        const auto& members = cluster_index[c];
+        for (size_t p = members.size(); p-- > 0; )
+            if (members[p] == slot) Distance::tile_pack(tile_blocks[c], width, p, v, dimension);
+    }
+
+    const std::vector<std::pair<float, int>>& RedBoxVector::tile_search(const float* query, int N) const {
+        QueryContext& ctx = query_context();
+        TopN pq(ctx.top);
+        if (N <= 0) return ctx.top;
+        bool initialized = _manager->is_cluster_initialized();
+        std::vector<uint16_t>& groups = ctx.probes;
+        if (initialized) {
+            select_probes(query, _manager->get_num_probes(), groups);
+        } else {
+            groups.assign(1, 0);
+        }
+
+        for (uint16_t g : groups) tile_scan_cluster(query, g, N, pq);
+        return pq.sorted();
+    }
+
+    // Top-N over tile group g (cluster g, or every slot before k-means) into pq.
+    void RedBoxVector::tile_scan_cluster(const float* query, uint16_t g, int N, TopN& pq) const {
+        bool initialized    = _manager->is_cluster_initialized();
+        const auto& kt      = Distance::kernels();
+        size_t width        = kt.tile_rows;
+        size_t tb           = width * dimension;
+        Distance::TileFn fn = kt.tile_for_metric(metric);
+        alignas(64) float dists[Distance::MAX_TILE_ROWS];
+
+        size_t n = initialized ? cluster_index[g].size() : _manager->get_count();
+        const float* tiles = tile_blocks[g].data();
+        for (size_t base = 0; base < n; base += width) {
+            fn(query, tiles + (base / width) * tb, dimension, dists);
+            size_t lanes = std::min(width, n - base);
+            for (size_t l = 0; l < lanes; ++l) {
+                int slot = initialized ? cluster_index[g][base + l] : static_cast<int>(base + l);
+                if (deleted_flags[slot]) continue;
+                // A reinsert into another cluster leaves a stale row behind.
+                if (initialized && _manager->get_cluster(slot) != g) continue;
+                pq.offer({ dists[l], slot }, N);
+            }
+        }
+    }
+
+    // -----------------------------------------------------------------------
+    void RedBoxVector::reorganize() {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        if (_manager->get_index_type() == IndexType::HNSW) hnsw_reorder_locked();
+        else                                               reorganize_locked();
+    }
+
+    bool RedBoxVector::needs_reorganize() const {
+        size_t count = _manager->get_count();
+        return count - organised_count > organised_count / REORG_TAIL_DIVISOR;
+    }
+
+    // Called under the write lock from insert(). With background_training
+    // the pass runs on the maintenance thread so the inserting caller
+    // doesn't wait for it; while another job holds that thread the tail
+    // just keeps growing until a later insert finds it free.
+    void RedBoxVector::schedule_reorganize() {
+        if (!needs_reorganize()) return;
+        if (!background_training) {
+            reorganize_locked();
+            return;
+        }
+        if (maintenance_running) return;
+        launch_maintenance([this] {
+            std::unique_lock<std::shared_mutex> lk(rw_mutex);
+            if (needs_reorganize()) reorganize_locked();
+            maintenance_running = false;
+        });
+    }
+
+    // New order: cluster 0's live slots, cluster 1's, ..., then every
+    // deleted slot (kept so a deleted id can still be reinserted in place).
+    // cluster_index is rebuilt from cluster_block, which also drops the
+    // stale entries reinserts leave in a slot's previous cluster.
+    void RedBoxVector::reorganize_locked() {
+        if (!_manager->has_clusters() || !_manager->is_cluster_initialized()) return;
+        size_t count = _manager->get_count();
+        uint16_t k   = _manager->get_num_clusters();
+
+        std::vector<std::vector<uint32_t>> by_cluster(k);
+        std::vector<uint32_t> parked;
+        for (size_t slot = 0; slot < count; ++slot) {
+            uint16_t c = _manager->get_cluster(static_cast<int>(slot));
+            if (deleted_flags[slot] || c >= k) parked.push_back((uint32_t)slot);
+            else                               by_cluster[c].push_back((uint32_t)slot);
+        }
+
+        std::vector<uint32_t> new_to_old;
+        new_to_old.reserve(count);
+        for (const auto& members : by_cluster)
+            new_to_old.insert(new_to_old.end(), members.begin(), members.end());
+        size_t live = new_to_old.size();
+        new_to_old.insert(new_to_old.end(), parked.begin(), parked.end());
+
+        _manager->permute_slots(new_to_old);
+
+        std::vector<uint8_t> flags(count);
+        std::vector<float>   norms(count);
+        for (size_t i = 0; i < count; ++i) {
+            flags[i] = deleted_flags[new_to_old[i]];
+            norms[i] = row_norms[new_to_old[i]];
+        }
+        deleted_flags.swap(flags);
+        row_norms.swap(norms);
+
+        int pos = 0;
+        for (uint16_t c = 0; c < k; ++c) {
+            cluster_index[c].resize(by_cluster[c].size());
+            std::iota(cluster_index[c].begin(), cluster_index[c].end(), pos);
+            pos += static_cast<int>(by_cluster[c].size());
+        }
+        for (size_t i = 0; i < live; ++i)
+            id_to_index[_manager->get_id(static_cast<int>(i))] = i;
+        if (pq_ready()) pq_rebuild_blocks();
+        tile_rebuild();
+        radius_rebuild();
+
+        organised_count = count;
+        Log::info("Reorganized " + std::to_string(live) + " vectors into "
+                  + std::to_string((int)k) + " contiguous clusters");
+    }
+
+    // New order: breadth-first over the graph (HnswManager::bfs_order).
+    // permute_slots carries each slot's level, level-0 list and upper index
+    // along; the edges are then rewritten to the new numbers.
+    void RedBoxVector::hnsw_reorder_locked() {
+        CoreEngine::SpecificMetadata* header = _manager->get_header();
+        size_t count = _manager->get_count();
+        if (count < 2 || !header->is_initialized) return;
+
+        // Pending links name their slot by number: finish them first. A
+        // hnsw_link_pending still waiting for the read lock then finds
+        // nothing to do.
+        std::vector<uint32_t> pending;
+        {
+            std::lock_guard<std::mutex> g(hnsw_unlinked_mtx);
+            pending.assign(hnsw_unlinked.begin(), hnsw_unlinked.end());
+            hnsw_unlinked.clear();
+        }
+        std::sort(pending.begin(), pending.end());
+        for (uint32_t slot : pending)
+            HnswManager::hnsw_link(
+                slot, _manager->get_float_ptr(slot), _manager->get_hnsw_level_block()[slot], header,
+                _manager->get_float_ptr(0), hnsw_edges(), dimension, dist_fn, deleted_flags.data(),
+                hnsw_insert_ctx, hnsw_insert_nb_cands, rows4_fn);
+
+        std::vector<uint32_t> new_to_old = HnswManager::bfs_order(hnsw_edges(), header, count, deleted_flags.data());
+        _manager->permute_slots(new_to_old);
+
+        std::vector<uint32_t> old_to_new(count);
+        for (size_t i = 0; i < count; ++i) old_to_new[new_to_old[i]] = static_cast<uint32_t>(i);
+        HnswManager::remap_edges(hnsw_edges(), header, count, old_to_new);
+
+        std::vector<uint8_t> flags(count);
+        for (size_t i = 0; i < count; ++i) flags[i] = deleted_flags[new_to_old[i]];
+        deleted_flags.swap(flags);
+        for (size_t i = 0; i < count; ++i)
+            if (!deleted_flags[i]) id_to_index[_manager->get_id(static_cast<int>(i))] = i;
+
+        Log::info("Reordered " + std::to_string(count) + " HNSW slots breadth-first from the entry point");
+    }
+
+    // -----------------------------------------------------------------------
+    bool RedBoxVector::centroid_graph_ready() const {
+        return use_centroid_graph && !centroid_graph.empty()
+            && centroid_graph.nodes() == _manager->get_num_clusters();
+    }
+
+    void RedBoxVector::centroid_graph_rebuild() {
+        centroid_graph.clear();
+        uint16_t k = _manager->get_num_clusters();
+        if (!use_centroid_graph || !_manager->is_cluster_initialized() || k < CENTROID_GRAPH_MIN_K) return;
+        centroid_graph.build(_manager->get_centroid_block(), k, dimension, dist_fn, rows4_fn);
+        Log::info("Centroid graph built over K=" + std::to_string((int)k));
+    }
+
+    uint16_t RedBoxVector::nearest_centroid(const float* v) const {
+        if (centroid_graph_ready())
+            return centroid_graph.nearest(v, _manager->get_centroid_block(), dimension, dist_fn, centroid_ef);
+        return ClusterManager::find_nearest_centroid(v, _manager->get_centroid_block(),
+                                                     _manager->get_num_clusters(), dimension, dist_fn);
+    }
+
+    void RedBoxVector::select_probes(const float* query, int probes, std::vector<uint16_t>& out) const {
+        uint16_t k = _manager->get_num_clusters();
+        probes     = std::clamp<int>(probes, 1, std::max<uint16_t>(k, 1));
+        out.clear();
+        if (probes == 1) {
+            out.push_back(nearest_centroid(query));
+            return;
+        }
+        const float* centroid_block = _manager->get_centroid_block();
+        if (centroid_graph_ready()) {
+            centroid_graph.nearest_n(query, probes, centroid_block, dimension, dist_fn,
+                                     std::max(centroid_ef, 2 * probes), out);
+            return;
+        }
+        std::vector<std::pair<float, uint16_t>>& centroid_dists = query_context().centroid_dists;
+        centroid_dists.resize(k);
+        for (uint16_t c = 0; c < k; ++c)
+            centroid_dists[c] = { dist_fn(query, centroid_block + (size_t)c * dimension, dimension), c };
+        std::partial_sort(centroid_dists.begin(), centroid_dists.begin() + probes, centroid_dists.end());
+        for (int p = 0; p < probes; ++p) out.push_back(centroid_dists[p].second);
+    }
+
+    // -----------------------------------------------------------------------
+    // Adaptive probing.
+
+    void RedBoxVector::radius_rebuild() {
+        cluster_radius.assign(cluster_index.size(), 0.0f);
+        if (!_manager->has_clusters() || !_manager->is_cluster_initialized()) return;
+        uint16_t k = _manager->get_num_clusters();
+        for (uint16_t c = 0; c < k; ++c)
+            for (int slot : cluster_index[c])
+                if (!deleted_flags[slot] && _manager->get_cluster(slot) == c)
+                    radius_cover(c, _manager->get_float_ptr(slot));
+    }
+
+    void RedBoxVector::radius_cover(uint16_t c, const float* v) {
+        if (c >= cluster_radius.size()) cluster_radius.resize(cluster_index.size(), 0.0f);
+        const float* centroid = _manager->get_centroid_block() + (size_t)c * dimension;
+        float r = std::sqrt(Distance::kernels().l2(v, centroid, dimension));
+        cluster_radius[c] = std::max(cluster_radius[c], r);
+    }
+
+    // Members other than v are at most |c_new - c_old| further from the
+    // moved centroid than they were from the old one.
+    void RedBoxVector::centroid_add(uint16_t c, const float* v) {
+        float* centroid = _manager->get_centroid_block() + (size_t)c * dimension;
+        centroid_before.assign(centroid, centroid + dimension);
+        ClusterManager::update_centroid(_manager->get_centroid_block(),
+                                        _manager->get_cluster_count_block(), c, v, dimension);
+        if (metric == Metric::Cosine) Distance::normalize(centroid, dimension);
+        if (c >= cluster_radius.size()) cluster_radius.resize(cluster_index.size(), 0.0f);
+        cluster_radius[c] += std::sqrt(Distance::kernels().l2(centroid_before.data(), centroid, dimension));
+        radius_cover(c, v);
+    }
+
+    void RedBoxVector::centroid_remove(uint16_t c, const float* v) {
+        float* centroid = _manager->get_centroid_block() + (size_t)c * dimension;
+        centroid_before.assign(centroid, centroid + dimension);
+        ClusterManager::remove_from_centroid(_manager->get_centroid_block(),
+                                             _manager->get_cluster_count_block(), c, v, dimension);
+        if (metric == Metric::Cosine) Distance::normalize(centroid, dimension);
+        if (c >= cluster_radius.size()) cluster_radius.resize(cluster_index.size(), 0.0f);
+        cluster_radius[c] += std::sqrt(Distance::kernels().l2(centroid_before.data(), centroid, dimension));
+    }
+
+    bool RedBoxVector::adaptive_ready() const {
+        return probe_params.adaptive && _manager->has_clusters() && _manager->is_cluster_initialized()
+            && !pq_ready() && !sq8_ready() && !bq_ready();
+    }
+
+    // Candidate clusters in centroid order; each is skipped when its lower
+    // bound can't beat the current N-th best, and the loop ends when no
+    // remaining cluster's bound can (suffix minimum) or at the ratio cut.
+    void RedBoxVector::adaptive_search(const float* query, int N, TopN& pq) const {
+        const auto& pp = probe_params;
+        QueryContext& ctx = query_context();
+        std::vector<uint16_t>& order = ctx.probes;
+        select_probes(query, std::max(pp.min_probes, pp.max_probes), order);
+
+        const float* centroids = _manager->get_centroid_block();
+        bool is_l2  = (metric == Metric::L2);
+        float qnorm = is_l2 ? 0.0f : std::sqrt(Distance::dot_scalar(query, query, dimension));
+        size_t P = order.size();
+        std::vector<float>& cdist = ctx.probe_dists;
+        std::vector<float>& bound = ctx.probe_bounds;
+        std::vector<float>& rest  = ctx.probe_rest;
+        cdist.resize(P);
+        bound.resize(P);
+        rest.resize(P + 1);
+        for (size_t i = 0; i < P; ++i) {
+            cdist[i] = dist_fn(query, centroids + (size_t)order[i] * dimension, dimension);
+            bound[i] = ClusterManager::probe_lower_bound(cdist[i], cluster_radius[order[i]], qnorm, is_l2);
+        }
+        rest[P] = std::numeric_limits<float>::max();
+        for (size_t i = P; i-- > 0; ) rest[i] = std::min(bound[i], rest[i + 1]);
+
+        bool use_tiles = tiles_ready();
+        std::vector<int>& rows = ctx.slots;
+        uint64_t scanned = 0;
+        for (size_t i = 0; i < P; ++i) {
+            if (i >= pp.min_probes) {
+                bool full = (int)pq.size() >= N;
+                if (full && rest[i] >= pq.top().first) break;
+                if (pp.ratio > 0.0f && metric != Metric::InnerProduct && cdist[i] > pp.ratio * cdist[0]) break;
+                if (full && bound[i] >= pq.top().first) continue;
+            }
+            uint16_t c = order[i];
+            if (use_tiles) {
+                tile_scan_cluster(query, c, N, pq);
             } else {
-                centroid_dists.resize(k);
-                for (uint16_t c = 0; c < k; ++c) {
-                    float d = Distance::l2(query.data(), centroid_block + (size_t)c * dimension,
-                                           dimension, use_avx2);
-                    centroid_dists[c] = { d, c };
+                rows.clear();
+                for (int slot : cluster_index[c])
+                    if (!deleted_flags[slot] && _manager->get_cluster(slot) == c) rows.push_back(slot);
+                scan_float_range(rows, 0, rows.size(), query, N, pq);
+            }
+            ++scanned;
+        }
+        adaptive_queries.fetch_add(1, std::memory_order_relaxed);
+        adaptive_probes.fetch_add(scanned, std::memory_order_relaxed);
+    }
+
+    // -----------------------------------------------------------------------
+    // Online rebalancing.
+    //
+    // After k-means, centroids only move by running means: removes never
+    // take a vector back out, so over time sizes skew and centroids drift
+    // off their members. A pass re-centres, splits and merges, then
+    // re-groups the file; everything in memory is rebuilt from
+    // cluster_block by reorganize_locked.
+    // -----------------------------------------------------------------------
+    size_t RedBoxVector::rebalance() {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        return rebalance_locked();
+    }
+
+    void RedBoxVector::note_cluster_write(uint16_t c) {
+        ++writes_since_rebalance;
+        if (!rebalance_params.automatic || maintenance_running) return;
+        uint16_t k   = _manager->get_num_clusters();
+        uint16_t cap = _manager->get_cluster_capacity();
+        double mean  = (double)_manager->get_count() / std::max<uint16_t>(k, 1);
+        bool due = rebalance_params.interval && writes_since_rebalance >= rebalance_params.interval;
+        if (writes_since_rebalance >= REBALANCE_MIN_WRITES) {
+            // Growth comes in steps of 1/8 so a pass isn't run per insert.
+            if (k < cap && (double)cluster_index[c].size() > rebalance_params.split_ratio * mean)
+                due = true;
+            if (_manager->is_auto_clusters()
+                && ClusterManager::auto_k(_manager->get_count(), cap) > k + k / 8)
+                due = true;
+        }
+        if (!due) return;
+        if (background_training) {
+            launch_maintenance([this] {
+                std::unique_lock<std::shared_mutex> lk(rw_mutex);
+                rebalance_locked();
+                maintenance_running = false;
+            });
+        } else {
+            rebalance_locked();
+        }
+    }
+
+    void RedBoxVector::detach_from_cluster(int slot, uint16_t c) {
+        auto& members = cluster_index[c];
+        auto pos = std::find(members.begin(), members.end(), slot);
+        if (pos == members.end()) return;
+        size_t p = (size_t)(pos - members.begin());
+        *pos = members.back();
+        members.pop_back();
+        if (p == members.size()) return;
+        if (pq_ready())
+            PqManager::pack(pq_blocks[c], p, _manager->get_pq_code(members[p]), _manager->get_pq_m());
+        if (tiles_ready())
+            Distance::tile_pack(tile_blocks[c], Distance::kernels().tile_rows, p,
+                                _manager->get_float_ptr(members[p]), dimension);
+    }
+
+    size_t RedBoxVector::rebalance_locked() {
+        writes_since_rebalance = 0;
+        if (!_manager->has_clusters() || !_manager->is_cluster_initialized()) return 0;
+        const auto& params = rebalance_params;
+        uint16_t k     = _manager->get_num_clusters();
+        uint16_t cap   = _manager->get_cluster_capacity();
+        size_t   count = _manager->get_count();
+        bool frozen    = (_manager->get_index_type() == IndexType::IVF_PQ);
+        float*    centroids = _manager->get_centroid_block();
+        uint64_t* counts    = _manager->get_cluster_count_block();
+        const float* data   = _manager->get_float_ptr(0);
+        auto centroid = [&](uint16_t c) { return centroids + (size_t)c * dimension; };
+
+        // Live members per cluster, from cluster_block (cluster_index may
+        // hold stale entries left by reinserts).
+        std::vector<std::vector<uint32_t>> members(cap);
+        size_t live = 0;
+        for (size_t slot = 0; slot < count; ++slot) {
+            uint16_t c = _manager->get_cluster(static_cast<int>(slot));
+            if (deleted_flags[slot] || c >= k) continue;
+            members[c].push_back((uint32_t)slot);
+            ++live;
+        }
+        if (live == 0) return 0;
+
+        // Slots whose centroid changed under them need new PQ codes.
+        std::vector<uint8_t> recode(count, 0);
+        auto move_to = [&](uint32_t slot, uint16_t c) {
+            _manager->set_cluster(static_cast<int>(slot), c);
+            members[c].push_back(slot);
+            recode[slot] = 1;
+        };
+        size_t recentred = 0, splits = 0, merges = 0;
+
+        // 1. Re-centre on the exact live mean. A centroid that moved more
+        //    than drift_ratio x its members' mean distance gets its members
+        //    reassigned: some are now nearer a neighbour.
+        if (!frozen) {
+            const auto l2 = Distance::kernels().l2;
+            std::vector<uint8_t> drifted(k, 0);
+            auto workers = worker_pool();
+            Parallel::parallel_for(workers.get(), k, Parallel::split_count(workers.get(), k, 1),
+                                   [&](size_t begin, size_t end, size_t) {
+                std::vector<double> sum(dimension);
+                std::vector<float>  mean(dimension);
+                for (size_t c = begin; c < end; ++c) {
+                    const auto& rows = members[c];
+                    if (rows.empty()) continue;
+                    std::fill(sum.begin(), sum.end(), 0.0);
+                    for (uint32_t slot : rows) {
+                        const float* v = data + (size_t)slot * dimension;
+                        for (size_t d = 0; d < dimension; ++d) sum[d] += v[d];
+                    }
+                    for (size_t d = 0; d < dimension; ++d) mean[d] = (float)(sum[d] / (double)rows.size());
+                    if (metric == Metric::Cosine) Distance::normalize(mean.data(), dimension);
+                    double spread = 0.0;
+                    for (uint32_t slot : rows) spread += l2(data + (size_t)slot * dimension, mean.data(), dimension);
+                    spread /= (double)rows.size();
+                    float* cen = centroid(static_cast<uint16_t>(c));
+                    drifted[c] = l2(cen, mean.data(), dimension) > params.drift_ratio * spread;
+                    std::copy(mean.begin(), mean.end(), cen);
                 }
-                std::partial_sort(centroid_dists.begin(),
-                                  centroid_dists.begin() + num_probes,
-                                  centroid_dists.end());
-
-                size_t reserve_size = 0;
-                for (int p = 0; p < num_probes; ++p)
-                    reserve_size += cluster_index[centroid_dists[p].second].size();
-                candidates.reserve(reserve_size);
-
-                for (int p = 0; p < num_probes; ++p) {
-                    uint16_t c = centroid_dists[p].second;
-                    for (int slot : cluster_index[c])
-                        if (!deleted_flags[slot]) candidates.push_back(slot);
+            });
+            for (uint16_t c = 0; c < k; ++c) {
+                if (!drifted[c]) continue;
+                ++recentred;
+                std::vector<uint32_t> stay;
+                for (uint32_t slot : members[c]) {
+                    uint16_t nc = ClusterManager::find_nearest_centroid(
+                        data + (size_t)slot * dimension, centroids, k, dimension, dist_fn);
+                    if (nc == c) stay.push_back(slot);
+                    else         move_to(slot, nc);
                 }
+                members[c].swap(stay);
             }
-        } else {
-            candidates.reserve(count);
-            for (int i = 0; i < count; ++i)
-                if (!deleted_flags[i]) candidates.push_back(i);
         }
 
-        if (candidates.empty()) return {};
+        // Folds cluster `small` into its members' nearest other centroids
+        // and renumbers the last cluster into the freed id.
+        std::vector<uint8_t> unsplittable(cap, 0);
+        auto merge_away = [&](uint16_t small) {
+            for (uint32_t slot : members[small]) {
+                const float* v = data + (size_t)slot * dimension;
+                float    best   = std::numeric_limits<float>::max();
+                uint16_t best_c = small;
+                for (uint16_t c = 0; c < k; ++c) {
+                    if (c == small) continue;
+                    float dd = dist_fn(v, centroid(c), dimension);
+                    if (dd < best) { best = dd; best_c = c; }
+                }
+                move_to(slot, best_c);
+            }
+            members[small].clear();
+            uint16_t last = k - 1;
+            if (small != last) {
+                std::copy(centroid(last), centroid(last) + dimension, centroid(small));
+                members[small].swap(members[last]);
+                unsplittable[small] = unsplittable[last];
+                for (uint32_t slot : members[small]) _manager->set_cluster(static_cast<int>(slot), small);
+            }
+            unsplittable[last] = 0;
+            --k;
+            ++merges;
+        };
+        auto smallest = [&](uint16_t except) {
+            uint16_t small = k;
+            for (uint16_t c = 0; c < k; ++c)
+                if (c != except && (small == k || members[c].size() < members[small].size())) small = c;
+            return small;
+        };
+
+        // 2. Merge clusters under merge_ratio x the mean size.
+        while (k > 1) {
+            uint16_t small = smallest(k);
+            if ((double)members[small].size() >= params.merge_ratio * (double)live / k) break;
+            merge_away(small);
+        }
+
+        // 3. Split the largest cluster while it is over split_ratio x the
+        //    mean, or K is short of the auto-K target. At capacity the
+        //    smallest cluster is merged away first if it is under a quarter
+        //    of the one being split. A split that leaves a side small enough
+        //    to be merged right back is not taken.
+        uint16_t target = _manager->is_auto_clusters() ? ClusterManager::auto_k(live, cap) : k;
+        std::vector<float>    halves(2 * dimension);
+        std::vector<uint16_t> side;
+        while (splits < cap) {
+            uint16_t big = k;
+            for (uint16_t c = 0; c < k; ++c)
+                if (!unsplittable[c] && (big == k || members[c].size() > members[big].size())) big = c;
+            if (big == k) break;
+            size_t m = members[big].size();
+            if (m < 2 || !(k < target || (double)m > params.split_ratio * (double)live / k)) break;
+            if (k == cap) {
+                uint16_t small = smallest(big);
+                if (k < 2 || small == k || members[small].size() * 4 > m) break;
+                bool big_is_last = (big == k - 1);
+                merge_away(small);
+                if (big_is_last) big = small;
+                m = members[big].size();
+            }
+
+            side.resize(m);
+            ClusterManager::split_in_two(data, members[big].data(), m, dimension, centroid(big),
+                                         halves.data(), side.data(), dist_fn);
+            size_t ones = (size_t)std::count(side.begin(), side.end(), (uint16_t)1);
+            double floor_size = params.merge_ratio * (double)live / (k + 1);
+            if ((double)std::min(ones, m - ones) <= floor_size) { unsplittable[big] = 1; continue; }
+
+            std::vector<uint32_t> stay;
+            for (size_t j = 0; j < m; ++j) {
+                uint32_t slot = members[big][j];
+                if (side[j]) move_to(slot, k);
+                else       { stay.push_back(slot); recode[slot] = 1; }
+            }
+            members[big].swap(stay);
+            std::copy(halves.begin(), halves.begin() + dimension, centroid(big));
+            std::copy(halves.begin() + dimension, halves.end(), centroid(k));
+            if (metric == Metric::Cosine) {
+                Distance::normalize(centroid(big), dimension);
+                Distance::normalize(centroid(k), dimension);
+            }
+            ++k;
+            ++splits;
+        }
 
-        PQ pq;
-        for (int slot : candidates) {
-            const float* vec_ptr = float_block_snap + (size_t)slot * dimension;
-            float dist = Distance::l2(vec_ptr, query.data(), dimension, use_avx2);
-            if ((int)pq.size() < N)                    pq.push({ dist, slot });
+        if (recentred + splits + merges == 0) {
+            if (!frozen) {
+                for (uint16_t c = 0; c < k; ++c) counts[c] = members[c].size();
+                radius_rebuild();
+            }
+            return 0;
+        }
+        _manager->set_num_clusters(k);
+        for (uint16_t c = 0; c < cap; ++c) counts[c] = (c < k) ? members[c].size() : 0;
+        if (pq_ready())
+            for (size_t slot = 0; slot < count; ++slot)
+                if (recode[slot] && !deleted_flags[slot])
+                    pq_encode_slot(static_cast<int>(slot), _manager->get_cluster(static_cast<int>(slot)));
+        for (size_t c = k; c < cluster_index.size(); ++c) cluster_index[c].clear();
+        reorganize_locked();
+        centroid_graph_rebuild();
+
+        Log::info("Rebalanced IVF: " + std::to_string(recentred) + " re-centred, "
+                  + std::to_string(splits) + " split, " + std::to_string(merges)
+                  + " merged, K=" + std::to_string((int)k));
+        return recentred + splits + merges;
+    }
+
+    void RedBoxVector::set_row_norm(size_t slot) {
+        if (row_norms.size() <= slot) row_norms.resize(slot + 1, 0.0f);
+        const float* v = _manager->get_float_ptr(static_cast<int>(slot));
+        row_norms[slot] = Distance::kernels().dot(v, v, dimension);
+    }
+
+    // -----------------------------------------------------------------------
+    // Batched search.
+    //
+    // Queries are grouped by the clusters they probe, and each cluster is
+    // swept in tiles of rows small enough to stay in cache while every query
+    // of its group is scored against them: a blocked (group x dim) x
+    // (dim x tile) product on the dot_x4 micro-kernel. L2 comes from the
+    // dot product and the stored norms, ||q||^2 - 2 q.x + ||x||^2.
+    // -----------------------------------------------------------------------
+    std::vector<std::vector<int>> RedBoxVector::search_batch(const float* queries, size_t nq, int k) {
+        std::vector<std::vector<int>> result(nq);
+        if (nq == 0 || k <= 0) return result;
+
+        std::vector<float> qs(queries, queries + nq * dimension);
+        if (metric == Metric::Cosine)
+            for (size_t i = 0; i < nq; ++i) Distance::normalize(qs.data() + i * dimension, dimension);
+
+        std::shared_lock<std::shared_mutex> lk(rw_mutex);
+        bool float_scan = _manager->has_clusters() && !pq_ready() && !sq8_ready() && !bq_ready();
+        if (!float_scan) {
+            lk.unlock();
+            for (size_t i = 0; i < nq; ++i)
+                result[i] = search_N(std::vector<float>(queries + i * dimension,
+                                                        queries + (i + 1) * dimension), k);
+            return result;
+        }
+
+        int count = static_cast<int>(_manager->get_count());
+        if (count == 0) return result;
+
+        // Group queries by probed cluster (one group of all when still flat).
+        bool initialized = _manager->is_cluster_initialized();
+        uint16_t kc      = _manager->get_num_clusters();
+        std::vector<std::vector<uint32_t>> groups(initialized ? kc : 1);
+        if (initialized) {
+            std::vector<uint16_t> probes;
+            for (size_t qi = 0; qi < nq; ++qi) {
+                select_probes(qs.data() + qi * dimension, _manager->get_num_probes(), probes);
+                for (uint16_t c : probes) groups[c].push_back((uint32_t)qi);
+            }
+        } else {
+            groups[0].resize(nq);
+            std::iota(groups[0].begin(), groups[0].end(), 0u);
+        }
+
+        bool is_l2 = (metric == Metric::L2);
+        std::vector<float> qnorm(nq, 0.0f);
+        if (is_l2)
+            for (size_t qi = 0; qi < nq; ++qi)
+                qnorm[qi] = Distance::kernels().dot(qs.data() + qi * dimension, qs.data() + qi * dimension, dimension);
+
+        const float* float_block = _manager->get_float_ptr(0);
+        Distance::Rows4Fn dot4   = Distance::kernels().dot_x4;
+        Distance::DistanceFn dot = Distance::kernels().dot;
+        size_t tile = std::max<size_t>(Distance::ROW_BLOCK,
+                                       BATCH_TILE_BYTES / (dimension * sizeof(float)));
+        tile -= tile % Distance::ROW_BLOCK;
+
+        std::vector<std::priority_queue<std::pair<float, int>>> heaps(nq);
+        auto offer = [&](uint32_t qi, float d, int slot) {
+            float dist = is_l2 ? std::max(0.0f, qnorm[qi] - 2.0f * d + row_norms[slot]) : 1.0f - d;
+            auto& pq = heaps[qi];
+            if ((int)pq.size() < k)                  pq.push({ dist, slot });
             else if (dist < pq.top().first) { pq.pop(); pq.push({ dist, slot }); }
+        };
+
+        std::vector<int> members;
+        const float* rows[Distance::ROW_BLOCK];
+        float dots[Distance::ROW_BLOCK];
+        for (size_t g = 0; g < groups.size(); ++g) {
+            if (groups[g].empty()) continue;
+            members.clear();
+            if (initialized) {
+                for (int slot : cluster_index[g])
+                    if (!deleted_flags[slot]) members.push_back(slot);
+            } else {
+                for (int slot = 0; slot < count; ++slot)
+                    if (!deleted_flags[slot]) members.push_back(slot);
+            }
+
+            for (size_t r0 = 0; r0 < members.size(); r0 += tile) {
+                size_t r1 = std::min(members.size(), r0 + tile);
+                for (uint32_t qi : groups[g]) {
+                    const float* q = qs.data() + (size_t)qi * dimension;
+                    size_t r = r0;
+                    for (; r + Distance::ROW_BLOCK <= r1; r += Distance::ROW_BLOCK) {
+                        for (int j = 0; j < Distance::ROW_BLOCK; ++j)
+                            rows[j] = float_block + (size_t)members[r + j] * dimension;
+                        dot4(q, rows, dimension, std::numeric_limits<float>::max(), dots);
+                        for (int j = 0; j < Distance::ROW_BLOCK; ++j) offer(qi, dots[j], members[r + j]);
+                    }
+                    for (; r < r1; ++r)
+                        offer(qi, dot(q, float_block + (size_t)members[r] * dimension, dimension), members[r]);
+                }
+            }
         }
 
-        std::vector<int> result;
-        result.reserve(pq.size());
-        while (!pq.empty()) {
-            result.push_back(static_cast<int>(_manager->get_id(pq.top().second)));
-            pq.pop();
+        for (size_t qi = 0; qi < nq; ++qi) {
+            auto& pq = heaps[qi];
+            auto& ids = result[qi];
+            ids.reserve(pq.size());
+            while (!pq.empty()) {
+                ids.push_back(static_cast<int>(_manager->get_id(pq.top().second)));
+                pq.pop();
+            }
+            std::reverse(ids.begin(), ids.end());
         }
-        std::reverse(result.begin(), result.end());
         return result;
     }
 
+    // Exact distances for the shortlist (when reranking), then sort and cut to N.
+    void RedBoxVector::finish_shortlist(std::vector<std::pair<float, int>>& cands,
+                                  const float* query, int N) const {
+        if (rerank_exact) {
+            const float* float_block = _manager->get_float_ptr(0);
+            for (auto& c : cands)
+                c.first = dist_fn(float_block + (size_t)c.second * dimension, query, dimension);
+        }
+        size_t n = std::min(cands.size(), (size_t)N);
+        std::partial_sort(cands.begin(), cands.begin() + n, cands.end());
+        cands.resize(n);
+    }
+
     // -----------------------------------------------------------------------
     void RedBoxVector::load_tombstones() {
         std::ifstream f(tombstone_file, std::ios::binary);
@@ -484,7 +1898,10 @@ namespace CoreEngine {
         return static_cast<uint32_t>(dimension);
     }
 
-    bool RedBoxVector::update(uint64_t id, const std::vector<float>& vec) {
+    bool RedBoxVector::update(uint64_t id, const std::vector<float>& raw_vec) {
+        std::vector<float> normalized;
+        const std::vector<float>& vec = apply_metric(raw_vec, normalized);
+
         std::unique_lock<std::shared_mutex> lk(rw_mutex);
 
         if (deleted_ids.count(id)) return false;
@@ -492,19 +1909,149 @@ namespace CoreEngine {
         auto it = id_to_index.find(id);
         if (it == id_to_index.end()) return false;
 
-        float* dst = _manager->get_float_ptr_mut(static_cast<int>(it->second));
+        int slot   = static_cast<int>(it->second);
+        float* dst = _manager->get_float_ptr_mut(slot);
+
+        // A vector that moved closer to another centroid changes cluster;
+        // running means are moved with it. IVF-PQ centroids stay frozen,
+        // but the member counts still follow the vector.
+        if (_manager->has_clusters() && _manager->is_cluster_initialized()) {
+            uint16_t old_c = _manager->get_cluster(slot);
+            uint16_t c     = nearest_centroid(vec.data());
+            if (c != old_c) {
+                if (_manager->get_index_type() != IndexType::IVF_PQ) {
+                    centroid_remove(old_c, dst);
+                    centroid_add(c, vec.data());
+                } else {
+                    uint64_t* counts = _manager->get_cluster_count_block();
+                    if (counts[old_c] > 0) --counts[old_c];
+                    ++counts[c];
+                    radius_cover(c, vec.data());
+                }
+                std::memcpy(dst, vec.data(), dimension * sizeof(float));
+                _manager->encode_slot(slot);
+                set_row_norm(slot);
+                detach_from_cluster(slot, old_c);
+                _manager->set_cluster(slot, c);
+                cluster_index[c].push_back(slot);
+                if (pq_ready()) {
+                    pq_encode_slot(slot, c);
+                    pq_append(c);
+                }
+                tile_store(slot);
+                note_cluster_write(c);
+                return true;
+            }
+        }
+
         std::memcpy(dst, vec.data(), dimension * sizeof(float));
+        _manager->encode_slot(slot);
+        if (_manager->has_clusters()) {
+            set_row_norm(slot);
+            tile_store(slot);
+            if (_manager->is_cluster_initialized()) radius_cover(_manager->get_cluster(slot), dst);
+        }
+
+        if (pq_ready()) {
+            uint16_t c = _manager->get_cluster(slot);
+            pq_encode_slot(slot, c);
+            const auto& members = cluster_index[c];
+            auto pos = std::find(members.begin(), members.end(), slot);
+            if (pos != members.end())
+                PqManager::pack(pq_blocks[c], (size_t)(pos - members.begin()),
+                                _manager->get_pq_code(slot), _manager->get_pq_m());
+        }
         return true;
     }
 
     void RedBoxVector::set_num_probes(uint8_t p) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
         _manager->set_num_probes(p);
     }
 
+    int RedBoxVector::hnsw_topn_ef(int n) const {
+        return std::max<int>(_manager->get_hnsw_ef_search(), n) * std::max<int>(hnsw_ef_factor, 1);
+    }
+
+    void RedBoxVector::set_hnsw_ef_factor(uint8_t factor) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        hnsw_ef_factor = std::max<uint8_t>(factor, 1);
+    }
+
     void RedBoxVector::set_hnsw_ef_search(uint16_t ef) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
         _manager->set_hnsw_ef_search(ef);
     }
 
+    void RedBoxVector::set_rerank(bool on) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        rerank_exact = on;
+    }
+
+    void RedBoxVector::set_bq_oversample(uint16_t factor) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        bq_oversample = std::max<uint16_t>(factor, 1);
+    }
+
+    void RedBoxVector::set_tiled_scan(bool on) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        tiled_scan = on;
+        tile_rebuild();
+    }
+
+    void RedBoxVector::set_search_threads(size_t n) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        num_threads = n ? n : std::max(1u, std::thread::hardware_concurrency());
+        pool.reset();   // restarted at the new size on the next large scan
+    }
+
+    void RedBoxVector::set_kmeans_params(const ClusterManager::TrainParams& params) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        kmeans_params = params;
+    }
+
+    void RedBoxVector::set_nn_descent_params(const NnDescent::Params& params) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        nn_descent_params = params;
+    }
+
+    void RedBoxVector::set_rebalance_params(const ClusterManager::RebalanceParams& params) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        rebalance_params = params;
+    }
+
+    void RedBoxVector::set_centroid_graph(bool on, uint16_t ef) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        use_centroid_graph = on;
+        centroid_ef        = std::max<int>(ef, 1);
+        centroid_graph_rebuild();
+    }
+
+    void RedBoxVector::set_probe_params(const ClusterManager::ProbeParams& params) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        probe_params = params;
+        probe_params.min_probes = std::max<uint8_t>(params.min_probes, 1);
+    }
+
+    double RedBoxVector::get_mean_probes() const {
+        uint64_t q = adaptive_queries.load(std::memory_order_relaxed);
+        return q ? (double)adaptive_probes.load(std::memory_order_relaxed) / (double)q : 0.0;
+    }
+
+    void RedBoxVector::set_background_training(bool on) {
+        std::unique_lock<std::shared_mutex> lk(rw_mutex);
+        background_training = on;
+    }
+
+    void RedBoxVector::wait_for_training() {
+        std::lock_guard<std::mutex> g(maintenance_mutex);
+        if (maintenance_thread.joinable()) maintenance_thread.join();
+    }
+
+    RedBoxVector::~RedBoxVector() {
+        wait_for_training();
+    }
+
     void RedBoxVector::warm_pages() {
         if (!_manager || _manager->get_count() == 0) return;
 
@@ -525,16 +2072,26 @@ namespace CoreEngine {
             sink += chunk;
         }
 
-        // Touch every edge entry
+        // SQ8 codes are what search actually scans
+        if (const uint8_t* cblk = _manager->get_code_block()) {
+            for (size_t i = 0; i < cap * dim; i += 4096)
+                sink += cblk[i];
+        }
+        if (const uint64_t* bblk = _manager->get_bq_block()) {
+            for (size_t i = 0; i < cap * Bq::words(dim); i += 512)
+                sink += bblk[i];
+        }
+
+        // Touch every edge page
         if (_manager->get_index_type() == IndexType::HNSW) {
-            const uint32_t* eblk = _manager->get_hnsw_edge_block();
+            const HnswManager::EdgeStore edges = hnsw_edges();
             uint8_t M = _manager->get_header()->hnsw_M;
-            size_t epn = HnswManager::edges_per_node(M);
-            for (size_t i = 0; i < cap; ++i) {
-                uint64_t chunk;
-                std::memcpy(&chunk, &eblk[i * epn], sizeof(chunk));
-                sink += chunk;
-            }
+            for (size_t i = 0; i < cap * HnswManager::level0_words(M); i += 1024)
+                sink += HnswManager::load_edge(&edges.level0[i]);
+            for (size_t i = 0; i < cap; i += 1024)
+                sink += edges.upper_index[i];
+            for (size_t i = 0; i < (size_t)*edges.upper_used * M; i += 1024)
+                sink += HnswManager::load_edge(&edges.upper[i]);
         }
 
         (void)sink;
@@ -550,27 +2107,50 @@ namespace StorageManager {
 
     static size_t calc_required_size(
         uint64_t dimensions, int initial_capacity, uint16_t num_clusters,
-        CoreEngine::IndexType idx_type, uint8_t hnsw_M)
+        CoreEngine::IndexType idx_type, uint8_t hnsw_M, CoreEngine::StorageMode storage,
+        uint8_t pq_m)
     {
         size_t base = sizeof(CoreEngine::SpecificMetadata)
                     + (size_t)initial_capacity * sizeof(uint64_t)    // id_block
                     + (size_t)initial_capacity * dimensions * sizeof(float); // float_block
 
-        if (idx_type == CoreEngine::IndexType::IVF) {
+        if (idx_type != CoreEngine::IndexType::HNSW) {
             base += (size_t)num_clusters * dimensions * sizeof(float)  // centroids
                   + (size_t)num_clusters * sizeof(uint64_t)           // cluster counts
                   + (size_t)initial_capacity * sizeof(uint16_t);      // cluster block
+            if (idx_type == CoreEngine::IndexType::IVF_PQ) {
+                base += (size_t)PqManager::KSUB * dimensions * sizeof(float)       // codebook
+                      + (size_t)initial_capacity * PqManager::code_bytes(pq_m);    // codes
+            }
         } else {
-            // HNSW: level_block + edge_block after float_block
+            // HNSW: level_block + edge blocks after float_block
             base += (size_t)initial_capacity * sizeof(uint8_t)                // level_block
-                  + (size_t)initial_capacity * HnswManager::edges_per_node(hnsw_M) * sizeof(uint32_t);
+                  + (size_t)initial_capacity * HnswManager::level0_words(hnsw_M) * sizeof(uint32_t)
+                  + (size_t)initial_capacity * sizeof(uint32_t)               // upper_index
+                  + HnswManager::upper_lists(initial_capacity, hnsw_M) * hnsw_M * sizeof(uint32_t);
+        }
+        if (storage == CoreEngine::StorageMode::SQ8) {
+            base += 2 * dimensions * sizeof(float)                  // sq8 min + scale
+                  + (size_t)initial_capacity * dimensions;          // code_block
+        } else if (storage == CoreEngine::StorageMode::BINARY) {
+            base += dimensions * sizeof(float)                                  // bq_mean
+                  + (size_t)initial_capacity * Bq::words(dimensions) * sizeof(uint64_t);  // bq_block
         }
         return base;
     }
 
+    // Files this build maps as they are: version 5 only changed the HNSW
+    // edge layout, so older IVF files are still current.
+    static bool layout_is_current(const CoreEngine::SpecificMetadata& h) {
+        if (h.version == CoreEngine::SpecificMetadata::CURRENT_VERSION) return true;
+        return h.version >= CoreEngine::SpecificMetadata::MIN_IVF_VERSION
+            && h.index_type != static_cast<uint8_t>(CoreEngine::IndexType::HNSW);
+    }
+
     Manager::Manager(const std::string& db_file, uint64_t dimensions,
                      int initial_capacity, uint16_t num_clusters, uint8_t num_probes,
-                     CoreEngine::IndexType index_type, uint8_t hnsw_M, uint16_t hnsw_ef_construction)
+                     CoreEngine::IndexType index_type, uint8_t hnsw_M, uint16_t hnsw_ef_construction,
+                     CoreEngine::Metric metric, CoreEngine::StorageMode storage, uint8_t pq_m)
         : allocated_size(initial_capacity), filename(db_file),
 #ifdef _WIN32
           hFile(NULL), hMapFile(NULL),
@@ -580,10 +2160,47 @@ namespace StorageManager {
           map_base(nullptr),
           header(nullptr), centroid_block(nullptr), cluster_count_block(nullptr),
           cluster_block(nullptr), id_block(nullptr), float_block(nullptr),
-          hnsw_level_block(nullptr), hnsw_edge_block(nullptr)
+          hnsw_level_block(nullptr), hnsw_edge_block(nullptr),
+          hnsw_upper_index(nullptr), hnsw_upper_block(nullptr),
+          pq_codebook(nullptr), pq_code_block(nullptr),
+          sq8_min(nullptr), sq8_scale(nullptr), code_block(nullptr),
+          bq_mean(nullptr), bq_block(nullptr)
     {
+        // Storage mode, PQ shape and IVF vs IVF-PQ are fixed at creation.
+        // Peek an existing header so the mapping matches the file whatever
+        // the caller asked for.
+        {
+            std::ifstream existing(db_file, std::ios::binary);
+            CoreEngine::SpecificMetadata peek{};
+            if (existing.read(reinterpret_cast<char*>(&peek), sizeof(peek)) && layout_is_current(peek)) {
+                storage = static_cast<CoreEngine::StorageMode>(peek.storage_mode);
+                auto file_type = static_cast<CoreEngine::IndexType>(peek.index_type);
+                if (index_type != CoreEngine::IndexType::HNSW && file_type != CoreEngine::IndexType::HNSW)
+                    index_type = file_type;
+                pq_m = peek.pq_m;
+                // Splits and merges change num_clusters, not the allocation.
+                if (file_type != CoreEngine::IndexType::HNSW)
+                    num_clusters = peek.cluster_capacity ? peek.cluster_capacity : peek.num_clusters;
+            }
+        }
         bool is_hnsw = (index_type == CoreEngine::IndexType::HNSW);
-        size_t required_size = calc_required_size(dimensions, initial_capacity, num_clusters, index_type, hnsw_M);
+        bool is_pq   = (index_type == CoreEngine::IndexType::IVF_PQ);
+        if (is_pq) {
+            // PQ codes replace the SQ8 role; keep one compressed copy.
+            storage = CoreEngine::StorageMode::F32;
+            if (pq_m == 0) pq_m = PqManager::default_m(dimensions);
+            if (dimensions % pq_m != 0)
+                throw std::invalid_argument("pq_m must divide the dimension");
+        } else {
+            pq_m = 0;
+        }
+        // Binary codes only serve scans; HNSW traversal stays on floats.
+        if (is_hnsw && storage == CoreEngine::StorageMode::BINARY)
+            storage = CoreEngine::StorageMode::F32;
+        bool is_sq8 = (storage == CoreEngine::StorageMode::SQ8);
+        bool is_bq  = (storage == CoreEngine::StorageMode::BINARY);
+
+        size_t required_size = calc_required_size(dimensions, initial_capacity, num_clusters, index_type, hnsw_M, storage, pq_m);
         size_t current_size = 0;
 
 #ifdef _WIN32
@@ -595,6 +2212,13 @@ namespace StorageManager {
         GetFileSizeEx(hFile, &fileSize);
         current_size = (size_t)fileSize.QuadPart;
 
+        // NTFS zero-fills a new file's extension unless it is marked sparse;
+        // POSIX ftruncate leaves holes already.
+        if (current_size == 0) {
+            DWORD ignored = 0;
+            DeviceIoControl(hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &ignored, NULL);
+        }
+
         if (current_size < required_size) {
             LARGE_INTEGER distance;
             distance.QuadPart = (LONGLONG)required_size;
@@ -637,8 +2261,16 @@ namespace StorageManager {
             float_block         = (float*)(id_block + initial_capacity);
             hnsw_level_block    = nullptr;
             hnsw_edge_block     = nullptr;
+            hnsw_upper_index    = nullptr;
+            hnsw_upper_block    = nullptr;
+            if (is_pq) {
+                // IVF-PQ appends: [pq_codebook][pq_code_block]
+                pq_codebook   = float_block + (size_t)initial_capacity * dimensions;
+                pq_code_block = (uint8_t*)(pq_codebook + (size_t)PqManager::KSUB * dimensions);
+            }
         } else {
             // HNSW layout: [Header][id_block][float_block][level_block][edge_block]
+            //              [upper_index][upper_block]
             centroid_block      = nullptr;
             cluster_count_block = nullptr;
             cluster_block       = nullptr;
@@ -646,6 +2278,21 @@ namespace StorageManager {
             float_block         = (float*)(id_block + initial_capacity);
             hnsw_level_block    = (uint8_t*)(float_block + (size_t)initial_capacity * dimensions);
             hnsw_edge_block     = (uint32_t*)(hnsw_level_block + initial_capacity);
+            hnsw_upper_index    = hnsw_edge_block + (size_t)initial_capacity * HnswManager::level0_words(hnsw_M);
+            hnsw_upper_block    = hnsw_upper_index + initial_capacity;
+        }
+
+        if (is_sq8 || is_bq) {
+            size_t before_codes = calc_required_size(dimensions, initial_capacity, num_clusters,
+                                                     index_type, hnsw_M, CoreEngine::StorageMode::F32, pq_m);
+            if (is_sq8) {
+                sq8_min    = (float*)((char*)map_base + before_codes);
+                sq8_scale  = sq8_min + dimensions;
+                code_block = (uint8_t*)(sq8_scale + dimensions);
+            } else {
+                bq_mean  = (float*)((char*)map_base + before_codes);
+                bq_block = (uint64_t*)(bq_mean + dimensions);
+            }
         }
 
         if (current_size == 0) {
@@ -657,9 +2304,15 @@ namespace StorageManager {
             header->next_id        = 1;
             header->version        = CoreEngine::SpecificMetadata::CURRENT_VERSION;
             header->num_clusters   = num_clusters;
+            header->cluster_capacity = num_clusters;
             header->is_initialized = 0;
             header->num_probes     = num_probes;
             header->index_type     = static_cast<uint8_t>(index_type);
+            header->metric         = static_cast<uint8_t>(metric);
+            header->storage_mode   = static_cast<uint8_t>(storage);
+            header->codes_trained    = 0;
+            header->pq_m           = pq_m;
+            header->pq_trained     = 0;
 
             if (is_hnsw) {
                 header->hnsw_M               = hnsw_M;
@@ -668,15 +2321,15 @@ namespace StorageManager {
                 header->hnsw_max_level        = 0;
                 header->hnsw_entry_point      = HnswManager::EMPTY;
                 header->hnsw_graph_version    = 0;
-
-                // Initialize all edge slots to EMPTY
-                size_t total_edges = (size_t)initial_capacity * HnswManager::edges_per_node(hnsw_M);
-                for (size_t i = 0; i < total_edges; ++i)
-                    hnsw_edge_block[i] = HnswManager::EMPTY;
+                header->hnsw_upper_used       = 0;
+                // The edge blocks are left as the truncate made them: all
+                // zero, which reads as no edges, and sparse on disk until
+                // nodes are linked in.
             }
         }
         else {
-            if (header->version != CoreEngine::SpecificMetadata::CURRENT_VERSION) {
+            if (!layout_is_current(*header)) {
+                uint8_t version = header->version;   // header goes with the mapping
 #ifdef _WIN32
                 UnmapViewOfFile(map_base); CloseHandle(hMapFile); CloseHandle(hFile);
 #else
@@ -684,18 +2337,20 @@ namespace StorageManager {
 #endif
                 throw std::runtime_error(
                     "Legacy database layout detected (version " +
-                    std::to_string(header->version) +
+                    std::to_string(version) +
                     "). Please recreate the database.");
             }
             if (header->dimensions != dimensions) {
+                uint64_t file_dim = header->dimensions;
 #ifdef _WIN32
                 UnmapViewOfFile(map_base); CloseHandle(hMapFile); CloseHandle(hFile);
 #else
                 munmap(map_base, required_size); close(fd);
 #endif
                 throw std::runtime_error("DB dimension mismatch! File has " +
-                    std::to_string(header->dimensions));
+                    std::to_string(file_dim));
             }
+            header->version = CoreEngine::SpecificMetadata::CURRENT_VERSION;
         }
     }
 
@@ -706,21 +2361,10 @@ namespace StorageManager {
 #ifdef _WIN32
             FlushViewOfFile(map_base, 0); UnmapViewOfFile(map_base);
 #else
-            size_t total;
-            if (header->index_type == static_cast<uint8_t>(CoreEngine::IndexType::HNSW)) {
-                total = sizeof(CoreEngine::SpecificMetadata)
-                      + (size_t)header->max_capacity * sizeof(uint64_t)
-                      + (size_t)header->max_capacity * header->dimensions * sizeof(float)
-                      + (size_t)header->max_capacity * sizeof(uint8_t)
-                      + (size_t)header->max_capacity * HnswManager::edges_per_node(header->hnsw_M) * sizeof(uint32_t);
-            } else {
-                total = sizeof(CoreEngine::SpecificMetadata)
-                      + (size_t)header->num_clusters * header->dimensions * sizeof(float)
-                      + (size_t)header->num_clusters * sizeof(uint64_t)
-                      + (size_t)header->max_capacity * sizeof(uint16_t)
-                      + (size_t)header->max_capacity * sizeof(uint64_t)
-                      + (size_t)header->max_capacity * header->dimensions * sizeof(float);
-            }
+            size_t total = calc_required_size(
+                header->dimensions, (int)header->max_capacity, get_cluster_capacity(),
+                static_cast<CoreEngine::IndexType>(header->index_type), header->hnsw_M,
+                get_storage_mode(), header->pq_m);
             msync(map_base, total, MS_SYNC);
             munmap(map_base, total);
 #endif
@@ -744,11 +2388,103 @@ namespace StorageManager {
         float* dst = float_block + slot * header->dimensions;
         std::memcpy(dst, vec.data(), header->dimensions * sizeof(float));
 
-        if (header->index_type == static_cast<uint8_t>(CoreEngine::IndexType::IVF)) {
+        if (header->index_type != static_cast<uint8_t>(CoreEngine::IndexType::HNSW)) {
             cluster_block[slot] = cluster;
         }
 
         header->vector_count++;
+        encode_slot(static_cast<int>(slot));
+    }
+
+    void Manager::add_vectors(const uint64_t* ids, const float* vecs, size_t n) {
+        if (header->vector_count + n > header->max_capacity)
+            throw std::runtime_error("Database full");
+
+        size_t first = header->vector_count;
+        size_t dim   = header->dimensions;
+        std::memcpy(id_block + first, ids, n * sizeof(uint64_t));
+        std::memcpy(float_block + first * dim, vecs, n * dim * sizeof(float));
+        if (header->index_type != static_cast<uint8_t>(CoreEngine::IndexType::HNSW))
+            std::fill(cluster_block + first, cluster_block + first + n, (uint16_t)0);
+
+        header->vector_count += n;
+        for (size_t i = 0; i < n; ++i) encode_slot(static_cast<int>(first + i));
+    }
+
+    void Manager::permute_slots(const std::vector<uint32_t>& new_to_old) {
+        size_t n = new_to_old.size();
+        if (n > header->vector_count) throw std::out_of_range("Permutation larger than vector count");
+
+        // Cycle-following gather: walk each cycle once, carrying the first
+        // element in scratch.
+        std::vector<uint8_t> done(n);
+        auto apply = [&](void* block, size_t elem_bytes) {
+            if (!block || elem_bytes == 0) return;
+            char* base = static_cast<char*>(block);
+            std::vector<char> scratch(elem_bytes);
+            std::fill(done.begin(), done.end(), (uint8_t)0);
+            for (size_t start = 0; start < n; ++start) {
+                if (done[start] || new_to_old[start] == start) { done[start] = 1; continue; }
+                std::memcpy(scratch.data(), base + start * elem_bytes, elem_bytes);
+                size_t j = start;
+                while (true) {
+                    done[j] = 1;
+                    size_t from = new_to_old[j];
+                    if (from == start) {
+                        std::memcpy(base + j * elem_bytes, scratch.data(), elem_bytes);
+                        break;
+                    }
+                    std::memcpy(base + j * elem_bytes, base + from * elem_bytes, elem_bytes);
+                    j = from;
+                }
+            }
+        };
+
+        size_t dim = header->dimensions;
+        apply(id_block,      sizeof(uint64_t));
+        apply(cluster_block, sizeof(uint16_t));
+        apply(hnsw_level_block, sizeof(uint8_t));
+        apply(hnsw_edge_block,  HnswManager::level0_words(header->hnsw_M) * sizeof(uint32_t));
+        apply(hnsw_upper_index, sizeof(uint32_t));
+        apply(float_block,   dim * sizeof(float));
+        apply(code_block,    dim);
+        apply(bq_block,      Bq::words(dim) * sizeof(uint64_t));
+        apply(pq_code_block, pq_code_block ? PqManager::code_bytes(header->pq_m) : 0);
+    }
+
+    uint8_t* Manager::get_pq_code_mut(int index) {
+        if (index >= (int)header->vector_count) throw std::out_of_range("Index out of bounds");
+        return pq_code_block + (size_t)index * PqManager::code_bytes(header->pq_m);
+    }
+
+    const uint8_t* Manager::get_pq_code(int index) const {
+        if (index >= (int)header->vector_count) throw std::out_of_range("Index out of bounds");
+        return pq_code_block + (size_t)index * PqManager::code_bytes(header->pq_m);
+    }
+
+    void Manager::train_codes(uint64_t n) {
+        if (!code_block && !bq_block) return;
+        size_t dim = header->dimensions;
+        n = std::min(n, header->vector_count);
+        if (code_block) Sq8::train(float_block, n, dim, sq8_min, sq8_scale);
+        else            Bq::train(float_block, n, dim, bq_mean);
+        header->codes_trained = 1;
+        for (uint64_t i = 0; i < header->vector_count; ++i)
+            encode_slot(static_cast<int>(i));
+    }
+
+    // No-op until train_codes() has run; slots written before that are
+    // encoded in bulk when it does.
+    void Manager::encode_slot(int index) {
+        if ((!code_block && !bq_block) || !header->codes_trained) return;
+        if (index >= (int)header->vector_count) throw std::out_of_range("Index out of bounds");
+        size_t dim = header->dimensions;
+        if (code_block)
+            Sq8::encode(float_block + (size_t)index * dim, sq8_min, sq8_scale, dim,
+                        code_block + (size_t)index * dim);
+        else
+            Bq::encode(float_block + (size_t)index * dim, bq_mean, dim,
+                       bq_block + (size_t)index * Bq::words(dim));
     }
 
     const float* Manager::get_float_ptr(int index) const {
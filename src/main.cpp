@@ -54,9 +54,12 @@
 //}
 
 #include "redboxdb/cpu_features.hpp"
+#include "redboxdb/distance.hpp"
 #include <iostream>
 
 int main() {
     std::cout << "AVX2 supported: " << Platform::has_avx2() << std::endl;
+    std::cout << "AVX-512F supported: " << Platform::has_avx512f() << std::endl;
+    std::cout << "Distance kernels: " << Distance::kernels().name << std::endl;
     return 0;
 }
\ No newline at end of file
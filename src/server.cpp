@@ -15,6 +15,7 @@
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
 #include "redboxdb/engine.hpp"
 #ifdef REDBOX_PG_ENABLED
 #include "redboxdb/metadata_store.hpp"
@@ -60,8 +61,32 @@ const uint8_t CMD_CREATE_HNSW_DB = 10;
 const uint8_t CMD_SET_HNSW_EF = 11;
 const uint8_t CMD_LIST_DBS = 12;
 const uint8_t CMD_DB_INFO = 13;
+const uint8_t CMD_CREATE_IVFPQ_DB = 14;
 
 constexpr size_t MAX_DB_NAME_LEN = 64;
+
+// SELECT_DB / CREATE_HNSW_DB pack three things into META: the name length in
+// the low 16 bits, the storage mode in bits 16-23 and the similarity metric
+// in the top byte. Old clients only ever sent a length <= 64, so both extra
+// bytes read as 0 = F32 / L2. Bits a command does not define are reserved
+// and must be zero.
+constexpr uint32_t HANDSHAKE_NAME_LEN_BITS = 0x0000FFFFu;
+constexpr uint32_t HANDSHAKE_STORAGE_BITS  = 0x00FF0000u;
+constexpr uint32_t HANDSHAKE_METRIC_BITS   = 0xFF000000u;
+inline uint32_t handshake_name_len(uint32_t meta) { return meta & HANDSHAKE_NAME_LEN_BITS; }
+inline bool handshake_reserved_clear(uint32_t meta, uint32_t fields) { return (meta & ~fields) == 0; }
+inline bool handshake_metric(uint32_t meta, CoreEngine::Metric& out) {
+    uint8_t raw = static_cast<uint8_t>(meta >> 24);
+    if (raw > static_cast<uint8_t>(CoreEngine::Metric::Cosine)) return false;
+    out = static_cast<CoreEngine::Metric>(raw);
+    return true;
+}
+inline bool handshake_storage(uint32_t meta, CoreEngine::StorageMode& out) {
+    uint8_t raw = static_cast<uint8_t>(meta >> 16);
+    if (raw > static_cast<uint8_t>(CoreEngine::StorageMode::BINARY)) return false;
+    out = static_cast<CoreEngine::StorageMode>(raw);
+    return true;
+}
 inline bool is_valid_db_name(const std::string& name) {
     if (name.empty() || name.size() > MAX_DB_NAME_LEN) return false;
     for (char c : name) {
@@ -71,12 +96,35 @@ inline bool is_valid_db_name(const std::string& name) {
 }
 
 
-using DbCatalog = std::unordered_map<std::string, std::unique_ptr<CoreEngine::RedBoxVector>>;
-using MutexMap = std::unordered_map<std::string, std::unique_ptr<std::mutex>>;
+// Server databases rebalance from the write path (on the background
+// maintenance thread) with the default limits.
+inline ClusterManager::RebalanceParams auto_rebalance() {
+    ClusterManager::RebalanceParams params;
+    params.automatic = true;
+    return params;
+}
+
+// One open DB. Connections keep a reference to the entry they selected, so
+// dropping it from the catalog never frees the lock under them. Data ops
+// share mtx (the engine synchronises them itself, so several connections
+// can ingest into one DB at once) and check dropped first; DROP takes mtx
+// alone, sets dropped and closes the engine before releasing it.
+struct DbEntry {
+    std::unique_ptr<CoreEngine::RedBoxVector> db;
+    std::shared_mutex mtx;
+    bool dropped = false;   // guarded by mtx
+};
+using DbCatalog = std::unordered_map<std::string, std::shared_ptr<DbEntry>>;
+
+// Catalog entry for a freshly opened engine.
+inline std::shared_ptr<DbEntry> make_entry(std::unique_ptr<CoreEngine::RedBoxVector> db) {
+    auto entry = std::make_shared<DbEntry>();
+    entry->db = std::move(db);
+    return entry;
+}
 
 struct SharedState {
     DbCatalog  catalog;
-    MutexMap   db_mutexes;
     std::mutex catalog_mutex;
     Metadata::Store* meta = nullptr;
 };
@@ -93,8 +141,8 @@ void handle_client(int client_socket, SharedState& state) {
 
     try {
 
-    CoreEngine::RedBoxVector* active_db = nullptr;
-    std::mutex* active_mtx = nullptr;
+    std::shared_ptr<DbEntry> active;
+    uint32_t active_dim = 0;
     std::string active_db_name;
 
     char header_buffer[5];
@@ -122,6 +170,16 @@ void handle_client(int client_socket, SharedState& state) {
         return true;
     };
 
+    // Runs op on the selected DB under its shared lock. False once a DROP
+    // (from any connection) has closed it; the caller then drops the
+    // connection, as it does when no DB was ever selected.
+    auto with_db = [&](auto&& op) -> bool {
+        std::shared_lock<std::shared_mutex> lk(active->mtx);
+        if (active->dropped) return false;
+        op(*active->db);
+        return true;
+    };
+
     while (true) {
         if (!recv_all(header_buffer, 5)) break;
 
@@ -131,7 +189,7 @@ void handle_client(int client_socket, SharedState& state) {
 
         // --- HANDSHAKE / SELECT DB ---
         if (cmd == CMD_SELECT_DB) {
-            uint32_t name_len = meta_data;
+            uint32_t name_len = handshake_name_len(meta_data);
             if (name_len > MAX_DB_NAME_LEN) {
                 std::cerr << "   [REJECTED] name_len=" << name_len << " exceeds limit\n";
                 break;
@@ -153,6 +211,29 @@ void handle_client(int client_socket, SharedState& state) {
             uint32_t requested_capacity = 0;
             if (!recv_all((char*)&requested_capacity, 4)) break;
 
+            if (!handshake_reserved_clear(meta_data, HANDSHAKE_NAME_LEN_BITS | HANDSHAKE_STORAGE_BITS | HANDSHAKE_METRIC_BITS)) {
+                std::cerr << "   [REJECTED] Reserved handshake bits set: " << meta_data << "\n";
+                char zero = 0;
+                if (!send_all(&zero, 1)) break;
+                continue;
+            }
+
+            CoreEngine::Metric requested_metric;
+            if (!handshake_metric(meta_data, requested_metric)) {
+                std::cerr << "   [REJECTED] Unknown metric " << (meta_data >> 24) << "\n";
+                char zero = 0;
+                if (!send_all(&zero, 1)) break;
+                continue;
+            }
+
+            CoreEngine::StorageMode requested_storage;
+            if (!handshake_storage(meta_data, requested_storage)) {
+                std::cerr << "   [REJECTED] Unknown storage mode " << ((meta_data >> 16) & 0xFF) << "\n";
+                char zero = 0;
+                if (!send_all(&zero, 1)) break;
+                continue;
+            }
+
             std::cout << "[SERVER] Req DB: " << db_name
                 << " (Dim: " << requested_dim << ")\n";
             std::cout << "[SERVER] Req Capacity: " << db_name
@@ -165,27 +246,33 @@ void handle_client(int client_socket, SharedState& state) {
                 if (state.catalog.find(db_name) == state.catalog.end()) {
                     std::cout << "   -> New/Loading...\n";
                     std::string filename = db_name + ".db";
-                    state.catalog[db_name] = std::make_unique<CoreEngine::RedBoxVector>(
-                        filename, requested_dim, (int)requested_capacity);
-                    state.db_mutexes[db_name] = std::make_unique<std::mutex>();
+                    state.catalog[db_name] = make_entry(std::make_unique<CoreEngine::RedBoxVector>(
+                        filename, requested_dim, (int)requested_capacity,
+                        CoreEngine::RedBoxVector::AUTO_CLUSTERS,
+                        CoreEngine::RedBoxVector::DEFAULT_PROBES, requested_metric,
+                        requested_storage));
+                    // k-means at the init threshold must not stall this client's insert.
+                    state.catalog[db_name]->db->set_background_training(true);
+                    state.catalog[db_name]->db->set_rebalance_params(auto_rebalance());
+                    state.catalog[db_name]->db->set_centroid_graph(true);
 
 #ifdef REDBOX_PG_ENABLED
                     if (state.meta) {
                         state.meta->create_database(db_name, requested_dim,
                             CoreEngine::IndexType::IVF, requested_capacity,
-                            *state.catalog[db_name]->get_header());
+                            *state.catalog[db_name]->db->get_header());
                     }
 #endif
                 }
 
-                active_db = state.catalog[db_name].get();
-                active_mtx = state.db_mutexes[db_name].get();
+                active = state.catalog[db_name];
+                active_dim = active->db->get_dim();
                 active_db_name = db_name;
             }
 
-            if (active_db->get_dim() != requested_dim) {
+            if (active_dim != requested_dim) {
                 std::cerr << "   [WARNING] Dimension mismatch! File is "
-                    << active_db->get_dim() << "\n";
+                    << active_dim << "\n";
             }
 
             if (!send_all("1", 1)) break;
@@ -194,7 +281,7 @@ void handle_client(int client_socket, SharedState& state) {
 
         // --- HANDSHAKE / CREATE HNSW DB ---
         if (cmd == CMD_CREATE_HNSW_DB) {
-            uint32_t name_len = meta_data;
+            uint32_t name_len = handshake_name_len(meta_data);
             if (name_len > MAX_DB_NAME_LEN) {
                 std::cerr << "   [REJECTED] name_len=" << name_len << " exceeds limit\n";
                 break;
@@ -218,6 +305,29 @@ void handle_client(int client_socket, SharedState& state) {
             uint16_t hnsw_ef_construction = 200;
             if (!recv_all((char*)&hnsw_ef_construction, 2)) break;
 
+            if (!handshake_reserved_clear(meta_data, HANDSHAKE_NAME_LEN_BITS | HANDSHAKE_STORAGE_BITS | HANDSHAKE_METRIC_BITS)) {
+                std::cerr << "   [REJECTED] Reserved handshake bits set: " << meta_data << "\n";
+                char zero = 0;
+                if (!send_all(&zero, 1)) break;
+                continue;
+            }
+
+            CoreEngine::Metric requested_metric;
+            if (!handshake_metric(meta_data, requested_metric)) {
+                std::cerr << "   [REJECTED] Unknown metric " << (meta_data >> 24) << "\n";
+                char zero = 0;
+                if (!send_all(&zero, 1)) break;
+                continue;
+            }
+
+            CoreEngine::StorageMode requested_storage;
+            if (!handshake_storage(meta_data, requested_storage)) {
+                std::cerr << "   [REJECTED] Unknown storage mode " << ((meta_data >> 16) & 0xFF) << "\n";
+                char zero = 0;
+                if (!send_all(&zero, 1)) break;
+                continue;
+            }
+
             std::cout << "[SERVER] Create HNSW DB: " << db_name
                 << " (Dim=" << requested_dim << " M=" << (int)hnsw_M
                 << " ef_c=" << hnsw_ef_construction << ")\n";
@@ -226,21 +336,100 @@ void handle_client(int client_socket, SharedState& state) {
                 std::lock_guard<std::mutex> lock(state.catalog_mutex);
                 if (state.catalog.find(db_name) == state.catalog.end()) {
                     std::string filename = db_name + ".db";
-                    state.catalog[db_name] = std::make_unique<CoreEngine::RedBoxVector>(
+                    state.catalog[db_name] = make_entry(std::make_unique<CoreEngine::RedBoxVector>(
                         filename, requested_dim, (int)requested_capacity,
-                        hnsw_M, hnsw_ef_construction);
-                    state.db_mutexes[db_name] = std::make_unique<std::mutex>();
+                        hnsw_M, hnsw_ef_construction, requested_metric, requested_storage));
 
 #ifdef REDBOX_PG_ENABLED
                     if (state.meta) {
                         state.meta->create_database(db_name, requested_dim,
                             CoreEngine::IndexType::HNSW, requested_capacity,
-                            *state.catalog[db_name]->get_header());
+                            *state.catalog[db_name]->db->get_header());
+                    }
+#endif
+                }
+                active = state.catalog[db_name];
+                active_dim = active->db->get_dim();
+                active_db_name = db_name;
+            }
+
+            if (!send_all("1", 1)) break;
+            continue;
+        }
+
+        // --- HANDSHAKE / CREATE IVF-PQ DB ---
+        if (cmd == CMD_CREATE_IVFPQ_DB) {
+            uint32_t name_len = handshake_name_len(meta_data);
+            if (name_len > MAX_DB_NAME_LEN) {
+                std::cerr << "   [REJECTED] name_len=" << name_len << " exceeds limit\n";
+                break;
+            }
+            std::string db_name(name_len, ' ');
+            if (!recv_all(&db_name[0], (int)name_len)) break;
+
+            if (!is_valid_db_name(db_name)) {
+                std::cerr << "   [REJECTED] Invalid db_name: " << db_name << "\n";
+                char zero = 0;
+                if (!send_all(&zero, 1)) break;
+                continue;
+            }
+
+            uint32_t requested_dim = 0;
+            if (!recv_all((char*)&requested_dim, 4)) break;
+            uint32_t requested_capacity = 0;
+            if (!recv_all((char*)&requested_capacity, 4)) break;
+            uint8_t pq_m = 0;
+            if (!recv_all((char*)&pq_m, 1)) break;
+
+            if (!handshake_reserved_clear(meta_data, HANDSHAKE_NAME_LEN_BITS | HANDSHAKE_METRIC_BITS)) {
+                std::cerr << "   [REJECTED] Reserved handshake bits set: " << meta_data << "\n";
+                char zero = 0;
+                if (!send_all(&zero, 1)) break;
+                continue;
+            }
+
+            CoreEngine::Metric requested_metric;
+            if (!handshake_metric(meta_data, requested_metric)) {
+                std::cerr << "   [REJECTED] Unknown metric " << (meta_data >> 24) << "\n";
+                char zero = 0;
+                if (!send_all(&zero, 1)) break;
+                continue;
+            }
+            if (pq_m != 0 && (requested_dim == 0 || requested_dim % pq_m != 0)) {
+                std::cerr << "   [REJECTED] pq_m=" << (int)pq_m << " does not divide dim " << requested_dim << "\n";
+                char zero = 0;
+                if (!send_all(&zero, 1)) break;
+                continue;
+            }
+
+            std::cout << "[SERVER] Create IVF-PQ DB: " << db_name
+                << " (Dim=" << requested_dim << " m=" << (int)pq_m << ")\n";
+
+            {
+                std::lock_guard<std::mutex> lock(state.catalog_mutex);
+                if (state.catalog.find(db_name) == state.catalog.end()) {
+                    std::string filename = db_name + ".db";
+                    CoreEngine::RedBoxVector::IvfPqParams pq;
+                    pq.k    = CoreEngine::RedBoxVector::AUTO_CLUSTERS;
+                    pq.pq_m = pq_m;
+                    state.catalog[db_name] = make_entry(std::make_unique<CoreEngine::RedBoxVector>(
+                        filename, requested_dim, (int)requested_capacity, pq, requested_metric));
+                    state.catalog[db_name]->db->set_background_training(true);
+                    state.catalog[db_name]->db->set_rebalance_params(auto_rebalance());
+                    state.catalog[db_name]->db->set_centroid_graph(true);
+
+#ifdef REDBOX_PG_ENABLED
+                    // The PG index_type enum has no IVF_PQ; the file header
+                    // carries the real type and wins on reopen.
+                    if (state.meta) {
+                        state.meta->create_database(db_name, requested_dim,
+                            CoreEngine::IndexType::IVF, requested_capacity,
+                            *state.catalog[db_name]->db->get_header());
                     }
 #endif
                 }
-                active_db = state.catalog[db_name].get();
-                active_mtx = state.db_mutexes[db_name].get();
+                active = state.catalog[db_name];
+                active_dim = active->db->get_dim();
                 active_db_name = db_name;
             }
 
@@ -248,18 +437,24 @@ void handle_client(int client_socket, SharedState& state) {
             continue;
         }
 
-        if (!active_db) break;
+        if (!active) break;
 
-        int current_dim = active_db->get_dim();
+        int current_dim = static_cast<int>(active_dim);
         int vec_byte_size = current_dim * sizeof(float);
+        // Row count and next id after a write, for the metadata store.
+        uint64_t db_count = 0, db_next_id = 0;
+        auto note_counts = [&](CoreEngine::RedBoxVector& db) {
+            db_count   = db.get_count();
+            db_next_id = db.get_next_id();
+        };
 
         if (cmd == CMD_INSERT) {
             std::vector<float> vec(current_dim);
             if (!recv_all((char*)vec.data(), vec_byte_size)) break;
-            { std::lock_guard<std::mutex> lk(*active_mtx); active_db->insert(meta_data, vec); }
+            if (!with_db([&](CoreEngine::RedBoxVector& db) { db.insert(meta_data, vec); note_counts(db); })) break;
 #ifdef REDBOX_PG_ENABLED
             if (state.meta) {
-                state.meta->update_counts(active_db_name, active_db->get_count(), active_db->get_next_id());
+                state.meta->update_counts(active_db_name, db_count, db_next_id);
                 state.meta->log_operation(active_db_name, "INSERT", meta_data);
             }
 #endif
@@ -269,7 +464,7 @@ void handle_client(int client_socket, SharedState& state) {
             std::vector<float> query(current_dim);
             if (!recv_all((char*)query.data(), vec_byte_size)) break;
             int result_id;
-            { std::lock_guard<std::mutex> lk(*active_mtx); result_id = active_db->search(query); }
+            if (!with_db([&](CoreEngine::RedBoxVector& db) { result_id = db.search(query); })) break;
 #ifdef REDBOX_PG_ENABLED
             if (state.meta) {
                 state.meta->log_operation(active_db_name, "SEARCH", 0);
@@ -279,10 +474,10 @@ void handle_client(int client_socket, SharedState& state) {
         }
         else if (cmd == CMD_DELETE) {
             bool success;
-            { std::lock_guard<std::mutex> lk(*active_mtx); success = active_db->remove(meta_data); }
+            if (!with_db([&](CoreEngine::RedBoxVector& db) { success = db.remove(meta_data); note_counts(db); })) break;
 #ifdef REDBOX_PG_ENABLED
             if (success && state.meta) {
-                state.meta->update_counts(active_db_name, active_db->get_count(), active_db->get_next_id());
+                state.meta->update_counts(active_db_name, db_count, db_next_id);
                 state.meta->log_operation(active_db_name, "DELETE", meta_data);
             }
 #endif
@@ -293,7 +488,7 @@ void handle_client(int client_socket, SharedState& state) {
             std::vector<float> vec(current_dim);
             if (!recv_all((char*)vec.data(), vec_byte_size)) break;
             bool success;
-            { std::lock_guard<std::mutex> lk(*active_mtx); success = active_db->update(meta_data, vec); }
+            if (!with_db([&](CoreEngine::RedBoxVector& db) { success = db.update(meta_data, vec); })) break;
 #ifdef REDBOX_PG_ENABLED
             if (success && state.meta) {
                 state.meta->log_operation(active_db_name, "UPDATE", meta_data);
@@ -306,10 +501,10 @@ void handle_client(int client_socket, SharedState& state) {
             std::vector<float> vec(current_dim);
             if (!recv_all((char*)vec.data(), vec_byte_size)) break;
             uint64_t assigned_id;
-            { std::lock_guard<std::mutex> lk(*active_mtx); assigned_id = active_db->insert_auto(vec); }
+            if (!with_db([&](CoreEngine::RedBoxVector& db) { assigned_id = db.insert_auto(vec); note_counts(db); })) break;
 #ifdef REDBOX_PG_ENABLED
             if (state.meta) {
-                state.meta->update_counts(active_db_name, active_db->get_count(), active_db->get_next_id());
+                state.meta->update_counts(active_db_name, db_count, db_next_id);
                 state.meta->log_operation(active_db_name, "INSERT_AUTO", assigned_id);
             }
 #endif
@@ -325,7 +520,7 @@ void handle_client(int client_socket, SharedState& state) {
                 if (!send_all((char*)&count, sizeof(count))) break;
             } else {
                 std::vector<int> results;
-                { std::lock_guard<std::mutex> lk(*active_mtx); results = active_db->search_N(query, n); }
+                if (!with_db([&](CoreEngine::RedBoxVector& db) { results = db.search_N(query, n); })) break;
                 uint32_t count = static_cast<uint32_t>(results.size());
                 if (!send_all((char*)&count, sizeof(count))) break;
                 if (count > 0)
@@ -336,50 +531,49 @@ void handle_client(int client_socket, SharedState& state) {
             bool success = false;
             std::string db_to_drop;
 
-            // active_db is already selected; grab its name from the catalog
+            // Only the entry this connection selected, if it is still the
+            // catalog's (another connection may have dropped and recreated it).
             {
                 std::lock_guard<std::mutex> lock(state.catalog_mutex);
-                for (auto& [name, db_ptr] : state.catalog) {
-                    if (db_ptr.get() == active_db) {
-                        db_to_drop = name;
-                        break;
-                    }
-                }
-                if (!db_to_drop.empty()) {
+                auto it = state.catalog.find(active_db_name);
+                if (it != state.catalog.end() && it->second == active) {
+                    db_to_drop = active_db_name;
 #ifdef REDBOX_PG_ENABLED
                     if (state.meta) {
                         state.meta->drop_database(db_to_drop);
                     }
 #endif
-                    state.catalog.erase(db_to_drop);
-                    state.db_mutexes.erase(db_to_drop);
+                    // Waits for ops already inside this DB and holds off the
+                    // rest until it is marked dropped and closed.
+                    std::unique_lock<std::shared_mutex> drain(active->mtx);
+                    active->dropped = true;
+                    active->db.reset();
+                    state.catalog.erase(it);
                     std::filesystem::remove(db_to_drop + ".db");
                     std::filesystem::remove(db_to_drop + ".db.del");
-                    active_db  = nullptr;
-                    active_mtx = nullptr;
-                    active_db_name.clear();
-                    success    = true;
+                    success = true;
                 }
             }
+            if (success) {
+                active.reset();
+                active_dim = 0;
+                active_db_name.clear();
+            }
 
             char resp = success ? '1' : '0';
             if (!send_all(&resp, 1)) break;
         }
         else if (cmd == CMD_SET_PROBES) {
             uint8_t new_probes = static_cast<uint8_t>(meta_data);
-            if (active_db && new_probes > 0) {
-                active_db->set_num_probes(new_probes);
+            if (new_probes > 0 && with_db([&](CoreEngine::RedBoxVector& db) { db.set_num_probes(new_probes); }))
                 std::cout << "[SERVER] Set num_probes = " << (int)new_probes << "\n";
-            }
             char resp = '1';
             if (!send_all(&resp, 1)) break;
         }
         else if (cmd == CMD_SET_HNSW_EF) {
             uint16_t new_ef = static_cast<uint16_t>(meta_data);
-            if (active_db) {
-                active_db->set_hnsw_ef_search(new_ef);
+            if (with_db([&](CoreEngine::RedBoxVector& db) { db.set_hnsw_ef_search(new_ef); }))
                 std::cout << "[SERVER] Set hnsw_ef_search = " << (int)new_ef << "\n";
-            }
             char resp = '1';
             if (!send_all(&resp, 1)) break;
         }
@@ -414,17 +608,21 @@ void handle_client(int client_socket, SharedState& state) {
             char zero = 0;
             if (!send_all(&zero, 1)) break;
 #else
-            if (!active_db || !state.meta) {
+            uint64_t vc = 0, cap = 0, nid = 0;
+            uint8_t idx = 0;
+            uint32_t dim = 0;
+            if (!state.meta || !with_db([&](CoreEngine::RedBoxVector& db) {
+                    vc  = db.get_count();
+                    cap = db.get_header()->max_capacity;
+                    nid = db.get_next_id();
+                    idx = static_cast<uint8_t>(db.get_index_type());
+                    dim = db.get_dim();
+                })) {
                 char zero = 0;
                 if (!send_all(&zero, 1)) break;
             } else {
                 char ok = 1;
                 if (!send_all(&ok, 1)) break;
-                uint64_t vc = active_db->get_count();
-                uint64_t cap = active_db->get_header()->max_capacity;
-                uint64_t nid = active_db->get_next_id();
-                uint8_t idx = static_cast<uint8_t>(active_db->get_index_type());
-                uint32_t dim = active_db->get_dim();
                 if (!send_all((char*)&vc, sizeof(vc))) break;
                 if (!send_all((char*)&cap, sizeof(cap))) break;
                 if (!send_all((char*)&nid, sizeof(nid))) break;
@@ -494,15 +692,17 @@ int main() {
                 std::string filename = data_dir + "/" + db.name + ".db";
                 std::lock_guard<std::mutex> lock(state.catalog_mutex);
                 if (params.index_type == static_cast<uint8_t>(CoreEngine::IndexType::HNSW)) {
-                    state.catalog[db.name] = std::make_unique<CoreEngine::RedBoxVector>(
+                    state.catalog[db.name] = make_entry(std::make_unique<CoreEngine::RedBoxVector>(
                         filename, params.dimensions, (int)params.max_capacity,
-                        params.hnsw_M, params.hnsw_ef_construction);
+                        params.hnsw_M, params.hnsw_ef_construction));
                 } else {
-                    state.catalog[db.name] = std::make_unique<CoreEngine::RedBoxVector>(
+                    state.catalog[db.name] = make_entry(std::make_unique<CoreEngine::RedBoxVector>(
                         filename, params.dimensions, (int)params.max_capacity,
-                        params.num_clusters, params.num_probes);
+                        params.num_clusters, params.num_probes));
+                    state.catalog[db.name]->db->set_background_training(true);
+                    state.catalog[db.name]->db->set_rebalance_params(auto_rebalance());
+                    state.catalog[db.name]->db->set_centroid_graph(true);
                 }
-                state.db_mutexes[db.name] = std::make_unique<std::mutex>();
                 std::cout << "[SERVER] Loaded DB from metadata: " << db.name
                           << " (dim=" << db.dimensions << " count=" << db.vector_count << ")\n";
             }
@@ -596,15 +796,16 @@ int main() {
     1        INSERT        Vector ID        Raw Float Data(Dim*4 bytes)          1 (Ack)
     2        SEARCH        (Ignored)        Raw Float Data (Dim*4 bytes)        Result ID (4 bytes)
     3        DELETE        Vector ID        (None)                               1 or 0 (Success/Fail)
-    4        SELECT_DB     Name Length      Database Name (UTF-8 String)         1 (Ack)
+    4        SELECT_DB     Name Len|Metric  Database Name (UTF-8 String)         1 (Ack)
     5        UPDATE        Vector ID        Raw Float Data (Dim*4 bytes)        1 or 0 (Success/Fail)
     6        INSERT_AUTO   (Ignored)        Raw Float Data (Dim*4 bytes)        Assigned ID (8 bytes)
     7        SEARCH_N      N (count)        Raw Float Data (Dim*4 bytes)        Count(4) + IDs(4*N)
     8        DROP_DB       (Ignored)        (None)                               1 or 0
     9        SET_PROBES    Probe count      (None)                               1 (Ack)
-    10       CREATE_HNSW   Name Length      Name + Dim(4) + Cap(4) + M(1) +     1 (Ack)
+    10       CREATE_HNSW   Name Len|Metric  Name + Dim(4) + Cap(4) + M(1) +     1 (Ack)
                                             ef_c(2)
     11       SET_HNSW_EF   ef value         (None)                               1 (Ack)
     12       LIST_DBS      (Ignored)        (None)                               Count(4) + Entries
     13       DB_INFO       (Ignored)        (None)                               OK(1) + VC(8)+Cap(8)+NID(8)+Type(1)+Dim(4)
+    14       CREATE_IVFPQ  Name Len|Metric  Name + Dim(4) + Cap(4) + m(1)        1 (Ack)
 */
\ No newline at end of file
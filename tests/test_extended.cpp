@@ -12,10 +12,20 @@
 #include <cstring>
 #include <fstream>
 #include <random>
+#include <limits>
+#include <chrono>
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
 #include "redboxdb/engine.hpp"
 #include "redboxdb/distance.hpp"
 #include "redboxdb/cluster_manager.hpp"
 #include "redboxdb/hnsw_manager.hpp"
+#include "redboxdb/sq8.hpp"
+#include "redboxdb/pq_manager.hpp"
+#include "redboxdb/bq.hpp"
+#include "redboxdb/thread_pool.hpp"
+#include "redboxdb/centroid_graph.hpp"
 #include <spdlog/spdlog.h>
 
 // =============================================================================
@@ -139,6 +149,169 @@ TEST_F(AVX2CorrectnessTest, L2DispatcherSelectsCorrectPath) {
     EXPECT_NEAR(via_avx2, via_scalar, 1e-4f);
 }
 
+TEST_F(AVX2CorrectnessTest, KernelTableMatchesScalarAtEveryLevel) {
+    // Every level up to the one this CPU supports must agree with scalar,
+    // including dims that exercise the AVX-512 masked tail.
+    auto top = Platform::detect_simd_level();
+    for (auto level : {Platform::SimdLevel::Scalar, Platform::SimdLevel::AVX2,
+                       Platform::SimdLevel::AVX512}) {
+        if (level > top) continue;
+        auto table = Distance::kernels_for(level);
+        EXPECT_EQ(table.level, level);
+        for (int dim : {1, 7, 15, 16, 17, 31, 33, 128, 129, 768}) {
+            auto a = make_vec(dim, dim);
+            auto b = make_vec(dim + 77, dim);
+            float scalar = Distance::l2_scalar(a.data(), b.data(), dim);
+            EXPECT_NEAR(table.l2(a.data(), b.data(), dim), scalar, 1e-3f * (1.0f + scalar))
+                << table.name << " dim=" << dim;
+        }
+    }
+}
+
+TEST_F(AVX2CorrectnessTest, FixedDimKernelsMatchScalar) {
+    using CoreEngine::Metric;
+    auto top = Platform::detect_simd_level();
+    for (auto level : {Platform::SimdLevel::AVX2, Platform::SimdLevel::AVX512}) {
+        if (level > top) continue;
+        for (int dim : {128, 384, 768, 1024, 1536}) {
+            auto a = make_vec(dim, dim);
+            auto b = make_vec(dim + 77, dim);
+            auto l2 = Distance::fixed_kernel_for(level, Metric::L2, dim);
+            auto ip = Distance::fixed_kernel_for(level, Metric::InnerProduct, dim);
+            ASSERT_NE(l2, nullptr) << "dim=" << dim;
+            ASSERT_NE(ip, nullptr) << "dim=" << dim;
+            float l2_ref = Distance::l2_scalar(a.data(), b.data(), dim);
+            float ip_ref = Distance::ip_scalar(a.data(), b.data(), dim);
+            EXPECT_NEAR(l2(a.data(), b.data(), dim), l2_ref, 1e-3f * (1.0f + l2_ref)) << "dim=" << dim;
+            EXPECT_NEAR(ip(a.data(), b.data(), dim), ip_ref, 1e-3f * (1.0f + std::fabs(ip_ref))) << "dim=" << dim;
+        }
+    }
+    // Unlisted dims (and the scalar level) fall back to the generic kernel.
+    EXPECT_EQ(Distance::fixed_kernel_for(top, Metric::L2, 129), nullptr);
+    EXPECT_EQ(Distance::fixed_kernel_for(Platform::SimdLevel::Scalar, Metric::L2, 128), nullptr);
+    const auto& table = Distance::kernels();
+    EXPECT_EQ(table.for_metric(Metric::L2, 129), table.l2);
+}
+
+TEST_F(AVX2CorrectnessTest, FourRowKernelsMatchSingleRow) {
+    auto top = Platform::detect_simd_level();
+    for (auto level : {Platform::SimdLevel::Scalar, Platform::SimdLevel::AVX2,
+                       Platform::SimdLevel::AVX512}) {
+        if (level > top) continue;
+        auto table = Distance::kernels_for(level);
+        for (int dim : {3, 16, 37, 128, 200}) {
+            auto q = make_vec(dim, dim);
+            std::vector<std::vector<float>> rows_v;
+            const float* rows[Distance::ROW_BLOCK];
+            for (int r = 0; r < Distance::ROW_BLOCK; ++r) rows_v.push_back(make_vec(dim * 10 + r, dim));
+            for (int r = 0; r < Distance::ROW_BLOCK; ++r) rows[r] = rows_v[r].data();
+
+            float l2[Distance::ROW_BLOCK], ip[Distance::ROW_BLOCK];
+            table.l2_x4(q.data(), rows, dim, std::numeric_limits<float>::max(), l2);
+            table.ip_x4(q.data(), rows, dim, std::numeric_limits<float>::max(), ip);
+            for (int r = 0; r < Distance::ROW_BLOCK; ++r) {
+                float l2_ref = Distance::l2_scalar(q.data(), rows[r], dim);
+                float ip_ref = Distance::ip_scalar(q.data(), rows[r], dim);
+                EXPECT_NEAR(l2[r], l2_ref, 1e-3f * (1.0f + l2_ref)) << table.name << " dim=" << dim;
+                EXPECT_NEAR(ip[r], ip_ref, 1e-3f * (1.0f + std::fabs(ip_ref))) << table.name << " dim=" << dim;
+            }
+
+            // With a bound below every row, each result is a partial sum >= bound.
+            float min_ref = std::numeric_limits<float>::max();
+            for (int r = 0; r < Distance::ROW_BLOCK; ++r)
+                min_ref = std::min(min_ref, Distance::l2_scalar(q.data(), rows[r], dim));
+            float bound = min_ref * 0.1f;
+            table.l2_x4(q.data(), rows, dim, bound, l2);
+            for (int r = 0; r < Distance::ROW_BLOCK; ++r) EXPECT_GE(l2[r], bound) << table.name;
+        }
+    }
+}
+
+TEST_F(AVX2CorrectnessTest, TileKernelsMatchSingleRow) {
+    auto top = Platform::detect_simd_level();
+    for (auto level : {Platform::SimdLevel::Scalar, Platform::SimdLevel::AVX2,
+                       Platform::SimdLevel::AVX512}) {
+        if (level > top) continue;
+        auto table = Distance::kernels_for(level);
+        size_t W = table.tile_rows;
+        ASSERT_LE(W, Distance::MAX_TILE_ROWS);
+        for (int dim : {1, 7, 16, 37, 128, 200}) {
+            auto q = make_vec(dim, dim);
+            // One full tile and a partial one (zero-padded lanes).
+            std::vector<std::vector<float>> rows_v;
+            std::vector<float> tiles;
+            for (size_t r = 0; r < W + 3; ++r) {
+                rows_v.push_back(make_vec(dim * 10 + (int)r, dim));
+                Distance::tile_pack(tiles, W, r, rows_v.back().data(), dim);
+            }
+            ASSERT_EQ(tiles.size(), 2 * W * dim);
+
+            float l2[Distance::MAX_TILE_ROWS], ip[Distance::MAX_TILE_ROWS];
+            for (size_t t = 0; t < 2; ++t) {
+                table.l2_tile(q.data(), tiles.data() + t * W * dim, dim, l2);
+                table.ip_tile(q.data(), tiles.data() + t * W * dim, dim, ip);
+                for (size_t l = 0; l < W && t * W + l < rows_v.size(); ++l) {
+                    const float* row = rows_v[t * W + l].data();
+                    float l2_ref = Distance::l2_scalar(q.data(), row, dim);
+                    float ip_ref = Distance::ip_scalar(q.data(), row, dim);
+                    EXPECT_NEAR(l2[l], l2_ref, 1e-3f * (1.0f + l2_ref)) << table.name << " dim=" << dim;
+                    EXPECT_NEAR(ip[l], ip_ref, 1e-3f * (1.0f + std::fabs(ip_ref))) << table.name << " dim=" << dim;
+                }
+            }
+        }
+    }
+}
+
+TEST_F(AVX2CorrectnessTest, HeuristicSameWithFourRowKernel) {
+    const size_t DIM = 48;
+    const int COUNT = 60;
+    std::vector<float> block;
+    for (int i = 0; i < COUNT; ++i) { auto v = make_vec(i, DIM); block.insert(block.end(), v.begin(), v.end()); }
+    auto q = make_vec(999, DIM);
+    const auto& table = Distance::kernels();
+    std::vector<HnswManager::SearchResult> cands;
+    for (int i = 0; i < COUNT; ++i)
+        cands.push_back({ table.l2(q.data(), block.data() + i * DIM, DIM), (uint32_t)i });
+
+    for (int M : {4, 8, 16, 32}) {
+        auto plain   = HnswManager::select_neighbors_heuristic(cands, M, block.data(), DIM, table.l2);
+        auto blocked = HnswManager::select_neighbors_heuristic(cands, M, block.data(), DIM, table.l2, table.l2_x4);
+        EXPECT_EQ(plain, blocked) << "M=" << M;
+    }
+}
+
+TEST_F(AVX2CorrectnessTest, BoundedL2AbandonsOnlyPastBound) {
+    auto top = Platform::detect_simd_level();
+    for (auto level : {Platform::SimdLevel::Scalar, Platform::SimdLevel::AVX2,
+                       Platform::SimdLevel::AVX512}) {
+        if (level > top) continue;
+        auto table = Distance::kernels_for(level);
+        for (int dim : {7, 64, 100, 128, 200, 1536}) {
+            auto a = make_vec(dim * 3, dim);
+            auto b = make_vec(dim * 3 + 1, dim);
+            float full = Distance::l2_scalar(a.data(), b.data(), dim);
+            // Unreachable bound: the exact distance.
+            float exact = table.l2_bounded(a.data(), b.data(), dim, std::numeric_limits<float>::max());
+            EXPECT_NEAR(exact, full, 1e-3f * (1.0f + full)) << table.name << " dim=" << dim;
+            // Tight bound: stops early, but never reports less than the bound.
+            float bound = full * 0.1f;
+            float cut = table.l2_bounded(a.data(), b.data(), dim, bound);
+            EXPECT_GE(cut, bound) << table.name << " dim=" << dim;
+            EXPECT_LE(cut, full * (1.0f + 1e-3f)) << table.name << " dim=" << dim;
+        }
+    }
+    EXPECT_EQ(Distance::kernels().bounded_for_metric(CoreEngine::Metric::InnerProduct, 1536), nullptr);
+    EXPECT_EQ(Distance::kernels().bounded_for_metric(CoreEngine::Metric::L2, 64), nullptr);
+    EXPECT_NE(Distance::kernels().bounded_for_metric(CoreEngine::Metric::L2, 1536), nullptr);
+}
+
+TEST_F(AVX2CorrectnessTest, RegistryPicksDetectedLevel) {
+    const auto& table = Distance::kernels();
+    EXPECT_EQ(table.level, Platform::detect_simd_level());
+    EXPECT_EQ(&table, &Distance::kernels()) << "table must be probed once and cached";
+    EXPECT_EQ(Platform::has_avx2(), table.level >= Platform::SimdLevel::AVX2);
+}
+
 TEST_F(AVX2CorrectnessTest, SearchConsistencyWithScalar) {
     // Verify that inserting vectors with AVX2 engine produces the same search
     // results as a brute-force scalar scan would
@@ -407,7 +580,7 @@ TEST_F(KMeansTest, KMeansProducesDistinctCentroids) {
 
     ClusterManager::kmeans_plus_plus_init(
         centroid_block.data(), cluster_count.data(), cluster_block.data(),
-        float_block.data(), K, N, DIM, true);
+        float_block.data(), K, N, DIM, Distance::kernels().l2);
 
     // All centroids should be distinct (no two identical)
     for (uint16_t i = 0; i < K; ++i) {
@@ -437,7 +610,7 @@ TEST_F(KMeansTest, KMeansClusterCountsSumToN) {
 
     ClusterManager::kmeans_plus_plus_init(
         centroid_block.data(), cluster_count.data(), cluster_block.data(),
-        float_block.data(), K, N, DIM, true);
+        float_block.data(), K, N, DIM, Distance::kernels().l2);
 
     uint64_t total = 0;
     for (uint16_t c = 0; c < K; ++c) total += cluster_count[c];
@@ -460,7 +633,7 @@ TEST_F(KMeansTest, KMeansClusterAssignmentsValid) {
 
     ClusterManager::kmeans_plus_plus_init(
         centroid_block.data(), cluster_count.data(), cluster_block.data(),
-        float_block.data(), K, N, DIM, true);
+        float_block.data(), K, N, DIM, Distance::kernels().l2);
 
     for (size_t i = 0; i < N; ++i) {
         EXPECT_LT(cluster_block[i], K)
@@ -484,7 +657,7 @@ TEST_F(KMeansTest, KMeansCentroidsAreActualMeans) {
 
     ClusterManager::kmeans_plus_plus_init(
         centroid_block.data(), cluster_count.data(), cluster_block.data(),
-        float_block.data(), K, N, DIM, true);
+        float_block.data(), K, N, DIM, Distance::kernels().l2);
 
     // Verify centroids are the mean of their assigned vectors
     for (uint16_t c = 0; c < K; ++c) {
@@ -523,19 +696,19 @@ TEST_F(KMeansTest, FindNearestCentroidReturnsClosest) {
     // Query near centroid 2
     std::vector<float> query = {0.0f, 9.0f, 0.0f, 0.0f};
     uint16_t result = ClusterManager::find_nearest_centroid(
-        query.data(), centroids.data(), K, DIM, true);
+        query.data(), centroids.data(), K, DIM, Distance::kernels().l2);
     EXPECT_EQ(result, 2);
 
     // Query near centroid 0
     query = {0.1f, 0.1f, 0.1f, 0.1f};
     result = ClusterManager::find_nearest_centroid(
-        query.data(), centroids.data(), K, DIM, true);
+        query.data(), centroids.data(), K, DIM, Distance::kernels().l2);
     EXPECT_EQ(result, 0);
 
     // Query near centroid 4
     query = {0.0f, 0.0f, 0.0f, 9.5f};
     result = ClusterManager::find_nearest_centroid(
-        query.data(), centroids.data(), K, DIM, true);
+        query.data(), centroids.data(), K, DIM, Distance::kernels().l2);
     EXPECT_EQ(result, 4);
 }
 
@@ -581,6 +754,107 @@ TEST_F(KMeansTest, KMeansEndToEndThroughEngine) {
     EXPECT_FALSE(results.empty());
 }
 
+TEST_F(KMeansTest, EarlyAbandonScanMatchesBruteForce) {
+    // dim 256 takes the early-abandoning kernel; results must not change.
+    const int DIM = 256, N = 800;
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10);
+    std::vector<std::vector<float>> vecs;
+    for (int i = 0; i < N; ++i) {
+        vecs.push_back(make_vec(i, DIM));
+        db.insert((uint64_t)(i + 1), vecs.back());
+    }
+    for (int q = 0; q < 10; ++q) {
+        auto query = make_vec(5000 + q, DIM);
+        std::vector<std::pair<float, int>> all;
+        for (int i = 0; i < N; ++i) all.push_back({ l2_ref(vecs[i], query), i + 1 });
+        std::sort(all.begin(), all.end());
+
+        auto got = db.search_N(query, 10);
+        ASSERT_EQ(got.size(), 10u);
+        for (int r = 0; r < 10; ++r) EXPECT_EQ(got[r], all[r].second) << "query " << q << " rank " << r;
+        EXPECT_EQ(db.search(query), all[0].second);
+    }
+}
+
+
+namespace {
+    struct KMeansRun {
+        std::vector<float>    centroids;
+        std::vector<uint64_t> counts;
+        std::vector<uint16_t> assign;
+    };
+
+    KMeansRun train(const std::vector<float>& data, size_t dim, uint16_t k,
+                    const ClusterManager::TrainParams& params, Parallel::ThreadPool* pool) {
+        size_t n = data.size() / dim;
+        KMeansRun r{ std::vector<float>(k * dim), std::vector<uint64_t>(k), std::vector<uint16_t>(n) };
+        ClusterManager::kmeans_train(r.centroids.data(), r.counts.data(), r.assign.data(), data.data(),
+                                     k, n, dim, Distance::kernels().l2, params, pool);
+        return r;
+    }
+
+    double inertia(const std::vector<float>& data, size_t dim, const KMeansRun& r) {
+        double sum = 0.0;
+        for (size_t i = 0; i < r.assign.size(); ++i)
+            sum += Distance::l2_scalar(data.data() + i * dim, r.centroids.data() + r.assign[i] * dim, dim);
+        return sum;
+    }
+}
+
+TEST_F(KMeansTest, TrainingIsIndependentOfThreadCount) {
+    const size_t DIM = 12, N = 6000;
+    const uint16_t K = 24;
+    std::vector<float> data;
+    for (size_t i = 0; i < N; ++i) { auto v = make_vec((int)i, DIM); data.insert(data.end(), v.begin(), v.end()); }
+
+    Parallel::ThreadPool pool(3);
+    for (int rounds : {0, 3}) {
+        ClusterManager::TrainParams params{ 100, 3, rounds };   // sample 2400 of 6000
+        auto serial   = train(data, DIM, K, params, nullptr);
+        auto parallel = train(data, DIM, K, params, &pool);
+        EXPECT_EQ(serial.centroids, parallel.centroids) << "rounds=" << rounds;
+        EXPECT_EQ(serial.assign, parallel.assign) << "rounds=" << rounds;
+        EXPECT_EQ(serial.counts, parallel.counts) << "rounds=" << rounds;
+        EXPECT_EQ(std::accumulate(serial.counts.begin(), serial.counts.end(), uint64_t{ 0 }), N);
+    }
+}
+
+TEST_F(KMeansTest, LloydRefinementLowersInertia) {
+    const size_t DIM = 8, N = 3000;
+    const uint16_t K = 16;
+    std::vector<float> data;
+    for (size_t i = 0; i < N; ++i) { auto v = make_vec((int)i, DIM); data.insert(data.end(), v.begin(), v.end()); }
+
+    for (int rounds : {0, 4}) {
+        double seeded  = inertia(data, DIM, train(data, DIM, K, { 0, 0, rounds }, nullptr));
+        double refined = inertia(data, DIM, train(data, DIM, K, { 0, 8, rounds }, nullptr));
+        EXPECT_LE(refined, seeded) << "rounds=" << rounds;
+    }
+}
+
+TEST_F(KMeansTest, ParallelSeedingFindsSeparatedBlobs) {
+    const size_t DIM = 6, PER_BLOB = 200;
+    const uint16_t K = 12;
+    std::mt19937 rng(7);
+    std::normal_distribution<float> noise(0.0f, 0.05f);
+    std::vector<float> data;
+    for (uint16_t b = 0; b < K; ++b) {
+        auto center = make_vec(1000 + b, DIM);
+        for (auto& x : center) x *= 20.0f;
+        for (size_t i = 0; i < PER_BLOB; ++i)
+            for (size_t d = 0; d < DIM; ++d) data.push_back(center[d] + noise(rng));
+    }
+
+    Parallel::ThreadPool pool(2);
+    auto r = train(data, DIM, K, { 0, 2, 3 }, &pool);
+    std::set<uint16_t> used;
+    for (uint16_t b = 0; b < K; ++b) {
+        uint16_t c = r.assign[b * PER_BLOB];
+        for (size_t i = 1; i < PER_BLOB; ++i) ASSERT_EQ(r.assign[b * PER_BLOB + i], c) << "blob " << b;
+        used.insert(c);
+    }
+    EXPECT_EQ(used.size(), (size_t)K);
+}
 
 // =============================================================================
 // 4. SERVER PROTOCOL PARSING UNIT TESTS
@@ -869,3 +1143,1922 @@ TEST_F(CorruptionTest, DoubleCloseHandled) {
         EXPECT_EQ(db.search({1.0f, 0.0f, 0.0f}), 1);
     }
 }
+
+
+// =============================================================================
+// 6. METRIC TESTS (inner product / cosine)
+// =============================================================================
+class MetricTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_metric"); ExtFixture::SetUp(); }
+};
+
+TEST_F(MetricTest, InnerProductKernelsMatchScalar) {
+    auto top = Platform::detect_simd_level();
+    for (auto level : {Platform::SimdLevel::Scalar, Platform::SimdLevel::AVX2,
+                       Platform::SimdLevel::AVX512}) {
+        if (level > top) continue;
+        auto table = Distance::kernels_for(level);
+        for (int dim : {1, 7, 16, 17, 33, 128, 769}) {
+            auto a = make_vec(dim, dim);
+            auto b = make_vec(dim + 3, dim);
+            float dot = 0.0f;
+            for (int d = 0; d < dim; ++d) dot += a[d] * b[d];
+            EXPECT_NEAR(table.dot(a.data(), b.data(), dim), dot, 1e-3f) << table.name << " dim=" << dim;
+            EXPECT_NEAR(table.ip(a.data(), b.data(), dim), 1.0f - dot, 1e-3f) << table.name << " dim=" << dim;
+        }
+    }
+}
+
+TEST_F(MetricTest, NormalizeProducesUnitVector) {
+    auto v = make_vec(9, 37);
+    Distance::normalize(v.data(), v.size());
+    EXPECT_NEAR(Distance::dot_scalar(v.data(), v.data(), v.size()), 1.0f, 1e-5f);
+
+    std::vector<float> zero(8, 0.0f);
+    Distance::normalize(zero.data(), zero.size());
+    for (float x : zero) EXPECT_EQ(x, 0.0f);
+}
+
+TEST_F(MetricTest, InnerProductPrefersLargerProjection) {
+    CoreEngine::RedBoxVector db(db_file, 3, 100, (uint16_t)10, (uint8_t)1,
+                                CoreEngine::Metric::InnerProduct);
+    db.insert(1, {1.0f, 0.0f, 0.0f});
+    db.insert(2, {10.0f, 0.0f, 0.0f});
+    db.insert(3, {0.0f, 1.0f, 0.0f});
+
+    // L2 would pick 1 (exact match); max inner product is 2.
+    EXPECT_EQ(db.search({1.0f, 0.0f, 0.0f}), 2);
+    auto top = db.search_N({1.0f, 0.0f, 0.0f}, 3);
+    ASSERT_EQ(top.size(), 3u);
+    EXPECT_EQ(top[0], 2);
+    EXPECT_EQ(top[1], 1);
+}
+
+TEST_F(MetricTest, CosineIgnoresMagnitude) {
+    CoreEngine::RedBoxVector db(db_file, 3, 100, (uint16_t)10, (uint8_t)1,
+                                CoreEngine::Metric::Cosine);
+    db.insert(1, {100.0f, 0.0f, 0.0f});
+    db.insert(2, {0.1f, 0.1f, 0.0f});
+
+    // L2 would pick 2 (it's near the origin); cosine picks the same direction.
+    EXPECT_EQ(db.search({1.0f, 0.0f, 0.0f}), 1);
+    EXPECT_EQ(db.search({0.0f, 3.0f, 3.0f}), 2);
+}
+
+TEST_F(MetricTest, MetricPersistsAcrossReopen) {
+    {
+        CoreEngine::RedBoxVector db(db_file, 3, 100, (uint16_t)10, (uint8_t)1,
+                                    CoreEngine::Metric::Cosine);
+        db.insert(1, {100.0f, 0.0f, 0.0f});
+        db.insert(2, {0.1f, 0.1f, 0.0f});
+    }
+    // Reopened with the default (L2) metric argument: the file's metric wins.
+    CoreEngine::RedBoxVector db(db_file, 3, 100, (uint16_t)10, (uint8_t)1);
+    EXPECT_EQ(db.get_metric(), CoreEngine::Metric::Cosine);
+    EXPECT_EQ(db.search({1.0f, 0.0f, 0.0f}), 1);
+}
+
+TEST_F(MetricTest, HnswCosineSearchN) {
+    const int DIM = 16;
+    CoreEngine::RedBoxVector db(db_file, DIM, 300, (uint8_t)8, (uint16_t)50,
+                                CoreEngine::Metric::Cosine);
+    std::vector<std::vector<float>> vecs;
+    for (int i = 0; i < 200; ++i) {
+        auto v = make_vec(i, DIM);
+        vecs.push_back(v);
+        // Scale each vector differently; cosine must not care.
+        for (auto& x : v) x *= (float)(1 + i % 7);
+        db.insert((uint64_t)(i + 1), v);
+    }
+    db.set_hnsw_ef_search(100);
+
+    int hits = 0;
+    for (int q = 0; q < 20; ++q) {
+        auto res = db.search_N(vecs[q], 5);
+        ASSERT_FALSE(res.empty());
+        if (res[0] == q + 1) ++hits;
+    }
+    EXPECT_GE(hits, 18);
+}
+
+
+// =============================================================================
+// 7. SQ8 STORAGE TESTS
+// =============================================================================
+class Sq8Test : public ExtFixture {
+protected:
+    void SetUp() override { init("test_sq8"); ExtFixture::SetUp(); }
+
+    // Exact top-N by brute force, as 1-based ids.
+    static std::vector<int> exact_top(const std::vector<std::vector<float>>& vecs,
+                                      const std::vector<float>& q, int N) {
+        std::vector<std::pair<float, int>> all;
+        for (size_t i = 0; i < vecs.size(); ++i) all.push_back({ l2_ref(vecs[i], q), (int)i + 1 });
+        std::partial_sort(all.begin(), all.begin() + N, all.end());
+        std::vector<int> ids;
+        for (int i = 0; i < N; ++i) ids.push_back(all[i].second);
+        return ids;
+    }
+};
+
+TEST_F(Sq8Test, EncodeDecodeWithinHalfStep) {
+    const int DIM = 37, N = 200;
+    std::vector<float> data;
+    for (int i = 0; i < N; ++i) { auto v = make_vec(i, DIM); data.insert(data.end(), v.begin(), v.end()); }
+
+    std::vector<float> vmin(DIM), scale(DIM), back(DIM);
+    std::vector<uint8_t> code(DIM);
+    Sq8::train(data.data(), N, DIM, vmin.data(), scale.data());
+    for (int i = 0; i < N; ++i) {
+        Sq8::encode(data.data() + i * DIM, vmin.data(), scale.data(), DIM, code.data());
+        Sq8::decode(code.data(), vmin.data(), scale.data(), DIM, back.data());
+        for (int d = 0; d < DIM; ++d)
+            ASSERT_LE(std::fabs(back[d] - data[i * DIM + d]), 0.5f * scale[d] + 1e-6f);
+    }
+
+    // Out-of-range values clamp instead of wrapping.
+    std::vector<float> big(DIM, 100.0f), small(DIM, -100.0f);
+    Sq8::encode(big.data(), vmin.data(), scale.data(), DIM, code.data());
+    EXPECT_EQ(code[0], 255);
+    Sq8::encode(small.data(), vmin.data(), scale.data(), DIM, code.data());
+    EXPECT_EQ(code[0], 0);
+}
+
+TEST_F(Sq8Test, QueryDistanceMatchesDecodedVector) {
+    const int N = 64;
+    for (int dim : {5, 16, 33, 128}) {
+        std::vector<float> data;
+        for (int i = 0; i < N; ++i) { auto v = make_vec(i + dim, dim); data.insert(data.end(), v.begin(), v.end()); }
+        std::vector<float> vmin(dim), scale(dim), back(dim);
+        std::vector<uint8_t> code(dim);
+        Sq8::train(data.data(), N, dim, vmin.data(), scale.data());
+        Sq8::encode(data.data() + 3 * dim, vmin.data(), scale.data(), dim, code.data());
+        Sq8::decode(code.data(), vmin.data(), scale.data(), dim, back.data());
+
+        auto q = make_vec(999, dim);
+        for (auto metric : {CoreEngine::Metric::L2, CoreEngine::Metric::InnerProduct}) {
+            Sq8::Query sq;
+            sq.prepare(q.data(), vmin.data(), scale.data(), dim, metric);
+            float ref = (metric == CoreEngine::Metric::L2)
+                ? Distance::l2_scalar(q.data(), back.data(), dim)
+                : Distance::ip_scalar(q.data(), back.data(), dim);
+            EXPECT_NEAR(sq.distance(code.data()), ref, 1e-3f * (1.0f + std::fabs(ref))) << "dim=" << dim;
+
+            // SIMD and scalar SQ8 kernels agree.
+            auto scalar = Sq8::kernels_for(Platform::SimdLevel::Scalar);
+            sq.k = scalar;
+            EXPECT_NEAR(sq.distance(code.data()), ref, 1e-3f * (1.0f + std::fabs(ref))) << "dim=" << dim;
+        }
+    }
+}
+
+TEST_F(Sq8Test, IvfSearchTrainsWithKMeansAndKeepsRecall) {
+    const int DIM = 16, N = 10000, K = 16;
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)4,
+                                CoreEngine::Metric::L2, CoreEngine::StorageMode::SQ8);
+    EXPECT_EQ(db.get_storage_mode(), CoreEngine::StorageMode::SQ8);
+
+    std::vector<std::vector<float>> vecs;
+    for (int i = 0; i < N; ++i) {
+        vecs.push_back(make_vec(i, DIM));
+        db.insert((uint64_t)(i + 1), vecs.back());
+    }
+    ASSERT_TRUE(db.get_header()->codes_trained);
+
+    // Queries are stored vectors: with rerank the exact match must come first.
+    int hits = 0;
+    for (int q = 0; q < 50; ++q) {
+        if (db.search(vecs[q * 37]) == q * 37 + 1) ++hits;
+        auto res = db.search_N(vecs[q * 37], 5);
+        ASSERT_EQ(res.size(), 5u);
+    }
+    EXPECT_GE(hits, 48);
+
+    // SQ8-only ranking stays close to exact on fresh queries.
+    db.set_rerank(false);
+    db.set_num_probes((uint8_t)K);
+    int overlap = 0;
+    for (int q = 0; q < 20; ++q) {
+        auto query = make_vec(100000 + q, DIM);
+        auto got = db.search_N(query, 10);
+        auto want = exact_top(vecs, query, 10);
+        for (int id : got)
+            if (std::find(want.begin(), want.end(), id) != want.end()) ++overlap;
+    }
+    EXPECT_GE(overlap, 170);  // >= 85% recall@10
+
+    // Updates re-encode: without rerank a moved vector is only found at its
+    // new position if its code changed too.
+    auto moved = make_vec(777777, DIM);
+    ASSERT_TRUE(db.update(5, moved));
+    EXPECT_EQ(db.search(moved), 5);
+}
+
+TEST_F(Sq8Test, HnswTrainsAfterThresholdAndPersists) {
+    const int DIM = 16, N = 1500;
+    std::vector<std::vector<float>> vecs;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint8_t)8, (uint16_t)100,
+                                    CoreEngine::Metric::L2, CoreEngine::StorageMode::SQ8);
+        for (int i = 0; i < N; ++i) {
+            vecs.push_back(make_vec(i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+            if (i == 500) { EXPECT_FALSE(db.get_header()->codes_trained); }
+        }
+        EXPECT_TRUE(db.get_header()->codes_trained);
+    }
+
+    // Reopened without asking for SQ8: the file's mode wins.
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint8_t)8, (uint16_t)100);
+    EXPECT_EQ(db.get_storage_mode(), CoreEngine::StorageMode::SQ8);
+    db.set_hnsw_ef_search(64);
+
+    int hits = 0;
+    for (int q = 0; q < 50; ++q) {
+        int idx = q * 29 + 1;
+        auto res = db.search_N(vecs[idx], 3);
+        ASSERT_FALSE(res.empty());
+        if (res[0] == idx + 1) ++hits;
+    }
+    EXPECT_GE(hits, 47);
+}
+
+// =============================================================================
+// 8. IVF-PQ TESTS
+// =============================================================================
+class PqTest : public Sq8Test {
+protected:
+    void SetUp() override { init("test_pq"); ExtFixture::SetUp(); }
+};
+
+TEST_F(PqTest, PackRoundTripsAndScanKernelsAgree) {
+    const size_t M = 12, COUNT = 70;   // spans three blocks, last one partial
+    std::mt19937 rng(7);
+    std::vector<std::vector<uint8_t>> codes(COUNT, std::vector<uint8_t>(PqManager::code_bytes(M)));
+    std::vector<uint8_t> blocks;
+    for (size_t i = 0; i < COUNT; ++i) {
+        for (auto& b : codes[i]) b = (uint8_t)(rng() & 0xFF);
+        PqManager::pack(blocks, i, codes[i].data(), M);
+    }
+    ASSERT_EQ(blocks.size(), 3 * PqManager::block_bytes(M));
+
+    std::vector<uint8_t> lut(M * 16);
+    for (auto& t : lut) t = (uint8_t)(rng() & 0xFF);
+
+    auto fast = PqManager::scan_block();
+    uint16_t ref[PqManager::BLOCK], got[PqManager::BLOCK];
+    for (size_t b = 0; b < 3; ++b) {
+        const uint8_t* blk = blocks.data() + b * PqManager::block_bytes(M);
+        PqManager::scan_block_scalar(blk, lut.data(), M, ref);
+        fast(blk, lut.data(), M, got);
+        for (int i = 0; i < PqManager::BLOCK; ++i) {
+            EXPECT_EQ(got[i], ref[i]) << "block " << b << " lane " << i;
+            size_t v = b * PqManager::BLOCK + i;
+            if (v >= COUNT) continue;
+            uint32_t want = 0;
+            for (size_t j = 0; j < M; ++j) want += lut[j * 16 + PqManager::get_code(codes[v].data(), j)];
+            EXPECT_EQ(ref[i], want) << "vector " << v;
+        }
+    }
+}
+
+TEST_F(PqTest, LutDistanceMatchesDecodedVector) {
+    const size_t DIM = 32, M = 8, N = 500, DSUB = DIM / M;
+    std::vector<float> centroid = make_vec(1, DIM), data;
+    for (size_t i = 0; i < N; ++i) {
+        auto v = make_vec((int)i + 10, DIM);
+        for (size_t d = 0; d < DIM; ++d) data.push_back(v[d] - centroid[d]);
+    }
+    std::vector<float> codebook(M * PqManager::KSUB * DSUB);
+    PqManager::train(data.data(), N, DIM, M, codebook.data());
+
+    std::vector<uint8_t> code(PqManager::code_bytes(M));
+    PqManager::encode(data.data(), codebook.data(), DIM, M, code.data());
+    // Reconstruction: centroid + codewords
+    std::vector<float> back(DIM);
+    for (size_t j = 0; j < M; ++j) {
+        const float* cw = codebook.data() + (j * PqManager::KSUB + PqManager::get_code(code.data(), j)) * DSUB;
+        for (size_t d = 0; d < DSUB; ++d) back[j * DSUB + d] = centroid[j * DSUB + d] + cw[d];
+    }
+
+    auto q = make_vec(4242, DIM);
+    for (bool is_l2 : {true, false}) {
+        PqManager::Lut lut;
+        lut.build(q.data(), centroid.data(), codebook.data(), DIM, M, is_l2);
+        uint32_t sum = 0;
+        for (size_t j = 0; j < M; ++j) sum += lut.q[j * 16 + PqManager::get_code(code.data(), j)];
+        float approx = lut.bias + lut.scale * (float)sum;
+        float ref = is_l2 ? Distance::l2_scalar(q.data(), back.data(), DIM)
+                          : Distance::ip_scalar(q.data(), back.data(), DIM);
+        // uint8 tables: each term is off by at most half a step
+        EXPECT_NEAR(approx, ref, 0.5f * lut.scale * M + 1e-4f) << (is_l2 ? "l2" : "ip");
+    }
+}
+
+TEST_F(PqTest, IvfPqSearchRerankAndReopen) {
+    const int DIM = 16, N = 10000, K = 16;
+    std::vector<std::vector<float>> vecs;
+    {
+        CoreEngine::RedBoxVector::IvfPqParams pq;
+        pq.k = K;
+        pq.num_probes = 4;
+        pq.pq_m = 8;
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, pq);
+        EXPECT_EQ(db.get_index_type(), CoreEngine::IndexType::IVF_PQ);
+        for (int i = 0; i < N; ++i) {
+            vecs.push_back(make_vec(i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+        }
+        ASSERT_TRUE(db.get_header()->pq_trained);
+        EXPECT_EQ(db.get_header()->pq_m, 8);
+    }
+
+    // Reopened through the plain IVF constructor: type and m come from the file.
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)K);
+    ASSERT_EQ(db.get_index_type(), CoreEngine::IndexType::IVF_PQ);
+    EXPECT_EQ(db.get_header()->pq_m, 8);
+
+    int hits = 0;
+    for (int q = 0; q < 50; ++q)
+        if (db.search(vecs[q * 37]) == q * 37 + 1) ++hits;
+    EXPECT_GE(hits, 48);
+
+    // Codes only: coarser than SQ8, but still finds most true neighbours.
+    db.set_rerank(false);
+    int overlap = 0;
+    for (int q = 0; q < 20; ++q) {
+        auto query = make_vec(100000 + q, DIM);
+        auto got = db.search_N(query, 10);
+        auto want = exact_top(vecs, query, 10);
+        for (int id : got)
+            if (std::find(want.begin(), want.end(), id) != want.end()) ++overlap;
+    }
+    EXPECT_GE(overlap, 100);  // >= 50% recall@10 at 4 bytes per vector
+
+    // Updates and deletes reach the fast-scan blocks. A small move keeps
+    // the slot in its cluster, so the code is rewritten in place.
+    db.set_rerank(true);
+    auto moved = vecs[4];
+    for (auto& x : moved) x += 0.05f;
+    ASSERT_TRUE(db.update(5, moved));
+    EXPECT_EQ(db.search(moved), 5);
+    ASSERT_TRUE(db.remove(5));
+    EXPECT_NE(db.search(moved), 5);
+}
+
+TEST_F(PqTest, UpdateAcrossClustersMovesMemberCount) {
+    const int DIM = 16, N = 10000, K = 16;
+    auto counts_and_cluster = [&](uint64_t id, std::vector<uint64_t>& counts) {
+        StorageManager::Manager m(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)K);
+        counts.assign(m.get_cluster_count_block(), m.get_cluster_count_block() + K);
+        for (int i = 0; i < (int)m.get_count(); ++i)
+            if (m.get_id(i) == id) return (int)m.get_cluster(i);
+        return -1;
+    };
+
+    std::vector<std::vector<float>> vecs;
+    {
+        CoreEngine::RedBoxVector::IvfPqParams pq;
+        pq.k = K;
+        pq.num_probes = 4;
+        pq.pq_m = 8;
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, pq);
+        for (int i = 0; i < N; ++i) {
+            vecs.push_back(make_vec(i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+        }
+        ASSERT_TRUE(db.get_header()->pq_trained);
+    }
+
+    std::vector<uint64_t> before, after;
+    int old_c = counts_and_cluster(1, before);
+    ASSERT_GE(old_c, 0);
+    // Move id 1 onto a vector from a different cluster.
+    int donor = -1;
+    for (int i = 1; i < N && donor < 0; ++i) {
+        std::vector<uint64_t> unused;
+        if (counts_and_cluster((uint64_t)(i + 1), unused) != old_c) donor = i;
+    }
+    ASSERT_GE(donor, 0);
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)K);
+        ASSERT_TRUE(db.update(1, vecs[donor]));
+    }
+    int new_c = counts_and_cluster(1, after);
+    ASSERT_NE(new_c, old_c);
+    EXPECT_EQ(after[old_c], before[old_c] - 1);
+    EXPECT_EQ(after[new_c], before[new_c] + 1);
+}
+
+TEST_F(PqTest, ReopenBeforeTrainingThenCrossThreshold) {
+    const int DIM = 16, N = 10000, K = 16, FIRST = 9000;
+    std::vector<std::vector<float>> vecs;
+    for (int i = 0; i < N; ++i) vecs.push_back(make_vec(i, DIM));
+    {
+        CoreEngine::RedBoxVector::IvfPqParams pq;
+        pq.k = K;
+        pq.num_probes = 4;
+        pq.pq_m = 8;
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, pq);
+        for (int i = 0; i < FIRST; ++i) db.insert((uint64_t)(i + 1), vecs[i]);
+        ASSERT_FALSE(db.get_header()->pq_trained);
+    }
+
+    // Training runs on the reopened file; every fast-scan block must be
+    // filled from the new cluster lists.
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)K);
+    for (int i = FIRST; i < N; ++i) db.insert((uint64_t)(i + 1), vecs[i]);
+    ASSERT_TRUE(db.get_header()->pq_trained);
+
+    int hits = 0;
+    for (int q = 0; q < 50; ++q) {
+        auto got = db.search_N(vecs[q * 197], 10);
+        ASSERT_FALSE(got.empty());
+        if (got[0] == q * 197 + 1) ++hits;
+    }
+    EXPECT_GE(hits, 48);
+}
+
+// =============================================================================
+// 9. BINARY QUANTIZATION TESTS
+// =============================================================================
+class BqTest : public Sq8Test {
+protected:
+    void SetUp() override { init("test_bq"); ExtFixture::SetUp(); }
+};
+
+TEST_F(BqTest, EncodeAndHammingKernelsAgree) {
+    std::mt19937_64 rng(11);
+    for (size_t nw : {1, 3, 4, 7, 12}) {
+        std::vector<uint64_t> a(nw), b(nw);
+        for (auto& w : a) w = rng();
+        for (auto& w : b) w = rng();
+        uint32_t ref = Bq::hamming_scalar(a.data(), b.data(), nw);
+        EXPECT_EQ(Bq::hamming()(a.data(), b.data(), nw), ref) << "words=" << nw;
+        EXPECT_EQ(Bq::hamming_scalar(a.data(), a.data(), nw), 0u);
+    }
+
+    // Bits follow the mean threshold; bits past dim stay clear.
+    const size_t DIM = 70;
+    std::vector<float> mean(DIM, 0.5f), v(DIM, 0.0f);
+    v[0] = 1.0f; v[65] = 1.0f;
+    std::vector<uint64_t> code(Bq::words(DIM));
+    Bq::encode(v.data(), mean.data(), DIM, code.data());
+    EXPECT_EQ(code[0], 1ull);
+    EXPECT_EQ(code[1], 2ull);
+}
+
+TEST_F(BqTest, FlatScanRerankFindsNeighboursAndPersists) {
+    const int DIM = 64, N = 3000;
+    std::vector<std::vector<float>> vecs;
+    for (int i = 0; i < N; ++i) {
+        auto v = make_vec(i, DIM);
+        for (auto& x : v) x += 0.5f;   // off-centre: sign bits alone would be mostly 1
+        vecs.push_back(v);
+    }
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)16, (uint8_t)4,
+                                    CoreEngine::Metric::L2, CoreEngine::StorageMode::BINARY);
+        for (int i = 0; i < N; ++i) {
+            db.insert((uint64_t)(i + 1), vecs[i]);
+            if (i == 500) { EXPECT_FALSE(db.get_header()->codes_trained); }
+        }
+        EXPECT_TRUE(db.get_header()->codes_trained);
+    }
+
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)16, (uint8_t)4);
+    EXPECT_EQ(db.get_storage_mode(), CoreEngine::StorageMode::BINARY);
+
+    int hits = 0;
+    for (int q = 0; q < 50; ++q)
+        if (db.search(vecs[q * 53]) == q * 53 + 1) ++hits;
+    EXPECT_EQ(hits, 50);
+
+    auto recall = [&](int queries) {
+        int overlap = 0;
+        for (int q = 0; q < queries; ++q) {
+            auto query = make_vec(100000 + q, DIM);
+            for (auto& x : query) x += 0.5f;
+            auto got = db.search_N(query, 10);
+            auto want = exact_top(vecs, query, 10);
+            for (int id : got)
+                if (std::find(want.begin(), want.end(), id) != want.end()) ++overlap;
+        }
+        return overlap;
+    };
+    int base = recall(20);
+    EXPECT_GE(base, 140);   // >= 70% recall@10 at 16x oversampling
+    db.set_bq_oversample(64);
+    EXPECT_GE(recall(20), base);
+}
+
+TEST_F(BqTest, HnswFallsBackToF32) {
+    CoreEngine::RedBoxVector db(db_file, 16, 100, (uint8_t)8, (uint16_t)100,
+                                CoreEngine::Metric::L2, CoreEngine::StorageMode::BINARY);
+    EXPECT_EQ(db.get_storage_mode(), CoreEngine::StorageMode::F32);
+}
+
+// =============================================================================
+// 10. BATCH SEARCH TESTS
+// =============================================================================
+class BatchSearchTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_batch"); ExtFixture::SetUp(); }
+
+    // Every query's batch answer against search_N. The norm expansion rounds
+    // differently from the direct kernel, so near-ties may swap.
+    static void expect_matches_search_N(CoreEngine::RedBoxVector& db, int dim, int nq, int k) {
+        std::vector<float> flat;
+        for (int q = 0; q < nq; ++q) { auto v = make_vec(50000 + q, dim); flat.insert(flat.end(), v.begin(), v.end()); }
+        auto batch = db.search_batch(flat.data(), nq, k);
+        ASSERT_EQ(batch.size(), (size_t)nq);
+        int same = 0, total = 0;
+        for (int q = 0; q < nq; ++q) {
+            auto single = db.search_N(std::vector<float>(flat.begin() + q * dim, flat.begin() + (q + 1) * dim), k);
+            ASSERT_EQ(batch[q].size(), single.size());
+            for (size_t r = 0; r < single.size(); ++r, ++total)
+                if (batch[q][r] == single[r]) ++same;
+        }
+        EXPECT_GE(same, total * 98 / 100);
+    }
+};
+
+TEST_F(BatchSearchTest, FlatScanMatchesSearchN) {
+    const int DIM = 40, N = 2000;
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10);
+    for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+    db.remove(3);
+    expect_matches_search_N(db, DIM, 33, 10);
+    EXPECT_TRUE(db.search_batch(nullptr, 0, 10).empty());
+}
+
+TEST_F(BatchSearchTest, IvfProbesMatchSearchN) {
+    const int DIM = 16, N = 10000;
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)32, (uint8_t)3);
+    for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+    ASSERT_TRUE(db.get_header()->is_initialized);
+    expect_matches_search_N(db, DIM, 64, 5);
+}
+
+TEST_F(BatchSearchTest, CosineAndCompressedModesMatchSearchN) {
+    const int DIM = 24, N = 1500;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)16, (uint8_t)4, CoreEngine::Metric::Cosine);
+        for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+        expect_matches_search_N(db, DIM, 20, 8);
+    }
+    std::filesystem::remove(db_file);
+    std::filesystem::remove(db_file + ".del");
+    {
+        // BQ trains at 1000 inserts; the batch falls back to per-query search.
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)16, (uint8_t)4,
+                                    CoreEngine::Metric::L2, CoreEngine::StorageMode::BINARY);
+        for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+        expect_matches_search_N(db, DIM, 20, 8);
+    }
+}
+
+// =============================================================================
+// 11. CLUSTER-CONTIGUOUS LAYOUT TESTS
+// =============================================================================
+class ClusterLayoutTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_layout"); ExtFixture::SetUp(); }
+
+    // Number of cluster-id descents across the live slots of the file.
+    int cluster_descents(size_t dim, int capacity, uint16_t k) {
+        StorageManager::Manager m(db_file, dim, capacity, k, 1);
+        std::ifstream del(db_file + ".del", std::ios::binary);
+        std::set<uint64_t> dead;
+        uint64_t id;
+        while (del.read(reinterpret_cast<char*>(&id), sizeof(id))) dead.insert(id);
+
+        int descents = 0, last = -1;
+        for (int i = 0; i < (int)m.get_count(); ++i) {
+            if (dead.count(m.get_id(i))) continue;
+            int c = m.get_cluster(i);
+            if (c < last) ++descents;
+            last = c;
+        }
+        return descents;
+    }
+};
+
+TEST_F(ClusterLayoutTest, KMeansInitGroupsClustersAndKeepsIds) {
+    const int DIM = 8, N = 10000, CAP = N + 2000;
+    const uint16_t K = 32;
+    std::vector<std::vector<float>> vecs;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, CAP, K, (uint8_t)K);
+        for (int i = 0; i < N; ++i) {
+            vecs.push_back(make_vec(i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+            if (i == 100) db.remove(50);   // deleted before the re-group
+        }
+        ASSERT_TRUE(db.get_header()->is_initialized);
+
+        // Every live id still resolves to its own vector after the move.
+        for (int i = 0; i < N; i += 97) {
+            if (i + 1 == 50) continue;
+            EXPECT_EQ(db.search(vecs[i]), i + 1) << "id " << i + 1;
+        }
+        EXPECT_NE(db.search(vecs[49]), 50);
+
+        // A deleted id can still be reinserted, and updates hit the moved slot.
+        db.insert(50, vecs[49]);
+        EXPECT_EQ(db.search(vecs[49]), 50);
+        auto moved = vecs[7];
+        moved[0] += 0.01f;
+        ASSERT_TRUE(db.update(8, moved));
+        EXPECT_EQ(db.search(moved), 8);
+    }
+    EXPECT_EQ(cluster_descents(DIM, CAP, K), 0);
+}
+
+TEST_F(ClusterLayoutTest, TailIsRegroupedAndSurvivesReopen) {
+    const int DIM = 8, N = 10000, EXTRA = 1500, CAP = N + 4000;
+    const uint16_t K = 32;
+    std::vector<std::vector<float>> vecs;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, CAP, K, (uint8_t)K);
+        for (int i = 0; i < N + EXTRA; ++i) {
+            vecs.push_back(make_vec(i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+        }
+    }
+    // 1500 appended slots (< N / 4) stay as an unsorted tail...
+    EXPECT_GT(cluster_descents(DIM, CAP, K), 0);
+    {
+        // ...until an explicit re-group; search is unaffected either way.
+        CoreEngine::RedBoxVector db(db_file, DIM, CAP, K, (uint8_t)K);
+        EXPECT_EQ(db.search(vecs[N + 10]), N + 11);
+        db.reorganize();
+        for (int i = 0; i < N + EXTRA; i += 131)
+            EXPECT_EQ(db.search(vecs[i]), i + 1) << "id " << i + 1;
+    }
+    EXPECT_EQ(cluster_descents(DIM, CAP, K), 0);
+    CoreEngine::RedBoxVector db(db_file, DIM, CAP, K, (uint8_t)K);
+    EXPECT_EQ(db.get_count(), (uint64_t)(N + EXTRA));
+    EXPECT_EQ(db.search(vecs[N + 100]), N + 101);
+}
+
+TEST_F(ClusterLayoutTest, BackgroundTrainingRegroupsOffTheInsertPath) {
+    const int DIM = 8, N = 10000, EXTRA = 5000, CAP = N + EXTRA + 1000;
+    const uint16_t K = 32;
+    std::vector<std::vector<float>> vecs;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, CAP, K, (uint8_t)K);
+        db.set_background_training(true);
+        for (int i = 0; i < N + EXTRA; ++i) {
+            vecs.push_back(make_vec(i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+        }
+        db.wait_for_training();
+        for (int i = 0; i < N + EXTRA; i += 131)
+            EXPECT_EQ(db.search(vecs[i]), i + 1) << "id " << i + 1;
+    }
+    // The tail passed a quarter of the grouped range well before the end,
+    // so only what arrived after the maintenance pass is left unsorted.
+    EXPECT_LT(cluster_descents(DIM, CAP, K), EXTRA / 3);
+}
+
+TEST_F(ClusterLayoutTest, ReopenedBeforeKMeansIsGroupedOnInit) {
+    const int DIM = 8, N = 10000, FIRST = 9000, CAP = N + 1000;
+    const uint16_t K = 32;
+    std::vector<std::vector<float>> vecs;
+    for (int i = 0; i < N; ++i) vecs.push_back(make_vec(i, DIM));
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, CAP, K, (uint8_t)K);
+        for (int i = 0; i < FIRST; ++i) db.insert((uint64_t)(i + 1), vecs[i]);
+    }
+    {
+        // The 9000 reopened slots were never grouped, so k-means re-groups
+        // all of them rather than treating them as an organised prefix.
+        CoreEngine::RedBoxVector db(db_file, DIM, CAP, K, (uint8_t)K);
+        for (int i = FIRST; i < N; ++i) db.insert((uint64_t)(i + 1), vecs[i]);
+        ASSERT_TRUE(db.get_header()->is_initialized);
+        for (int i = 0; i < N; i += 131)
+            EXPECT_EQ(db.search(vecs[i]), i + 1) << "id " << i + 1;
+    }
+    EXPECT_EQ(cluster_descents(DIM, CAP, K), 0);
+}
+
+// =============================================================================
+// 12. TRANSPOSED TILE SCAN TESTS
+// =============================================================================
+class TiledScanTest : public BatchSearchTest {
+protected:
+    void SetUp() override { init("test_tiles"); ExtFixture::SetUp(); }
+
+    // search_N with tiles on against the row-major scan on the same data.
+    static void expect_tiles_match_rows(CoreEngine::RedBoxVector& db, int dim, int nq, int k) {
+        std::vector<std::vector<int>> tiled;
+        for (int q = 0; q < nq; ++q) tiled.push_back(db.search_N(make_vec(70000 + q, dim), k));
+        db.set_tiled_scan(false);
+        int same = 0, total = 0;
+        for (int q = 0; q < nq; ++q) {
+            auto rows = db.search_N(make_vec(70000 + q, dim), k);
+            ASSERT_EQ(tiled[q].size(), rows.size());
+            for (size_t r = 0; r < rows.size(); ++r, ++total)
+                if (tiled[q][r] == rows[r]) ++same;
+        }
+        db.set_tiled_scan(true);
+        EXPECT_GE(same, total * 98 / 100);
+    }
+};
+
+TEST_F(TiledScanTest, FlatScanFollowsInsertsDeletesAndUpdates) {
+    const int DIM = 20, N = 900;
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10);
+    db.set_tiled_scan(true);
+    for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+    EXPECT_EQ(db.search(make_vec(17, DIM)), 18);
+
+    db.remove(18);
+    EXPECT_NE(db.search(make_vec(17, DIM)), 18);
+    db.insert(18, make_vec(5000, DIM));          // reinsert into the old slot
+    EXPECT_EQ(db.search(make_vec(5000, DIM)), 18);
+    ASSERT_TRUE(db.update(40, make_vec(6000, DIM)));
+    EXPECT_EQ(db.search(make_vec(6000, DIM)), 40);
+    expect_tiles_match_rows(db, DIM, 25, 10);
+}
+
+TEST_F(TiledScanTest, IvfTilesSurviveKMeansAndReinserts) {
+    for (auto metric : {CoreEngine::Metric::L2, CoreEngine::Metric::Cosine}) {
+        std::filesystem::remove(db_file);
+        std::filesystem::remove(db_file + ".del");
+        const int DIM = 24, N = 10500;
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)32, (uint8_t)4, metric);
+        db.set_tiled_scan(true);                 // before k-means: flat tiles, then rebuilt
+        for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+        ASSERT_TRUE(db.get_header()->is_initialized);
+
+        db.remove(100);
+        db.insert(100, make_vec(30000, DIM));    // may land in another cluster
+        EXPECT_EQ(db.search(make_vec(30000, DIM)), 100);
+        // A small move keeps the slot in its cluster.
+        auto moved = make_vec(199, DIM);
+        moved[0] += 0.01f;
+        ASSERT_TRUE(db.update(200, moved));
+        EXPECT_EQ(db.search_N(moved, 1).front(), 200);
+        expect_tiles_match_rows(db, DIM, 40, 10);
+    }
+}
+
+// =============================================================================
+// 13. INTRA-QUERY PARALLEL SCAN TESTS
+// =============================================================================
+class ParallelScanTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_parallel"); ExtFixture::SetUp(); }
+};
+
+TEST_F(ParallelScanTest, PoolRunsEveryTaskOnceAndFallsBackWhenBusy) {
+    Parallel::ThreadPool pool(3);
+    for (size_t tasks : {1, 2, 7, 64}) {
+        std::vector<std::atomic<int>> hits(tasks);
+        pool.run(tasks, [&](size_t t) { hits[t]++; });
+        for (size_t t = 0; t < tasks; ++t) EXPECT_EQ(hits[t].load(), 1) << "tasks=" << tasks;
+    }
+
+    // Several callers at once: whoever finds the pool busy runs inline.
+    std::atomic<int> total{ 0 };
+    std::vector<std::thread> callers;
+    for (int c = 0; c < 4; ++c)
+        callers.emplace_back([&] {
+            for (int r = 0; r < 50; ++r) pool.run(8, [&](size_t) { total++; });
+        });
+    for (auto& t : callers) t.join();
+    EXPECT_EQ(total.load(), 4 * 50 * 8);
+}
+
+TEST_F(ParallelScanTest, WideProbeScanMatchesBruteForce) {
+    // All 4 clusters probed: the scan is exact and crosses PARALLEL_THRESHOLD.
+    const int DIM = 8, N = 60000, K = 10;
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)4, (uint8_t)4);
+    db.set_search_threads(4);                    // split even on a single-core runner
+    std::vector<std::vector<float>> vecs;
+    for (int i = 0; i < N; ++i) {
+        vecs.push_back(make_vec(i, DIM));
+        db.insert((uint64_t)(i + 1), vecs.back());
+    }
+    db.remove(77);
+
+    auto brute = [&](const std::vector<float>& q) {
+        std::vector<std::pair<float, int>> all;
+        for (int i = 0; i < N; ++i)
+            if (i + 1 != 77) all.push_back({ l2_ref(q, vecs[i]), i + 1 });
+        std::partial_sort(all.begin(), all.begin() + K, all.end());
+        std::vector<int> ids;
+        for (int j = 0; j < K; ++j) ids.push_back(all[j].second);
+        return ids;
+    };
+
+    std::vector<std::vector<float>> queries;
+    for (int q = 0; q < 8; ++q) queries.push_back(make_vec(90000 + q, DIM));
+    for (const auto& q : queries) {
+        auto expected = brute(q);
+        EXPECT_EQ(db.search_N(q, K), expected);
+        EXPECT_EQ(db.search(q), expected.front());
+    }
+    EXPECT_EQ(db.search(vecs[76]), brute(vecs[76]).front());
+
+    // Concurrent readers share the pool (or fall back inline) and agree.
+    std::atomic<int> mismatches{ 0 };
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t)
+        readers.emplace_back([&, t] {
+            for (int r = 0; r < 3; ++r) {
+                const auto& q = queries[(t + r) % queries.size()];
+                if (db.search_N(q, K) != brute(q)) mismatches++;
+            }
+        });
+    for (auto& t : readers) t.join();
+    EXPECT_EQ(mismatches.load(), 0);
+
+    db.set_search_threads(1);                    // serial scan, same answer
+    EXPECT_EQ(db.search_N(queries[0], K), brute(queries[0]));
+}
+
+// =============================================================================
+// 14. BACKGROUND IVF TRAINING TESTS
+// =============================================================================
+class BackgroundTrainingTest : public Sq8Test {
+protected:
+    void SetUp() override { init("test_bg_kmeans"); ExtFixture::SetUp(); }
+};
+
+TEST_F(BackgroundTrainingTest, InsertsAndSearchesContinueThenClustersInstall) {
+    for (auto metric : {CoreEngine::Metric::L2, CoreEngine::Metric::Cosine}) {
+        std::filesystem::remove(db_file);
+        std::filesystem::remove(db_file + ".del");
+        const int DIM = 16, N = 13000, K = 16;
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)4, metric);
+        db.set_background_training(true);
+        std::vector<std::vector<float>> vecs;
+        for (int i = 0; i < N; ++i) {
+            vecs.push_back(make_vec(i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+            // Flat scan (or IVF once installed) answers throughout.
+            if (i % 1000 == 999) {
+                EXPECT_EQ(db.search(vecs[i - 500]), i - 499);
+            }
+        }
+        db.remove(50);
+        auto moved = vecs[60];
+        moved[0] += 0.01f;
+        ASSERT_TRUE(db.update(61, moved));
+
+        db.wait_for_training();
+        ASSERT_TRUE(db.get_header()->is_initialized);
+        // Vectors from before, during and after the training window.
+        int hits = 0;
+        for (int q = 0; q < 60; ++q)
+            if (db.search(vecs[q * 211]) == q * 211 + 1) ++hits;
+        EXPECT_GE(hits, 58);
+        EXPECT_NE(db.search(vecs[49]), 50);
+        EXPECT_EQ(db.search(moved), 61);
+        db.insert(50, vecs[49]);                 // normal IVF path after install
+        EXPECT_EQ(db.search(vecs[49]), 50);
+    }
+}
+
+TEST_F(BackgroundTrainingTest, InstallCountsEachLiveSlotOnce) {
+    const int DIM = 16, N = 10000, K = 16, REMOVED = 40, MOVED = 500;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)4);
+        db.set_background_training(true);
+        for (int i = 0; i < N; ++i) {
+            db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+            if (i == 1000)
+                for (int r = 0; r < REMOVED; ++r) db.remove((uint64_t)(r + 1));
+        }
+        // Rewritten while training is likely still running on its snapshot.
+        for (int i = REMOVED; i < REMOVED + MOVED; ++i)
+            ASSERT_TRUE(db.update((uint64_t)(i + 1), make_vec(i + N / 2, DIM)));
+        db.wait_for_training();
+        ASSERT_TRUE(db.get_header()->is_initialized);
+    }
+    StorageManager::Manager m(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)4);
+    uint64_t total = 0;
+    for (int c = 0; c < m.get_num_clusters(); ++c) total += m.get_cluster_count_block()[c];
+    EXPECT_EQ(total, (uint64_t)(N - REMOVED));
+}
+
+TEST_F(BackgroundTrainingTest, IvfPqTrainsCodebookOffTheInsertPath) {
+    const int DIM = 16, N = 11000;
+    CoreEngine::RedBoxVector::IvfPqParams pq;
+    pq.k = 16;
+    pq.num_probes = 4;
+    pq.pq_m = 8;
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, pq);
+    db.set_background_training(true);
+    std::vector<std::vector<float>> vecs;
+    for (int i = 0; i < N; ++i) {
+        vecs.push_back(make_vec(i, DIM));
+        db.insert((uint64_t)(i + 1), vecs.back());
+    }
+    db.wait_for_training();
+    ASSERT_TRUE(db.get_header()->pq_trained);
+
+    int hits = 0;
+    for (int q = 0; q < 50; ++q)
+        if (db.search(vecs[q * 217]) == q * 217 + 1) ++hits;
+    EXPECT_GE(hits, 48);
+
+    db.set_rerank(false);
+    int overlap = 0;
+    for (int q = 0; q < 20; ++q) {
+        auto query = make_vec(100000 + q, DIM);
+        auto got = db.search_N(query, 10);
+        auto want = exact_top(vecs, query, 10);
+        for (int id : got)
+            if (std::find(want.begin(), want.end(), id) != want.end()) ++overlap;
+    }
+    EXPECT_GE(overlap, 100);
+}
+
+// =============================================================================
+// 15. IVF REBALANCING TESTS
+// =============================================================================
+class RebalanceTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_rebalance"); ExtFixture::SetUp(); }
+
+    // A point of blob b: centre at 10 * b on axis 0, unit noise elsewhere.
+    static std::vector<float> blob_vec(int b, int seed, int dim) {
+        auto v = make_vec(seed, dim);
+        v[0] += 10.0f * (float)b;
+        return v;
+    }
+
+    // Live vectors per cluster, read back from the closed file.
+    std::vector<size_t> cluster_sizes(size_t dim, int capacity) {
+        StorageManager::Manager m(db_file, dim, capacity);
+        std::vector<size_t> sizes(m.get_num_clusters(), 0);
+        for (int i = 0; i < (int)m.get_count(); ++i)
+            if (m.get_cluster(i) < sizes.size()) sizes[m.get_cluster(i)]++;
+        return sizes;
+    }
+};
+
+TEST_F(RebalanceTest, AutoKAndTwoMeansSplit) {
+    EXPECT_EQ(ClusterManager::auto_k(10000, 1000), 100);
+    EXPECT_EQ(ClusterManager::auto_k(10000, 50), 50);
+    EXPECT_EQ(ClusterManager::auto_k(0, 50), 1);
+    EXPECT_GE(ClusterManager::auto_capacity(1000000), 2000);
+
+    const int DIM = 6, M = 400;
+    std::vector<float> data;
+    for (int i = 0; i < M; ++i) {
+        auto v = blob_vec(i % 2 ? 3 : 0, i, DIM);
+        data.insert(data.end(), v.begin(), v.end());
+    }
+    std::vector<uint32_t> rows(M);
+    std::iota(rows.begin(), rows.end(), 0u);
+    std::vector<float> center(DIM, 0.0f), halves(2 * DIM);
+    std::vector<uint16_t> side(M);
+    ClusterManager::split_in_two(data.data(), rows.data(), M, DIM, center.data(), halves.data(),
+                                 side.data(), Distance::l2_scalar);
+    for (int i = 2; i < M; ++i)
+        EXPECT_EQ(side[i], side[i % 2]) << "row " << i;
+    EXPECT_NE(side[0], side[1]);
+    EXPECT_NEAR(std::abs(halves[0] - halves[DIM]), 30.0f, 1.0f);
+}
+
+TEST_F(RebalanceTest, UpdateMovesVectorToNearestCluster) {
+    const int DIM = 8, N = 10500;
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)16, (uint8_t)1);
+    db.set_tiled_scan(true);
+    for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+    ASSERT_TRUE(db.get_header()->is_initialized);
+
+    // One probe: found only if the update moved the slot to its new cluster.
+    for (int i = 0; i < 20; ++i) {
+        auto far = make_vec(60000 + i, DIM);
+        ASSERT_TRUE(db.update((uint64_t)(i * 101 + 1), far));
+        EXPECT_EQ(db.search(far), i * 101 + 1);
+    }
+    EXPECT_EQ(db.search(make_vec(5000, DIM)), 5001);
+}
+
+TEST_F(RebalanceTest, SkewedInsertsAreSplitAtFixedK) {
+    const int DIM = 8, N = 10000, SKEW = 30000, CAP = N + SKEW + 10, K = 8;
+    std::vector<std::vector<float>> vecs;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, CAP, (uint16_t)K, (uint8_t)2);
+        for (int i = 0; i < N; ++i) {
+            vecs.push_back(blob_vec(i % K, i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+        }
+        // Everything after k-means lands in blob 0's cluster.
+        for (int i = N; i < N + SKEW; ++i) {
+            vecs.push_back(blob_vec(0, i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+        }
+    }
+    auto before = cluster_sizes(DIM, CAP);
+    ASSERT_EQ(before.size(), (size_t)K);
+    size_t big_before = *std::max_element(before.begin(), before.end());
+    EXPECT_GT(big_before, (size_t)SKEW);
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, CAP, (uint16_t)K, (uint8_t)2);
+        EXPECT_GT(db.rebalance(), 0u);
+        EXPECT_EQ(db.get_header()->num_clusters, K);
+        for (int i = 0; i < N + SKEW; i += 397)
+            EXPECT_EQ(db.search(vecs[i]), i + 1) << "id " << i + 1;
+    }
+    auto after = cluster_sizes(DIM, CAP);
+    EXPECT_LT(*std::max_element(after.begin(), after.end()), big_before * 3 / 4);
+}
+
+TEST_F(RebalanceTest, AutoClustersGrowWithTheData) {
+    const int DIM = 8, N = 40000;
+    std::vector<std::vector<float>> vecs;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, CoreEngine::RedBoxVector::AUTO_CLUSTERS,
+                                    (uint8_t)8);
+        ClusterManager::RebalanceParams rp;
+        rp.automatic = true;
+        db.set_rebalance_params(rp);
+        for (int i = 0; i < N; ++i) {
+            vecs.push_back(make_vec(i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+            if (i + 1 == 10000) {
+                EXPECT_EQ(db.get_header()->num_clusters, 100);
+            }
+        }
+        // sqrt(40000) = 200, reached in steps of 1/8.
+        EXPECT_GE(db.get_header()->num_clusters, 180);
+        EXPECT_LE(db.get_header()->num_clusters, 200);
+        int hits = 0;
+        for (int i = 0; i < N; i += 400)
+            if (db.search(vecs[i]) == i + 1) ++hits;
+        EXPECT_GE(hits, 98);
+    }
+    // Reopened with an explicit k: the file keeps its own K and capacity.
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)50, (uint8_t)8);
+    EXPECT_GE(db.get_header()->num_clusters, 180);
+    EXPECT_EQ(db.search(vecs[12345]), 12346);
+}
+
+// =============================================================================
+// 16. CENTROID GRAPH (COARSE QUANTIZER) TESTS
+// =============================================================================
+class CentroidGraphTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_centroid_graph"); ExtFixture::SetUp(); }
+};
+
+TEST_F(CentroidGraphTest, GraphAgreesWithBruteForce) {
+    const int DIM = 16, K = 2000, Q = 200;
+    std::vector<float> centroids;
+    for (int c = 0; c < K; ++c) {
+        auto v = make_vec(c, DIM);
+        centroids.insert(centroids.end(), v.begin(), v.end());
+    }
+    auto dist_fn = Distance::kernels().for_metric(CoreEngine::Metric::L2, DIM);
+    CentroidGraph::Graph g;
+    g.build(centroids.data(), (uint16_t)K, DIM, dist_fn,
+            Distance::kernels().rows4_for_metric(CoreEngine::Metric::L2));
+    ASSERT_EQ(g.nodes(), K);
+
+    int exact = 0, overlap = 0;
+    std::vector<uint16_t> probes;
+    for (int i = 0; i < Q; ++i) {
+        auto q = make_vec(100000 + i, DIM);
+        std::vector<std::pair<float, uint16_t>> ref(K);
+        for (int c = 0; c < K; ++c)
+            ref[c] = { dist_fn(q.data(), centroids.data() + (size_t)c * DIM, DIM), (uint16_t)c };
+        std::partial_sort(ref.begin(), ref.begin() + 10, ref.end());
+
+        if (g.nearest(q.data(), centroids.data(), DIM, dist_fn, 64) == ref[0].second) ++exact;
+        g.nearest_n(q.data(), 10, centroids.data(), DIM, dist_fn, 64, probes);
+        ASSERT_EQ(probes.size(), 10u);
+        for (int r = 0; r < 10; ++r)
+            if (std::find(probes.begin(), probes.end(), ref[r].second) != probes.end()) ++overlap;
+    }
+    EXPECT_GE(exact, Q * 95 / 100);
+    EXPECT_GE(overlap, Q * 10 * 9 / 10);
+}
+
+TEST_F(CentroidGraphTest, LargeKInsertsAndSearchesThroughGraph) {
+    const int DIM = 8, N = 12000, K = 512;
+    std::vector<std::vector<float>> vecs;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)4);
+        db.set_centroid_graph(true);
+        for (int i = 0; i < N; ++i) {
+            vecs.push_back(make_vec(i, DIM));
+            db.insert((uint64_t)(i + 1), vecs.back());
+        }
+        ASSERT_TRUE(db.get_header()->is_initialized);
+        ASSERT_EQ(db.get_header()->num_clusters, K);
+
+        // Post-init inserts are assigned through the graph; pre-init ones by
+        // k-means. Both have to be found with a handful of probes.
+        int hits = 0;
+        for (int i = 0; i < N; i += 60)
+            if (db.search(vecs[i]) == i + 1) ++hits;
+        EXPECT_GE(hits, (N / 60) * 95 / 100);
+
+        auto top = db.search_N(vecs[N - 1], 5);
+        ASSERT_FALSE(top.empty());
+        EXPECT_EQ(top[0], N);
+    }
+    // Not persisted: rebuilt from the stored centroids when turned on again.
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)4);
+    db.set_centroid_graph(true, 32);
+    EXPECT_EQ(db.search(vecs[777]), 778);
+}
+
+// =============================================================================
+// 17. ADAPTIVE PROBING TESTS
+// =============================================================================
+class AdaptiveProbeTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_adaptive_probe"); ExtFixture::SetUp(); }
+
+    static constexpr int DIM = 8, K = 16, N = 12000;
+
+    static std::vector<float> blob_vec(int b, int seed) {
+        auto v = make_vec(seed, DIM);
+        v[0] += 10.0f * (float)b;
+        return v;
+    }
+
+    static std::vector<float> unit(std::vector<float> v) {
+        float n = 0;
+        for (float x : v) n += x * x;
+        for (float& x : v) x /= std::sqrt(n);
+        return v;
+    }
+
+    // Inserts N blob points (some after k-means, some moved by update),
+    // then checks search_N's distances against a brute-force top 10.
+    void expect_exact(CoreEngine::Metric metric, bool tiled) {
+        bool cosine = (metric == CoreEngine::Metric::Cosine);
+        auto dist = [&](const std::vector<float>& a, const std::vector<float>& b) {
+            if (!cosine) return l2_ref(a, b);
+            float d = 0;
+            for (size_t i = 0; i < a.size(); ++i) d += a[i] * b[i];
+            return 1.0f - d;
+        };
+
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)1, metric);
+        db.set_tiled_scan(tiled);
+        ClusterManager::ProbeParams pp;
+        pp.adaptive   = true;
+        pp.max_probes = K;
+        db.set_probe_params(pp);
+
+        std::vector<std::vector<float>> vecs;
+        for (int i = 0; i < N; ++i) {
+            vecs.push_back(blob_vec(i % K, i));
+            db.insert((uint64_t)(i + 1), vecs.back());
+        }
+        ASSERT_TRUE(db.get_header()->is_initialized);
+        for (int i = 0; i < N; i += 37) {
+            vecs[i] = blob_vec((i + 5) % K, 50000 + i);
+            ASSERT_TRUE(db.update((uint64_t)(i + 1), vecs[i]));
+        }
+        if (cosine) for (auto& v : vecs) v = unit(v);
+
+        for (int q = 0; q < 40; ++q) {
+            auto query = blob_vec(q % K, 90000 + q);
+            if (cosine) query = unit(query);
+            std::vector<float> ref;
+            for (const auto& v : vecs) ref.push_back(dist(query, v));
+            std::sort(ref.begin(), ref.end());
+
+            auto ids = db.search_N(query, 10);
+            ASSERT_EQ(ids.size(), 10u);
+            std::vector<float> got;
+            for (int id : ids) got.push_back(dist(query, vecs[id - 1]));
+            std::sort(got.begin(), got.end());
+            for (int r = 0; r < 10; ++r)
+                EXPECT_NEAR(got[r], ref[r], 1e-4f) << "query " << q << " rank " << r;
+        }
+        // Well separated blobs: most of the K candidates are cut by the
+        // bound. (Normalised, the far blobs bunch up around one direction.)
+        EXPECT_GT(db.get_mean_probes(), 0.0);
+        if (!cosine) {
+            EXPECT_LT(db.get_mean_probes(), K / 2.0);
+        }
+    }
+};
+
+TEST_F(AdaptiveProbeTest, RadiusBoundIsExactOverCandidateClusters) {
+    expect_exact(CoreEngine::Metric::L2, false);
+}
+
+TEST_F(AdaptiveProbeTest, TiledAndCosineScansUseTheSameBound) {
+    expect_exact(CoreEngine::Metric::L2, true);
+    cleanup();
+    expect_exact(CoreEngine::Metric::Cosine, false);
+}
+
+TEST_F(AdaptiveProbeTest, RatioCutStopsEasyQueriesEarly) {
+    std::vector<std::vector<float>> vecs;
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)K, (uint8_t)8);
+    for (int i = 0; i < N; ++i) {
+        vecs.push_back(make_vec(i, DIM));
+        db.insert((uint64_t)(i + 1), vecs.back());
+    }
+    ClusterManager::ProbeParams pp;
+    pp.adaptive   = true;
+    pp.max_probes = 8;
+    pp.ratio      = 1.5f;
+    db.set_probe_params(pp);
+
+    int hits = 0;
+    for (int i = 0; i < N; i += 100)
+        if (db.search(vecs[i]) == i + 1) ++hits;
+    EXPECT_EQ(hits, N / 100);
+    EXPECT_GE(db.get_mean_probes(), 1.0);
+    EXPECT_LT(db.get_mean_probes(), 8.0);
+}
+
+// =============================================================================
+// 18. PER-THREAD SEARCH CONTEXT TESTS
+// =============================================================================
+class SearchContextTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_search_context"); ExtFixture::SetUp(); }
+    void TearDown() override { try_remove(other_file); ExtFixture::TearDown(); }
+
+    std::string other_file = "test_search_context_big.db";
+};
+
+TEST_F(SearchContextTest, VisitedEpochsWrapAndGrow) {
+    HnswManager::VisitedSet v;
+    v.next(10);
+    EXPECT_FALSE(v.test_and_set(3));
+    EXPECT_TRUE(v.test_and_set(3));
+    // A stale mark must never read as visited, across the 16-bit wrap too.
+    for (int walk = 0; walk < 70000; ++walk) {
+        v.next(10);
+        ASSERT_FALSE(v.test(3)) << "walk " << walk;
+        if (walk % 1000 == 0) v.set(3);
+    }
+    v.next(100);
+    EXPECT_FALSE(v.test(99));
+    v.set(99);
+    EXPECT_TRUE(v.test(99));
+}
+
+TEST_F(SearchContextTest, HnswDatabasesOfDifferentCapacityShareAThread) {
+    const int DIM = 16, SMALL = 200, BIG = 3000;
+    CoreEngine::RedBoxVector small(db_file, DIM, SMALL, (uint8_t)8, (uint16_t)50);
+    CoreEngine::RedBoxVector big(other_file, DIM, BIG, (uint8_t)8, (uint16_t)50);
+    for (int i = 0; i < SMALL; ++i) small.insert((uint64_t)(i + 1), make_vec(i, DIM));
+    for (int i = 0; i < BIG; ++i)   big.insert((uint64_t)(i + 1), make_vec(10000 + i, DIM));
+
+    int small_hits = 0, big_hits = 0;
+    for (int i = 0; i < SMALL; ++i) {
+        if (big.search(make_vec(10000 + i * 7, DIM)) == i * 7 + 1) ++big_hits;
+        auto top = small.search_N(make_vec(i, DIM), 5);
+        if (!top.empty() && top[0] == i + 1) ++small_hits;
+    }
+    EXPECT_GE(small_hits, SMALL * 98 / 100);
+    EXPECT_GE(big_hits, SMALL * 95 / 100);
+}
+
+// The compressed and tile scans hand back the thread's shortlist buffer;
+// an interleaved query of another size or path must not leak into it.
+TEST_F(SearchContextTest, ShortlistScansRepeatAcrossInterleavedQueries) {
+    const int DIM = 16, N = 1500;
+    auto check = [&](CoreEngine::RedBoxVector& db, const char* label) {
+        for (int q = 0; q < 20; ++q) {
+            auto query = make_vec(50000 + q, DIM);
+            auto first = db.search_N(query, 10);
+            auto best  = db.search(query);
+            ASSERT_EQ(first.size(), 10u) << label;
+            db.search_N(make_vec(60000 + q, DIM), 40);
+            EXPECT_NE(db.search(make_vec(q, DIM)), -1) << label;
+            EXPECT_EQ(db.search_N(query, 10), first) << label << " query " << q;
+            EXPECT_EQ(db.search(query), best) << label << " query " << q;
+        }
+    };
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)16, (uint8_t)4,
+                                    CoreEngine::Metric::L2, CoreEngine::StorageMode::BINARY);
+        for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+        ASSERT_TRUE(db.get_header()->codes_trained);
+        check(db, "bq");
+    }
+    try_remove(db_file);
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint16_t)16, (uint8_t)4);
+        for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+        db.set_tiled_scan(true);
+        check(db, "tiles");
+    }
+    CoreEngine::RedBoxVector db(other_file, DIM, N + 10, (uint8_t)8, (uint16_t)50,
+                                CoreEngine::Metric::L2, CoreEngine::StorageMode::SQ8);
+    for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+    ASSERT_TRUE(db.get_header()->codes_trained);
+    check(db, "hnsw sq8");
+}
+
+// =============================================================================
+// 19. HNSW TOP-N SEARCH TESTS
+// =============================================================================
+class HnswTopNTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_hnsw_topn"); ExtFixture::SetUp(); }
+};
+
+TEST_F(HnswTopNTest, Heap4KeepsOrder) {
+    auto before = [](int a, int b) { return a < b; };
+    std::vector<int> heap, values;
+    std::mt19937 rng(7);
+    for (int i = 0; i < 500; ++i) {
+        int v = (int)(rng() % 1000);
+        values.push_back(v);
+        HnswManager::Heap4::push(heap, v, before);
+    }
+    // Replacing the top keeps the 500 smallest of the stream in the heap.
+    HnswManager::Heap4::replace_top(heap, 2000, before);
+    std::sort(values.begin(), values.end());
+    values[0] = 2000;
+    std::sort(values.begin(), values.end());
+    for (int v : values) {
+        ASSERT_EQ(heap.front(), v);
+        HnswManager::Heap4::pop(heap, before);
+    }
+    EXPECT_TRUE(heap.empty());
+}
+
+TEST_F(HnswTopNTest, SearchNIsSortedAndEfIsTunable) {
+    const int DIM = 16, N = 3000, TOP = 100, Q = 20;
+    std::vector<std::vector<float>> vecs;
+    CoreEngine::RedBoxVector db(db_file, DIM, N, (uint8_t)8, (uint16_t)64);
+    for (int i = 0; i < N; ++i) {
+        vecs.push_back(make_vec(i, DIM));
+        db.insert((uint64_t)(i + 1), vecs.back());
+    }
+
+    auto recall = [&](uint16_t ef, uint8_t factor) {
+        db.set_hnsw_ef_search(ef);
+        db.set_hnsw_ef_factor(factor);
+        size_t hits = 0;
+        for (int q = 0; q < Q; ++q) {
+            auto query = make_vec(50000 + q, DIM);
+            std::vector<std::pair<float, int>> ref;
+            for (int i = 0; i < N; ++i) ref.push_back({ l2_ref(query, vecs[i]), i + 1 });
+            std::partial_sort(ref.begin(), ref.begin() + TOP, ref.end());
+            std::set<int> truth;
+            for (int r = 0; r < TOP; ++r) truth.insert(ref[r].second);
+
+            auto ids = db.search_N(query, TOP);
+            EXPECT_EQ(ids.size(), (size_t)TOP);
+            for (size_t r = 1; r < ids.size(); ++r)
+                EXPECT_LE(l2_ref(query, vecs[ids[r - 1] - 1]), l2_ref(query, vecs[ids[r] - 1]) + 1e-5f);
+            for (int id : ids) hits += truth.count(id);
+        }
+        return (double)hits / (Q * TOP);
+    };
+
+    // ef below N: the beam is N wide either way.
+    double narrow = recall(10, 1);
+    double wide   = recall(400, 1);
+    double legacy = recall(100, 4);
+    EXPECT_GE(narrow, 0.80);
+    EXPECT_GE(wide, 0.97);
+    EXPECT_GE(legacy, 0.97);
+    EXPECT_GE(wide, narrow);
+}
+
+TEST_F(HnswTopNTest, SpanOverloadMatchesVectorResult) {
+    const int DIM = 16, N = 1500;
+    CoreEngine::RedBoxVector db(db_file, DIM, N, (uint8_t)8, (uint16_t)64);
+    for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+
+    std::vector<int> out(10, -1);
+    for (int q = 0; q < 10; ++q) {
+        auto query = make_vec(50000 + q, DIM);
+        auto want  = db.search_N(query, 10);
+        ASSERT_EQ(db.search_N(query, std::span<int>(out)), want.size());
+        EXPECT_EQ(out, want);
+    }
+    // Asking for more than the database holds: only count are written.
+    CoreEngine::RedBoxVector tiny(db_file + ".tiny", DIM, 10, (uint8_t)8, (uint16_t)64);
+    for (int i = 0; i < 3; ++i) tiny.insert((uint64_t)(i + 1), make_vec(i, DIM));
+    std::fill(out.begin(), out.end(), -1);
+    EXPECT_EQ(tiny.search_N(make_vec(0, DIM), std::span<int>(out)), 3u);
+    EXPECT_EQ(out[0], 1);
+    EXPECT_EQ(out[3], -1);
+    EXPECT_TRUE(tiny.search_N(make_vec(0, DIM), std::span<int>()) == 0);
+    try_remove(db_file + ".tiny");
+}
+
+// =============================================================================
+// 20. PARALLEL HNSW LINK TESTS
+// =============================================================================
+class ParallelHnswLinkTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_parallel_hnsw_link"); ExtFixture::SetUp(); }
+};
+
+TEST_F(ParallelHnswLinkTest, LinkersShareOneGraph) {
+    const int DIM = 16, N = 2000, THREADS = 4;
+    const uint8_t M = 8;
+    std::vector<float> data((size_t)N * DIM);
+    for (int i = 0; i < N; ++i) {
+        auto v = make_vec(i, DIM);
+        std::copy(v.begin(), v.end(), data.begin() + (size_t)i * DIM);
+    }
+    CoreEngine::SpecificMetadata header{};
+    header.max_capacity         = N;
+    header.hnsw_M               = M;
+    header.hnsw_ef_construction = 64;
+    header.hnsw_entry_point     = HnswManager::EMPTY;
+    std::vector<uint32_t> level0((size_t)N * HnswManager::level0_words(M), 0);
+    std::vector<uint32_t> upper_index(N, 0);
+    std::vector<uint32_t> upper(HnswManager::upper_lists(N, M) * M, 0);
+    uint32_t upper_used = 0;
+    HnswManager::EdgeStore edges{ level0.data(), upper_index.data(), upper.data(), &upper_used,
+                                  HnswManager::upper_lists(N, M) };
+    std::vector<uint8_t> levels(N);
+    std::mt19937 rng(3);
+    for (int i = 0; i < N; ++i)
+        HnswManager::set_level(edges, levels.data(), (uint32_t)i,
+                               std::min(HnswManager::compute_level(M, rng), HnswManager::MAX_LEVEL));
+
+    auto dist_fn = Distance::kernels().for_metric(CoreEngine::Metric::L2, DIM);
+    HnswManager::GraphLocks locks;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&, t]() {
+            HnswManager::SearchContext ctx;
+            std::vector<HnswManager::SearchResult> nb_cands;
+            for (int i = t; i < N; i += THREADS)
+                HnswManager::hnsw_link((uint32_t)i, &data[(size_t)i * DIM], levels[i], &header, data.data(),
+                                       edges, DIM, dist_fn, nullptr, ctx, nb_cands, nullptr, &locks);
+        });
+    }
+    for (auto& th : threads) th.join();
+
+    // The top level survived the races, and no list holds a duplicate or a self-loop.
+    EXPECT_EQ(header.hnsw_max_level, *std::max_element(levels.begin(), levels.end()));
+    EXPECT_EQ(levels[header.hnsw_entry_point], header.hnsw_max_level);
+    for (int i = 0; i < N; ++i) {
+        for (int l = 0; l <= levels[i]; ++l) {
+            const uint32_t* lev = HnswManager::level_edges(edges, (uint32_t)i, l, M);
+            std::set<uint32_t> seen;
+            for (int e = 0; e < HnswManager::m_max(l, M); ++e) {
+                uint32_t nb = HnswManager::load_edge(lev + e);
+                if (nb == HnswManager::EMPTY) continue;
+                EXPECT_NE(nb, (uint32_t)i);
+                EXPECT_TRUE(seen.insert(nb).second);
+            }
+        }
+    }
+
+    HnswManager::SearchContext ctx;
+    std::vector<std::pair<float, uint32_t>> out(1);
+    int hits = 0;
+    for (int i = 0; i < N; ++i) {
+        HnswManager::hnsw_search(&data[(size_t)i * DIM], 64, &header, data.data(), edges, DIM,
+                                 dist_fn, nullptr, ctx, out);
+        if (out[0].second == (uint32_t)i) ++hits;
+    }
+    EXPECT_GE(hits, N * 98 / 100);
+}
+
+TEST_F(ParallelHnswLinkTest, InsertsRunAlongsideSearches) {
+    const int DIM = 16, N = 2000, WRITERS = 4;
+    CoreEngine::RedBoxVector db(db_file, DIM, N, (uint8_t)8, (uint16_t)64);
+
+    std::atomic<int> writers_left{ WRITERS };
+    std::atomic<bool> bad_result{ false };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < WRITERS; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int i = t; i < N; i += WRITERS) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+            --writers_left;
+        });
+    }
+    for (int r = 0; r < 2; ++r) {
+        threads.emplace_back([&, r]() {
+            int q = 0;
+            while (writers_left.load() > 0) {
+                for (int id : db.search_N(make_vec(90000 + r * 1000 + (q++ % 1000), DIM), 10))
+                    if (id < 1 || id > N) bad_result = true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+    for (auto& th : threads) th.join();
+
+    EXPECT_FALSE(bad_result.load());
+    EXPECT_EQ(db.get_count(), (uint64_t)N);
+    int hits = 0;
+    for (int i = 0; i < N; ++i)
+        if (db.search(make_vec(i, DIM)) == i + 1) ++hits;
+    EXPECT_GE(hits, N * 98 / 100);
+
+    // Deleting and re-inserting during concurrent ingest relinks the slot once.
+    const int CHURN = N / 4;
+    std::thread churn([&]() {
+        for (int i = 0; i < CHURN; ++i) {
+            db.remove((uint64_t)(i + 1));
+            db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+        }
+    });
+    for (int i = CHURN; i < 2 * CHURN; ++i) db.update((uint64_t)(i + 1), make_vec(i, DIM));
+    churn.join();
+    hits = 0;
+    for (int i = 0; i < 2 * CHURN; ++i)
+        if (db.search(make_vec(i, DIM)) == i + 1) ++hits;
+    EXPECT_GE(hits, 2 * CHURN * 98 / 100);
+}
+
+// =============================================================================
+// 21. HNSW BULK BUILD TESTS
+// =============================================================================
+class HnswBulkTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_hnsw_bulk"); ExtFixture::SetUp(); }
+};
+
+TEST_F(HnswBulkTest, ParallelBuildFindsEveryRow) {
+    const int DIM = 16, N = 3000, HALF = N / 2;
+    std::vector<float> data((size_t)N * DIM);
+    std::vector<uint64_t> ids(N);
+    for (int i = 0; i < N; ++i) {
+        auto v = make_vec(i, DIM);
+        std::copy(v.begin(), v.end(), data.begin() + (size_t)i * DIM);
+        ids[i] = (uint64_t)(i + 1);
+    }
+    CoreEngine::RedBoxVector db(db_file, DIM, N, (uint8_t)8, (uint16_t)64);
+
+    // Two batches on four threads: the second extends a live graph.
+    db.insert_bulk(ids.data(), data.data(), HALF, 4);
+    db.insert_bulk(ids.data() + HALF, data.data() + (size_t)HALF * DIM, N - HALF, 4);
+    EXPECT_EQ(db.get_count(), (uint64_t)N);
+
+    int hits = 0;
+    for (int i = 0; i < N; ++i)
+        if (db.search(make_vec(i, DIM)) == i + 1) ++hits;
+    EXPECT_GE(hits, N * 95 / 100);
+
+    // A deleted id in a batch goes back into its old slot.
+    ASSERT_TRUE(db.remove(7));
+    auto moved = make_vec(77777, DIM);
+    db.insert_bulk(&ids[6], moved.data(), 1, 4);
+    EXPECT_EQ(db.get_count(), (uint64_t)N);
+    EXPECT_EQ(db.search(moved), 7);
+}
+
+TEST_F(HnswBulkTest, SearchesRunDuringTheLinkPass) {
+    const int DIM = 16, N = 20000;
+    std::vector<float> data((size_t)N * DIM);
+    std::vector<uint64_t> ids(N);
+    for (int i = 0; i < N; ++i) {
+        auto v = make_vec(i, DIM);
+        std::copy(v.begin(), v.end(), data.begin() + (size_t)i * DIM);
+        ids[i] = (uint64_t)(i + 1);
+    }
+    CoreEngine::RedBoxVector db(db_file, DIM, N, (uint8_t)8, (uint16_t)64);
+    db.insert(1, make_vec(0, DIM));
+
+    // Only the copy and the level draw hold the write lock, so no search
+    // waits for anything like the whole build.
+    using Clock = std::chrono::steady_clock;
+    std::atomic<bool> done{ false };
+    Clock::duration build{};
+    std::thread bulk([&]() {
+        auto t0 = Clock::now();
+        db.insert_bulk(ids.data() + 1, data.data() + DIM, N - 1, 2);
+        build = Clock::now() - t0;
+        done = true;
+    });
+    Clock::duration longest{};
+    auto query = make_vec(N / 2, DIM);
+    while (!done) {
+        auto t0 = Clock::now();
+        db.search(query);
+        longest = std::max(longest, Clock::now() - t0);
+    }
+    bulk.join();
+    EXPECT_LT(longest * 4, build);
+
+    int hits = 0;
+    for (int i = 0; i < N; i += 7)
+        if (db.search(make_vec(i, DIM)) == i + 1) ++hits;
+    EXPECT_GE(hits, (N / 7 + 1) * 95 / 100);
+}
+
+TEST_F(HnswBulkTest, CosineRowsAreNormalised) {
+    const int DIM = 8, N = 500;
+    std::vector<float> data((size_t)N * DIM);
+    std::vector<uint64_t> ids(N);
+    for (int i = 0; i < N; ++i) {
+        auto v = make_vec(i, DIM);
+        for (int d = 0; d < DIM; ++d) data[(size_t)i * DIM + d] = v[d] * (float)(1 + i % 5);
+        ids[i] = (uint64_t)(i + 1);
+    }
+    CoreEngine::RedBoxVector db(db_file, DIM, N, (uint8_t)8, (uint16_t)64, CoreEngine::Metric::Cosine);
+    db.insert_bulk(ids.data(), data.data(), N, 2);
+
+    int hits = 0;
+    for (int i = 0; i < N; ++i)
+        if (db.search(make_vec(i, DIM)) == i + 1) ++hits;
+    EXPECT_GE(hits, N * 95 / 100);
+}
+
+// =============================================================================
+// 22. NN-DESCENT BULK BUILD TESTS
+// =============================================================================
+class NnDescentTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_nn_descent"); ExtFixture::SetUp(); }
+};
+
+TEST_F(NnDescentTest, KnnListsMatchBruteForce) {
+    const int DIM = 8, N = 2000, K = 16;
+    std::vector<float> data((size_t)N * DIM);
+    for (int i = 0; i < N; ++i) {
+        auto v = make_vec(i, DIM);
+        std::copy(v.begin(), v.end(), data.begin() + (size_t)i * DIM);
+    }
+    auto dist_fn = Distance::kernels().for_metric(CoreEngine::Metric::L2, DIM);
+    Parallel::ThreadPool pool(1);
+    auto lists = NnDescent::build_knn(data.data(), N, DIM, dist_fn, K, NnDescent::Params{}, &pool);
+
+    size_t hits = 0;
+    for (int v = 0; v < N; v += 10) {
+        std::vector<std::pair<float, uint32_t>> ref;
+        for (int u = 0; u < N; ++u)
+            if (u != v) ref.push_back({ dist_fn(&data[(size_t)v * DIM], &data[(size_t)u * DIM], DIM), (uint32_t)u });
+        std::partial_sort(ref.begin(), ref.begin() + K, ref.end());
+        std::set<uint32_t> truth;
+        for (int r = 0; r < K; ++r) truth.insert(ref[r].second);
+        for (int i = 0; i < K; ++i) {
+            const auto& nb = lists[(size_t)v * K + i];
+            if (i > 0) { EXPECT_LE(lists[(size_t)v * K + i - 1].dist, nb.dist); }
+            hits += truth.count(nb.id);
+        }
+    }
+    EXPECT_GE((double)hits / ((N / 10) * K), 0.9);
+}
+
+TEST_F(NnDescentTest, BulkBuildSearchesLikeIncremental) {
+    const int DIM = 16, N = 3000, TOP = 10, Q = 50;
+    std::vector<float> data((size_t)N * DIM);
+    std::vector<uint64_t> ids(N);
+    for (int i = 0; i < N; ++i) {
+        auto v = make_vec(i, DIM);
+        std::copy(v.begin(), v.end(), data.begin() + (size_t)i * DIM);
+        ids[i] = (uint64_t)(i + 1);
+    }
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint8_t)8, (uint16_t)64);
+    db.insert_bulk(ids.data(), data.data(), N, 2, CoreEngine::RedBoxVector::BulkBuild::NnDescent);
+    EXPECT_EQ(db.get_count(), (uint64_t)N);
+
+    int self = 0;
+    for (int i = 0; i < N; ++i)
+        if (db.search(make_vec(i, DIM)) == i + 1) ++self;
+    EXPECT_GE(self, N * 95 / 100);
+
+    size_t hits = 0;
+    for (int q = 0; q < Q; ++q) {
+        auto query = make_vec(60000 + q, DIM);
+        std::vector<std::pair<float, int>> ref;
+        for (int i = 0; i < N; ++i) ref.push_back({ l2_ref(query, make_vec(i, DIM)), i + 1 });
+        std::partial_sort(ref.begin(), ref.begin() + TOP, ref.end());
+        std::set<int> truth;
+        for (int r = 0; r < TOP; ++r) truth.insert(ref[r].second);
+        for (int id : db.search_N(query, TOP)) hits += truth.count(id);
+    }
+    EXPECT_GE((double)hits / (Q * TOP), 0.9);
+
+    // Into a database that already has a graph, rows are linked incrementally.
+    std::vector<uint64_t> more_ids = { 90001, 90002 };
+    auto a = make_vec(123456, DIM), b = make_vec(654321, DIM);
+    std::vector<float> more(a);
+    more.insert(more.end(), b.begin(), b.end());
+    db.insert_bulk(more_ids.data(), more.data(), 2, 2, CoreEngine::RedBoxVector::BulkBuild::NnDescent);
+    EXPECT_EQ(db.search(a), 90001);
+    EXPECT_EQ(db.search(b), 90002);
+}
+
+// =============================================================================
+// 23. COMPACT HNSW EDGE STORAGE TESTS
+// =============================================================================
+class CompactEdgeTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_compact_edges"); ExtFixture::SetUp(); }
+
+    void set_version(uint8_t v) {
+        std::fstream f(db_file, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(offsetof(CoreEngine::SpecificMetadata, version));
+        f.write(reinterpret_cast<const char*>(&v), 1);
+    }
+};
+
+TEST_F(CompactEdgeTest, UpperListsGoOnlyToUpperNodes) {
+    const int M = 4;
+    std::vector<uint32_t> level0(8 * HnswManager::level0_words(M), 0);
+    std::vector<uint32_t> upper_index(8, 0);
+    std::vector<uint32_t> upper(5 * M, 0);
+    uint32_t used = 0;
+    HnswManager::EdgeStore edges{ level0.data(), upper_index.data(), upper.data(), &used, 5 };
+    std::vector<uint8_t> levels(8);
+
+    EXPECT_EQ(HnswManager::set_level(edges, levels.data(), 0, 3), 3);
+    EXPECT_EQ(HnswManager::set_level(edges, levels.data(), 1, 0), 0);
+    EXPECT_EQ(upper_index[1], 0u);
+    // Past the end of the region a node gets the levels that still fit.
+    EXPECT_EQ(HnswManager::set_level(edges, levels.data(), 2, 4), 2);
+    EXPECT_EQ(HnswManager::set_level(edges, levels.data(), 3, 1), 0);
+    EXPECT_EQ(used, 5u);
+    EXPECT_EQ(levels[2], 2);
+
+    // A node's lists are consecutive and disjoint from everyone else's.
+    EXPECT_EQ(HnswManager::level_edges(edges, 0, 3, M), upper.data() + 2 * M);
+    EXPECT_EQ(HnswManager::level_edges(edges, 2, 1, M), upper.data() + 3 * M);
+    EXPECT_EQ(HnswManager::level_edges(edges, 5, 0, M), level0.data() + 5 * 2 * M);
+}
+
+TEST_F(CompactEdgeTest, FileIsSmallerAndSurvivesReopen) {
+    const int DIM = 16, N = 2000, CAP = 4000;
+    const uint8_t M = 16;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, CAP, M, (uint16_t)64);
+        for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+        // A re-inserted node keeps its level and lists.
+        db.remove(7);
+        db.insert(7, make_vec(6, DIM));
+    }
+    // The old layout spent (2M + 16M) words per slot on edges alone.
+    EXPECT_LT(std::filesystem::file_size(db_file), (size_t)CAP * (2 + 16) * M * sizeof(uint32_t));
+
+    CoreEngine::RedBoxVector db(db_file, DIM, CAP, M, (uint16_t)64);
+    int hits = 0;
+    for (int i = 0; i < N; ++i)
+        if (db.search(make_vec(i, DIM)) == i + 1) ++hits;
+    EXPECT_GE(hits, N * 95 / 100);
+}
+
+TEST_F(CompactEdgeTest, OlderHnswFilesAreRejectedButIvfFilesOpen) {
+    {
+        CoreEngine::RedBoxVector db(db_file, 8, 100, (uint8_t)8, (uint16_t)32);
+        db.insert(1, make_vec(1, 8));
+    }
+    set_version(4);
+    EXPECT_THROW({
+        CoreEngine::RedBoxVector db(db_file, 8, 100, (uint8_t)8, (uint16_t)32);
+    }, std::exception);
+    cleanup();
+
+    {
+        CoreEngine::RedBoxVector db(db_file, 8, 100);
+        db.insert(1, make_vec(1, 8));
+    }
+    set_version(4);
+    CoreEngine::RedBoxVector db(db_file, 8, 100);
+    EXPECT_EQ(db.get_count(), 1u);
+    EXPECT_EQ(db.search(make_vec(1, 8)), 1);
+}
+
+// =============================================================================
+// 24. SPARSE HNSW EDGE BLOCK TESTS
+// =============================================================================
+class SparseEdgeTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_sparse_edges"); ExtFixture::SetUp(); }
+};
+
+TEST_F(SparseEdgeTest, ZeroWordsReadAsEmpty) {
+    uint32_t words[3] = { 0, 0, 0 };
+    EXPECT_EQ(HnswManager::load_edge(&words[0]), HnswManager::EMPTY);
+    HnswManager::store_edge(&words[1], 0);
+    HnswManager::store_edge(&words[2], 41);
+    EXPECT_EQ(HnswManager::load_edge(&words[1]), 0u);
+    EXPECT_EQ(HnswManager::load_edge(&words[2]), 41u);
+    HnswManager::store_edge(&words[2], HnswManager::EMPTY);
+    EXPECT_EQ(words[2], 0u);
+    EXPECT_EQ(HnswManager::level_edge_count(words, 3), 1);
+}
+
+TEST_F(SparseEdgeTest, LargeDatabaseIsCreatedWithoutWritingEdges) {
+    const int DIM = 8, CAP = 2000000, N = 500;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, CAP, (uint8_t)16, (uint16_t)64);
+        for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+        int hits = 0;
+        for (int i = 0; i < N; ++i)
+            if (db.search(make_vec(i, DIM)) == i + 1) ++hits;
+        EXPECT_GE(hits, N * 95 / 100);
+    }
+#ifndef _WIN32
+    // Only the pages the inserts touched are allocated on disk.
+    struct stat st {};
+    ASSERT_EQ(stat(db_file.c_str(), &st), 0);
+    EXPECT_GT((size_t)st.st_size, (size_t)CAP * 16 * 2 * sizeof(uint32_t));
+    EXPECT_LT((size_t)st.st_blocks * 512, (size_t)st.st_size / 20);
+#endif
+}
+
+// =============================================================================
+// 25. HNSW SLOT REORDERING TESTS
+// =============================================================================
+class HnswReorderTest : public ExtFixture {
+protected:
+    void SetUp() override { init("test_hnsw_reorder"); ExtFixture::SetUp(); }
+};
+
+TEST_F(HnswReorderTest, BfsOrderPutsNeighboursCloser) {
+    const int DIM = 8, N = 3000, M = 8;
+    std::vector<float> data((size_t)N * DIM);
+    for (int i = 0; i < N; ++i) {
+        auto v = make_vec(i, DIM);
+        std::copy(v.begin(), v.end(), data.begin() + (size_t)i * DIM);
+    }
+    CoreEngine::SpecificMetadata header{};
+    header.max_capacity         = N;
+    header.hnsw_M               = M;
+    header.hnsw_ef_construction = 64;
+    header.hnsw_entry_point     = HnswManager::EMPTY;
+    std::vector<uint32_t> level0((size_t)N * HnswManager::level0_words(M), 0);
+    std::vector<uint32_t> upper_index(N, 0);
+    std::vector<uint32_t> upper(HnswManager::upper_lists(N, M) * M, 0);
+    uint32_t upper_used = 0;
+    HnswManager::EdgeStore edges{ level0.data(), upper_index.data(), upper.data(), &upper_used,
+                                  HnswManager::upper_lists(N, M) };
+    std::vector<uint8_t> levels(N), deleted(N, 0);
+    auto dist_fn = Distance::kernels().for_metric(CoreEngine::Metric::L2, DIM);
+    std::mt19937 rng(5);
+    HnswManager::SearchContext ctx;
+    std::vector<HnswManager::SearchResult> nb_cands;
+    for (int i = 0; i < N; ++i)
+        HnswManager::hnsw_insert((uint32_t)i, &data[(size_t)i * DIM], &header, data.data(), edges,
+                                 levels.data(), DIM, dist_fn, nullptr, rng, ctx, nb_cands);
+    for (int i = 0; i < N; i += 50) deleted[i] = 1;
+    deleted[header.hnsw_entry_point] = 0;
+
+    auto order = HnswManager::bfs_order(edges, &header, N, deleted.data());
+    ASSERT_EQ(order.size(), (size_t)N);
+    EXPECT_EQ(order[0], header.hnsw_entry_point);
+    std::vector<uint32_t> old_to_new(N, HnswManager::EMPTY);
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ(old_to_new[order[i]], HnswManager::EMPTY);
+        old_to_new[order[i]] = (uint32_t)i;
+    }
+    for (int i = N - N / 50; i < N; ++i) EXPECT_TRUE(deleted[order[i]]);
+
+    // Level-0 edges whose ends are at most 2M slots apart, before and after
+    // renumbering: with BFS a node's unvisited neighbours follow it.
+    const int NEAR = 2 * M;
+    size_t near_before = 0, near_after = 0;
+    for (int v = 0; v < N; ++v) {
+        const uint32_t* lev = HnswManager::level_edges(edges, (uint32_t)v, 0, M);
+        for (int e = 0; e < HnswManager::m_max(0, M); ++e) {
+            uint32_t nb = HnswManager::load_edge(lev + e);
+            if (nb == HnswManager::EMPTY) continue;
+            near_before += std::abs(v - (int)nb) <= NEAR;
+            near_after  += std::abs((int)old_to_new[v] - (int)old_to_new[nb]) <= NEAR;
+        }
+    }
+    EXPECT_GT(near_after, 5 * near_before);
+
+    // remap_edges renames every edge and the entry point.
+    uint32_t entry = header.hnsw_entry_point;
+    uint32_t first = HnswManager::load_edge(HnswManager::level_edges(edges, entry, 0, M));
+    HnswManager::remap_edges(edges, &header, N, old_to_new);
+    EXPECT_EQ(header.hnsw_entry_point, 0u);
+    EXPECT_EQ(HnswManager::load_edge(HnswManager::level_edges(edges, entry, 0, M)), old_to_new[first]);
+}
+
+TEST_F(HnswReorderTest, ReorganizeKeepsEveryIdSearchable) {
+    const int DIM = 16, N = 2000;
+    {
+        CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint8_t)8, (uint16_t)64);
+        for (int i = 0; i < N; ++i) db.insert((uint64_t)(i + 1), make_vec(i, DIM));
+        for (int i = 0; i < N; i += 10) db.remove((uint64_t)(i + 1));
+        db.reorganize();
+
+        int hits = 0;
+        for (int i = 0; i < N; ++i) {
+            int found = db.search(make_vec(i, DIM));
+            EXPECT_NE(found % 10, 1);               // deleted ids stay gone
+            if (i % 10 != 0 && found == i + 1) ++hits;
+        }
+        EXPECT_GE(hits, (N - N / 10) * 95 / 100);
+
+        // A deleted id still goes back into its own (moved) slot.
+        db.insert(11, make_vec(10, DIM));
+        EXPECT_EQ(db.search(make_vec(10, DIM)), 11);
+        EXPECT_EQ(db.get_count(), (uint64_t)N);
+    }
+
+    CoreEngine::RedBoxVector db(db_file, DIM, N + 10, (uint8_t)8, (uint16_t)64);
+    int hits = 0;
+    for (int i = 1; i < N; i += 10)
+        if (db.search(make_vec(i, DIM)) == i + 1) ++hits;
+    EXPECT_GE(hits, (N / 10) * 95 / 100);
+}